@@ -25,6 +25,7 @@
 #include <locale.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <pthread.h>
@@ -95,18 +96,27 @@ static int dummy_printf(const char *__restrict __format, ...)
 
 typedef enum {
 	TERMINATE, LPM_FORCE_ON, LPM_FORCE_OFF, LPM_AUTO, SUV_MODE_ENTER, SUV_MODE_EXIT, HFI_EVENT,
+	CONFIG_UPDATE,
 } message_name_t;
 
-#define MAX_MSG_SIZE		512
-
 typedef struct {
 	message_name_t msg_id;
-	int msg_size;
-	unsigned long msg[MAX_MSG_SIZE];
 } message_capsul_t;
 
 #define MAX_STR_LENGTH		256
 
+/* Tier 0 uses lp_mode_cpus and the util thresholds, the others LpmTiers */
+#define LPM_TIER_MAX		4
+
+struct lpm_tier_config {
+	char cpus[MAX_STR_LENGTH];
+	int entry_threshold;
+	int exit_threshold;
+};
+
+/* systemd units kept on all CPUs in cgroup v2 mode */
+#define LPM_EXEMPT_MAX		8
+
 // lpmd config data
 typedef struct {
 	int mode;
@@ -115,6 +125,9 @@ typedef struct {
 	int powersaver_def;
 	int hfi_lpm_enable;
 	int hfi_suv_enable;
+	int hfi_debounce;
+	int hfi_lpm_cpus;
+	int hfi_min_perf;
 	int util_enable;
 	int util_entry_threshold;
 	int util_exit_threshold;
@@ -123,7 +136,22 @@ typedef struct {
 	int util_entry_hyst;
 	int util_exit_hyst;
 	int ignore_itmt;
+	int util_policy;
+	int util_source;
+	int lpm_cpu_policy;
+	int lpm_cpu_modules;
 	char lp_mode_cpus[MAX_STR_LENGTH];
+	int nr_tiers;
+	struct lpm_tier_config tiers[LPM_TIER_MAX];
+	int nr_exempt_units;
+	char exempt_units[LPM_EXEMPT_MAX][MAX_STR_LENGTH];
+	int watch_config;
+	int clamp_target_util;
+	int clamp_target_power;
+	int clamp_max_step;
+	int clamp_interval;
+	int irq_rate_limit;
+	int softirq_rate_limit;
 } lpmd_config_t;
 
 enum lpm_cpu_process_mode {
@@ -134,6 +162,29 @@ enum lpm_cpu_process_mode {
 	LPM_CPU_MODE_MAX = LPM_CPU_POWERCLAMP,
 };
 
+enum util_policy_type {
+	UTIL_POLICY_LEGACY,
+	UTIL_POLICY_EWMA,
+	UTIL_POLICY_MAX,
+};
+
+enum util_source_type {
+	UTIL_SOURCE_PROC_STAT,
+	UTIL_SOURCE_CPUIDLE,
+	UTIL_SOURCE_APERF_MPERF,
+	UTIL_SOURCE_MAX,
+};
+
+/* How the LPM CPUs are detected when lp_mode_cpus is not set */
+enum lpm_cpu_policy {
+	LPM_CPU_POLICY_AUTO, /* CPUs without L3, else the last Ecore cluster */
+	LPM_CPU_POLICY_SOC, /* The SoC tile cores, the ones without L3 */
+	LPM_CPU_POLICY_MODULES, /* The least capable modules, from one die first */
+	LPM_CPU_POLICY_MAX,
+};
+
+#define LPM_CPU_MODULES_MAX	64
+
 enum lpm_command {
 	USER_ENTER, /* Force enter LPM and always stay in LPM */
 	USER_AUTO, /* Allow oppotunistic LPM based on util/hfi request */
@@ -149,20 +200,44 @@ enum lpm_command {
 	LPM_CMD_MAX,
 };
 
+/* Transition phases instrumented by lpmd_stats.c */
+enum lpm_phase {
+	LPM_PHASE_ITMT,
+	LPM_PHASE_IRQ_NATIVE,
+	LPM_PHASE_IRQ_IRQBALANCE,
+	/* Same order as enum lpm_cpu_process_mode */
+	LPM_PHASE_CPU_CGROUPV2,
+	LPM_PHASE_CPU_ISOLATE,
+	LPM_PHASE_CPU_POWERCLAMP,
+	LPM_PHASE_CPU_OFFLINE,
+	LPM_PHASE_TOTAL,
+	LPM_PHASE_MAX,
+};
+
 enum cpumask_idx {
 	CPUMASK_LPM_DEFAULT, CPUMASK_ONLINE, CPUMASK_HFI, CPUMASK_HFI_SUV, /* HFI Survivability mode */
+	CPUMASK_HFI_RANKED, /* Most efficient CPUs per HFI */
+	CPUMASK_LPM_TIER1, CPUMASK_LPM_TIER2, CPUMASK_LPM_TIER3, /* Graduated LPM tiers */
 	CPUMASK_MAX,
 };
 
-#define MAX_LPM_CPUS		8
-
 #define UTIL_DELAY_MAX		5000
+#define HFI_DEBOUNCE_MAX	5000
+/* HFI capabilities are reported in 0 - 255, scaled by 4 */
+#define HFI_CAP_MAX		(255 * 4)
 #define UTIL_HYST_MAX		10000
+#define CLAMP_STEP_MAX		50
+#define CLAMP_POWER_MAX		1000000
+/* Per CPU and per second */
+#define IRQ_RATE_MAX		10000000
+/* systemd replies for the slices of one transition */
+#define SYSTEMD_REPLY_TIMEOUT_USEC	(5 * 1000 * 1000)
 
 /* lpmd_main.c */
 int in_debug_mode(void);
 
 /* lpmd_proc.c: interfaces */
+extern char *lpm_cmd_str[LPM_CMD_MAX];
 int lpmd_lock(void);
 int lpmd_unlock(void);
 int in_lpm(void);
@@ -171,6 +246,9 @@ int get_idle_duration(void);
 int get_cpu_mode(void);
 int has_hfi_lpm_monitor(void);
 int has_hfi_suv_monitor(void);
+int get_hfi_debounce(void);
+int get_hfi_lpm_cpus(void);
+int get_hfi_min_perf(void);
 int has_util_monitor(void);
 int get_util_entry_interval(void);
 int get_util_exit_interval(void);
@@ -178,36 +256,83 @@ int get_util_entry_threshold(void);
 int get_util_exit_threshold(void);
 int get_util_entry_hyst(void);
 int get_util_exit_hyst(void);
+int get_util_policy(void);
+int get_util_source(void);
+int get_irq_rate_limit(void);
+int get_softirq_rate_limit(void);
+int get_lpm_cpu_policy(void);
+int get_lpm_cpu_modules(void);
+int get_clamp_target_util(void);
+int get_clamp_target_power(void);
+int get_clamp_max_step(void);
+int get_clamp_interval(void);
+int get_config_lpm_tiers(void);
+char* get_lpm_tier_cpus(int tier);
+int get_config_exempt_units(void);
+char* get_config_exempt_unit(int i);
+int get_lpm_tier_entry_threshold(int tier);
+int get_lpm_tier_exit_threshold(int tier);
+int get_lpm_tier(void);
+int process_lpm_tier(int tier);
+int process_lpm_hfi_ranked(int *cpus, int nr);
 void set_ignore_itmt(void);
 
 int process_lpm(enum lpm_command cmd);
 int process_lpm_unlock(enum lpm_command cmd);
 int freeze_lpm(void);
 int restore_lpm(void);
+void lpm_transition_done(int ret);
 
 void lpmd_terminate(void);
-void lpmd_force_on(void);
-void lpmd_force_off(void);
-void lpmd_set_auto(void);
-void lpmd_suv_enter(void);
-void lpmd_suv_exit(void);
+int lpmd_force_on(void);
+int lpmd_force_off(void);
+int lpmd_set_auto(void);
+int lpmd_suv_enter(void);
+int lpmd_suv_exit(void);
+typedef void (*lpmd_request_cb)(int ret, void *data);
+void lpmd_send_request_async(message_name_t msg_id, lpmd_request_cb cb, void *data);
 void lpmd_notify_hfi_event(void);
+int lpmd_get_tunable_int(const char *name, int *val);
+int lpmd_get_tunable_str(const char *name, char *buf, int size);
+int lpmd_set_tunable_int(const char *name, int val);
+int lpmd_set_tunable_str(const char *name, const char *str);
 
 /* lpmd_proc.c: init func */
 int lpmd_main(void);
+int lpmd_replay(const char *path);
 
 /* lpmd_dbus_server.c */
 int intel_dbus_server_init(gboolean (*exit_handler)(void));
 
 /* lpmd_config.c */
 int lpmd_get_config(lpmd_config_t *lpmd_config);
+void lpmd_set_config_file(const char *file);
+void lpmd_config_update(lpmd_config_t *lpmd_config);
+int lpmd_config_watch_init(void);
+int lpmd_config_watch_process(void);
 
 /* util.c */
 int periodic_util_update(void);
+int psi_init(void);
+int psi_process(short revents);
+int psi_replay_init(int registered);
+int util_read_stat(unsigned long long *busy, unsigned long long *total, int nr);
+char* util_stats_str(void);
+void util_config_changed(void);
 
 /* cpu.c */
 int init_cpu(char *cmd_cpus, enum lpm_cpu_process_mode mode);
+int init_cpu_replay(char *cmd_cpus, char *topology);
+char* cpu_topology_str(void);
 int process_cpus(int enter, enum lpm_cpu_process_mode mode);
+int process_cpus_switch(enum lpm_cpu_process_mode mode);
+int lpm_cpus_changed(void);
+int process_cpus_pending(void);
+int process_cpus_wait(void);
+int powerclamp_set_idle(int pct);
+int systemd_bus_init(void);
+int systemd_bus_get_poll(short *events, int *timeout);
+int systemd_bus_process(void);
 
 /* cpu.c: helpers */
 int is_cpu_online(int cpu);
@@ -222,8 +347,12 @@ int has_cpus(enum cpumask_idx idx);
 int add_cpu(int cpu, enum cpumask_idx idx);
 void reset_cpus(enum cpumask_idx idx);
 int set_lpm_cpus(enum cpumask_idx new);
+int get_lpm_tiers(void);
+enum cpumask_idx get_lpm_tier_cpumask(int tier);
+int update_lpm_cpus(char *cmd_cpus);
 int uevent_init(void);
 int check_cpu_hotplug(void);
+int replay_cpu_hotplug(int cpu, int online);
 
 /* cpu.c : APIs for SUV mode support */
 int process_suv_mode(enum lpm_command cmd);
@@ -233,17 +362,116 @@ int in_hfi_suv_mode(void);
 /* irq.c */
 int init_irq(void);
 int process_irqs(int enter, enum lpm_cpu_process_mode mode);
+int process_irqs_switch(enum lpm_cpu_process_mode mode);
+int irq_use_irqbalance(void);
+int irqbalance_monitor_init(void);
+int check_irqbalance_restart(void);
+
+/* timer.c */
+int lpmd_timer_init(void);
+int lpmd_timer_add(const char *name, int (*fn)(void), int slack_ms);
+void lpmd_timer_arm(int id, int delay_ms);
+int lpmd_timer_armed(int id);
+int lpmd_timer_process(void);
+uint64_t lpmd_timer_next(void);
+
+/* clamp.c */
+int clamp_init(void);
+int clamp_get_idle(void);
+void clamp_start(void);
+void clamp_stop(void);
+void clamp_config_changed(void);
+
+/* rapl.c */
+enum rapl_domain {
+	RAPL_PKG,
+	RAPL_CORE,
+	RAPL_DOMAIN_MAX,
+};
+
+int rapl_energy_uj(enum rapl_domain domain, uint64_t *uj);
+int rapl_has_domain(enum rapl_domain domain);
+int rapl_timer_init(void);
+
+/* irqload.c */
+int irq_load_sample(void);
+int irq_load_over(void);
+int irq_load_fits(enum cpumask_idx idx);
+
+/* residency.c */
+int residency_init(enum util_source_type type);
+int residency_read(int *busy, int *c0, int nr);
+
+/* stats.c */
+uint64_t lpm_stats_now(void);
+void lpm_stats_record(int enter, enum lpm_command cmd, enum lpm_phase phase, uint64_t ns);
+uint64_t lpm_stats_mean_ns(int enter, enum lpm_phase phase);
+char* lpm_stats_str(void);
+void lpm_stats_residency_init(void);
+void lpm_stats_residency(int in, enum lpm_command cmd);
+char* lpm_stats_residency_str(void);
 
 /* hfi.c */
 int hfi_init(void);
 int hfi_kill(void);
 void hfi_receive(void);
+int hfi_replay_init(void);
+void hfi_replay(int *caps, int nr_caps);
+char* hfi_ranking_str(void);
+
+/* trace.c */
+/* flags of a trace: PSI trigger registered */
+#define LPMD_TRACE_F_PSI	(1 << 0)
+
+enum lpmd_trace_type {
+	LPMD_TRACE_STAT,
+	LPMD_TRACE_HFI,
+	LPMD_TRACE_HOTPLUG,
+	LPMD_TRACE_PROFILE,
+	LPMD_TRACE_MSG,
+	LPMD_TRACE_PSI,
+};
+
+struct lpmd_trace_rec {
+	enum lpmd_trace_type type;
+	uint64_t time;
+	/* LPMD_TRACE_HFI: nr_caps (cpu, perf, eff) */
+	int *caps;
+	int nr_caps;
+	/* LPMD_TRACE_HOTPLUG */
+	int cpu;
+	int online;
+	/* LPMD_TRACE_MSG */
+	int msg_id;
+	/* LPMD_TRACE_PROFILE */
+	char profile[MAX_STR_LENGTH];
+};
+
+void lpmd_trace_set_file(const char *path);
+int lpmd_trace_init(int flags);
+void lpmd_trace_close(void);
+void lpmd_trace_hfi(int cpu, int perf, int eff);
+void lpmd_trace_hfi_done(void);
+void lpmd_trace_hotplug(int cpu, int online);
+void lpmd_trace_profile(const char *profile);
+void lpmd_trace_msg(int msg_id);
+void lpmd_trace_psi(void);
+int lpmd_trace_replaying(void);
+uint64_t lpmd_trace_now(void);
+void lpmd_trace_set_now(uint64_t now);
+int lpmd_trace_replay_open(const char *path, int *flags, char **topology);
+int lpmd_trace_read(struct lpmd_trace_rec *rec);
+void lpmd_trace_stat_update(void);
+int lpmd_trace_stat(int cpu, unsigned long long *busy, unsigned long long *total);
+void lpmd_trace_replay_close(void);
 
 /* socket.c */
 int socket_init_connection(char *name);
 int socket_send_cmd(char *name, char *data);
 
 /* helper */
+int lpmd_cache_knob(const char *name);
+int lpmd_cache_knob_volatile(const char *name);
 int lpmd_write_str(const char *name, char *str, int print_level);
 int lpmd_write_str_verbose(const char *name, char *str, int print_level);
 int lpmd_write_str_append(const char *name, char *str, int print_level);
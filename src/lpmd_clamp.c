@@ -0,0 +1,281 @@
+/*
+ * lpmd_clamp.c: closed-loop idle injection for LPM_CPU_POWERCLAMP
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * In powerclamp mode the CPUs outside of the LPM CPUs get idle injected.
+ * Without a target, the idle percentage stays at get_idle_percentage ().
+ * With ClampTargetUtil, a proportional controller adjusts it so that the
+ * clamped CPUs are busy for ClampTargetUtil percent of the time that is
+ * not injected idle: busier CPUs get less idle injected, idler ones more.
+ * ClampTargetPowerMW makes the controller track the RAPL package power
+ * instead, while ClampTargetUtil, when also set, still bounds how busy the
+ * clamped CPUs get. Each step changes the idle percentage by at most
+ * ClampMaxStep.
+ * Everything here runs on the core thread, like the LPM transitions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lpmd.h"
+
+#define CLAMP_TIMER_SLACK_MS		50
+#define CLAMP_INTERVAL_DEFAULT_MS	1000
+#define CLAMP_STEP_DEFAULT		10
+
+static int clamp_timer = -1;
+/* Idle percentage in use, kept across LPM entries as a warm start */
+static int clamp_idle = -1;
+/* Powerclamp LPM is ongoing */
+static int clamp_lpm;
+/* The controller adjusts its idle */
+static int clamp_running;
+
+static int clamp_nr;
+static unsigned long long *clamp_busy, *clamp_total;
+static unsigned long long *clamp_busy_prev, *clamp_total_prev;
+
+static uint64_t clamp_energy_prev;
+static uint64_t clamp_time_prev;
+static int clamp_have_energy;
+
+static int clamp_enabled(void)
+{
+	return get_clamp_target_util () || get_clamp_target_power ();
+}
+
+static int clamp_interval(void)
+{
+	return get_clamp_interval () ? get_clamp_interval () : CLAMP_INTERVAL_DEFAULT_MS;
+}
+
+static int clamp_max_step(void)
+{
+	return get_clamp_max_step () ? get_clamp_max_step () : CLAMP_STEP_DEFAULT;
+}
+
+static int clamp_alloc(void)
+{
+	if (clamp_busy)
+		return 0;
+
+	clamp_nr = get_max_cpus () + 1;
+	clamp_busy = calloc (clamp_nr, sizeof(*clamp_busy));
+	clamp_total = calloc (clamp_nr, sizeof(*clamp_total));
+	clamp_busy_prev = calloc (clamp_nr, sizeof(*clamp_busy_prev));
+	clamp_total_prev = calloc (clamp_nr, sizeof(*clamp_total_prev));
+	if (!clamp_busy || !clamp_total || !clamp_busy_prev || !clamp_total_prev) {
+		free (clamp_busy);
+		free (clamp_total);
+		free (clamp_busy_prev);
+		free (clamp_total_prev);
+		clamp_busy = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Take the reference samples for the next clamp_timer_fn () */
+static int clamp_sample_begin(void)
+{
+	uint64_t uj;
+
+	if (util_read_stat (clamp_busy_prev, clamp_total_prev, clamp_nr))
+		return 1;
+
+	clamp_have_energy = get_clamp_target_power () && !rapl_energy_uj (RAPL_PKG, &uj);
+	if (clamp_have_energy) {
+		clamp_energy_prev = uj;
+		clamp_time_prev = lpm_stats_now ();
+	}
+
+	return 0;
+}
+
+/*
+ * Busy percentage of the clamped CPUs, relative to the time not spent in
+ * injected idle. Returns -1 when there is nothing to measure.
+ */
+static int clamp_load(void)
+{
+	unsigned long long busy = 0, total = 0;
+	int avail;
+	int cpu;
+
+	if (util_read_stat (clamp_busy, clamp_total, clamp_nr))
+		return -1;
+
+	for (cpu = 0; cpu < clamp_nr - 1; cpu++) {
+		/* CPUs that went offline in between have a total of 0 */
+		if (!clamp_total[cpu + 1] || !clamp_total_prev[cpu + 1])
+			continue;
+		if (is_cpu_for_lpm (cpu) || !is_cpu_online (cpu))
+			continue;
+		if (clamp_total[cpu + 1] < clamp_total_prev[cpu + 1])
+			continue;
+
+		busy += clamp_busy[cpu + 1] - clamp_busy_prev[cpu + 1];
+		total += clamp_total[cpu + 1] - clamp_total_prev[cpu + 1];
+	}
+
+	memcpy (clamp_busy_prev, clamp_busy, clamp_nr * sizeof(*clamp_busy));
+	memcpy (clamp_total_prev, clamp_total, clamp_nr * sizeof(*clamp_total));
+
+	if (!total)
+		return -1;
+
+	avail = 100 - clamp_idle;
+	if (avail < 1)
+		avail = 1;
+
+	return busy * 100 * 100 / total / avail;
+}
+
+/* Package power in mW since the previous call, -1 when not available */
+static int clamp_power(void)
+{
+	uint64_t uj, now, delta_ms;
+	int power;
+
+	if (!clamp_have_energy || rapl_energy_uj (RAPL_PKG, &uj))
+		return -1;
+
+	now = lpm_stats_now ();
+	delta_ms = (now - clamp_time_prev) / 1000000;
+	if (!delta_ms)
+		return -1;
+
+	/* uJ per ms is mW */
+	power = (uj - clamp_energy_prev) / delta_ms;
+	clamp_energy_prev = uj;
+	clamp_time_prev = now;
+
+	return power;
+}
+
+static int clamp_timer_fn(void)
+{
+	int target_util = get_clamp_target_util ();
+	int target_power = get_clamp_target_power ();
+	int max_step = clamp_max_step ();
+	int load, power, step, ustep, idle;
+
+	if (!clamp_running || !clamp_enabled ())
+		return -1;
+
+	load = clamp_load ();
+	power = clamp_power ();
+
+	/* Positive steps inject more idle */
+	step = 0;
+	if (target_power && power >= 0)
+		step = (power - target_power) * 100 / target_power / 2;
+	else if (target_util && load >= 0)
+		step = (target_util - load) / 2;
+
+	/* With a power target, the util target only ever lowers the idle */
+	if (target_power && target_util && load >= 0) {
+		ustep = (target_util - load) / 2;
+		if (ustep < step)
+			step = ustep;
+	}
+
+	if (step > max_step)
+		step = max_step;
+	if (step < -max_step)
+		step = -max_step;
+
+	idle = clamp_idle + step;
+	if (idle < 0)
+		idle = 0;
+	if (idle > get_idle_percentage ())
+		idle = get_idle_percentage ();
+
+	lpmd_log_debug ("clamp: load %d%% power %dmW idle %d%% -> %d%%\n", load, power, clamp_idle,
+					idle);
+
+	if (idle != clamp_idle && !powerclamp_set_idle (idle))
+		clamp_idle = idle;
+
+	return clamp_interval ();
+}
+
+int clamp_init(void)
+{
+	clamp_timer = lpmd_timer_add ("clamp", clamp_timer_fn, CLAMP_TIMER_SLACK_MS);
+	return clamp_timer < 0;
+}
+
+/* Idle percentage to use for LPM, after a CPU switch too */
+int clamp_get_idle(void)
+{
+	if (clamp_running)
+		return clamp_idle;
+
+	return get_idle_percentage ();
+}
+
+/*
+ * Called once powerclamp injects get_idle_percentage () into the CPUs
+ * outside of the LPM CPUs.
+ */
+void clamp_start(void)
+{
+	clamp_lpm = 1;
+
+	if (clamp_timer < 0 || !clamp_enabled () || clamp_alloc ())
+		return;
+
+	if (clamp_idle < 0 || clamp_idle > get_idle_percentage ())
+		clamp_idle = get_idle_percentage ();
+
+	if (clamp_idle != get_idle_percentage () && powerclamp_set_idle (clamp_idle))
+		clamp_idle = get_idle_percentage ();
+
+	if (clamp_sample_begin ())
+		return;
+
+	clamp_running = 1;
+	lpmd_timer_arm (clamp_timer, clamp_interval ());
+}
+
+void clamp_stop(void)
+{
+	clamp_lpm = 0;
+	clamp_running = 0;
+	lpmd_timer_arm (clamp_timer, -1);
+}
+
+/* Start or stop the controller of an ongoing LPM after a runtime change */
+void clamp_config_changed(void)
+{
+	if (!clamp_lpm)
+		return;
+
+	if (clamp_running && !clamp_enabled ()) {
+		clamp_running = 0;
+		lpmd_timer_arm (clamp_timer, -1);
+		powerclamp_set_idle (get_idle_percentage ());
+	}
+	else if (!clamp_running && clamp_enabled ()) {
+		clamp_start ();
+	}
+}
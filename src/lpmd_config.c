@@ -18,6 +18,9 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <libgen.h>
+#include <sys/inotify.h>
+
 #include "lpmd.h"
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -27,15 +30,148 @@
 
 static void lpmd_dump_config(lpmd_config_t *lpmd_config)
 {
+	int i;
+
 	if (!lpmd_config)
 		return;
 
 	lpmd_log_info ("Mode:%d\n", lpmd_config->mode);
 	lpmd_log_info ("HFI LPM Enable:%d\n", lpmd_config->hfi_lpm_enable);
 	lpmd_log_info ("HFI SUV Enable:%d\n", lpmd_config->hfi_suv_enable);
+	lpmd_log_info ("HFI debounce:%d\n", lpmd_config->hfi_debounce);
+	lpmd_log_info ("HFI LPM CPUs:%d\n", lpmd_config->hfi_lpm_cpus);
+	lpmd_log_info ("HFI min perf:%d\n", lpmd_config->hfi_min_perf);
 	lpmd_log_info ("Util entry threshold:%d\n", lpmd_config->util_entry_threshold);
 	lpmd_log_info ("Util exit threshold:%d\n", lpmd_config->util_exit_threshold);
+	lpmd_log_info ("Util policy:%d\n", lpmd_config->util_policy);
+	lpmd_log_info ("Util source:%d\n", lpmd_config->util_source);
 	lpmd_log_info ("Util LP Mode CPUs:%s\n", lpmd_config->lp_mode_cpus);
+	lpmd_log_info ("LPM CPU policy:%d modules:%d\n", lpmd_config->lpm_cpu_policy,
+					lpmd_config->lpm_cpu_modules);
+	lpmd_log_info ("Watch config:%d\n", lpmd_config->watch_config);
+	lpmd_log_info ("IRQ rate limit:%d softirq rate limit:%d\n", lpmd_config->irq_rate_limit,
+					lpmd_config->softirq_rate_limit);
+	lpmd_log_info ("Clamp target util:%d power:%dmW max step:%d interval:%d\n",
+					lpmd_config->clamp_target_util, lpmd_config->clamp_target_power,
+					lpmd_config->clamp_max_step, lpmd_config->clamp_interval);
+	for (i = 0; i < lpmd_config->nr_exempt_units; i++)
+		lpmd_log_info ("Exempt unit:%s\n", lpmd_config->exempt_units[i]);
+	for (i = 1; i < lpmd_config->nr_tiers; i++)
+		lpmd_log_info ("LPM tier %d: CPUs:%s entry threshold:%d exit threshold:%d\n", i,
+						lpmd_config->tiers[i].cpus[0] ? lpmd_config->tiers[i].cpus : "auto",
+						lpmd_config->tiers[i].entry_threshold,
+						lpmd_config->tiers[i].exit_threshold);
+}
+
+static int lpmd_fill_tier(xmlDoc *doc, xmlNode *a_node, struct lpm_tier_config *tier)
+{
+	xmlNode *cur_node = NULL;
+	char *tmp_value;
+	char *pos;
+	int ret = LPMD_SUCCESS;
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		tmp_value = (char*) xmlNodeListGetString (doc, cur_node->xmlChildrenNode, 1);
+		if (!tmp_value)
+			continue;
+
+		errno = 0;
+		if (!strncmp ((const char*) cur_node->name, "Cpus", strlen ("Cpus"))) {
+			if (strlen (tmp_value) >= sizeof(tier->cpus)) {
+				lpmd_log_error ("Tier Cpus longer than %zu characters, use ranges like 8-15\n",
+								sizeof(tier->cpus) - 1);
+				ret = LPMD_ERROR;
+			}
+			else
+				snprintf (tier->cpus, sizeof(tier->cpus), "%s", tmp_value);
+		}
+		else if (!strncmp ((const char*) cur_node->name, "EntryThreshold",
+							strlen ("EntryThreshold"))) {
+			tier->entry_threshold = strtol (tmp_value, &pos, 10);
+			if (errno || *pos != '\0' || tier->entry_threshold <= 0
+					|| tier->entry_threshold > 100)
+				ret = LPMD_ERROR;
+		}
+		else if (!strncmp ((const char*) cur_node->name, "ExitThreshold",
+							strlen ("ExitThreshold"))) {
+			tier->exit_threshold = strtol (tmp_value, &pos, 10);
+			if (errno || *pos != '\0' || tier->exit_threshold <= 0 || tier->exit_threshold > 100)
+				ret = LPMD_ERROR;
+		}
+		else {
+			ret = LPMD_ERROR;
+		}
+
+		if (ret != LPMD_SUCCESS)
+			lpmd_log_error ("Invalid tier data, name: %s value: %s\n", cur_node->name, tmp_value);
+		xmlFree (tmp_value);
+		if (ret != LPMD_SUCCESS)
+			return ret;
+	}
+
+	if (!tier->entry_threshold || !tier->exit_threshold) {
+		lpmd_log_error ("LPM tier without EntryThreshold or ExitThreshold\n");
+		return LPMD_ERROR;
+	}
+
+	return LPMD_SUCCESS;
+}
+
+static int lpmd_fill_tiers(xmlDoc *doc, xmlNode *a_node, lpmd_config_t *lpmd_config)
+{
+	xmlNode *cur_node = NULL;
+
+	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
+		if (cur_node->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (strncmp ((const char*) cur_node->name, "Tier", strlen ("Tier"))) {
+			lpmd_log_error ("Invalid LpmTiers data, name: %s\n", cur_node->name);
+			return LPMD_ERROR;
+		}
+
+		if (lpmd_config->nr_tiers >= LPM_TIER_MAX) {
+			lpmd_log_error ("Too many LPM tiers, at most %d supported\n", LPM_TIER_MAX - 1);
+			return LPMD_ERROR;
+		}
+
+		if (lpmd_fill_tier (doc, cur_node->children, &lpmd_config->tiers[lpmd_config->nr_tiers])
+				!= LPMD_SUCCESS)
+			return LPMD_ERROR;
+
+		lpmd_config->nr_tiers++;
+	}
+
+	return LPMD_SUCCESS;
+}
+
+/* Comma or space separated unit names, e.g. "machine.slice,latency.slice" */
+static int lpmd_fill_exempt_units(char *str, lpmd_config_t *lpmd_config)
+{
+	char *unit, *saveptr;
+
+	lpmd_config->nr_exempt_units = 0;
+	for (unit = strtok_r (str, ", \t\n", &saveptr); unit;
+			unit = strtok_r (NULL, ", \t\n", &saveptr)) {
+		if (lpmd_config->nr_exempt_units >= LPM_EXEMPT_MAX) {
+			lpmd_log_error ("Too many exempt units, at most %d supported\n", LPM_EXEMPT_MAX);
+			return LPMD_ERROR;
+		}
+
+		/* Unit names always have a type suffix */
+		if (!strchr (unit, '.') || strlen (unit) >= MAX_STR_LENGTH) {
+			lpmd_log_error ("Invalid exempt unit %s\n", unit);
+			return LPMD_ERROR;
+		}
+
+		snprintf (lpmd_config->exempt_units[lpmd_config->nr_exempt_units++], MAX_STR_LENGTH,
+					"%s", unit);
+	}
+
+	return LPMD_SUCCESS;
 }
 
 static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, lpmd_config_t *lpmd_config)
@@ -48,8 +184,14 @@ static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, lpmd_config_t *lpmd_co
 		return LPMD_ERROR;
 
 	lpmd_config->performance_def = lpmd_config->balanced_def = lpmd_config->powersaver_def = LPM_FORCE_OFF;
+	lpmd_config->nr_tiers = 1;
 	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
 		if (cur_node->type == XML_ELEMENT_NODE) {
+			if (!strncmp ((const char*) cur_node->name, "LpmTiers", strlen ("LpmTiers"))) {
+				if (lpmd_fill_tiers (doc, cur_node->children, lpmd_config) != LPMD_SUCCESS)
+					return LPMD_ERROR;
+				continue;
+			}
 			tmp_value = (char*) xmlNodeListGetString (doc, cur_node->xmlChildrenNode, 1);
 			if (tmp_value) {
 				lpmd_log_info ("node type: Element, name: %s, value: %s\n", cur_node->name,
@@ -78,6 +220,28 @@ static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, lpmd_config_t *lpmd_co
 							|| (lpmd_config->hfi_suv_enable != 1 && lpmd_config->hfi_suv_enable != 0))
 						goto err;
 				}
+				else if (!strncmp((const char*)cur_node->name, "HfiDebounceMS", strlen ("HfiDebounceMS"))) {
+					errno = 0;
+					lpmd_config->hfi_debounce = strtol (tmp_value, &pos, 10);
+					if (errno
+							|| *pos
+									!= '\0'|| lpmd_config->hfi_debounce < 0 || lpmd_config->hfi_debounce > HFI_DEBOUNCE_MAX)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "HfiLpmCpus", strlen ("HfiLpmCpus"))) {
+					errno = 0;
+					lpmd_config->hfi_lpm_cpus = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->hfi_lpm_cpus < 0)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "HfiMinPerf", strlen ("HfiMinPerf"))) {
+					errno = 0;
+					lpmd_config->hfi_min_perf = strtol (tmp_value, &pos, 10);
+					if (errno
+							|| *pos
+									!= '\0'|| lpmd_config->hfi_min_perf < 0 || lpmd_config->hfi_min_perf > HFI_CAP_MAX)
+						goto err;
+				}
 				else if (!strncmp((const char*)cur_node->name, "EntryDelayMS", strlen ("EntryDelayMS"))) {
 					errno = 0;
 					lpmd_config->util_entry_delay = strtol (tmp_value, &pos, 10);
@@ -134,13 +298,111 @@ static int lpmd_fill_config(xmlDoc *doc, xmlNode *a_node, lpmd_config_t *lpmd_co
 									!= '\0'|| lpmd_config->ignore_itmt < 0 || lpmd_config->ignore_itmt > 1)
 						goto err;
 				}
+				else if (!strncmp((const char*)cur_node->name, "WatchConfig", strlen ("WatchConfig"))) {
+					errno = 0;
+					lpmd_config->watch_config = strtol (tmp_value, &pos, 10);
+					if (errno
+							|| *pos
+									!= '\0'|| lpmd_config->watch_config < 0 || lpmd_config->watch_config > 1)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "ClampTargetUtil", strlen ("ClampTargetUtil"))) {
+					errno = 0;
+					lpmd_config->clamp_target_util = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->clamp_target_util < 0
+							|| lpmd_config->clamp_target_util > 100)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "ClampTargetPowerMW",
+									strlen ("ClampTargetPowerMW"))) {
+					errno = 0;
+					lpmd_config->clamp_target_power = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->clamp_target_power < 0
+							|| lpmd_config->clamp_target_power > CLAMP_POWER_MAX)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "ClampMaxStep", strlen ("ClampMaxStep"))) {
+					errno = 0;
+					lpmd_config->clamp_max_step = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->clamp_max_step < 0
+							|| lpmd_config->clamp_max_step > CLAMP_STEP_MAX)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "ClampIntervalMS", strlen ("ClampIntervalMS"))) {
+					errno = 0;
+					lpmd_config->clamp_interval = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->clamp_interval < 0
+							|| lpmd_config->clamp_interval > UTIL_DELAY_MAX)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "UtilPolicy", strlen ("UtilPolicy"))) {
+					if (!strcmp (tmp_value, "legacy"))
+						lpmd_config->util_policy = UTIL_POLICY_LEGACY;
+					else if (!strcmp (tmp_value, "ewma"))
+						lpmd_config->util_policy = UTIL_POLICY_EWMA;
+					else
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "IrqRateLimit", strlen ("IrqRateLimit"))) {
+					errno = 0;
+					lpmd_config->irq_rate_limit = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->irq_rate_limit < 0
+							|| lpmd_config->irq_rate_limit > IRQ_RATE_MAX)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "SoftirqRateLimit", strlen ("SoftirqRateLimit"))) {
+					errno = 0;
+					lpmd_config->softirq_rate_limit = strtol (tmp_value, &pos, 10);
+					if (errno || *pos != '\0' || lpmd_config->softirq_rate_limit < 0
+							|| lpmd_config->softirq_rate_limit > IRQ_RATE_MAX)
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "UtilSource", strlen ("UtilSource"))) {
+					if (!strcmp (tmp_value, "procstat"))
+						lpmd_config->util_source = UTIL_SOURCE_PROC_STAT;
+					else if (!strcmp (tmp_value, "cpuidle"))
+						lpmd_config->util_source = UTIL_SOURCE_CPUIDLE;
+					else if (!strcmp (tmp_value, "aperfmperf"))
+						lpmd_config->util_source = UTIL_SOURCE_APERF_MPERF;
+					else
+						goto err;
+				}
+				else if (!strncmp((const char*)cur_node->name, "LpmCpuPolicy", strlen ("LpmCpuPolicy"))) {
+					lpmd_config->lpm_cpu_modules = 0;
+					if (!strcmp (tmp_value, "auto"))
+						lpmd_config->lpm_cpu_policy = LPM_CPU_POLICY_AUTO;
+					else if (!strcmp (tmp_value, "soc"))
+						lpmd_config->lpm_cpu_policy = LPM_CPU_POLICY_SOC;
+					else if (!strcmp (tmp_value, "modules"))
+						lpmd_config->lpm_cpu_policy = LPM_CPU_POLICY_MODULES;
+					else if (!strncmp (tmp_value, "modules:", strlen ("modules:"))) {
+						lpmd_config->lpm_cpu_policy = LPM_CPU_POLICY_MODULES;
+						errno = 0;
+						lpmd_config->lpm_cpu_modules = strtol (tmp_value + strlen ("modules:"),
+																&pos, 10);
+						if (errno || *pos != '\0' || lpmd_config->lpm_cpu_modules < 1
+								|| lpmd_config->lpm_cpu_modules > LPM_CPU_MODULES_MAX)
+							goto err;
+					}
+					else
+						goto err;
+				}
 				else if (!strncmp((const char*)cur_node->name, "lp_mode_cpus", strlen ("lp_mode_cpus"))) {
 					if (!strncmp (tmp_value, "-1", strlen ("-1")))
 						lpmd_config->lp_mode_cpus[0] = '\0';
+					else if (strlen (tmp_value) >= sizeof(lpmd_config->lp_mode_cpus)) {
+						lpmd_log_error ("lp_mode_cpus longer than %zu characters, use ranges like 8-15\n",
+										sizeof(lpmd_config->lp_mode_cpus) - 1);
+						goto err;
+					}
 					else
 						snprintf (lpmd_config->lp_mode_cpus, sizeof(lpmd_config->lp_mode_cpus),
 									"%s", tmp_value);
 				}
+				else if (!strncmp((const char*)cur_node->name, "ExemptUnits", strlen ("ExemptUnits"))) {
+					if (lpmd_fill_exempt_units (tmp_value, lpmd_config) != LPMD_SUCCESS)
+						goto err;
+				}
 				else if (!strncmp((const char*)cur_node->name, "PerformanceDef", strlen ("PerformanceDef"))) {
 					errno = 0;
 					lpmd_config->performance_def = strtol (tmp_value, &pos, 10);
@@ -197,18 +459,46 @@ err:			xmlFree (tmp_value);
 		}
 	}
 
+	lpmd_config_update (lpmd_config);
+
+	return LPMD_SUCCESS;
+}
+
+/* Update the fields derived from others, after parsing or a runtime change */
+void lpmd_config_update(lpmd_config_t *lpmd_config)
+{
 	/* use entry_threshold == 0 or exit_threshold == 0 to effectively disable util monitor */
 	if (lpmd_config->util_entry_threshold && lpmd_config->util_exit_threshold)
 		lpmd_config->util_enable = 1;
 	else
 		lpmd_config->util_enable = 0;
 
-	return LPMD_SUCCESS;
+	lpmd_config->tiers[0].entry_threshold = lpmd_config->util_entry_threshold;
+	lpmd_config->tiers[0].exit_threshold = lpmd_config->util_exit_threshold;
+}
+
+/* Configuration file other than TDCONFDIR/CONFIG_FILE_NAME, e.g. for replays */
+static char *config_file;
+
+void lpmd_set_config_file(const char *file)
+{
+	free (config_file);
+	config_file = file ? strdup (file) : NULL;
+}
+
+static const char *config_file_name(char *buf, size_t size)
+{
+	if (config_file)
+		return config_file;
+
+	snprintf (buf, size, "%s/%s", TDCONFDIR, CONFIG_FILE_NAME);
+	return buf;
 }
 
 int lpmd_get_config(lpmd_config_t *lpmd_config)
 {
-	char file_name[MAX_FILE_NAME_PATH];
+	char default_file[MAX_FILE_NAME_PATH];
+	const char *file_name;
 	xmlNode *root_element;
 	xmlNode *cur_node;
 	struct stat s;
@@ -217,7 +507,7 @@ int lpmd_get_config(lpmd_config_t *lpmd_config)
 	if (!lpmd_config)
 		return LPMD_ERROR;
 
-	snprintf (file_name, MAX_FILE_NAME_PATH, "%s/%s", TDCONFDIR, CONFIG_FILE_NAME);
+	file_name = config_file_name (default_file, sizeof(default_file));
 
 	lpmd_log_msg ("Reading configuration file %s\n", file_name);
 
@@ -258,3 +548,63 @@ int lpmd_get_config(lpmd_config_t *lpmd_config)
 
 	return LPMD_SUCCESS;
 }
+
+/*
+ * WatchConfig: watch the directory of the configuration file, editors and
+ * package managers usually replace the file rather than rewrite it.
+ */
+static int config_watch_fd = -1;
+static char config_watch_name[MAX_STR_LENGTH];
+
+int lpmd_config_watch_init(void)
+{
+	char default_file[MAX_FILE_NAME_PATH];
+	char dir[MAX_STR_LENGTH], base[MAX_STR_LENGTH];
+	const char *file_name;
+
+	file_name = config_file_name (default_file, sizeof(default_file));
+	snprintf (dir, sizeof(dir), "%s", file_name);
+	snprintf (base, sizeof(base), "%s", file_name);
+	snprintf (config_watch_name, sizeof(config_watch_name), "%s", basename (base));
+
+	config_watch_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (config_watch_fd < 0) {
+		lpmd_log_error ("inotify_init1 failed: %s\n", strerror (errno));
+		return -1;
+	}
+
+	if (inotify_add_watch (config_watch_fd, dirname (dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		lpmd_log_error ("Cannot watch %s: %s\n", file_name, strerror (errno));
+		close (config_watch_fd);
+		config_watch_fd = -1;
+		return -1;
+	}
+
+	lpmd_log_info ("Watching %s for changes\n", file_name);
+
+	return config_watch_fd;
+}
+
+/* Handle POLLIN on the fd returned by lpmd_config_watch_init (), 1 if the file changed */
+int lpmd_config_watch_process(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int changed = 0;
+	ssize_t len;
+	char *ptr;
+
+	for (;;) {
+		len = read (config_watch_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(*event) + event->len) {
+			event = (const struct inotify_event*) ptr;
+			if (event->len && !strcmp (event->name, config_watch_name))
+				changed = 1;
+		}
+	}
+
+	return changed;
+}
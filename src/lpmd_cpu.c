@@ -35,6 +35,8 @@
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -56,24 +58,50 @@ static int topo_max_cpus;
 static int max_online_cpu;
 static size_t size_cpumask;
 
+/*
+ * The string and byte encodings of a mask are built on first use and kept
+ * until the mask changes. Every change gets the mask a new gen from
+ * cpumask_gen, so an encoding is valid while the gen it was built at is
+ * the current one. The reverse encodings depend on CPUMASK_ONLINE as well.
+ * The buffers are allocated once and rebuilt in place, so the pointers
+ * handed out stay valid.
+ */
+enum cpumask_enc {
+	CPUMASK_ENC_STR, CPUMASK_ENC_STR_REVERSE, CPUMASK_ENC_HEXSTR, CPUMASK_ENC_HEXSTR_REVERSE,
+	CPUMASK_ENC_HEXVALS, CPUMASK_ENC_MAX,
+};
+
+struct cpumask_cache {
+	void *buf;
+	unsigned int gen;
+	unsigned int online_gen;
+};
+
 struct lpm_cpus {
 	cpu_set_t *mask;
 	char *name;
-	char *str;
-	char *str_reverse;
-	char *hexstr;
-	char *hexstr_reverse;
+	unsigned int gen;
+	struct cpumask_cache enc[CPUMASK_ENC_MAX];
 };
 
+static unsigned int cpumask_gen;
+
 static struct lpm_cpus cpumasks[CPUMASK_MAX] = {
 		[CPUMASK_LPM_DEFAULT] = { .name = "Low Power", },
 		[CPUMASK_ONLINE] = { .name = "Online", },
 		[CPUMASK_HFI] = { .name = "HFI Low Power", },
 		[CPUMASK_HFI_SUV] = { .name = "HFI SUV", },
+		[CPUMASK_HFI_RANKED] = { .name = "HFI Ranked", },
+		[CPUMASK_LPM_TIER1] = { .name = "Low Power Tier 1", },
+		[CPUMASK_LPM_TIER2] = { .name = "Low Power Tier 2", },
+		[CPUMASK_LPM_TIER3] = { .name = "Low Power Tier 3", },
 };
 
 static enum cpumask_idx lpm_cpus_cur = CPUMASK_LPM_DEFAULT;
 
+/* The LPM CPUs process_cpus () last applied, empty when out of LPM */
+static cpu_set_t *lpm_cpus_applied;
+
 int is_cpu_online(int cpu)
 {
 	if (cpu < 0 || cpu >= topo_max_cpus)
@@ -172,161 +200,180 @@ static char to_hexchar(int val)
 	return val - 10 + 'a';
 }
 
+/*
+ * Kernel cpumask format, e.g. "ff,ffffffff" for 40 CPUs. The kernel parses
+ * a cpumask as comma separated 32-bit words, so a ',' goes every 8 digits.
+ */
 static int cpumask_to_hexstr(cpu_set_t *mask, char *str, int size)
 {
-	int cpu;
-	int i;
+	int nibbles = (topo_max_cpus + 3) / 4;
+	int cpu, i;
 	int pos = 0;
-	char c = 0;
-
-	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
-		i = cpu % 4;
+	int c;
 
-		if (!i)
-			c = 0;
+	for (i = nibbles - 1; i >= 0; i--) {
+		c = 0;
+		for (cpu = i * 4; cpu < i * 4 + 4 && cpu < topo_max_cpus; cpu++) {
+			if (CPU_ISSET_S(cpu, size_cpumask, mask))
+				c |= 1 << (cpu % 4);
+		}
 
-		if (CPU_ISSET_S(cpu, size_cpumask, mask))
-			c += (1 << i);
+		if (pos + 2 >= size)
+			return -1;
 
-		if (i == 3) {
-			str[pos] = to_hexchar (c);
-			pos++;
-			if (pos >= size)
-				return -1;
-		}
+		str[pos++] = to_hexchar (c);
+		if (i && !(i % 8))
+			str[pos++] = ',';
 	}
 	str[pos] = '\0';
 
-	pos--;
-	for (i = 0; i <= pos / 2; i++) {
-		c = str[i];
-		str[i] = str[pos - i];
-		str[pos - i] = c;
-	}
-
 	return 0;
 }
 
-static char* get_cpus_str(enum cpumask_idx idx)
+/* "%d," for every CPU in the worst case */
+static int cpus_str_size(void)
 {
-	if (!cpumasks[idx].mask)
-		return NULL;
+	int digits = 1;
+	int n;
 
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
-		return NULL;
-
-	if (cpumasks[idx].str)
-		return cpumasks[idx].str;
+	for (n = topo_max_cpus; n >= 10; n /= 10)
+		digits++;
 
-	cpumasks[idx].str = calloc (1, MAX_STR_LENGTH);
-	if (!cpumasks[idx].str)
-		err (3, "STR_ALLOC");
-
-	cpumask_to_str (cpumasks[idx].mask, cpumasks[idx].str, MAX_STR_LENGTH);
-	return cpumasks[idx].str;
+	return topo_max_cpus * (digits + 1) + 1;
 }
 
-static char* get_cpus_hexstr(enum cpumask_idx idx)
+/* Hex digits plus a ',' per 32-bit word */
+static int cpus_hexstr_size(void)
 {
-	if (!cpumasks[idx].mask)
-		return NULL;
-
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
-		return NULL;
+	int nibbles = (topo_max_cpus + 3) / 4;
 
-	if (cpumasks[idx].hexstr)
-		return cpumasks[idx].hexstr;
+	return nibbles + nibbles / 8 + 2;
+}
 
-	cpumasks[idx].hexstr = calloc (1, MAX_STR_LENGTH);
-	if (!cpumasks[idx].hexstr)
-		err (3, "STR_ALLOC");
+static int cpus_hexvals_size(void)
+{
+	return (topo_max_cpus + 7) / 8;
+}
 
-	cpumask_to_hexstr (cpumasks[idx].mask, cpumasks[idx].hexstr, MAX_STR_LENGTH);
-	return cpumasks[idx].hexstr;
+static void cpumask_changed(enum cpumask_idx idx)
+{
+	/* 0 is the gen of masks that were never changed */
+	if (!++cpumask_gen)
+		++cpumask_gen;
+	cpumasks[idx].gen = cpumask_gen;
 }
 
-char* get_lpm_cpus_hexstr(void)
+static void cpumask_to_hexvals(cpu_set_t *mask, uint8_t *vals)
 {
-	return get_cpus_hexstr (lpm_cpus_cur);
+	int cpu;
+
+	memset (vals, 0, cpus_hexvals_size ());
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (CPU_ISSET_S(cpu, size_cpumask, mask))
+			vals[cpu / 8] |= 1 << (cpu % 8);
+	}
 }
 
-static char* get_cpus_hexstr_reverse(enum cpumask_idx idx)
+/* The encoding enc of mask idx, NULL for an empty mask */
+static void* get_cpus_enc(enum cpumask_idx idx, enum cpumask_enc enc)
 {
+	struct cpumask_cache *cache = &cpumasks[idx].enc[enc];
+	unsigned int online_gen = cpumasks[CPUMASK_ONLINE].gen;
+	int reverse = enc == CPUMASK_ENC_STR_REVERSE || enc == CPUMASK_ENC_HEXSTR_REVERSE;
 	cpu_set_t *mask;
+	int size;
 
 	if (!cpumasks[idx].mask)
 		return NULL;
 
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
+	if (enc != CPUMASK_ENC_HEXVALS && !CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
 		return NULL;
 
-	if (cpumasks[idx].hexstr_reverse)
-		return cpumasks[idx].hexstr_reverse;
+	if (cache->buf && cache->gen == cpumasks[idx].gen
+			&& (!reverse || cache->online_gen == online_gen))
+		return cache->buf;
 
-	cpumasks[idx].hexstr_reverse = calloc (1, MAX_STR_LENGTH);
-	if (!cpumasks[idx].hexstr_reverse)
-		err (3, "STR_ALLOC");
+	if (enc == CPUMASK_ENC_STR || enc == CPUMASK_ENC_STR_REVERSE)
+		size = cpus_str_size ();
+	else if (enc == CPUMASK_ENC_HEXVALS)
+		size = cpus_hexvals_size ();
+	else
+		size = cpus_hexstr_size ();
 
-	alloc_cpu_set (&mask);
-	CPU_XOR_S(size_cpumask, mask, cpumasks[idx].mask, cpumasks[CPUMASK_ONLINE].mask);
-	cpumask_to_hexstr (mask, cpumasks[idx].hexstr_reverse, MAX_STR_LENGTH);
-	CPU_FREE(mask);
+	if (!cache->buf) {
+		cache->buf = calloc (1, size);
+		if (!cache->buf)
+			err (3, "STR_ALLOC");
+	}
 
-	return cpumasks[idx].hexstr_reverse;
-}
+	mask = cpumasks[idx].mask;
+	if (reverse) {
+		alloc_cpu_set (&mask);
+		CPU_XOR_S(size_cpumask, mask, cpumasks[idx].mask, cpumasks[CPUMASK_ONLINE].mask);
+	}
 
-static char* get_cpus_str_reverse(enum cpumask_idx idx)
-{
-	cpu_set_t *mask;
+	switch (enc) {
+		case CPUMASK_ENC_STR:
+		case CPUMASK_ENC_STR_REVERSE:
+			cpumask_to_str (mask, cache->buf, size);
+			break;
+		case CPUMASK_ENC_HEXSTR:
+		case CPUMASK_ENC_HEXSTR_REVERSE:
+			cpumask_to_hexstr (mask, cache->buf, size);
+			break;
+		default:
+			cpumask_to_hexvals (mask, cache->buf);
+			break;
+	}
 
-	if (!cpumasks[idx].mask)
-		return NULL;
+	if (reverse)
+		CPU_FREE(mask);
 
-	if (!CPU_COUNT_S(size_cpumask, cpumasks[idx].mask))
-		return NULL;
+	cache->gen = cpumasks[idx].gen;
+	cache->online_gen = online_gen;
+	return cache->buf;
+}
+
+static char* get_cpus_str(enum cpumask_idx idx)
+{
+	return get_cpus_enc (idx, CPUMASK_ENC_STR);
+}
 
-	if (cpumasks[idx].str_reverse)
-		return cpumasks[idx].str_reverse;
+static char* get_cpus_hexstr(enum cpumask_idx idx)
+{
+	return get_cpus_enc (idx, CPUMASK_ENC_HEXSTR);
+}
 
-	cpumasks[idx].str_reverse = calloc (1, MAX_STR_LENGTH);
-	if (!cpumasks[idx].str_reverse)
-		err (3, "STR_ALLOC");
+char* get_lpm_cpus_hexstr(void)
+{
+	return get_cpus_hexstr (lpm_cpus_cur);
+}
 
-	alloc_cpu_set (&mask);
-	CPU_XOR_S(size_cpumask, mask, cpumasks[idx].mask, cpumasks[CPUMASK_ONLINE].mask);
-	cpumask_to_str (mask, cpumasks[idx].str_reverse, MAX_STR_LENGTH);
-	CPU_FREE(mask);
+static char* get_cpus_hexstr_reverse(enum cpumask_idx idx)
+{
+	return get_cpus_enc (idx, CPUMASK_ENC_HEXSTR_REVERSE);
+}
 
-	return cpumasks[idx].str_reverse;
+static char* get_cpus_str_reverse(enum cpumask_idx idx)
+{
+	return get_cpus_enc (idx, CPUMASK_ENC_STR_REVERSE);
 }
 
+/* One bit per CPU, CPU0 in bit 0 of vals[0] */
 static int get_cpus_hexvals(enum cpumask_idx idx, uint8_t *vals, int size)
 {
-	int i, j, k;
-	uint8_t v = 0;
+	uint8_t *cached;
 
-	if (!cpumasks[idx].mask)
+	if (size < cpus_hexvals_size ()) {
+		lpmd_log_error ("size too big\n");
 		return -1;
-
-	for (i = 0; i < topo_max_cpus; i++) {
-		j = i % 8;
-		k = i / 8;
-
-		if (k >= size) {
-			lpmd_log_error ("size too big\n");
-			return -1;
-		}
-
-		if (!CPU_ISSET_S(i, size_cpumask, cpumasks[idx].mask))
-			goto set_val;
-
-		v |= 1 << j;
-set_val: if (j == 7) {
-			vals[k] = v;
-			v = 0;
-		}
 	}
 
+	cached = get_cpus_enc (idx, CPUMASK_ENC_HEXVALS);
+	if (!cached)
+		return -1;
+
+	memcpy (vals, cached, cpus_hexvals_size ());
 	return 0;
 }
 
@@ -350,10 +397,10 @@ static int _add_cpu(int cpu, enum cpumask_idx idx)
 	if (!cpumasks[idx].mask)
 		alloc_cpu_set (&cpumasks[idx].mask);
 
-	if (idx != CPUMASK_ONLINE && CPU_COUNT_S(size_cpumask, cpumasks[idx].mask) >= MAX_LPM_CPUS)
-		return LPMD_FATAL_ERROR;
-
-	CPU_SET_S(cpu, size_cpumask, cpumasks[idx].mask);
+	if (!CPU_ISSET_S(cpu, size_cpumask, cpumasks[idx].mask)) {
+		CPU_SET_S(cpu, size_cpumask, cpumasks[idx].mask);
+		cpumask_changed (idx);
+	}
 
 	return LPMD_SUCCESS;
 }
@@ -377,15 +424,10 @@ void reset_cpus(enum cpumask_idx idx)
 {
 	if (cpumasks[idx].mask)
 		CPU_ZERO_S(size_cpumask, cpumasks[idx].mask);
-	free (cpumasks[idx].str);
-	free (cpumasks[idx].str_reverse);
-	free (cpumasks[idx].hexstr);
-	free (cpumasks[idx].hexstr_reverse);
-	cpumasks[idx].str = NULL;
-	cpumasks[idx].str_reverse = NULL;
-	cpumasks[idx].hexstr = NULL;
-	cpumasks[idx].hexstr_reverse = NULL;
-	lpm_cpus_cur = CPUMASK_LPM_DEFAULT;
+	cpumask_changed (idx);
+	/* Resetting a mask that is not in use must not change the LPM CPUs */
+	if (lpm_cpus_cur == idx)
+		lpm_cpus_cur = CPUMASK_LPM_DEFAULT;
 }
 
 int set_lpm_cpus(enum cpumask_idx new)
@@ -393,16 +435,19 @@ int set_lpm_cpus(enum cpumask_idx new)
 	if (lpm_cpus_cur == new)
 		return 0;
 
-	if (new == CPUMASK_HFI_SUV)
+	if (new == CPUMASK_HFI_SUV) {
 		CPU_XOR_S(size_cpumask, cpumasks[new].mask, cpumasks[CPUMASK_ONLINE].mask,
 					cpumasks[new].mask);
+		cpumask_changed (new);
+	}
 
 	lpm_cpus_cur = new;
 	return 0;
 }
 
 #define BITMASK_SIZE 32
-static int set_max_cpu_num(void)
+/* Fallback when the possible CPUs are not available, rounded up to 32 CPUs */
+static int set_max_cpu_num_siblings(void)
 {
 	FILE *filep;
 	unsigned long dummy;
@@ -428,15 +473,57 @@ static int set_max_cpu_num(void)
 		topo_max_cpus += BITMASK_SIZE;
 	fclose (filep);
 
+	return 0;
+}
+
+/*
+ * Size every cpumask, and everything indexed by CPU, from the possible CPUs
+ * (nr_cpu_ids). The list, e.g. "0-511", can be of any length, so only the
+ * last CPU in it is kept. CPUs hotplugged later are always in the range.
+ */
+static int set_max_cpu_num(void)
+{
+	FILE *filep;
+	int cpu, last = -1;
+	char sep;
+
+	filep = fopen ("/sys/devices/system/cpu/possible", "r");
+	if (filep) {
+		while (fscanf (filep, "%d%c", &cpu, &sep) >= 1)
+			last = cpu;
+		fclose (filep);
+	}
+
+	if (last >= 0)
+		topo_max_cpus = last + 1;
+	else if (set_max_cpu_num_siblings ())
+		return -1;
+
 	lpmd_log_debug ("\t%d CPUs supported in maximum\n", topo_max_cpus);
 	return 0;
 }
 
+/*
+ * CPU hotplug tracking. The online CPUs are updated incrementally from the
+ * ACTION and DEVPATH fields of the kernel uevents, and all pending messages
+ * are handled in one wakeup. Only when the socket overflowed and events
+ * were lost, the online CPUs are read again from sysfs.
+ */
+#define UEVENT_BUF_SIZE		8192
+#define UEVENT_RCVBUF_SIZE	(256 * 1024)
+#define PATH_CPU_ONLINE		"/sys/devices/system/cpu/online"
+#define UEVENT_CPU_PATH		"/devices/system/cpu/cpu"
+
 static int uevent_fd = -1;
+static char uevent_buf[UEVENT_BUF_SIZE];
+
+/* Online CPUs as seen by the uevents, CPUMASK_ONLINE is the initial state */
+static cpu_set_t *hotplug_cpus;
 
 int uevent_init(void)
 {
 	struct sockaddr_nl nls;
+	int size = UEVENT_RCVBUF_SIZE;
 
 	memset (&nls, 0, sizeof(struct sockaddr_nl));
 
@@ -444,10 +531,14 @@ int uevent_init(void)
 	nls.nl_pid = getpid();
 	nls.nl_groups = -1;
 
-	uevent_fd = socket (PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	uevent_fd = socket (PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
 	if (uevent_fd < 0)
 		return uevent_fd;
 
+	/* Absorb the bursts of suspend/resume and bulk offlining */
+	if (setsockopt (uevent_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt (uevent_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
 	if (bind (uevent_fd, (struct sockaddr*) &nls, sizeof(struct sockaddr_nl))) {
 		lpmd_log_warn ("kob_uevent bind failed \n");
 		close (uevent_fd);
@@ -458,106 +549,177 @@ int uevent_init(void)
 	return uevent_fd;
 }
 
-static int has_cpu_uevent(void)
+/* Parse a sysfs CPU list, e.g. "0-3,8,10-11", without checking online */
+static void cpu_list_to_mask(char *str, cpu_set_t *mask)
 {
-	ssize_t i = 0;
-	ssize_t len;
-	const char *dev_path = "DEVPATH=";
-	unsigned int dev_path_len = strlen(dev_path);
-	const char *cpu_path = "/devices/system/cpu/cpu";
-	char buffer[MAX_STR_LENGTH];
+	unsigned long start, end;
+	char *next = str;
+
+	while (isdigit (*next)) {
+		start = end = strtoul (next, &next, 10);
+		if (*next == '-')
+			end = strtoul (next + 1, &next, 10);
+		for (; start <= end && start < (unsigned long) topo_max_cpus; start++)
+			CPU_SET_S(start, size_cpumask, mask);
+		if (*next == ',')
+			next++;
+	}
+}
 
-	len = recv (uevent_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
-	if (len <= 0)
-		return 0;
-	buffer[len] = '\0';
+static int read_cpu_list(const char *path, cpu_set_t *mask)
+{
+	char *str;
+	int fd, len;
 
-	lpmd_log_debug ("Receive uevent: %s\n", buffer);
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
 
-	while (i < len) {
-		if (strlen (buffer + i) > dev_path_len
-				&& !strncmp (buffer + i, dev_path, dev_path_len)) {
-			if (!strncmp (buffer + i + dev_path_len, cpu_path,
-					strlen (cpu_path))) {
-				lpmd_log_debug ("\tMatches: %s\n", buffer + i + dev_path_len);
-				return 1;
-			}
-		}
-		i += strlen (buffer + i) + 1;
+	/* A fragmented list can be as long as a "%d," per CPU */
+	str = malloc (cpus_str_size ());
+	if (!str) {
+		close (fd);
+		return -1;
+	}
+
+	len = read (fd, str, cpus_str_size () - 1);
+	close (fd);
+	if (len < 0) {
+		free (str);
+		return -1;
 	}
+	str[len] = '\0';
 
+	cpu_list_to_mask (str, mask);
+	free (str);
 	return 0;
 }
 
-#define PATH_PROC_STAT "/proc/stat"
+/* Resync hotplug_cpus from sysfs, returns 1 when it changed */
+static int hotplug_cpus_resync(void)
+{
+	cpu_set_t *mask;
+	int changed;
 
-int check_cpu_hotplug(void)
+	alloc_cpu_set (&mask);
+	if (read_cpu_list (PATH_CPU_ONLINE, mask) || !CPU_COUNT_S(size_cpumask, mask)) {
+		CPU_FREE(mask);
+		return 0;
+	}
+
+	changed = !CPU_EQUAL_S(size_cpumask, mask, hotplug_cpus);
+	if (changed) {
+		CPU_ZERO_S(size_cpumask, hotplug_cpus);
+		CPU_OR_S(size_cpumask, hotplug_cpus, hotplug_cpus, mask);
+	}
+	CPU_FREE(mask);
+
+	return changed;
+}
+
+/* Apply one uevent message of len bytes, returns 1 when a CPU changed state */
+static int parse_cpu_uevent(char *buf, ssize_t len)
 {
-	FILE *filep;
-	static cpu_set_t *curr;
-	static cpu_set_t *prev;
-	cpu_set_t *tmp;
+	const char *action = NULL;
+	const char *devpath = NULL;
+	char *p, *end;
+	int cpu, online;
 
-	if (!has_cpu_uevent ())
+	/* Kernel messages start with "action@devpath", udev ones do not */
+	if (!strchr (buf, '@'))
 		return 0;
 
-	if (!curr) {
-		alloc_cpu_set (&curr);
-		alloc_cpu_set (&prev);
-		CPU_OR_S (size_cpumask, curr, cpumasks[CPUMASK_ONLINE].mask, cpumasks[CPUMASK_ONLINE].mask);
+	for (p = buf; p < buf + len; p += strlen (p) + 1) {
+		if (!strncmp (p, "ACTION=", strlen ("ACTION=")))
+			action = p + strlen ("ACTION=");
+		else if (!strncmp (p, "DEVPATH=", strlen ("DEVPATH=")))
+			devpath = p + strlen ("DEVPATH=");
 	}
 
-	tmp = prev;
-	prev = curr;
-	curr = tmp;
-	CPU_ZERO_S (size_cpumask, curr);
+	if (!action || !devpath || strncmp (devpath, UEVENT_CPU_PATH, strlen (UEVENT_CPU_PATH)))
+		return 0;
 
-	filep = fopen (PATH_PROC_STAT, "r");
-	if (!filep)
+	p = (char*) devpath + strlen (UEVENT_CPU_PATH);
+	if (!isdigit (*p))
+		return 0;
+
+	cpu = strtol (p, &end, 10);
+	if (*end != '\0' || cpu >= topo_max_cpus)
+		return 0;
+
+	if (!strcmp (action, "online"))
+		online = 1;
+	else if (!strcmp (action, "offline") || !strcmp (action, "remove"))
+		online = 0;
+	else
 		return 0;
 
-	while (!feof (filep)) {
-		char *tmpline = NULL;
-		size_t size = 0;
-		char *line;
-		int cpu;
-		char *p;
-		int ret;
+	lpmd_log_debug ("Receive uevent: CPU%d %s\n", cpu, action);
+
+	if (!!CPU_ISSET_S(cpu, size_cpumask, hotplug_cpus) == online)
+		return 0;
+
+	if (online)
+		CPU_SET_S(cpu, size_cpumask, hotplug_cpus);
+	else
+		CPU_CLR_S(cpu, size_cpumask, hotplug_cpus);
+
+	return 1;
+}
 
-		tmpline = NULL;
-		size = 0;
+/* Handle all pending uevents, returns 1 when the online CPUs changed */
+static int drain_cpu_uevents(void)
+{
+	int changed = 0;
+	ssize_t len;
 
-		if (getline (&tmpline, &size, filep) <= 0) {
-			free (tmpline);
+	for (;;) {
+		len = recv (uevent_fd, uevent_buf, sizeof(uevent_buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Messages were dropped, their changes are only visible in sysfs */
+			if (errno == ENOBUFS) {
+				lpmd_log_debug ("uevent socket overflow, resync online CPUs\n");
+				changed |= hotplug_cpus_resync ();
+				continue;
+			}
 			break;
 		}
+		if (!len)
+			break;
 
-		line = strdup (tmpline);
-
-		p = strtok (line, " ");
+		uevent_buf[len] = '\0';
+		changed |= parse_cpu_uevent (uevent_buf, len);
+	}
 
-		ret = sscanf (p, "cpu%d", &cpu);
-		if (ret != 1)
-			goto free;
+	return changed;
+}
 
-		CPU_SET_S (cpu, size_cpumask, curr);
+static cpu_set_t *hotplug_prev;
 
-free:
-		free (tmpline);
-		free (line);
+static void hotplug_cpus_begin(void)
+{
+	if (!hotplug_cpus) {
+		alloc_cpu_set (&hotplug_cpus);
+		alloc_cpu_set (&hotplug_prev);
+		CPU_OR_S (size_cpumask, hotplug_cpus, cpumasks[CPUMASK_ONLINE].mask, cpumasks[CPUMASK_ONLINE].mask);
 	}
 
-	fclose (filep);
+	CPU_ZERO_S (size_cpumask, hotplug_prev);
+	CPU_OR_S (size_cpumask, hotplug_prev, hotplug_prev, hotplug_cpus);
+}
 
+static int hotplug_cpus_changed(cpu_set_t *prev)
+{
 	/* CPU Hotplug detected, should freeze lpmd */
-	if (!CPU_EQUAL_S (size_cpumask, curr, cpumasks[CPUMASK_ONLINE].mask)) {
+	if (!CPU_EQUAL_S (size_cpumask, hotplug_cpus, cpumasks[CPUMASK_ONLINE].mask)) {
 		lpmd_log_debug ("check_cpu_hotplug: CPU Hotplug detected, freeze lpmd\n");
 		return freeze_lpm ();
 	}
 
 	/* CPU restored to original state, should restore lpmd */
-	if (CPU_EQUAL_S (size_cpumask, curr, cpumasks[CPUMASK_ONLINE].mask) &&
-	    !CPU_EQUAL_S (size_cpumask, curr, prev)) {
+	if (!CPU_EQUAL_S (size_cpumask, hotplug_cpus, prev)) {
 		lpmd_log_debug ("check_cpu_hotplug: CPU Hotplug restored, restore lpmd\n");
 		return restore_lpm ();
 	}
@@ -566,6 +728,47 @@ free:
 	return 0;
 }
 
+static void probe_hotplug_cpus(void);
+
+int check_cpu_hotplug(void)
+{
+	int cpu;
+
+	hotplug_cpus_begin ();
+
+	if (!drain_cpu_uevents ())
+		return 0;
+
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!!CPU_ISSET_S(cpu, size_cpumask, hotplug_cpus)
+				!= !!CPU_ISSET_S(cpu, size_cpumask, hotplug_prev))
+			lpmd_trace_hotplug (cpu, CPU_ISSET_S(cpu, size_cpumask, hotplug_cpus));
+	}
+
+	probe_hotplug_cpus ();
+
+	return hotplug_cpus_changed (hotplug_prev);
+}
+
+/* Apply a CPU hotplug recorded in a trace */
+int replay_cpu_hotplug(int cpu, int online)
+{
+	if (cpu < 0 || cpu >= topo_max_cpus)
+		return 0;
+
+	hotplug_cpus_begin ();
+
+	if (online)
+		CPU_SET_S(cpu, size_cpumask, hotplug_cpus);
+	else
+		CPU_CLR_S(cpu, size_cpumask, hotplug_cpus);
+
+	if (CPU_EQUAL_S(size_cpumask, hotplug_cpus, hotplug_prev))
+		return 0;
+
+	return hotplug_cpus_changed (hotplug_prev);
+}
+
 /* Bit 15 of CPUID.7 EDX stands for Hybrid support */
 #define CPUFEATURE_HYBRID	(1 << 15)
 #define PATH_PM_PROFILE "/sys/firmware/acpi/pm_profile"
@@ -596,56 +799,386 @@ static struct cpu_model_entry id_table[] = {
 	lpmd_log_debug("CPUID 0x%08x subleaf 0x%08x: eax = 0x%08x ebx = 0x%08x ecx = 0x%08x"	\
 			"edx = 0x%08x\n", leaf, subleaf, eax, ebx, ecx, edx);
 
-static int detect_supported_cpu(void)
+/*
+ * Core type and L3 presence of each CPU, for the LPM CPU detection. Both are
+ * read from sysfs when the kernel exposes them, and only what is missing is
+ * probed with CPUID, which needs a migration to every CPU. The result is
+ * cached in TDSTATEDIR, keyed by the CPUID signature, the microcode version
+ * and the number of CPUs, so later starts skip the discovery.
+ */
+#define PATH_TOPO_CACHE		TDSTATEDIR "/topology"
+#define PATH_CPU_ATOM		"/sys/devices/cpu_atom/cpus"
+#define PATH_MICROCODE		"/sys/devices/system/cpu/cpu0/microcode/version"
+
+static cpu_set_t *topo_probed;
+static cpu_set_t *topo_atom;
+static cpu_set_t *topo_l3;
+static unsigned int cpu_signature;
+static unsigned int cpu_microcode;
+
+/* 1 when the CPU has a unified L3, 0 when not, -1 when sysfs can't tell */
+static int sysfs_cpu_l3(int cpu)
 {
-	unsigned int eax, ebx, ecx, edx;
-	unsigned int max_level, family, model, stepping;
-	int val;
-
-	cpuid(0, eax, ebx, ecx, edx);
-
-	/* Unsupported vendor */
-        if (ebx != 0x756e6547 || edx != 0x49656e69 || ecx != 0x6c65746e)
-		return -1;
-
-	max_level = eax;
+	FILE *filep;
+	char path[MAX_STR_LENGTH];
+	char type[16];
+	int index, level, ret;
 
-	cpuid(1, eax, ebx, ecx, edx);
-	family = (eax >> 8) & 0xf;
-	model = (eax >> 4) & 0xf;
-	stepping = eax & 0xf;
+	for (index = 0;; index++) {
+		snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu,
+					index);
+		filep = fopen (path, "r");
+		if (!filep)
+			break;
+		ret = fscanf (filep, "%d", &level);
+		fclose (filep);
+		if (ret != 1)
+			return -1;
 
-	if (family == 6)
-		model += ((eax >> 16) & 0xf) << 4;
+		if (level != 3)
+			continue;
 
-	lpmd_log_info("%u CPUID levels; family:model:stepping 0x%x:%x:%x (%u:%u:%u)\n",
-			max_level, family, model, stepping, family, model, stepping);
+		snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu,
+					index);
+		filep = fopen (path, "r");
+		if (!filep)
+			return -1;
+		ret = fscanf (filep, "%15s", type);
+		fclose (filep);
+		if (ret != 1)
+			return -1;
 
-	val = 0;
-	while (id_table[val].family) {
-		if (id_table[val].family == family && id_table[val].model == model)
-			break;
-		val++;
-        }
+		if (!strcmp (type, "Unified"))
+			return 1;
+	}
 
-	/* Unsupported model */
-        if (!id_table[val].family || max_level < 0x1a) {
-		lpmd_log_info("Unsupported platform\n");
+	/* No cache information at all */
+	if (!index)
 		return -1;
-        }
 
-	cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return 0;
+}
 
-	/* Run on Hybrid platforms only */
-	if (!(edx & CPUFEATURE_HYBRID)) {
-		lpmd_log_debug("Non-Hybrid platform detected\n");
+static int cpuid_cpu_topology(int cpu, int need_atom, int need_l3)
+{
+	unsigned int eax, ebx, ecx, edx, subleaf;
+
+	if (cpu_migrate(cpu) < 0) {
+		lpmd_log_error("Failed to migrated to cpu%d\n", cpu);
 		return -1;
 	}
 
-	/* /sys/firmware/acpi/pm_profile is mandatory */
-	if (lpmd_read_int(PATH_PM_PROFILE, &val, -1)) {
-		lpmd_log_debug("Failed to read %s\n", PATH_PM_PROFILE);
-		return -1;
+	if (need_atom) {
+		cpuid(0x1a, eax, ebx, ecx, edx);
+		if (((eax >> 24) & 0xFF) == 0x20)
+			CPU_SET_S(cpu, size_cpumask, topo_atom);
+	}
+
+	if (!need_l3)
+		return 0;
+
+	for(subleaf = 0;; subleaf++) {
+		unsigned int type, level;
+
+		cpuid_count(4, subleaf, eax, ebx, ecx, edx);
+
+		type = eax & 0x1f;
+		level = (eax >> 5) & 0x7;
+
+		/* No more caches */
+		if (!type)
+			break;
+		/* Unified Cache */
+		if (type !=3 )
+			continue;
+		/* L3 */
+		if (level != 3)
+			continue;
+
+		CPU_SET_S(cpu, size_cpumask, topo_l3);
+		break;
+	}
+
+	return 0;
+}
+
+static void topo_cache_write_mask(FILE *filep, const char *key, cpu_set_t *mask)
+{
+	int cpu, first = 1;
+
+	fprintf (filep, "%s ", key);
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!CPU_ISSET_S(cpu, size_cpumask, mask))
+			continue;
+		fprintf (filep, first ? "%d" : ",%d", cpu);
+		first = 0;
+	}
+	fprintf (filep, "\n");
+}
+
+static void topo_cache_save(void)
+{
+	FILE *filep;
+
+	filep = fopen (PATH_TOPO_CACHE ".tmp", "w");
+	if (!filep) {
+		lpmd_log_debug ("Can't write %s\n", PATH_TOPO_CACHE);
+		return;
+	}
+
+	fprintf (filep, "signature 0x%x\nmicrocode 0x%x\ncpus %d\n", cpu_signature, cpu_microcode,
+				topo_max_cpus);
+	topo_cache_write_mask (filep, "probed", topo_probed);
+	topo_cache_write_mask (filep, "atom", topo_atom);
+	topo_cache_write_mask (filep, "l3", topo_l3);
+
+	if (fclose (filep) || rename (PATH_TOPO_CACHE ".tmp", PATH_TOPO_CACHE)) {
+		lpmd_log_debug ("Can't write %s\n", PATH_TOPO_CACHE);
+		unlink (PATH_TOPO_CACHE ".tmp");
+		return;
+	}
+
+	lpmd_log_debug ("\tTopology cached in %s\n", PATH_TOPO_CACHE);
+}
+
+/* Returns 0 when a cache for this CPU model and microcode was loaded */
+static int topo_cache_load(void)
+{
+	FILE *filep;
+	char *line, *val;
+	int size = cpus_str_size () + 32;
+	unsigned int signature = 0, microcode = 0;
+	int cpus = 0;
+
+	filep = fopen (PATH_TOPO_CACHE, "r");
+	if (!filep)
+		return -1;
+
+	line = malloc (size);
+	if (!line) {
+		fclose (filep);
+		return -1;
+	}
+
+	while (fgets (line, size, filep)) {
+		val = strchr (line, ' ');
+		if (!val)
+			continue;
+		*val++ = '\0';
+
+		if (!strcmp (line, "signature"))
+			signature = strtoul (val, NULL, 16);
+		else if (!strcmp (line, "microcode"))
+			microcode = strtoul (val, NULL, 16);
+		else if (!strcmp (line, "cpus"))
+			cpus = strtol (val, NULL, 10);
+		else if (!strcmp (line, "probed"))
+			cpu_list_to_mask (val, topo_probed);
+		else if (!strcmp (line, "atom"))
+			cpu_list_to_mask (val, topo_atom);
+		else if (!strcmp (line, "l3"))
+			cpu_list_to_mask (val, topo_l3);
+	}
+
+	free (line);
+	fclose (filep);
+
+	if (signature != cpu_signature || microcode != cpu_microcode || cpus != topo_max_cpus) {
+		lpmd_log_debug ("\tStale topology cache %s\n", PATH_TOPO_CACHE);
+		CPU_ZERO_S(size_cpumask, topo_probed);
+		CPU_ZERO_S(size_cpumask, topo_atom);
+		CPU_ZERO_S(size_cpumask, topo_l3);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* atom lists the Atom cores unless need_atom, then they come from CPUID */
+static int probe_cpu(int cpu, cpu_set_t *atom, int need_atom, int *migrated)
+{
+	int l3;
+
+	if (!need_atom && CPU_ISSET_S(cpu, size_cpumask, atom))
+		CPU_SET_S(cpu, size_cpumask, topo_atom);
+
+	l3 = sysfs_cpu_l3 (cpu);
+	if (l3 > 0)
+		CPU_SET_S(cpu, size_cpumask, topo_l3);
+
+	if (need_atom || l3 < 0) {
+		if (cpuid_cpu_topology (cpu, need_atom, l3 < 0))
+			return -1;
+		*migrated = 1;
+	}
+
+	CPU_SET_S(cpu, size_cpumask, topo_probed);
+	return 0;
+}
+
+static int probe_cpu_topology(void)
+{
+	FILE *filep;
+	cpu_set_t *atom, *check;
+	int cpu, need_atom;
+	int migrated = 0, changed = 0;
+	int ret = 0;
+
+	alloc_cpu_set (&topo_probed);
+	alloc_cpu_set (&topo_atom);
+	alloc_cpu_set (&topo_l3);
+	alloc_cpu_set (&atom);
+
+	filep = fopen (PATH_MICROCODE, "r");
+	if (filep) {
+		if (fscanf (filep, "%x", &cpu_microcode) != 1)
+			cpu_microcode = 0;
+		fclose (filep);
+	}
+
+	topo_cache_load ();
+
+	/* The hybrid PMU lists the Atom cores, one read for all CPUs */
+	need_atom = read_cpu_list (PATH_CPU_ATOM, atom) < 0;
+
+	/* The cache is from another SKU of the same model */
+	if (!need_atom) {
+		alloc_cpu_set (&check);
+		CPU_XOR_S(size_cpumask, check, atom, topo_atom);
+		CPU_AND_S(size_cpumask, check, check, topo_probed);
+		CPU_AND_S(size_cpumask, check, check, cpumasks[CPUMASK_ONLINE].mask);
+		if (CPU_COUNT_S(size_cpumask, check)) {
+			lpmd_log_debug ("\tTopology cache mismatch, discard\n");
+			CPU_ZERO_S(size_cpumask, topo_probed);
+			CPU_ZERO_S(size_cpumask, topo_atom);
+			CPU_ZERO_S(size_cpumask, topo_l3);
+		}
+		CPU_FREE(check);
+	}
+
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!is_cpu_online (cpu) || CPU_ISSET_S(cpu, size_cpumask, topo_probed))
+			continue;
+
+		ret = probe_cpu (cpu, atom, need_atom, &migrated);
+		if (ret)
+			break;
+		changed = 1;
+	}
+	CPU_FREE(atom);
+
+	/* Don't stay on the last probed CPU */
+	if (migrated)
+		sched_setaffinity (0, size_cpumask, cpumasks[CPUMASK_ONLINE].mask);
+
+	if (!ret && changed)
+		topo_cache_save ();
+
+	lpmd_log_debug ("\tTopology %s%s\n", changed ? "probed" : "from cache",
+					migrated ? " with CPUID" : "");
+	return ret;
+}
+
+/*
+ * CPUs onlined after the start are not in topo_probed yet, which the module
+ * based detection needs for all CPUs. Probe them from the hotplug path.
+ */
+static void probe_hotplug_cpus(void)
+{
+	cpu_set_t *atom, *affinity;
+	int cpu, need_atom, migrated = 0, changed = 0;
+	int ret = 0;
+
+	if (!topo_probed)
+		return;
+
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (CPU_ISSET_S(cpu, size_cpumask, hotplug_cpus)
+				&& !CPU_ISSET_S(cpu, size_cpumask, topo_probed))
+			break;
+	}
+	if (cpu == topo_max_cpus)
+		return;
+
+	alloc_cpu_set (&atom);
+	alloc_cpu_set (&affinity);
+	need_atom = read_cpu_list (PATH_CPU_ATOM, atom) < 0;
+	/* CPUID migrates this thread, whose affinity is set by lpmd_set_cpu_affinity () */
+	if (sched_getaffinity (0, size_cpumask, affinity))
+		CPU_OR_S(size_cpumask, affinity, affinity, cpumasks[CPUMASK_ONLINE].mask);
+
+	for (; cpu < topo_max_cpus; cpu++) {
+		if (!CPU_ISSET_S(cpu, size_cpumask, hotplug_cpus)
+				|| CPU_ISSET_S(cpu, size_cpumask, topo_probed))
+			continue;
+
+		ret = probe_cpu (cpu, atom, need_atom, &migrated);
+		if (ret)
+			break;
+		lpmd_log_debug ("\tProbed topology of CPU%d\n", cpu);
+		changed = 1;
+	}
+
+	if (migrated)
+		sched_setaffinity (0, size_cpumask, affinity);
+	CPU_FREE(affinity);
+	CPU_FREE(atom);
+
+	if (!ret && changed)
+		topo_cache_save ();
+}
+
+static int detect_supported_cpu(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int max_level, family, model, stepping;
+	int val;
+
+	cpuid(0, eax, ebx, ecx, edx);
+
+	/* Unsupported vendor */
+        if (ebx != 0x756e6547 || edx != 0x49656e69 || ecx != 0x6c65746e)
+		return -1;
+
+	max_level = eax;
+
+	cpuid(1, eax, ebx, ecx, edx);
+	cpu_signature = eax;
+	family = (eax >> 8) & 0xf;
+	model = (eax >> 4) & 0xf;
+	stepping = eax & 0xf;
+
+	if (family == 6)
+		model += ((eax >> 16) & 0xf) << 4;
+
+	lpmd_log_info("%u CPUID levels; family:model:stepping 0x%x:%x:%x (%u:%u:%u)\n",
+			max_level, family, model, stepping, family, model, stepping);
+
+	val = 0;
+	while (id_table[val].family) {
+		if (id_table[val].family == family && id_table[val].model == model)
+			break;
+		val++;
+        }
+
+	/* Unsupported model */
+        if (!id_table[val].family || max_level < 0x1a) {
+		lpmd_log_info("Unsupported platform\n");
+		return -1;
+        }
+
+	cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	/* Run on Hybrid platforms only */
+	if (!(edx & CPUFEATURE_HYBRID)) {
+		lpmd_log_debug("Non-Hybrid platform detected\n");
+		return -1;
+	}
+
+	/* /sys/firmware/acpi/pm_profile is mandatory */
+	if (lpmd_read_int(PATH_PM_PROFILE, &val, -1)) {
+		lpmd_log_debug("Failed to read %s\n", PATH_PM_PROFILE);
+		return -1;
 	}
 
 	if (val != 2) {
@@ -696,12 +1229,15 @@ static int parse_cpu_topology(void)
 	}
 	max_online_cpu = i;
 
-	return 0;
+	return probe_cpu_topology ();
 }
 
 /* Run intel_lpmd on the LP-Mode CPUs only */
 static void lpmd_set_cpu_affinity(void)
 {
+	/* The CPUs of a replay are the ones of the recording system */
+	if (lpmd_trace_replaying ())
+		return;
 	if (!cpumasks[CPUMASK_LPM_DEFAULT].mask)
 		return;
 	if (!CPU_COUNT_S (size_cpumask, cpumasks[CPUMASK_LPM_DEFAULT].mask))
@@ -804,53 +1340,88 @@ static int detect_lpm_cpus_cmd(char *cmd)
  */
 static int is_cpu_atom(int cpu)
 {
-	unsigned int eax, ebx, ecx, edx;
-	unsigned int type;
-
-	if (cpu_migrate(cpu) < 0) {
-		lpmd_log_error("Failed to migrated to cpu%d\n", cpu);
+	if (!CPU_ISSET_S(cpu, size_cpumask, topo_probed))
 		return -1;
-	}
 
-	cpuid(0x1a, eax, ebx, ecx, edx);
+	return CPU_ISSET_S(cpu, size_cpumask, topo_atom);
+}
+
+/*
+ * Per CPU topology lists and attributes used to detect the LPM CPUs. They
+ * come from sysfs, or from the recorded topology in a replay, see
+ * init_cpu_replay (). Older recordings may not have all of them.
+ */
+enum topo_list {
+	TOPO_LIST_CLUSTER, TOPO_LIST_SIBLINGS, TOPO_LIST_DIE, TOPO_LIST_L3, TOPO_LIST_MAX_FREQ,
+	TOPO_LIST_MAX,
+};
+
+static const char *topo_list_names[TOPO_LIST_MAX] = {
+	[TOPO_LIST_CLUSTER] = "cluster_cpus_list",
+	[TOPO_LIST_SIBLINGS] = "thread_siblings_list",
+	[TOPO_LIST_DIE] = "die_cpus_list",
+	[TOPO_LIST_L3] = "l3_shared_cpu_list",
+	[TOPO_LIST_MAX_FREQ] = "cpuinfo_max_freq",
+};
 
-	type = (eax >> 24) & 0xFF;
+/* Relative to /sys/devices/system/cpu/cpuN */
+static const char *topo_list_paths[TOPO_LIST_MAX] = {
+	[TOPO_LIST_CLUSTER] = "topology/cluster_cpus_list",
+	[TOPO_LIST_SIBLINGS] = "topology/thread_siblings_list",
+	[TOPO_LIST_DIE] = "topology/die_cpus_list",
+	/* index3 is the L3 on Intel CPUs that have one */
+	[TOPO_LIST_L3] = "cache/index3/shared_cpu_list",
+	[TOPO_LIST_MAX_FREQ] = "cpufreq/cpuinfo_max_freq",
+};
 
-	return type == 0x20;
-}
+static char **replay_topo_lists[TOPO_LIST_MAX];
 
-static int detect_lpm_cpus_cluster(void)
+/* Returns the length of the list read into str, <= 0 when unavailable */
+static int read_topology_list(int cpu, enum topo_list list, char *str, int size)
 {
 	FILE *filep;
 	char path[MAX_STR_LENGTH];
-	char str[MAX_STR_LENGTH];
-	int i, ret;
+	int ret;
 
-	for (i = topo_max_cpus; i >= 0; i--) {
-		if (!is_cpu_online (i))
-			continue;
+	if (lpmd_trace_replaying ()) {
+		if (!replay_topo_lists[list] || !replay_topo_lists[list][cpu])
+			return -1;
+		return snprintf (str, size, "%s", replay_topo_lists[list][cpu]);
+	}
 
-		snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/cluster_cpus_list",
-					i);
-		path[MAX_STR_LENGTH - 1] = '\0';
+	snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, topo_list_paths[list]);
 
-		filep = fopen (path, "r");
-		if (!filep)
-			continue;
+	filep = fopen (path, "r");
+	if (!filep)
+		return -1;
 
-		ret = fread (str, 1, MAX_STR_LENGTH - 1, filep);
-		fclose (filep);
+	ret = fread (str, 1, size - 1, filep);
+	fclose (filep);
+
+	if (ret <= 0)
+		return ret;
+
+	str[ret] = '\0';
+	return ret;
+}
+
+static int detect_lpm_cpus_cluster(void)
+{
+	char str[MAX_STR_LENGTH];
+	int i;
 
-		if (ret <= 0)
+	for (i = topo_max_cpus - 1; i >= 0; i--) {
+		if (!is_cpu_online (i))
 			continue;
 
-		str[ret] = '\0';
+		if (read_topology_list (i, TOPO_LIST_CLUSTER, str, sizeof(str)) <= 0)
+			continue;
 
 		if (parse_cpu_str (str, CPUMASK_LPM_DEFAULT) <= 0)
 			continue;
 
 		/* An Ecore module contains 4 Atom cores */
-		if (CPU_COUNT_S(size_cpumask, cpumasks[CPUMASK_LPM_DEFAULT].mask) == 4 && is_cpu_atom(i))
+		if (CPU_COUNT_S(size_cpumask, cpumasks[CPUMASK_LPM_DEFAULT].mask) == 4 && is_cpu_atom(i) > 0)
 			break;
 
 		reset_cpus (CPUMASK_LPM_DEFAULT);
@@ -866,34 +1437,12 @@ static int detect_lpm_cpus_cluster(void)
 
 static int detect_cpu_l3(int cpu)
 {
-	unsigned int eax, ebx, ecx, edx, subleaf;
-
-	if (cpu_migrate(cpu) < 0) {
-		lpmd_log_error("Failed to migrated to cpu%d\n", cpu);
+	if (!CPU_ISSET_S(cpu, size_cpumask, topo_probed))
 		return -1;
-	}
-
-	for(subleaf = 0;; subleaf++) {
-		unsigned int type, level;
-
-		cpuid_count(4, subleaf, eax, ebx, ecx, edx);
-
-		type = eax & 0x1f;
-		level = (eax >> 5) & 0x7;
-
-		/* No more caches */
-		if (!type)
-			break;
-		/* Unified Cache */
-		if (type !=3 )
-			continue;
-		/* L3 */
-		if (level != 3)
-			continue;
 
-		/* Do nothing about CPUs that have L3 */
+	/* Do nothing about CPUs that have L3 */
+	if (CPU_ISSET_S(cpu, size_cpumask, topo_l3))
 		return 0;
-	}
 
 	/* Use CPUs don't have L3 as LPM CPUs */
 	_add_cpu (cpu, CPUMASK_LPM_DEFAULT);
@@ -930,35 +1479,333 @@ err: reset_cpus (CPUMASK_LPM_DEFAULT);
 	return 0;
 }
 
-static int detect_lpm_cpus(char *cmd_cpus)
+/*
+ * Topology model for LpmCpuPolicy "modules": the online CPUs grouped in
+ * modules, i.e. the CPUs sharing an L2 cluster, or the SMT siblings of a
+ * core when there are no clusters. Each module has the die and the L3
+ * domain of its first CPU, identified by their lowest CPU (-1 when
+ * unknown, or for l3 without an L3), and the highest max frequency.
+ */
+struct lpm_module {
+	int first;
+	int nr_cpus;
+	int atom;
+	int l3;
+	int die;
+	int max_freq;
+	cpu_set_t *cpus;
+};
+
+/* The first number of a topology list or attribute, -1 when unavailable */
+static int topo_list_first(int cpu, enum topo_list list)
 {
-	int ret;
-	char *str;
+	char str[MAX_STR_LENGTH];
 
-	if (cmd_cpus && cmd_cpus[0] != '\0') {
-		ret = detect_lpm_cpus_cmd (cmd_cpus);
-		if (ret <= 0) {
-			lpmd_log_error ("\tInvalid -c parameter: %s\n", cmd_cpus);
-			exit (-1);
-		}
-		str = "CommandLine";
-		goto end;
-	}
+	if (read_topology_list (cpu, list, str, sizeof(str)) <= 0)
+		return -1;
 
-	ret = detect_lpm_cpus_l3 ();
-	if (ret < 0)
-		return ret;
+	return strtol (str, NULL, 10);
+}
 
-	if (ret > 0) {
-		str = "Lcores";
+static int build_lpm_modules(struct lpm_module *modules)
+{
+	struct lpm_module *module;
+	int cpu, first, freq, i;
+	int nr = 0;
+
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!is_cpu_online (cpu))
+			continue;
+
+		first = topo_list_first (cpu, TOPO_LIST_CLUSTER);
+		if (first < 0)
+			first = topo_list_first (cpu, TOPO_LIST_SIBLINGS);
+		if (first < 0)
+			first = cpu;
+
+		for (i = 0; i < nr; i++) {
+			if (modules[i].first == first)
+				break;
+		}
+
+		module = &modules[i];
+		if (i == nr) {
+			alloc_cpu_set (&module->cpus);
+			module->first = first;
+			module->atom = is_cpu_atom (cpu) > 0;
+			module->l3 = -1;
+			if (CPU_ISSET_S(cpu, size_cpumask, topo_l3)) {
+				module->l3 = topo_list_first (cpu, TOPO_LIST_L3);
+				/* Has an L3, but not which one */
+				if (module->l3 < 0)
+					module->l3 = 0;
+			}
+			module->die = topo_list_first (cpu, TOPO_LIST_DIE);
+			nr++;
+		}
+
+		CPU_SET_S(cpu, size_cpumask, module->cpus);
+		module->nr_cpus++;
+		if (is_cpu_atom (cpu) <= 0)
+			module->atom = 0;
+
+		freq = topo_list_first (cpu, TOPO_LIST_MAX_FREQ);
+		if (freq > module->max_freq)
+			module->max_freq = freq;
+	}
+
+	return nr;
+}
+
+/*
+ * Least capable first: Ecore modules before Pcores, then the ones without
+ * L3 (SoC tile), then by max frequency. Among equal ones the last module
+ * comes first, like in detect_lpm_cpus_cluster ().
+ */
+static int lpm_module_cmp(const void *a, const void *b)
+{
+	const struct lpm_module *x = a, *y = b;
+
+	if (x->atom != y->atom)
+		return y->atom - x->atom;
+	if ((x->l3 < 0) != (y->l3 < 0))
+		return (y->l3 < 0) - (x->l3 < 0);
+	if (x->max_freq != y->max_freq)
+		return x->max_freq - y->max_freq;
+	return y->first - x->first;
+}
+
+static void add_lpm_module(struct lpm_module *module)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (CPU_ISSET_S(cpu, size_cpumask, module->cpus))
+			_add_cpu (cpu, CPUMASK_LPM_DEFAULT);
+	}
+	module->first = -1;
+}
+
+/*
+ * Use the nr least capable modules as LPM CPUs. The modules after the
+ * first one are taken from the same die and L3 domain first, so the other
+ * dies can stay idle. Using all online CPUs is not a valid choice.
+ */
+static int detect_lpm_cpus_modules(int nr)
+{
+	struct lpm_module *modules;
+	int nr_modules, picked = 0;
+	int die, l3, pass, i;
+
+	/* The L3 and atom bits come from the probed topology */
+	for (i = 0; i < topo_max_cpus; i++) {
+		if (is_cpu_online (i) && !CPU_ISSET_S(i, size_cpumask, topo_probed))
+			return -1;
+	}
+
+	modules = calloc (topo_max_cpus, sizeof(*modules));
+	if (!modules)
+		return 0;
+
+	nr_modules = build_lpm_modules (modules);
+	qsort (modules, nr_modules, sizeof(*modules), lpm_module_cmp);
+
+	for (i = 0; i < nr_modules; i++)
+		lpmd_log_debug ("	Module %d: %d CPUs, %s, L3 %d, die %d, max freq %d\n",
+						modules[i].first, modules[i].nr_cpus, modules[i].atom ? "Ecore" : "Pcore",
+						modules[i].l3, modules[i].die, modules[i].max_freq);
+
+	if (!nr_modules)
 		goto end;
+
+	die = modules[0].die;
+	l3 = modules[0].l3;
+
+	/* Same die and L3 domain, same die, then any */
+	for (pass = 0; pass < 3; pass++) {
+		for (i = 0; i < nr_modules && picked < nr; i++) {
+			if (modules[i].first < 0)
+				continue;
+			if (pass < 2 && modules[i].die != die)
+				continue;
+			if (!pass && modules[i].l3 != l3)
+				continue;
+			add_lpm_module (&modules[i]);
+			picked++;
+		}
+	}
+
+	if (CPU_EQUAL_S(size_cpumask, cpumasks[CPUMASK_LPM_DEFAULT].mask,
+					cpumasks[CPUMASK_ONLINE].mask))
+		reset_cpus (CPUMASK_LPM_DEFAULT);
+
+end:
+	for (i = 0; i < nr_modules; i++)
+		CPU_FREE(modules[i].cpus);
+	free (modules);
+
+	if (!has_cpus (CPUMASK_LPM_DEFAULT)) {
+		reset_cpus (CPUMASK_LPM_DEFAULT);
+		return 0;
+	}
+
+	return CPU_COUNT_S(size_cpumask, cpumasks[CPUMASK_LPM_DEFAULT].mask);
+}
+
+/*
+ * Detect CPUMASK_LPM_DEFAULT with the configured LpmCpuPolicy. Returns the
+ * number of CPUs, 0 when none apply, < 0 when the topology is unknown.
+ */
+static int detect_lpm_cpus_policy(const char **name)
+{
+	int ret;
+
+	switch (get_lpm_cpu_policy ()) {
+		case LPM_CPU_POLICY_SOC:
+			*name = "SoC cores";
+			return detect_lpm_cpus_l3 ();
+		case LPM_CPU_POLICY_MODULES:
+			*name = "Modules";
+			return detect_lpm_cpus_modules (get_lpm_cpu_modules ());
+		default:
+			break;
+	}
+
+	ret = detect_lpm_cpus_l3 ();
+	if (ret) {
+		*name = "Lcores";
+		return ret;
+	}
+
+	*name = "Ecores";
+	return detect_lpm_cpus_cluster ();
+}
+
+/*
+ * Graduated LPM tiers, each one a superset of the previous one when
+ * detected automatically: tier 0 is CPUMASK_LPM_DEFAULT, the next tier adds
+ * all Ecore modules, and every further tier adds one more Pcore together
+ * with its SMT siblings. The util monitor steps between them.
+ */
+static enum cpumask_idx lpm_tier_cpumasks[LPM_TIER_MAX] = {
+	CPUMASK_LPM_DEFAULT, CPUMASK_LPM_TIER1, CPUMASK_LPM_TIER2, CPUMASK_LPM_TIER3,
+};
+
+static int lpm_tiers = 1;
+
+int get_lpm_tiers(void)
+{
+	return lpm_tiers;
+}
+
+enum cpumask_idx get_lpm_tier_cpumask(int tier)
+{
+	if (tier < 0 || tier >= lpm_tiers)
+		return CPUMASK_LPM_DEFAULT;
+
+	return lpm_tier_cpumasks[tier];
+}
+
+static int add_cpu_siblings(int cpu, enum cpumask_idx idx)
+{
+	char str[MAX_STR_LENGTH];
+
+	if (read_topology_list (cpu, TOPO_LIST_SIBLINGS, str, sizeof(str)) <= 0)
+		return _add_cpu (cpu, idx);
+
+	return parse_cpu_str (str, idx) > 0 ? 0 : -1;
+}
+
+static int detect_lpm_tier_auto(int tier)
+{
+	enum cpumask_idx idx = lpm_tier_cpumasks[tier];
+	enum cpumask_idx prev = lpm_tier_cpumasks[tier - 1];
+	int cpu, added = 0;
+
+	if (!cpumasks[idx].mask)
+		alloc_cpu_set (&cpumasks[idx].mask);
+	CPU_OR_S(size_cpumask, cpumasks[idx].mask, cpumasks[idx].mask, cpumasks[prev].mask);
+	cpumask_changed (idx);
+
+	/* All the Ecores first */
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!is_cpu_online (cpu) || CPU_ISSET_S(cpu, size_cpumask, cpumasks[idx].mask))
+			continue;
+		if (is_cpu_atom (cpu) > 0) {
+			_add_cpu (cpu, idx);
+			added = 1;
+		}
+	}
+
+	if (added)
+		return 0;
+
+	/* Then one more Pcore */
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!is_cpu_online (cpu) || CPU_ISSET_S(cpu, size_cpumask, cpumasks[idx].mask))
+			continue;
+		return add_cpu_siblings (cpu, idx);
+	}
+
+	return -1;
+}
+
+static void detect_lpm_tiers(void)
+{
+	const char *cpus;
+	char *str;
+	enum cpumask_idx idx;
+	int tier, ret;
+
+	for (tier = 1; tier < get_config_lpm_tiers (); tier++) {
+		idx = lpm_tier_cpumasks[tier];
+
+		cpus = get_lpm_tier_cpus (tier);
+		if (cpus[0] == '\0' || !strcmp (cpus, "auto")) {
+			ret = detect_lpm_tier_auto (tier);
+		}
+		else {
+			/* parse_cpu_str () modifies the string */
+			str = strdup (cpus);
+			ret = str && parse_cpu_str (str, idx) > 0 ? 0 : -1;
+			free (str);
+		}
+
+		if (ret < 0 || has_cpus (idx) <= has_cpus (lpm_tier_cpumasks[tier - 1])
+				|| CPU_EQUAL_S(size_cpumask, cpumasks[idx].mask, cpumasks[CPUMASK_ONLINE].mask)) {
+			lpmd_log_info ("\tNo valid CPUs for Low Power tier %d, use %d tiers\n", tier, tier);
+			reset_cpus (idx);
+			break;
+		}
+
+		lpmd_log_info ("\tUse CPU %s as Low Power CPUs (tier %d)\n", get_cpus_str (idx), tier);
 	}
 
-	if (detect_lpm_cpus_cluster ()) {
-		str = "Ecores";
+	lpm_tiers = tier;
+}
+
+static int detect_lpm_cpus(char *cmd_cpus)
+{
+	int ret;
+	const char *str;
+
+	if (cmd_cpus && cmd_cpus[0] != '\0') {
+		ret = detect_lpm_cpus_cmd (cmd_cpus);
+		if (ret <= 0) {
+			lpmd_log_error ("\tInvalid -c parameter: %s\n", cmd_cpus);
+			exit (-1);
+		}
+		str = "CommandLine";
 		goto end;
 	}
 
+	ret = detect_lpm_cpus_policy (&str);
+	if (ret < 0)
+		return ret;
+
+	if (ret > 0)
+		goto end;
+
 	if (has_hfi_lpm_monitor () || has_hfi_suv_monitor ()) {
 		lpmd_log_info (
 				"\tNo valid Low Power CPUs detected, use dynamic Low Power CPUs from HFI hints\n");
@@ -973,10 +1820,67 @@ end: if (has_cpus (CPUMASK_LPM_DEFAULT))
 		lpmd_log_info ("\tUse CPU %s as Default Low Power CPUs (%s)\n",
 						get_cpus_str (CPUMASK_LPM_DEFAULT), str);
 
+	if (has_cpus (CPUMASK_LPM_DEFAULT))
+		detect_lpm_tiers ();
+
 	lpmd_set_cpu_affinity ();
 	return 0;
 }
 
+/*
+ * Runtime change of lp_mode_cpus (empty for automatic detection) or of the
+ * LPM tiers. Rebuilds CPUMASK_LPM_DEFAULT and the tier masks, and keeps the
+ * previous ones when no valid LPM CPUs are found. The caller moves an
+ * ongoing LPM to the new CPUs. Must be invoked with lpmd_lock held.
+ */
+int update_lpm_cpus(char *cmd_cpus)
+{
+	char *str;
+	cpu_set_t *prev;
+	int tier, ret;
+
+	alloc_cpu_set (&prev);
+	if (cpumasks[CPUMASK_LPM_DEFAULT].mask)
+		CPU_OR_S(size_cpumask, prev, prev, cpumasks[CPUMASK_LPM_DEFAULT].mask);
+
+	reset_cpus (CPUMASK_LPM_DEFAULT);
+
+	if (cmd_cpus && cmd_cpus[0] != '\0') {
+		str = strdup (cmd_cpus);
+		ret = str ? detect_lpm_cpus_cmd (str) : -1;
+		free (str);
+	}
+	else {
+		const char *name;
+
+		ret = detect_lpm_cpus_policy (&name);
+	}
+
+	if (ret <= 0 || !has_cpus (CPUMASK_LPM_DEFAULT)) {
+		lpmd_log_error ("\tNo valid Low Power CPUs for %s, keep the current ones\n",
+						cmd_cpus && cmd_cpus[0] ? cmd_cpus : "auto");
+		reset_cpus (CPUMASK_LPM_DEFAULT);
+		if (!cpumasks[CPUMASK_LPM_DEFAULT].mask)
+			alloc_cpu_set (&cpumasks[CPUMASK_LPM_DEFAULT].mask);
+		CPU_OR_S(size_cpumask, cpumasks[CPUMASK_LPM_DEFAULT].mask,
+					cpumasks[CPUMASK_LPM_DEFAULT].mask, prev);
+		cpumask_changed (CPUMASK_LPM_DEFAULT);
+		CPU_FREE(prev);
+		return LPMD_ERROR;
+	}
+	CPU_FREE(prev);
+
+	lpmd_log_info ("\tUse CPU %s as Default Low Power CPUs\n", get_cpus_str (CPUMASK_LPM_DEFAULT));
+
+	for (tier = 1; tier < LPM_TIER_MAX; tier++)
+		reset_cpus (lpm_tier_cpumasks[tier]);
+	detect_lpm_tiers ();
+
+	lpmd_set_cpu_affinity ();
+
+	return LPMD_SUCCESS;
+}
+
 static int check_cpu_offline_support(void)
 {
 	return lpmd_open ("/sys/devices/system/cpu/cpu0/online", 1);
@@ -1009,173 +1913,702 @@ static int process_cpu_offline(int enter)
 			online_cpu (cpu, 1);
 		}
 	}
-
-	return 0;
+
+	return 0;
+}
+
+/* Online the CPUs that join LPM before offlining the ones that leave */
+static int process_cpu_offline_switch(void)
+{
+	int cpu;
+
+	lpmd_log_info ("\tOnline/Offline changed CPUs\n");
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (is_cpu_online (cpu) && is_cpu_for_lpm (cpu)
+				&& !CPU_ISSET_S(cpu, size_cpumask, lpm_cpus_applied))
+			online_cpu (cpu, 1);
+	}
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (is_cpu_online (cpu) && !is_cpu_for_lpm (cpu)
+				&& CPU_ISSET_S(cpu, size_cpumask, lpm_cpus_applied))
+			online_cpu (cpu, 0);
+	}
+
+	return 0;
+}
+
+/* Support for LPM_CPU_CGROUPV2 */
+#define PATH_CGROUP                    "/sys/fs/cgroup"
+#define PATH_CG2_SUBTREE_CONTROL	PATH_CGROUP "/cgroup.subtree_control"
+
+/*
+ * One system bus connection is kept for the daemon's lifetime, and its fd is
+ * polled by lpmd_core_main_loop. The SetUnitProperties calls for all slices
+ * of one transition are queued together and their replies are collected
+ * asynchronously. A transition completes when all replies have arrived or
+ * when the first one fails.
+ */
+static sd_bus *systemd_bus;
+
+static struct {
+	unsigned int id;
+	int pending;
+	int enter;
+	int notify;
+} systemd_txn;
+
+static int restore_systemd_cgroup(int notify);
+
+static void systemd_bus_close(void)
+{
+	if (!systemd_bus)
+		return;
+
+	sd_bus_flush_close_unref (systemd_bus);
+	systemd_bus = NULL;
+}
+
+static int systemd_bus_open(void)
+{
+	int ret;
+
+	if (systemd_bus && sd_bus_is_open (systemd_bus) > 0)
+		return 0;
+
+	systemd_bus_close ();
+
+	ret = sd_bus_open_system (&systemd_bus);
+	if (ret < 0) {
+		lpmd_log_error ("Failed to connect to system bus: %s\n", strerror (-ret));
+		systemd_bus = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void systemd_txn_begin(int enter, int notify)
+{
+	/* Replies still in flight for an older transaction are ignored */
+	systemd_txn.id++;
+	systemd_txn.pending = 0;
+	systemd_txn.enter = enter;
+	systemd_txn.notify = notify;
+}
+
+static void systemd_txn_complete(int ret)
+{
+	int enter = systemd_txn.enter;
+	int notify = systemd_txn.notify;
+
+	systemd_txn_begin (0, 0);
+
+	if (ret && enter)
+		restore_systemd_cgroup (0);
+
+	/* The slices are unrestricted now, drop the cpuset controller */
+	if (!enter && notify)
+		lpmd_write_str (PATH_CG2_SUBTREE_CONTROL, "-cpuset", LPMD_LOG_INFO);
+
+	if (notify)
+		lpm_transition_done (ret);
+}
+
+/* How the reply of a SetUnitProperties call is handled */
+enum systemd_reply {
+	SYSTEMD_REPLY_REQUIRED,	/* An error fails the transition */
+	SYSTEMD_REPLY_LOGGED,	/* An error is only logged, e.g. for a unit that went away */
+};
+
+static int systemd_bus_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	unsigned int id = (unsigned int) ((uintptr_t) userdata >> 1);
+	int required = ((uintptr_t) userdata & 1) == SYSTEMD_REPLY_REQUIRED;
+	const sd_bus_error *error;
+
+	if (id != systemd_txn.id || !systemd_txn.pending)
+		return 0;
+
+	if (sd_bus_message_is_method_error (m, NULL)) {
+		error = sd_bus_message_get_error (m);
+		if (required) {
+			lpmd_log_error ("SetUnitProperties failed: %s\n",
+							error && error->message ? error->message : "unknown error");
+			systemd_txn_complete (-1);
+			return 0;
+		}
+		lpmd_log_warn ("SetUnitProperties failed, ignored: %s\n",
+						error && error->message ? error->message : "unknown error");
+	}
+
+	if (--systemd_txn.pending == 0) {
+		lpmd_log_debug ("\tAll systemd replies received\n");
+		systemd_txn_complete (0);
+	}
+
+	return 0;
+}
+
+int systemd_bus_init(void)
+{
+	if (systemd_bus_open ())
+		return -1;
+
+	return sd_bus_get_fd (systemd_bus);
+}
+
+/* Return the fd to poll, and shrink *timeout to the bus timeout if earlier */
+int systemd_bus_get_poll(short *events, int *timeout)
+{
+	struct timespec ts;
+	uint64_t usec, now;
+	int ret;
+
+	if (!systemd_bus)
+		return -1;
+
+	ret = sd_bus_get_events (systemd_bus);
+	*events = ret > 0 ? ret : POLLIN;
+
+	if (sd_bus_get_timeout (systemd_bus, &usec) < 0 || usec == UINT64_MAX)
+		return sd_bus_get_fd (systemd_bus);
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	ret = usec > now ? (usec - now + 999) / 1000 : 0;
+	if (*timeout < 0 || ret < *timeout)
+		*timeout = ret;
+
+	return sd_bus_get_fd (systemd_bus);
+}
+
+/* Must be invoked with lpmd_lock held */
+int systemd_bus_process(void)
+{
+	int ret;
+
+	if (!systemd_bus)
+		return 0;
+
+	do {
+		ret = sd_bus_process (systemd_bus, NULL);
+	} while (ret > 0);
+
+	if (ret < 0) {
+		lpmd_log_error ("Failed to process system bus: %s\n", strerror (-ret));
+		systemd_bus_close ();
+		if (systemd_txn.pending)
+			systemd_txn_complete (-1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Whether process_cpus () completes later via lpm_transition_done () */
+int process_cpus_pending(void)
+{
+	return systemd_txn.pending > 0 && systemd_txn.notify;
+}
+
+/*
+ * Block until the outstanding transition completes so that a new one
+ * never overlaps it. Must be invoked with lpmd_lock held.
+ */
+int process_cpus_wait(void)
+{
+	int ret;
+
+	while (systemd_txn.pending) {
+		ret = systemd_bus_process ();
+		if (ret < 0 || !systemd_txn.pending)
+			break;
+
+		ret = sd_bus_wait (systemd_bus, UINT64_MAX);
+		if (ret < 0 && ret != -EINTR) {
+			lpmd_log_error ("Failed to wait on system bus: %s\n", strerror (-ret));
+			systemd_bus_close ();
+			systemd_txn_complete (-1);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * All replies complete the systemd transaction, see enum systemd_reply for
+ * the errors. An empty vals, size 0, resets AllowedCPUs.
+ */
+static int update_allowed_cpus(const char *unit, uint8_t *vals, int size,
+								enum systemd_reply reply)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *m = NULL;
+	char buf[MAX_STR_LENGTH];
+	int offset;
+	int ret;
+	int i;
+
+	if (systemd_bus_open ())
+		return -1;
+
+	/*
+	 * creates a new bus message object that encapsulates a D-Bus method call,
+	 * and returns it in the m output parameter.
+	 * The call will be made on the destination, path, on the interface, member.
+	 */
+	/* Issue the method call and store the response message in m */
+	ret = sd_bus_message_new_method_call (systemd_bus, &m, "org.freedesktop.systemd1",
+											"/org/freedesktop/systemd1",
+											"org.freedesktop.systemd1.Manager",
+											"SetUnitProperties");
+	if (ret < 0) {
+		fprintf (stderr, "Failed to issue method call: %s\n", error.message);
+		goto finish;
+	}
+
+
+//	Attach fields to a D-Bus message based on a type string
+	ret = sd_bus_message_append (m, "sb", unit, 1);
+	if (ret < 0) {
+		fprintf (stderr, "Failed to append unit: %s\n", error.message);
+		goto finish;
+	}
+
+	/*
+	 * appends a new container to the message m.
+	 * After opening a new container, it can be filled with content using
+	 * sd_bus_message_append(3) and similar functions.
+	 * Containers behave like a stack. To nest containers inside each other,
+	 * call sd_bus_message_open_container() multiple times without calling
+	 * sd_bus_message_close_container() in between. Each container will be
+	 * nested inside the previous container.
+	 * Instead of literals, the corresponding constants SD_BUS_TYPE_STRUCT,
+	 * SD_BUS_TYPE_ARRAY, SD_BUS_TYPE_VARIANT or SD_BUS_TYPE_DICT_ENTRY can also be used.
+	 */
+	ret = sd_bus_message_open_container (m, SD_BUS_TYPE_ARRAY, "(sv)");
+	if (ret < 0) {
+		fprintf (stderr, "Failed to append array: %s\n", error.message);
+		goto finish;
+	}
+
+	ret = sd_bus_message_open_container (m, SD_BUS_TYPE_STRUCT, "sv");
+	if (ret < 0) {
+		fprintf (stderr, "Failed to open container struct: %s\n", error.message);
+		goto finish;
+	}
+
+	/*
+	 * appends a single field to the message m.
+	 * The parameter type determines how the pointer p is interpreted.
+	 */
+	ret = sd_bus_message_append_basic (m, SD_BUS_TYPE_STRING, "AllowedCPUs");
+	if (ret < 0) {
+		fprintf (stderr, "Failed to append string: %s\n", error.message);
+		goto finish_1;
+	}
+
+	ret = sd_bus_message_open_container (m, 'v', "ay");
+	if (ret < 0) {
+		fprintf (stderr, "Failed to open container: %s\n", error.message);
+		goto finish_2;
+	}
+
+	/*
+	 * appends an array to a D-Bus message m. A container will be opened,
+	 * the array contents appended, and the container closed.
+	 */
+	ret = sd_bus_message_append_array (m, 'y', vals, size);
+	if (ret < 0) {
+		fprintf (stderr, "Failed to append allowed_cpus: %s\n", error.message);
+		goto finish_2;
+	}
+
+	offset = snprintf (buf, MAX_STR_LENGTH, "\tSending Dbus message to systemd: %s: ", unit);
+	for (i = 0; i < size; i++) {
+		if (offset < MAX_STR_LENGTH)
+			offset += snprintf (buf + offset, MAX_STR_LENGTH - offset, "0x%02x ", vals[i]);
+	}
+	buf[MAX_STR_LENGTH - 1] = '\0';
+	lpmd_log_info ("%s\n", buf);
+
+	sd_bus_message_close_container (m);
+
+finish_2: sd_bus_message_close_container (m);
+
+finish_1: sd_bus_message_close_container (m);
+
+finish: if (ret >= 0) {
+		ret = sd_bus_call_async (systemd_bus, NULL, m, systemd_bus_reply,
+								(void*) (((uintptr_t) systemd_txn.id << 1) | reply),
+								SYSTEMD_REPLY_TIMEOUT_USEC);
+		if (ret < 0)
+			fprintf (stderr, "Failed to call: %s\n", strerror (-ret));
+		else
+			systemd_txn.pending++;
+	}
+
+	sd_bus_error_free (&error);
+	sd_bus_message_unref (m);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* The slices confined to the LPM CPUs */
+static const char *lpm_slices[] = { "system.slice", "user.slice", "machine.slice", NULL };
+
+/*
+ * ExemptUnits. cgroup v2 limits a unit to the CPUs of its parent, so a slice
+ * with an exempt unit below it is not confined itself. Its other child units
+ * are confined instead, down to the exempt unit. Only slices are descended
+ * into: the cgroups below a service or scope are delegated to it and not
+ * units of the system manager. A unit found below a service, e.g. a user
+ * unit below user@1000.service, therefore keeps that whole service.
+ * The units are looked up in cgroupfs on every LPM entry and CPU switch.
+ */
+#define CG_SCAN_DEPTH	8
+
+/* cgroupfs paths relative to PATH_CGROUP of the units kept on all CPUs */
+static char **cg_kept;
+static int nr_cg_kept;
+
+/*
+ * The units confined by lpmd. The lpm_slices get all online CPUs back on
+ * exit, the other units the AllowedCPUs they had before, NULL for none.
+ */
+struct cg_confined {
+	char *unit;
+	cpu_set_t *prev;
+	int top;
+	int seen;
+};
+
+static struct cg_confined *cg_confined;
+static int nr_cg_confined, cg_confined_size;
+
+static int is_unit_exempt(const char *unit)
+{
+	int i;
+
+	for (i = 0; i < get_config_exempt_units (); i++) {
+		if (!strcmp (get_config_exempt_unit (i), unit))
+			return 1;
+	}
+	return 0;
+}
+
+static int is_slice(const char *name)
+{
+	size_t len = strlen (name);
+
+	return len > strlen (".slice") && !strcmp (name + len - strlen (".slice"), ".slice");
+}
+
+static void cg_kept_add(const char *rel)
+{
+	char **kept;
+	int i;
+
+	for (i = 0; i < nr_cg_kept; i++) {
+		if (!strcmp (cg_kept[i], rel))
+			return;
+	}
+
+	kept = realloc (cg_kept, (nr_cg_kept + 1) * sizeof(*kept));
+	if (!kept)
+		return;
+	cg_kept = kept;
+	cg_kept[nr_cg_kept] = strdup (rel);
+	if (cg_kept[nr_cg_kept])
+		nr_cg_kept++;
+}
+
+static void cg_kept_free(void)
+{
+	int i;
+
+	for (i = 0; i < nr_cg_kept; i++)
+		free (cg_kept[i]);
+	free (cg_kept);
+	cg_kept = NULL;
+	nr_cg_kept = 0;
+}
+
+/* unit is the unit of the service or scope rel is in, NULL while in slices */
+static void cg_scan_exempt(const char *rel, const char *unit, int depth)
+{
+	char path[MAX_STR_LENGTH * 2];
+	struct dirent *entry;
+	const char *own;
+	char *child;
+	DIR *dir;
+
+	snprintf (path, sizeof(path), "%s/%s", PATH_CGROUP, rel);
+	dir = opendir (path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir (dir)) != NULL) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+			continue;
+		if (asprintf (&child, "%s/%s", rel, entry->d_name) < 0)
+			break;
+
+		own = unit ? unit : is_slice (entry->d_name) ? NULL : child;
+		if (is_unit_exempt (entry->d_name)) {
+			if (own && own != child)
+				lpmd_log_info ("\t%s is in %s, keep all of it\n", entry->d_name, own);
+			cg_kept_add (own ? own : child);
+		}
+
+		if (depth < CG_SCAN_DEPTH)
+			cg_scan_exempt (child, own, depth + 1);
+		free (child);
+	}
+
+	closedir (dir);
+}
+
+/* 1 when rel is kept, 2 when a kept unit is below it, else 0 */
+static int cg_kept_match(const char *rel)
+{
+	size_t len = strlen (rel);
+	int i, ret = 0;
+
+	for (i = 0; i < nr_cg_kept; i++) {
+		if (!strcmp (cg_kept[i], rel))
+			return 1;
+		if (!strncmp (cg_kept[i], rel, len) && cg_kept[i][len] == '/')
+			ret = 2;
+	}
+	return ret;
 }
 
-/* Support for LPM_CPU_CGROUPV2 */
-#define PATH_CGROUP                    "/sys/fs/cgroup"
-#define PATH_CG2_SUBTREE_CONTROL	PATH_CGROUP "/cgroup.subtree_control"
+/* The current cpuset.cpus of rel, which systemd sets from AllowedCPUs */
+static cpu_set_t* cg_read_cpus(const char *rel)
+{
+	char path[MAX_STR_LENGTH * 2];
+	cpu_set_t *mask;
 
-static int update_allowed_cpus(const char *unit, uint8_t *vals, int size)
+	snprintf (path, sizeof(path), "%s/%s/cpuset.cpus", PATH_CGROUP, rel);
+	alloc_cpu_set (&mask);
+	if (read_cpu_list (path, mask) || !CPU_COUNT_S(size_cpumask, mask)) {
+		CPU_FREE(mask);
+		return NULL;
+	}
+
+	return mask;
+}
+
+static struct cg_confined* cg_confined_get(const char *unit, const char *rel, int top)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message *m = NULL;
-	sd_bus *bus = NULL;
-	char buf[MAX_STR_LENGTH];
-	int offset;
-	int ret;
+	struct cg_confined *c;
 	int i;
 
-//	 creates a new, independent bus connection to the system bus
-	ret = sd_bus_open_system (&bus);
-	if (ret < 0) {
-		fprintf (stderr, "Failed to connect to system bus: %s\n", strerror (-ret));
-		goto finish;
+	for (i = 0; i < nr_cg_confined; i++) {
+		if (!strcmp (cg_confined[i].unit, unit))
+			return &cg_confined[i];
 	}
 
-	/*
-	 * creates a new bus message object that encapsulates a D-Bus method call,
-	 * and returns it in the m output parameter.
-	 * The call will be made on the destination, path, on the interface, member.
-	 */
-	/* Issue the method call and store the response message in m */
-	ret = sd_bus_message_new_method_call (bus, &m, "org.freedesktop.systemd1",
-											"/org/freedesktop/systemd1",
-											"org.freedesktop.systemd1.Manager",
-											"SetUnitProperties");
-	if (ret < 0) {
-		fprintf (stderr, "Failed to issue method call: %s\n", error.message);
-		goto finish;
+	if (nr_cg_confined == cg_confined_size) {
+		int size = cg_confined_size ? cg_confined_size * 2 : 32;
+
+		c = realloc (cg_confined, size * sizeof(*c));
+		if (!c)
+			return NULL;
+		cg_confined = c;
+		cg_confined_size = size;
 	}
 
+	c = &cg_confined[nr_cg_confined];
+	c->unit = strdup (unit);
+	if (!c->unit)
+		return NULL;
+	c->top = top;
+	/* Before lpmd confines it for the first time */
+	c->prev = top ? NULL : cg_read_cpus (rel);
+	c->seen = 0;
+	nr_cg_confined++;
 
-//	Attach fields to a D-Bus message based on a type string
-	ret = sd_bus_message_append (m, "sb", unit, 1);
-	if (ret < 0) {
-		fprintf (stderr, "Failed to append unit: %s\n", error.message);
-		goto finish;
-	}
+	return c;
+}
 
-	/*
-	 * appends a new container to the message m.
-	 * After opening a new container, it can be filled with content using
-	 * sd_bus_message_append(3) and similar functions.
-	 * Containers behave like a stack. To nest containers inside each other,
-	 * call sd_bus_message_open_container() multiple times without calling
-	 * sd_bus_message_close_container() in between. Each container will be
-	 * nested inside the previous container.
-	 * Instead of literals, the corresponding constants SD_BUS_TYPE_STRUCT,
-	 * SD_BUS_TYPE_ARRAY, SD_BUS_TYPE_VARIANT or SD_BUS_TYPE_DICT_ENTRY can also be used.
-	 */
-	ret = sd_bus_message_open_container (m, SD_BUS_TYPE_ARRAY, "(sv)");
-	if (ret < 0) {
-		fprintf (stderr, "Failed to append array: %s\n", error.message);
-		goto finish;
-	}
+/* Give a confined unit its CPUs back, online_vals are all online CPUs */
+static void cg_confined_restore(struct cg_confined *c, uint8_t *online_vals, int size)
+{
+	uint8_t *vals;
 
-	ret = sd_bus_message_open_container (m, SD_BUS_TYPE_STRUCT, "sv");
-	if (ret < 0) {
-		fprintf (stderr, "Failed to open container struct: %s\n", error.message);
-		goto finish;
+	if (c->top) {
+		update_allowed_cpus (c->unit, online_vals, size, SYSTEMD_REPLY_REQUIRED);
+		return;
 	}
 
-	/*
-	 * appends a single field to the message m.
-	 * The parameter type determines how the pointer p is interpreted.
-	 */
-	ret = sd_bus_message_append_basic (m, SD_BUS_TYPE_STRING, "AllowedCPUs");
-	if (ret < 0) {
-		fprintf (stderr, "Failed to append string: %s\n", error.message);
-		goto finish_1;
+	if (!c->prev) {
+		update_allowed_cpus (c->unit, online_vals, 0, SYSTEMD_REPLY_LOGGED);
+		return;
 	}
 
-	ret = sd_bus_message_open_container (m, 'v', "ay");
-	if (ret < 0) {
-		fprintf (stderr, "Failed to open container: %s\n", error.message);
-		goto finish_2;
+	vals = calloc (size, 1);
+	if (vals) {
+		cpumask_to_hexvals (c->prev, vals);
+		update_allowed_cpus (c->unit, vals, size, SYSTEMD_REPLY_LOGGED);
 	}
+	free (vals);
+}
 
-	/*
-	 * appends an array to a D-Bus message m. A container will be opened,
-	 * the array contents appended, and the container closed.
-	 */
-	ret = sd_bus_message_append_array (m, 'y', vals, size);
-	if (ret < 0) {
-		fprintf (stderr, "Failed to append allowed_cpus: %s\n", error.message);
-		goto finish_2;
-	}
+static void cg_confined_remove(int i)
+{
+	free (cg_confined[i].unit);
+	if (cg_confined[i].prev)
+		CPU_FREE(cg_confined[i].prev);
+	cg_confined[i] = cg_confined[--nr_cg_confined];
+}
 
-	offset = snprintf (buf, MAX_STR_LENGTH, "\tSending Dbus message to systemd: %s: ", unit);
-	for (i = 0; i < size; i++) {
-		if (offset < MAX_STR_LENGTH)
-			offset += snprintf (buf + offset, MAX_STR_LENGTH - offset, "0x%02x ", vals[i]);
-	}
-	buf[MAX_STR_LENGTH - 1] = '\0';
-	lpmd_log_info ("%s\n", buf);
+static int cg_confine_unit(const char *rel, uint8_t *vals, int size, int top)
+{
+	const char *unit = strrchr (rel, '/');
+	struct cg_confined *c;
+	int ret;
 
-	sd_bus_message_close_container (m);
+	unit = unit ? unit + 1 : rel;
+	c = cg_confined_get (unit, rel, top);
+	if (!c)
+		return top ? -1 : 0;
+	c->seen = 1;
 
-finish_2: sd_bus_message_close_container (m);
+	ret = update_allowed_cpus (unit, vals, size,
+								top ? SYSTEMD_REPLY_REQUIRED : SYSTEMD_REPLY_LOGGED);
+	return top ? ret : 0;
+}
 
-finish_1: sd_bus_message_close_container (m);
+/* Confine rel, or its child units when an exempt unit is below it */
+static int cg_confine(const char *rel, uint8_t *vals, int size, int top)
+{
+	char path[MAX_STR_LENGTH * 2];
+	struct dirent *entry;
+	char *child;
+	DIR *dir;
 
-finish: if (ret >= 0) {
-		ret = sd_bus_call (bus, m, 0, &error, NULL);
-		if (ret < 0) {
-			fprintf (stderr, "Failed to call: %s\n", error.message);
-		}
+	switch (cg_kept_match (rel)) {
+		case 1:
+			return 0;
+		case 0:
+			return cg_confine_unit (rel, vals, size, top);
+		default:
+			break;
 	}
 
-	sd_bus_error_free (&error);
-	sd_bus_message_unref (m);
-	sd_bus_unref (bus);
+	snprintf (path, sizeof(path), "%s/%s", PATH_CGROUP, rel);
+	dir = opendir (path);
+	if (!dir)
+		return 0;
 
-	return ret < 0 ? -1 : 0;
+	while ((entry = readdir (dir)) != NULL) {
+		/* Child units, not the control files */
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.' || !strchr (entry->d_name, '.'))
+			continue;
+		if (asprintf (&child, "%s/%s", rel, entry->d_name) < 0)
+			break;
+		cg_confine (child, vals, size, 0);
+		free (child);
+	}
+
+	closedir (dir);
+	return 0;
 }
 
-static int restore_systemd_cgroup()
+static int restore_systemd_cgroup(int notify)
 {
-	int size = topo_max_cpus / 8;
+	int size = (topo_max_cpus + 7) / 8;
 	uint8_t *vals;
 
 	vals = calloc (size, 1);
 	get_cpus_hexvals (CPUMASK_ONLINE, vals, size);
 
-	update_allowed_cpus ("system.slice", vals, size);
-	update_allowed_cpus ("user.slice", vals, size);
-	update_allowed_cpus ("machine.slice", vals, size);
+	systemd_txn_begin (0, notify);
+	cg_kept_free ();
+	while (nr_cg_confined) {
+		cg_confined_restore (&cg_confined[nr_cg_confined - 1], vals, size);
+		cg_confined_remove (nr_cg_confined - 1);
+	}
 	free (vals);
+
+	/* Nothing was queued, so no completion will ever be reported */
+	if (!systemd_txn.pending) {
+		systemd_txn_begin (0, 0);
+		return -1;
+	}
+
+	/* A broken connection is reported by systemd_bus_process () */
+	sd_bus_flush (systemd_bus);
+
 	return 0;
 }
 
-static int update_systemd_cgroup()
+/*
+ * Also used for a CPU switch. Units confined by a previous call that are
+ * not anymore, e.g. below a newly started exempt unit, get their CPUs back.
+ */
+static int update_systemd_cgroup(void)
 {
-	int size = topo_max_cpus / 8;
-	uint8_t *vals;
-	int ret;
+	int size = (topo_max_cpus + 7) / 8;
+	uint8_t *vals, *all_vals;
+	int ret = 0;
+	int i;
 
 	vals = calloc (size, 1);
+	all_vals = calloc (size, 1);
 	get_cpus_hexvals (lpm_cpus_cur, vals, size);
+	get_cpus_hexvals (CPUMASK_ONLINE, all_vals, size);
+
+	cg_kept_free ();
+	for (i = 0; lpm_slices[i]; i++) {
+		if (is_unit_exempt (lpm_slices[i]))
+			cg_kept_add (lpm_slices[i]);
+		else if (get_config_exempt_units ())
+			cg_scan_exempt (lpm_slices[i], NULL, 1);
+	}
 
-	ret = update_allowed_cpus ("system.slice", vals, size);
-	if (ret)
-		goto restore;
+	systemd_txn_begin (1, 1);
+
+	for (i = 0; i < nr_cg_confined; i++)
+		cg_confined[i].seen = 0;
+
+	for (i = 0; lpm_slices[i] && !ret; i++)
+		ret = cg_confine (lpm_slices[i], vals, size, 1);
+
+	for (i = nr_cg_confined - 1; i >= 0; i--) {
+		if (cg_confined[i].seen)
+			continue;
+		cg_confined_restore (&cg_confined[i], all_vals, size);
+		cg_confined_remove (i);
+	}
 
-	ret = update_allowed_cpus ("user.slice", vals, size);
 	if (ret)
 		goto restore;
 
-	ret = update_allowed_cpus ("machine.slice", vals, size);
-	if (ret)
+	/* All slices exempt, nothing to wait for */
+	if (!systemd_txn.pending) {
+		free (vals);
+		free (all_vals);
+		systemd_txn_begin (0, 0);
+		return 0;
+	}
+
+	ret = sd_bus_flush (systemd_bus);
+	if (ret < 0)
 		goto restore;
 
 	free (vals);
+	free (all_vals);
 	return 0;
 
 restore: free (vals);
-	restore_systemd_cgroup ();
-	return ret;
+	free (all_vals);
+	systemd_txn_begin (0, 0);
+	restore_systemd_cgroup (0);
+	return -1;
 }
 
 static int check_cpu_cgroupv2_support(void)
@@ -1196,7 +2629,9 @@ static int process_cpu_cgroupv2_enter(void)
 
 static int process_cpu_cgroupv2_exit(void)
 {
-	restore_systemd_cgroup ();
+	/* -cpuset is written once systemd has replied */
+	if (!restore_systemd_cgroup (1))
+		return 0;
 
 	return lpmd_write_str (PATH_CG2_SUBTREE_CONTROL, "-cpuset", LPMD_LOG_INFO);
 }
@@ -1264,6 +2699,12 @@ static int check_cpu_powerclamp_support(void)
 	if (path_powerclamp[0] == '\0')
 		return 1;
 
+	lpmd_cache_knob (PATH_CPUMASK);
+	lpmd_cache_knob (PATH_MAXIDLE);
+	lpmd_cache_knob (PATH_DURATION);
+	/* The thermal core may also set it */
+	lpmd_cache_knob_volatile (path_powerclamp);
+
 	return 0;
 }
 
@@ -1296,17 +2737,41 @@ static int process_cpu_powerclamp_enter(void)
 	int pct = get_idle_percentage ();
 	int dur = get_idle_duration ();
 
-	return _process_cpu_powerclamp_enter (get_cpus_hexstr_reverse (lpm_cpus_cur), pct, dur);
+	if (_process_cpu_powerclamp_enter (get_cpus_hexstr_reverse (lpm_cpus_cur), pct, dur))
+		return 1;
+
+	clamp_start ();
+	return 0;
+}
+
+/* Update the injected idle of an ongoing LPM, below max_idle */
+int powerclamp_set_idle(int pct)
+{
+	return lpmd_write_int (path_powerclamp, pct, LPMD_LOG_DEBUG);
 }
 
 static int process_cpu_powerclamp_exit()
 {
+	clamp_stop ();
+
 	if (lpmd_write_int (PATH_DURATION, default_dur, LPMD_LOG_INFO))
 		return 1;
 
 	return lpmd_write_int (path_powerclamp, 0, LPMD_LOG_INFO);
 }
 
+/* intel_powerclamp rejects cpumask changes while injecting idle */
+static int process_cpu_powerclamp_switch(void)
+{
+	if (lpmd_write_int (path_powerclamp, 0, LPMD_LOG_INFO))
+		return 1;
+
+	if (lpmd_write_str (PATH_CPUMASK, get_cpus_hexstr_reverse (lpm_cpus_cur), LPMD_LOG_INFO))
+		return 1;
+
+	return lpmd_write_int (path_powerclamp, clamp_get_idle (), LPMD_LOG_INFO);
+}
+
 static int process_cpu_powerclamp(int enter)
 {
 	if (enter)
@@ -1445,6 +2910,10 @@ static int process_cpu_isolate_enter(void)
 		closedir (dir);
 	}
 
+	/* The kernel invalidates the partition when its CPUs go offline */
+	lpmd_cache_knob_volatile ("/sys/fs/cgroup/lpm/cpuset.cpus.partition");
+	lpmd_cache_knob ("/sys/fs/cgroup/lpm/cpuset.cpus");
+
 	if (lpmd_write_str ("/sys/fs/cgroup/lpm/cpuset.cpus.partition", "member", LPMD_LOG_INFO))
 		return 1;
 
@@ -1535,6 +3004,192 @@ int init_cpu(char *cmd_cpus, enum lpm_cpu_process_mode mode)
 	return 0;
 }
 
+/*
+ * The CPU topology recorded in a trace, in the format of the topology
+ * cache plus the online CPUs and the topology lists of every online CPU.
+ * The returned string must be freed by the caller.
+ */
+char* cpu_topology_str(void)
+{
+	FILE *filep;
+	char *buf = NULL, *str;
+	size_t size;
+	int cpu, list;
+
+	str = malloc (cpus_str_size ());
+	filep = open_memstream (&buf, &size);
+	if (!str || !filep) {
+		free (str);
+		if (filep)
+			fclose (filep);
+		free (buf);
+		return NULL;
+	}
+
+	fprintf (filep, "cpus %d\n", topo_max_cpus);
+	topo_cache_write_mask (filep, "online", cpumasks[CPUMASK_ONLINE].mask);
+	topo_cache_write_mask (filep, "probed", topo_probed);
+	topo_cache_write_mask (filep, "atom", topo_atom);
+	topo_cache_write_mask (filep, "l3", topo_l3);
+
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (!is_cpu_online (cpu))
+			continue;
+		for (list = 0; list < TOPO_LIST_MAX; list++) {
+			if (read_topology_list (cpu, list, str, cpus_str_size ()) <= 0)
+				continue;
+			str[strcspn (str, "\n")] = '\0';
+			fprintf (filep, "%s %d %s\n", topo_list_names[list], cpu, str);
+		}
+	}
+
+	free (str);
+	if (fclose (filep)) {
+		free (buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static int replay_topology_line(char *key, char *val, cpu_set_t *online)
+{
+	char *list;
+	int i, cpu;
+
+	if (!strcmp (key, "online"))
+		cpu_list_to_mask (val, online);
+	else if (!strcmp (key, "probed"))
+		cpu_list_to_mask (val, topo_probed);
+	else if (!strcmp (key, "atom"))
+		cpu_list_to_mask (val, topo_atom);
+	else if (!strcmp (key, "l3"))
+		cpu_list_to_mask (val, topo_l3);
+
+	for (i = 0; i < TOPO_LIST_MAX; i++) {
+		if (strcmp (key, topo_list_names[i]))
+			continue;
+
+		cpu = strtol (val, &list, 10);
+		if (cpu < 0 || cpu >= topo_max_cpus || *list != ' ')
+			return -1;
+
+		if (!replay_topo_lists[i])
+			replay_topo_lists[i] = calloc (topo_max_cpus, sizeof(char *));
+		if (!replay_topo_lists[i])
+			return -1;
+		free (replay_topo_lists[i][cpu]);
+		replay_topo_lists[i][cpu] = strdup (list + 1);
+	}
+
+	return 0;
+}
+
+/*
+ * init_cpu () for a replay: use the topology from cpu_topology_str () of
+ * the recording system instead of probing this one. The CPU mode is not
+ * checked as a replay never applies it.
+ */
+int init_cpu_replay(char *cmd_cpus, char *topology)
+{
+	cpu_set_t *online;
+	char *line, *val, *saveptr;
+	int cpu;
+
+	line = strtok_r (topology, "\n", &saveptr);
+	if (!line || strncmp (line, "cpus ", 5))
+		return LPMD_ERROR;
+
+	topo_max_cpus = strtol (line + 5, NULL, 10);
+	if (topo_max_cpus <= 0)
+		return LPMD_ERROR;
+
+	alloc_cpu_set (&online);
+	alloc_cpu_set (&topo_probed);
+	alloc_cpu_set (&topo_atom);
+	alloc_cpu_set (&topo_l3);
+
+	while ((line = strtok_r (NULL, "\n", &saveptr)) != NULL) {
+		val = strchr (line, ' ');
+		if (!val)
+			continue;
+		*val++ = '\0';
+
+		if (replay_topology_line (line, val, online)) {
+			CPU_FREE(online);
+			return LPMD_ERROR;
+		}
+	}
+
+	reset_cpus (CPUMASK_ONLINE);
+	for (cpu = 0; cpu < topo_max_cpus; cpu++) {
+		if (CPU_ISSET_S(cpu, size_cpumask, online))
+			add_cpu (cpu, CPUMASK_ONLINE);
+	}
+	CPU_FREE(online);
+	max_online_cpu = topo_max_cpus;
+
+	/* SUV mode injects idle directly, not in dry run, so never in a replay */
+	in_suv = -1;
+
+	if (!has_cpus (CPUMASK_ONLINE))
+		return LPMD_ERROR;
+
+	lpmd_log_info ("Replaying on %d CPUs, %d online\n", topo_max_cpus, has_cpus (CPUMASK_ONLINE));
+
+	return detect_lpm_cpus (cmd_cpus);
+}
+
+static void update_lpm_cpus_applied(int enter)
+{
+	if (!lpm_cpus_applied)
+		alloc_cpu_set (&lpm_cpus_applied);
+
+	CPU_ZERO_S(size_cpumask, lpm_cpus_applied);
+	if (enter && cpumasks[lpm_cpus_cur].mask)
+		CPU_OR_S(size_cpumask, lpm_cpus_applied, lpm_cpus_applied, cpumasks[lpm_cpus_cur].mask);
+}
+
+/* Whether the LPM CPUs differ from the ones process_cpus () last applied */
+int lpm_cpus_changed(void)
+{
+	if (!lpm_cpus_applied || !cpumasks[lpm_cpus_cur].mask)
+		return 1;
+
+	return !CPU_EQUAL_S(size_cpumask, lpm_cpus_applied, cpumasks[lpm_cpus_cur].mask);
+}
+
+/*
+ * Move an ongoing LPM to the current LPM CPUs without leaving it. Only the
+ * CPU restriction itself is rewritten, e.g. AllowedCPUs of the systemd
+ * slices, the cpuset controller stays enabled.
+ */
+int process_cpus_switch(enum lpm_cpu_process_mode mode)
+{
+	int ret;
+
+	lpmd_log_info ("Switch CPUs ...\n");
+	switch (mode) {
+		case LPM_CPU_OFFLINE:
+			ret = process_cpu_offline_switch ();
+			break;
+		case LPM_CPU_CGROUPV2:
+			ret = update_systemd_cgroup ();
+			break;
+		case LPM_CPU_POWERCLAMP:
+			ret = process_cpu_powerclamp_switch ();
+			break;
+		case LPM_CPU_ISOLATE:
+			ret = process_cpu_isolate_enter ();
+			break;
+		default:
+			exit (-1);
+	}
+
+	update_lpm_cpus_applied (1);
+	return ret;
+}
+
 int process_cpus(int enter, enum lpm_cpu_process_mode mode)
 {
 	int ret;
@@ -1542,6 +3197,8 @@ int process_cpus(int enter, enum lpm_cpu_process_mode mode)
 	if (enter != 1 && enter != 0)
 		return LPMD_ERROR;
 
+	update_lpm_cpus_applied (enter);
+
 	lpmd_log_info ("Process CPUs ...\n");
 	switch (mode) {
 		case LPM_CPU_OFFLINE:
@@ -56,6 +56,18 @@ dbus_interface_s_uv__mo_de__en_te_r(PrefObject *obj, GError **error);
 static gboolean
 dbus_interface_s_uv__mo_de__ex_it(PrefObject *obj, GError **error);
 
+static gboolean
+dbus_interface_get_transition_stats(PrefObject *obj, gchar **stats, GError **error);
+
+static gboolean
+dbus_interface_get_hfi_ranking(PrefObject *obj, gchar **ranking, GError **error);
+
+static gboolean
+dbus_interface_get_stats(PrefObject *obj, gchar **stats, GError **error);
+
+static gboolean
+dbus_interface_get_residency_stats(PrefObject *obj, gchar **stats, GError **error);
+
 #include "intel_lpmd_dbus_interface.h"
 
 static gboolean
@@ -85,47 +97,133 @@ static gboolean dbus_interface_terminate(PrefObject *obj, GError **error)
 	return TRUE;
 }
 
+/* The requests wait for the core thread, report what it returned */
+static gboolean dbus_request_result(int ret, const char *request, GError **error)
+{
+	if (ret >= 0)
+		return TRUE;
+
+	if (ret == -EBUSY) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
+						"%s refused, LPM is frozen after a CPU hotplug", request);
+		return FALSE;
+	}
+
+	g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "%s failed or timed out", request);
+	return FALSE;
+}
+
 static gboolean dbus_interface_l_pm__fo_rc_e__on(PrefObject *obj, GError **error)
 {
 	lpmd_log_debug ("intel_lpmd_dbus_interface_lpm_enter\n");
-	lpmd_force_on ();
 
-	return TRUE;
+	return dbus_request_result (lpmd_force_on (), "LPM_FORCE_ON", error);
 }
 
 static gboolean dbus_interface_l_pm__fo_rc_e__of_f(PrefObject *obj, GError **error)
 {
 	lpmd_log_debug ("intel_lpmd_dbus_interface_lpm_exit\n");
-	lpmd_force_off ();
 
-	return TRUE;
+	return dbus_request_result (lpmd_force_off (), "LPM_FORCE_OFF", error);
 }
 
 static gboolean dbus_interface_l_pm__au_to(PrefObject *obj, GError **error)
 {
-	lpmd_set_auto ();
-	return TRUE;
+	return dbus_request_result (lpmd_set_auto (), "LPM_AUTO", error);
 }
 
 static gboolean dbus_interface_s_uv__mo_de__en_te_r(PrefObject *obj, GError **error)
 {
 	lpmd_log_debug ("intel_lpmd_dbus_interface_suv_enter\n");
 
-	if (!has_suv_support ())
+	if (!has_suv_support ()) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED, "No SUV support");
 		return FALSE;
+	}
 
-	lpmd_suv_enter ();
-
-	return TRUE;
+	return dbus_request_result (lpmd_suv_enter (), "SUV_MODE_ENTER", error);
 }
 
 static gboolean dbus_interface_s_uv__mo_de__ex_it(PrefObject *obj, GError **error)
 {
-	if (!has_suv_support ())
+	if (!has_suv_support ()) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED, "No SUV support");
 		return FALSE;
+	}
 
 	lpmd_log_debug ("intel_lpmd_dbus_interface_suv_exit\n");
-	lpmd_suv_exit ();
+
+	return dbus_request_result (lpmd_suv_exit (), "SUV_MODE_EXIT", error);
+}
+
+static gboolean dbus_interface_get_transition_stats(PrefObject *obj, gchar **stats, GError **error)
+{
+	char *str;
+
+	lpmd_log_debug ("intel_lpmd_dbus_interface_get_transition_stats\n");
+
+	str = lpm_stats_str ();
+	if (!str) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NO_MEMORY, "No memory for stats");
+		return FALSE;
+	}
+
+	*stats = g_strdup (str);
+	free (str);
+
+	return TRUE;
+}
+
+static gboolean dbus_interface_get_hfi_ranking(PrefObject *obj, gchar **ranking, GError **error)
+{
+	char *str;
+
+	lpmd_log_debug ("intel_lpmd_dbus_interface_get_hfi_ranking\n");
+
+	str = hfi_ranking_str ();
+	if (!str) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NO_MEMORY, "No memory for HFI ranking");
+		return FALSE;
+	}
+
+	*ranking = g_strdup (str);
+	free (str);
+
+	return TRUE;
+}
+
+static gboolean dbus_interface_get_stats(PrefObject *obj, gchar **stats, GError **error)
+{
+	char *str;
+
+	lpmd_log_debug ("intel_lpmd_dbus_interface_get_stats\n");
+
+	str = util_stats_str ();
+	if (!str) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NO_MEMORY, "No memory for util stats");
+		return FALSE;
+	}
+
+	*stats = g_strdup (str);
+	free (str);
+
+	return TRUE;
+}
+
+static gboolean dbus_interface_get_residency_stats(PrefObject *obj, gchar **stats, GError **error)
+{
+	char *str;
+
+	lpmd_log_debug ("intel_lpmd_dbus_interface_get_residency_stats\n");
+
+	str = lpm_stats_residency_str ();
+	if (!str) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NO_MEMORY, "No memory for residency stats");
+		return FALSE;
+	}
+
+	*stats = g_strdup (str);
+	free (str);
 
 	return TRUE;
 }
@@ -151,6 +249,21 @@ lpmd_dbus_load_introspection(const gchar *filename, GError **error)
 }
 
 
+/* Return a request from its completion, the main loop never waits for it */
+static void
+lpmd_dbus_request_done(int ret, void *data)
+{
+	GDBusMethodInvocation *invocation = data;
+	g_autoptr(GError) error = NULL;
+
+	if (!dbus_request_result(ret, g_dbus_method_invocation_get_method_name(invocation),
+				 &error)) {
+		g_dbus_method_invocation_return_gerror(invocation, error);
+		return;
+	}
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
 static void
 lpmd_dbus_handle_method_call(GDBusConnection       *connection,
 			    const gchar           *sender,
@@ -173,29 +286,80 @@ lpmd_dbus_handle_method_call(GDBusConnection       *connection,
 	}
 
 	if (g_strcmp0(method_name, "LPM_FORCE_ON") == 0) {
-		g_dbus_method_invocation_return_value(invocation, NULL);
-		dbus_interface_l_pm__fo_rc_e__on(obj, &error);
+		lpmd_log_debug("intel_lpmd_dbus_interface_lpm_enter\n");
+		lpmd_send_request_async(LPM_FORCE_ON, lpmd_dbus_request_done, invocation);
 		return;
 	}
 
 	if (g_strcmp0(method_name, "LPM_FORCE_OFF") == 0) {
-		g_dbus_method_invocation_return_value(invocation, NULL);
-		dbus_interface_l_pm__fo_rc_e__of_f(obj, &error);
+		lpmd_log_debug("intel_lpmd_dbus_interface_lpm_exit\n");
+		lpmd_send_request_async(LPM_FORCE_OFF, lpmd_dbus_request_done, invocation);
 		return;
 	}
 	if (g_strcmp0(method_name, "LPM_AUTO") == 0) {
-		g_dbus_method_invocation_return_value(invocation, NULL);
-		dbus_interface_l_pm__au_to(obj, &error);
+		lpmd_send_request_async(LPM_AUTO, lpmd_dbus_request_done, invocation);
 		return;
 	}
 	if (g_strcmp0(method_name, "SUV_MODE_ENTER") == 0) {
-		g_dbus_method_invocation_return_value(invocation, NULL);
-		dbus_interface_s_uv__mo_de__en_te_r(obj, &error);
+		if (!has_suv_support()) {
+			g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+							      G_DBUS_ERROR_NOT_SUPPORTED,
+							      "No SUV support");
+			return;
+		}
+		lpmd_log_debug("intel_lpmd_dbus_interface_suv_enter\n");
+		lpmd_send_request_async(SUV_MODE_ENTER, lpmd_dbus_request_done, invocation);
 		return;
 	}
 	if (g_strcmp0(method_name, "SUV_MODE_EXIT") == 0) {
-		g_dbus_method_invocation_return_value(invocation, NULL);
-		dbus_interface_s_uv__mo_de__ex_it(obj, &error);
+		if (!has_suv_support()) {
+			g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+							      G_DBUS_ERROR_NOT_SUPPORTED,
+							      "No SUV support");
+			return;
+		}
+		lpmd_log_debug("intel_lpmd_dbus_interface_suv_exit\n");
+		lpmd_send_request_async(SUV_MODE_EXIT, lpmd_dbus_request_done, invocation);
+		return;
+	}
+	if (g_strcmp0(method_name, "GetTransitionStats") == 0) {
+		g_autofree gchar *stats = NULL;
+
+		if (!dbus_interface_get_transition_stats(obj, &stats, &error)) {
+			g_dbus_method_invocation_return_gerror(invocation, error);
+			return;
+		}
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", stats));
+		return;
+	}
+	if (g_strcmp0(method_name, "GetHfiRanking") == 0) {
+		g_autofree gchar *ranking = NULL;
+
+		if (!dbus_interface_get_hfi_ranking(obj, &ranking, &error)) {
+			g_dbus_method_invocation_return_gerror(invocation, error);
+			return;
+		}
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", ranking));
+		return;
+	}
+	if (g_strcmp0(method_name, "GetStats") == 0) {
+		g_autofree gchar *stats = NULL;
+
+		if (!dbus_interface_get_stats(obj, &stats, &error)) {
+			g_dbus_method_invocation_return_gerror(invocation, error);
+			return;
+		}
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", stats));
+		return;
+	}
+	if (g_strcmp0(method_name, "GetResidencyStats") == 0) {
+		g_autofree gchar *stats = NULL;
+
+		if (!dbus_interface_get_residency_stats(obj, &stats, &error)) {
+			g_dbus_method_invocation_return_gerror(invocation, error);
+			return;
+		}
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", stats));
 		return;
 	}
 
@@ -216,6 +380,21 @@ lpmd_dbus_handle_get_property(GDBusConnection  *connection,
 			     GError          **error,
 			     gpointer          user_data)
 {
+	gchar str[MAX_STR_LENGTH];
+	gint32 val;
+
+	lpmd_log_debug ("intel_lpmd_dbus_interface_get_property %s\n", property_name);
+
+	if (!lpmd_get_tunable_int(property_name, &val))
+		return g_variant_new_int32(val);
+	if (!lpmd_get_tunable_str(property_name, str, sizeof(str)))
+		return g_variant_new_string(str);
+
+	g_set_error(error,
+		    G_DBUS_ERROR,
+		    G_DBUS_ERROR_UNKNOWN_PROPERTY,
+		    "no such property %s",
+		    property_name);
 	return NULL;
 }
 
@@ -228,6 +407,27 @@ lpmd_dbus_handle_set_property(GDBusConnection  *connection,
 			     GVariant         *value,
 			     GError          **error,
 			     gpointer          user_data) {
+	int ret;
+
+	lpmd_log_debug ("intel_lpmd_dbus_interface_set_property %s\n", property_name);
+
+	/* Applied by the core thread before returning */
+	if (g_variant_is_of_type(value, G_VARIANT_TYPE_INT32))
+		ret = lpmd_set_tunable_int(property_name, g_variant_get_int32(value));
+	else if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+		ret = lpmd_set_tunable_str(property_name, g_variant_get_string(value, NULL));
+	else
+		ret = LPMD_ERROR;
+
+	if (ret) {
+		g_set_error(error,
+			    G_DBUS_ERROR,
+			    G_DBUS_ERROR_INVALID_ARGS,
+			    "invalid value for %s",
+			    property_name);
+		return FALSE;
+	}
+
 	return TRUE;
 }
 
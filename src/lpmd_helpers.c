@@ -27,8 +27,129 @@
 
 #include "lpmd.h"
 
+/*
+ * Knob cache for the sysfs/cgroupfs/procfs files written on every LPM
+ * enter/exit. Each cached knob keeps a persistent fd and the last value
+ * written by lpmd, so that writing a value that is already in place is
+ * skipped.
+ * Note: the cache only tracks writes from lpmd itself. Knobs the kernel
+ * changes by itself, like an invalidated cpuset partition, are cached with
+ * lpmd_cache_knob_volatile () and re-read before a write is skipped.
+ */
+#define MAX_CACHED_KNOBS	16
+
+struct lpmd_knob {
+	char name[MAX_STR_LENGTH];
+	int fd;
+	int valid;
+	int reread;
+	char val[MAX_STR_LENGTH];
+};
+
+static struct lpmd_knob knobs[MAX_CACHED_KNOBS];
+static int nr_knobs;
+
+static struct lpmd_knob* find_knob(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_knobs; i++) {
+		if (!strcmp (knobs[i].name, name))
+			return &knobs[i];
+	}
+	return NULL;
+}
+
+static int knob_read(struct lpmd_knob *knob, char *buf, int size)
+{
+	ssize_t len;
+
+	len = pread (knob->fd, buf, size - 1, 0);
+	if (len < 0)
+		return 1;
+
+	buf[len] = '\0';
+	/* Remove the Newline */
+	if (len && buf[len - 1] == '\n')
+		buf[len - 1] = '\0';
+	return 0;
+}
+
+/* Returns 1 when the write is skipped because the value is already in place */
+static int knob_write(struct lpmd_knob *knob, char *str, int *err)
+{
+	size_t len = strlen (str);
+
+	*err = 0;
+
+	if (knob->reread)
+		knob->valid = !knob_read (knob, knob->val, sizeof(knob->val));
+
+	if (knob->valid && !strcmp (knob->val, str))
+		return 1;
+
+	if (pwrite (knob->fd, str, len, 0) != (ssize_t) len) {
+		knob->valid = 0;
+		*err = errno;
+		return 0;
+	}
+
+	knob->valid = len < sizeof(knob->val);
+	if (knob->valid)
+		memcpy (knob->val, str, len + 1);
+	return 0;
+}
+
+/*
+ * Keep a persistent fd for a knob that is written in the LPM enter/exit path.
+ * The current knob value is used as the initial cached value.
+ */
+static int cache_knob(const char *name, int reread)
+{
+	struct lpmd_knob *knob;
+	int fd;
+
+	if (!name)
+		return 1;
+
+	if (find_knob (name))
+		return 0;
+
+	if (nr_knobs >= MAX_CACHED_KNOBS) {
+		lpmd_log_debug ("Too many cached knobs, %s not cached\n", name);
+		return 1;
+	}
+
+	fd = open (name, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		lpmd_log_debug ("Open %s failed, not cached\n", name);
+		return 1;
+	}
+
+	knob = &knobs[nr_knobs++];
+	snprintf (knob->name, sizeof(knob->name), "%s", name);
+	knob->fd = fd;
+	knob->reread = reread;
+	knob->valid = !knob_read (knob, knob->val, sizeof(knob->val));
+
+	lpmd_log_debug ("Cache knob %s, value \"%s\"\n", name, knob->valid ? knob->val : "");
+	return 0;
+}
+
+int lpmd_cache_knob(const char *name)
+{
+	return cache_knob (name, 0);
+}
+
+/* For knobs the kernel may change, the current value is read before each write */
+int lpmd_cache_knob_volatile(const char *name)
+{
+	return cache_knob (name, 1);
+}
+
 static int _write_str(const char *name, char *str, int print_level, int log_level, const char *mode)
 {
+	struct lpmd_knob *knob;
 	FILE *filep;
 	char prefix[16];
 	int i, ret;
@@ -45,6 +166,21 @@ static int _write_str(const char *name, char *str, int print_level, int log_leve
 		prefix[i] = '\0';
 	}
 
+	knob = strcmp (mode, "r+") ? NULL : find_knob (name);
+	if (knob) {
+		if (knob_write (knob, str, &ret)) {
+			lpmd_log_debug ("%sSkip writing \"%s\" to %s, unchanged\n", prefix, str, name);
+			return 0;
+		}
+		if (ret) {
+			lpmd_log_error ("%sWrite \"%s\" to %s failed, strlen %zu, errno %d\n", prefix, str,
+							name, strlen (str), ret);
+			return 1;
+		}
+		filep = NULL;
+		goto log;
+	}
+
 	filep = fopen (name, mode);
 	if (!filep) {
 		lpmd_log_error ("%sOpen %s failed\n", prefix, name);
@@ -59,6 +195,8 @@ static int _write_str(const char *name, char *str, int print_level, int log_leve
 		return 1;
 	}
 
+log:
+
 	switch (print_level) {
 		case LPMD_LOG_INFO:
 			lpmd_log_info ("%sWrite \"%s\" to %s\n", prefix, str, name);
@@ -73,7 +211,8 @@ static int _write_str(const char *name, char *str, int print_level, int log_leve
 			break;
 	}
 
-	fclose (filep);
+	if (filep)
+		fclose (filep);
 	return 0;
 }
 
@@ -103,8 +242,10 @@ int lpmd_write_str_verbose(const char *name, char *str, int print_level)
 
 int lpmd_write_int(const char *name, int val, int print_level)
 {
+	struct lpmd_knob *knob;
 	FILE *filep;
 	char prefix[16];
+	char str[16];
 	int i, ret;
 	struct timespec tp1 = { }, tp2 = { };
 
@@ -125,6 +266,21 @@ int lpmd_write_int(const char *name, int val, int print_level)
 		prefix[i] = '\0';
 	}
 
+	knob = find_knob (name);
+	if (knob) {
+		snprintf (str, sizeof(str), "%d", val);
+		if (knob_write (knob, str, &ret)) {
+			lpmd_log_debug ("%sSkip writing \"%d\" to %s, unchanged\n", prefix, val, name);
+			return 0;
+		}
+		if (ret) {
+			lpmd_log_error ("%sWrite \"%d\" to %s failed, errno %d\n", prefix, val, name, ret);
+			return 1;
+		}
+		filep = NULL;
+		goto log;
+	}
+
 	filep = fopen (name, "r+");
 	if (!filep) {
 		lpmd_log_error ("%sOpen %s failed\n", prefix, name);
@@ -138,6 +294,8 @@ int lpmd_write_int(const char *name, int val, int print_level)
 		return 1;
 	}
 
+log:
+
 	clock_gettime (CLOCK_MONOTONIC, &tp2);
 
 	switch (print_level) {
@@ -157,15 +315,19 @@ int lpmd_write_int(const char *name, int val, int print_level)
 			break;
 	}
 
-	fclose (filep);
+	if (filep)
+		fclose (filep);
 	return 0;
 
 }
 
 int lpmd_read_int(const char *name, int *val, int print_level)
 {
+	struct lpmd_knob *knob;
 	FILE *filep;
 	char prefix[16];
+	char str[MAX_STR_LENGTH];
+	char *pos;
 	int i, t, ret;
 
 	if (!name || !val)
@@ -183,6 +345,21 @@ int lpmd_read_int(const char *name, int *val, int print_level)
 		prefix[i] = '\0';
 	}
 
+	knob = find_knob (name);
+	if (knob) {
+		if (knob_read (knob, str, sizeof(str))) {
+			lpmd_log_error ("%sRead %s failed\n", prefix, name);
+			return 1;
+		}
+		errno = 0;
+		t = strtol (str, &pos, 10);
+		if (errno || pos == str) {
+			lpmd_log_error ("%sRead %s failed, \"%s\"\n", prefix, name, str);
+			return 1;
+		}
+		goto end;
+	}
+
 	filep = fopen (name, "r");
 	if (!filep) {
 		lpmd_log_error ("%sOpen %s failed\n", prefix, name);
@@ -198,6 +375,7 @@ int lpmd_read_int(const char *name, int *val, int print_level)
 
 	fclose (filep);
 
+end:
 	*val = t;
 
 	if (print_level >= 0)
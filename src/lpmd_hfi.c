@@ -19,6 +19,8 @@
  *
  * This file processes HFI messages from the firmware. When the EE column for
  * a CPU is 255, that CPU will be in allowed list to run all thread.
+ * With HfiLpmCpus set, the CPUs used for LPM are instead the N online CPUs
+ * with the highest EE value, optionally skipping CPUs below HfiMinPerf.
  */
 
 #define _GNU_SOURCE
@@ -177,6 +179,45 @@ struct perf_cap {
 	int eff;
 };
 
+/*
+ * Latest perf/eff capability per CPU, updated by every CAPACITY_CHANGE
+ * message. A firmware update may span several messages, so the table is
+ * only evaluated once the netlink socket is fully drained, and then only
+ * after the hints have been stable for the HfiDebounceMS window.
+ */
+struct hfi_cap {
+	int valid;
+	int perf;
+	int eff;
+	int selected;	/* In the applied CPUMASK_HFI_RANKED */
+};
+
+/* Keep re-arming the debounce for at most this many windows */
+#define HFI_DEBOUNCE_MAX_WINDOWS	4
+
+static struct hfi_cap *hfi_table;
+static int hfi_table_size;
+static int hfi_table_dirty;
+static int hfi_timer = -1;
+static uint64_t hfi_dirty_since;
+
+/*
+ * Online CPUs ordered by efficiency, rebuilt on every evaluation. The first
+ * hfi_rank_selected entries form CPUMASK_HFI_RANKED, unless a frozen LPM
+ * keeps the previous ones. Also read by the D-Bus thread, hence the mutex.
+ */
+struct hfi_rank {
+	int cpu;
+	int perf;
+	int eff;
+};
+
+static struct hfi_rank *hfi_rank;
+static int hfi_rank_nr;
+static int hfi_rank_selected;
+static int *hfi_rank_cpus;
+static pthread_mutex_t hfi_rank_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int suv_bit_set(void)
 {
 //	Depends on kernel patch to export kernel knobs for this
@@ -185,56 +226,170 @@ static int suv_bit_set(void)
 
 static void update_one_cpu(struct perf_cap *perf_cap)
 {
-	if (perf_cap->cpu < 0)
+	struct hfi_cap *cap;
+
+	if (perf_cap->cpu < 0 || perf_cap->cpu >= hfi_table_size)
+		return;
+
+	cap = &hfi_table[perf_cap->cpu];
+	if (cap->valid && cap->perf == perf_cap->perf && cap->eff == perf_cap->eff)
+		return;
+
+	cap->valid = 1;
+	cap->perf = perf_cap->perf;
+	cap->eff = perf_cap->eff;
+	hfi_table_dirty = 1;
+}
+
+/* Most efficient first, then the faster one, then the lower CPU number */
+static int hfi_rank_cmp(const void *a, const void *b)
+{
+	const struct hfi_rank *ra = a, *rb = b;
+
+	if (ra->eff != rb->eff)
+		return rb->eff - ra->eff;
+	if (ra->perf != rb->perf)
+		return rb->perf - ra->perf;
+	return ra->cpu - rb->cpu;
+}
+
+static void hfi_rank_update(void)
+{
+	int min_perf = get_hfi_min_perf ();
+	int nr_cpus = get_hfi_lpm_cpus ();
+	int cpu, i, nr = 0;
+
+	pthread_mutex_lock (&hfi_rank_mutex);
+
+	for (cpu = 0; cpu < hfi_table_size; cpu++) {
+		struct hfi_cap *cap = &hfi_table[cpu];
+
+		if (!cap->valid || !cap->eff || cap->perf < min_perf || !is_cpu_online (cpu))
+			continue;
+
+		hfi_rank[nr].cpu = cpu;
+		hfi_rank[nr].perf = cap->perf;
+		hfi_rank[nr].eff = cap->eff;
+		nr++;
+	}
+
+	qsort (hfi_rank, nr, sizeof(*hfi_rank), hfi_rank_cmp);
+	hfi_rank_nr = nr;
+	hfi_rank_selected = nr_cpus < nr ? nr_cpus : nr;
+	for (i = 0; i < hfi_rank_selected; i++)
+		hfi_rank_cpus[i] = hfi_rank[i].cpu;
+	nr = hfi_rank_selected;
+
+	pthread_mutex_unlock (&hfi_rank_mutex);
+
+	/* Also moves an ongoing LPM to the new CPUs */
+	if (process_lpm_hfi_ranked (hfi_rank_cpus, nr))
 		return;
 
-	if (perf_cap->eff == 255 * 4 && has_hfi_lpm_monitor ())
-		add_cpu (perf_cap->cpu, CPUMASK_HFI);
-	if (!perf_cap->perf && !perf_cap->eff && has_hfi_suv_monitor () && suv_bit_set ())
-		add_cpu (perf_cap->cpu, CPUMASK_HFI_SUV);
+	pthread_mutex_lock (&hfi_rank_mutex);
+	for (cpu = 0; cpu < hfi_table_size; cpu++)
+		hfi_table[cpu].selected = 0;
+	for (i = 0; i < nr; i++)
+		hfi_table[hfi_rank_cpus[i]].selected = 1;
+	pthread_mutex_unlock (&hfi_rank_mutex);
 }
 
-static void process_one_event(int first, int last, int nr)
+/*
+ * Format the current ranking, one CPU per line, most efficient first.
+ * The returned string must be freed by the caller.
+ */
+char* hfi_ranking_str(void)
+{
+	size_t size, offset;
+	char *buf;
+	int i;
+
+	pthread_mutex_lock (&hfi_rank_mutex);
+
+	size = (hfi_rank_nr + 1) * 64;
+	buf = malloc (size);
+	if (!buf)
+		goto out;
+
+	offset = snprintf (buf, size, "%4s %4s %5s %5s %8s\n", "rank", "cpu", "perf", "eff",
+						"selected");
+	for (i = 0; i < hfi_rank_nr; i++)
+		offset += snprintf (buf + offset, size - offset, "%4d %4d %5d %5d %8s\n", i + 1,
+							hfi_rank[i].cpu, hfi_rank[i].perf, hfi_rank[i].eff,
+							hfi_table[hfi_rank[i].cpu].selected ? "yes" : "no");
+
+out: pthread_mutex_unlock (&hfi_rank_mutex);
+
+	return buf;
+}
+
+static void process_one_event(void)
 {
 	static int in_lpm = 0;
+	int cpu;
 
-	if (nr < 16 || last >= get_max_online_cpu () - 1) {
-		if (has_cpus (CPUMASK_HFI)) {
-			if (in_lpm) {
-				lpmd_log_debug ("\tRedundant HFI LPM event ignored\n\n");
-			}
-			else {
-				lpmd_log_debug ("\tHFI LPM hints detected\n");
-				process_lpm (HFI_ENTER);
-				in_lpm = 1;
-			}
-			reset_cpus (CPUMASK_HFI);
-		}
-		else if (has_cpus (CPUMASK_HFI_SUV)) {
-			if (in_hfi_suv_mode ()) {
-				lpmd_log_debug ("\tRedundant HFI SUV event ignored\n\n");
-			}
-			else {
-				lpmd_log_debug ("\tHFI SUV hints detected\n");
-				process_suv_mode (HFI_SUV_ENTER);
-			}
-			reset_cpus (CPUMASK_HFI_SUV);
+	if (has_hfi_lpm_monitor ())
+		hfi_rank_update ();
+
+	for (cpu = 0; cpu < hfi_table_size; cpu++) {
+		struct hfi_cap *cap = &hfi_table[cpu];
+
+		if (!cap->valid)
+			continue;
+		/*
+		 * Only the firmware LPM hint enters HFI LPM, the ranking picks the
+		 * CPUs of any LPM. Every CPU has an efficiency, a ranking alone would
+		 * hold LPM regardless of the utilization.
+		 */
+		if (cap->eff == 255 * 4 && has_hfi_lpm_monitor ())
+			add_cpu (cpu, CPUMASK_HFI);
+		if (!cap->perf && !cap->eff && has_hfi_suv_monitor () && suv_bit_set ())
+			add_cpu (cpu, CPUMASK_HFI_SUV);
+	}
+
+	if (has_cpus (CPUMASK_HFI)) {
+		if (in_lpm) {
+			lpmd_log_debug ("\tRedundant HFI LPM event ignored\n\n");
 		}
-		else if (in_lpm) {
-			lpmd_log_debug ("\tHFI LPM recover\n");
-//			 Don't override the DETECT_LPM_CPU_DEFAULT so it is auto recovered
-			process_lpm (HFI_EXIT);
-			in_lpm = 0;
+		else {
+			lpmd_log_debug ("\tHFI LPM hints detected\n");
+			process_lpm (HFI_ENTER);
+			in_lpm = 1;
 		}
-		else if (in_hfi_suv_mode ()) {
-			lpmd_log_debug ("\tHFI SUV recover\n");
-//			 Don't override the DETECT_LPM_CPU_DEFAULT so it is auto recovered
-			process_suv_mode (HFI_SUV_EXIT);
+		reset_cpus (CPUMASK_HFI);
+	}
+	else if (has_cpus (CPUMASK_HFI_SUV)) {
+		if (in_hfi_suv_mode ()) {
+			lpmd_log_debug ("\tRedundant HFI SUV event ignored\n\n");
 		}
 		else {
-			lpmd_log_info ("\t\t\tUnsupported HFI event ignored\n");
+			lpmd_log_debug ("\tHFI SUV hints detected\n");
+			process_suv_mode (HFI_SUV_ENTER);
 		}
+		reset_cpus (CPUMASK_HFI_SUV);
+	}
+	else if (in_lpm) {
+		lpmd_log_debug ("\tHFI LPM recover\n");
+//		 Don't override the DETECT_LPM_CPU_DEFAULT so it is auto recovered
+		process_lpm (HFI_EXIT);
+		in_lpm = 0;
 	}
+	else if (in_hfi_suv_mode ()) {
+		lpmd_log_debug ("\tHFI SUV recover\n");
+//		 Don't override the DETECT_LPM_CPU_DEFAULT so it is auto recovered
+		process_suv_mode (HFI_SUV_EXIT);
+	}
+	/* Only the ranking changed */
+	else if (!has_hfi_lpm_monitor () || !get_hfi_lpm_cpus ()) {
+		lpmd_log_info ("\t\t\tUnsupported HFI event ignored\n");
+	}
+}
+
+static int hfi_timer_fn(void)
+{
+	hfi_table_dirty = 0;
+	process_one_event ();
+	return -1;
 }
 
 static int handle_event(struct nl_msg *n, void *arg)
@@ -242,7 +397,6 @@ static int handle_event(struct nl_msg *n, void *arg)
 	struct nlmsghdr *nlh = nlmsg_hdr (n);
 	struct genlmsghdr *genlhdr = genlmsg_hdr (nlh);
 	struct nlattr *attrs[THERMAL_GENL_ATTR_MAX + 1];
-	int first_cpu = -1, last_cpu = -1, nr_cpus = 0;
 	struct perf_cap perf_cap;
 	int ret;
 
@@ -286,15 +440,11 @@ static int handle_event(struct nl_msg *n, void *arg)
 				offset = 0;
 				buf[MAX_STR_LENGTH - 1] = '\0';
 				lpmd_log_debug ("\t\t\t%s\n", buf);
+				lpmd_trace_hfi (perf_cap.cpu, perf_cap.perf, perf_cap.eff);
 				update_one_cpu (&perf_cap);
-				if (first_cpu == -1)
-					first_cpu = perf_cap.cpu;
-				last_cpu = perf_cap.cpu;
-				nr_cpus++;
 			}
 		}
 	}
-	process_one_event (first_cpu, last_cpu, nr_cpus);
 
 	return 0;
 }
@@ -308,12 +458,76 @@ int hfi_kill(void)
 	return 0;
 }
 
+static void hfi_table_changed(void)
+{
+	int debounce = get_hfi_debounce ();
+	uint64_t now;
+
+	if (!hfi_table_dirty)
+		return;
+
+	if (!debounce || hfi_timer < 0) {
+		hfi_timer_fn ();
+		return;
+	}
+
+	now = lpm_stats_now ();
+	if (!lpmd_timer_armed (hfi_timer))
+		hfi_dirty_since = now;
+	else if (now - hfi_dirty_since >= (uint64_t) debounce * HFI_DEBOUNCE_MAX_WINDOWS * 1000000)
+		return;
+
+	/* Evaluate once the hints have been stable for the debounce window */
+	lpmd_timer_arm (hfi_timer, debounce);
+}
+
 void hfi_receive(void)
 {
 	int err = 0;
 
+	/* Drain the socket, the table is evaluated once for the whole batch */
 	while (!err)
 		err = nl_recvmsgs (drv.nl_handle, drv.nl_cb);
+
+	lpmd_trace_hfi_done ();
+	hfi_table_changed ();
+}
+
+static int hfi_table_init(void)
+{
+	hfi_table_size = get_max_cpus ();
+	hfi_table = calloc (hfi_table_size, sizeof(*hfi_table));
+	hfi_rank = calloc (hfi_table_size, sizeof(*hfi_rank));
+	hfi_rank_cpus = calloc (hfi_table_size, sizeof(*hfi_rank_cpus));
+	if (!hfi_table || !hfi_rank || !hfi_rank_cpus) {
+		lpmd_log_error ("Failed to allocate HFI table\n");
+		return -1;
+	}
+
+	hfi_timer = lpmd_timer_add ("hfi", hfi_timer_fn, 0);
+	return 0;
+}
+
+/* HFI updates of a replay come from the trace, no netlink socket */
+int hfi_replay_init(void)
+{
+	return hfi_table_init ();
+}
+
+/* Apply one recorded batch of nr_caps (cpu, perf, eff) updates */
+void hfi_replay(int *caps, int nr_caps)
+{
+	struct perf_cap perf_cap;
+	int i;
+
+	for (i = 0; i < nr_caps; i++) {
+		perf_cap.cpu = caps[i * 3];
+		perf_cap.perf = caps[i * 3 + 1];
+		perf_cap.eff = caps[i * 3 + 2];
+		update_one_cpu (&perf_cap);
+	}
+
+	hfi_table_changed ();
 }
 
 int hfi_init(void)
@@ -324,6 +538,9 @@ int hfi_init(void)
 
 	signal (SIGPIPE, SIG_IGN);
 
+	if (hfi_table_init ())
+		goto err_proc;
+
 	sock = nl_socket_alloc ();
 	if (!sock) {
 		lpmd_log_error ("nl_socket_alloc failed\n");
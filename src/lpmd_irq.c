@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/inotify.h>
 #include <errno.h>
 #include <getopt.h>
 #include <cpuid.h>
@@ -46,17 +47,39 @@
 
 static char irq_socket_name[64];
 
-#define MAX_IRQS		128
+/*
+ * Native IRQ handling: IRQ affinities are stored as arrays of 32-bit words,
+ * in the same order as the comma separated groups in
+ * /proc/irq/N/smp_affinity, i.e. word[0] is for CPU0-31.
+ */
+#define IRQ_TABLE_SIZE_DEF	64
+
+/* irq_slot[] values other than the index + 1 of a saved IRQ */
+#define IRQ_SLOT_NONE		0
+#define IRQ_SLOT_UNMOVABLE	-1
 
 struct info_irq {
 	int irq;
-	char affinity[MAX_STR_LENGTH];
+	uint32_t *affinity;	/* Original affinity, restored on exit */
 };
 
 struct info_irqs {
-	/* Cached IRQ smp_affinity info */
+	/* IRQs that have been changed and need to be restored */
 	int nr_irqs;
-	struct info_irq irq[MAX_IRQS];
+	int size;
+	struct info_irq *irq;
+	uint32_t *masks;
+
+	/* words per cpumask */
+	int nr_words;
+	uint32_t *target;
+	uint32_t *cur;
+	char *str;
+	int str_size;
+
+	/* Indexed by IRQ number */
+	int *irq_slot;
+	int max_irq;
 };
 
 struct info_irqs info_irqs;
@@ -100,13 +123,148 @@ static int dump_smp_affinity(void)
 
 static int irqbalance_pid = -1;
 
+/*
+ * irqbalance closes the connection after each command, so the session keeps
+ * everything else persistent: the socket name, the credentials message (in
+ * lpmd_socket.c) and the command buffer. An inotify watch on SOCKET_TMPFS
+ * tracks irqbalance restarts, which change the socket name.
+ */
+static char *socket_cmd;
+static int socket_cmd_size;
+
+static int irqbalance_inotify_fd = -1;
+static int wd_run = -1;
+static int wd_irqbalance = -1;
+
+/* How IRQs were updated on LPM entry, so that exit restores them the same way */
+enum irq_lpm_state {
+	IRQ_LPM_NONE,
+	IRQ_LPM_NATIVE,
+	IRQ_LPM_IRQBALANCE,
+};
+
+static enum irq_lpm_state irq_lpm_state = IRQ_LPM_NONE;
+
+/* Append to socket_cmd at offset, grow the buffer when needed */
+static int socket_cmd_append(int offset, const char *fmt, ...)
+{
+	va_list args;
+	char *buf;
+	int ret;
+
+	for (;;) {
+		va_start(args, fmt);
+		ret = vsnprintf (socket_cmd + offset, socket_cmd_size - offset, fmt, args);
+		va_end(args);
+		if (ret < 0)
+			return -1;
+
+		if (offset + ret < socket_cmd_size)
+			return offset + ret;
+
+		buf = realloc (socket_cmd, socket_cmd_size * 2);
+		if (!buf)
+			return -1;
+		socket_cmd = buf;
+		socket_cmd_size *= 2;
+	}
+}
+
+/* Encode the banned CPUs as ranges, e.g. "0-3,8-15" */
+static int socket_cmd_append_cpus(int offset)
+{
+	int cpu, start = -1;
+	int first = 1;
+
+	for (cpu = 0; cpu <= get_max_cpus (); cpu++) {
+		int banned = cpu < get_max_cpus () && is_cpu_online (cpu) && !is_cpu_for_lpm (cpu);
+
+		if (banned) {
+			if (start < 0)
+				start = cpu;
+			continue;
+		}
+
+		if (start < 0)
+			continue;
+
+		if (start == cpu - 1)
+			offset = socket_cmd_append (offset, first ? "%d" : ",%d", start);
+		else
+			offset = socket_cmd_append (offset, first ? "%d-%d" : ",%d-%d", start, cpu - 1);
+		if (offset < 0)
+			return -1;
+
+		first = 0;
+		start = -1;
+	}
+
+	/* No CPU to ban */
+	if (first)
+		offset = socket_cmd_append (offset, "NULL");
+
+	return offset;
+}
+
+static int irqbalance_pid_alive(int pid)
+{
+	return !kill (pid, 0) || errno == EPERM;
+}
+
+/* Find the socket of a running irqbalance, stale sockets are ignored */
+static int irqbalance_detect(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int pid;
+
+	irqbalance_pid = -1;
+	irq_socket_name[0] = '\0';
+
+	dir = opendir (SOCKET_TMPFS);
+	if (!dir)
+		return -1;
+
+	while ((entry = readdir (dir)) != NULL) {
+		if (strncmp (entry->d_name, SOCKET_PATH, strlen (SOCKET_PATH)))
+			continue;
+		if (sscanf (entry->d_name, SOCKET_PATH "%d.sock", &pid) != 1)
+			continue;
+		if (!irqbalance_pid_alive (pid))
+			continue;
+
+		irqbalance_pid = pid;
+		snprintf (irq_socket_name, sizeof(irq_socket_name), "%s/%s%d.sock", SOCKET_TMPFS,
+					SOCKET_PATH, irqbalance_pid);
+		break;
+	}
+
+	closedir (dir);
+	return irqbalance_pid;
+}
+
+static int irqbalance_send_cmd(char *cmd)
+{
+	int pid = irqbalance_pid;
+
+	if (!socket_send_cmd (irq_socket_name, cmd))
+		return LPMD_SUCCESS;
+
+	/* irqbalance may have been restarted since last rescan */
+	if (irqbalance_detect () == -1 || irqbalance_pid == pid) {
+		lpmd_log_error ("Failed to send irqbalance command\n");
+		return LPMD_ERROR;
+	}
+
+	lpmd_log_info ("\tirqbalance restarted, switch to socket %s\n", irq_socket_name);
+	return socket_send_cmd (irq_socket_name, cmd);
+}
+
 static int irqbalance_ban_cpus(int enter)
 {
-	char socket_cmd[MAX_STR_LENGTH];
 	struct timespec tp1, tp2;
-	int cpu;
 	int offset;
-	int first = 1;
+	int ret;
 
 	dump_smp_affinity();
 
@@ -115,160 +273,320 @@ static int irqbalance_ban_cpus(int enter)
 	else
 		lpmd_log_info ("\tRestore IRQ affinity (irqbalance)\n");
 
-	offset = snprintf (socket_cmd, sizeof("settings cpus "), "settings cpus ");
-	if (!enter) {
-		offset += snprintf (socket_cmd + offset, sizeof("NULL"), "NULL");
-		goto end;
+	if (!socket_cmd) {
+		socket_cmd_size = MAX_STR_LENGTH;
+		socket_cmd = malloc (socket_cmd_size);
+		if (!socket_cmd)
+			return -1;
 	}
 
-	for (cpu = 0; cpu < get_max_cpus (); cpu++) {
-		if (!is_cpu_online (cpu))
-			continue;
+	offset = socket_cmd_append (0, "settings cpus ");
+	if (offset < 0)
+		return -1;
 
-		if (!is_cpu_for_lpm (cpu)) {
-			if (MAX_STR_LENGTH <= offset) {
-				lpmd_log_error ("Too many CPUs for socket message\n");
-				return -1;
-			}
-			if (first)
-				offset += snprintf (socket_cmd + offset, MAX_STR_LENGTH - offset, "%d", cpu);
-			else
-				offset += snprintf (socket_cmd + offset, MAX_STR_LENGTH - offset, ",%d", cpu);
-			first = 0;
-		}
-	}
+	if (enter)
+		offset = socket_cmd_append_cpus (offset);
+	else
+		offset = socket_cmd_append (offset, "NULL");
 
-end: socket_cmd[offset] = '\0';
+	if (offset < 0) {
+		lpmd_log_error ("Failed to build socket message\n");
+		return -1;
+	}
 
 	clock_gettime (CLOCK_MONOTONIC, &tp1);
-	socket_send_cmd (irq_socket_name, socket_cmd);
+	ret = irqbalance_send_cmd (socket_cmd);
 	clock_gettime (CLOCK_MONOTONIC, &tp2);
 	lpmd_log_info ("\tSend socket command %s (%lu ns)\n", socket_cmd,
 		1000000000UL * (tp2.tv_sec - tp1.tv_sec) + tp2.tv_nsec - tp1.tv_nsec);
+	return ret;
+}
+
+static int irq_info_init(void)
+{
+	info->nr_words = (get_max_cpus () + 31) / 32;
+	if (!info->nr_words)
+		info->nr_words = 1;
+
+	info->size = IRQ_TABLE_SIZE_DEF;
+	info->irq = calloc (info->size, sizeof(*info->irq));
+	info->masks = calloc (info->size * info->nr_words, sizeof(uint32_t));
+	info->target = calloc (info->nr_words, sizeof(uint32_t));
+	info->cur = calloc (info->nr_words, sizeof(uint32_t));
+	/* 8 hex digits plus ',' per word, and the Newline */
+	info->str_size = info->nr_words * 9 + 2;
+	info->str = calloc (info->str_size, 1);
+
+	if (!info->irq || !info->masks || !info->target || !info->cur || !info->str) {
+		lpmd_log_error ("Failed to allocate IRQ table\n");
+		return LPMD_ERROR;
+	}
+	return LPMD_SUCCESS;
+}
+
+static int irq_table_grow(void)
+{
+	struct info_irq *irq;
+	uint32_t *masks;
+	int size = info->size * 2;
+	int i;
+
+	irq = realloc (info->irq, size * sizeof(*irq));
+	if (!irq)
+		return -1;
+	info->irq = irq;
+
+	masks = realloc (info->masks, size * info->nr_words * sizeof(uint32_t));
+	if (!masks)
+		return -1;
+
+	/* affinity pointers point into the masks array */
+	for (i = 0; i < info->nr_irqs; i++)
+		irq[i].affinity = masks + i * info->nr_words;
+
+	info->masks = masks;
+	info->size = size;
+	return 0;
+}
+
+static int irq_slot_grow(int irq)
+{
+	int *slot;
+	int max = info->max_irq ? info->max_irq : IRQ_TABLE_SIZE_DEF;
+
+	while (max <= irq)
+		max *= 2;
+
+	slot = realloc (info->irq_slot, max * sizeof(int));
+	if (!slot)
+		return -1;
+
+	memset (slot + info->max_irq, 0, (max - info->max_irq) * sizeof(int));
+	info->irq_slot = slot;
+	info->max_irq = max;
 	return 0;
 }
 
+/* Parse "xxxxxxxx,xxxxxxxx" from the last group, which is for CPU0-31 */
+static void str_to_irq_mask(char *str, uint32_t *mask)
+{
+	char *end;
+	int i;
+
+	memset (mask, 0, info->nr_words * sizeof(uint32_t));
+
+	end = str + strlen (str);
+	for (i = 0; i < info->nr_words; i++) {
+		char *start = end;
+
+		while (start > str && *(start - 1) != ',')
+			start--;
+
+		*end = '\0';
+		mask[i] = strtoul (start, NULL, 16);
+
+		if (start == str)
+			break;
+		end = start - 1;
+	}
+}
+
+/* Leading zero words are dropped, the kernel rejects words beyond nr_cpu_ids */
+static char* irq_mask_to_str(uint32_t *mask)
+{
+	int offset = 0;
+	int i;
+
+	for (i = info->nr_words - 1; i > 0; i--) {
+		if (mask[i])
+			break;
+	}
+
+	offset = snprintf (info->str, info->str_size, "%x", mask[i]);
+	for (i--; i >= 0; i--)
+		offset += snprintf (info->str + offset, info->str_size - offset, ",%08x", mask[i]);
+
+	return info->str;
+}
+
+static void update_irq_target(void)
+{
+	int cpu;
+
+	memset (info->target, 0, info->nr_words * sizeof(uint32_t));
+	for (cpu = 0; cpu < get_max_cpus (); cpu++) {
+		if (is_cpu_for_lpm (cpu))
+			info->target[cpu / 32] |= 1U << (cpu % 32);
+	}
+}
+
 static int native_restore_irqs(void)
 {
 	char path[MAX_STR_LENGTH];
-	int i;
+	char *str;
+	int i, fd;
 
 	lpmd_log_info ("\tRestore IRQ affinity (native)\n");
 
 	for (i = 0; i < info->nr_irqs; i++) {
-		char *str = info->irq[i].affinity;
-
 		snprintf (path, MAX_STR_LENGTH, "/proc/irq/%i/smp_affinity", info->irq[i].irq);
+		info->irq_slot[info->irq[i].irq] = IRQ_SLOT_NONE;
 
-		lpmd_write_str (path, str, LPMD_LOG_DEBUG);
+		fd = open (path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		str = irq_mask_to_str (info->irq[i].affinity);
+		if (write (fd, str, strlen (str)) < 0)
+			lpmd_log_debug ("\t\tRestore IRQ%d affinity %s failed\n", info->irq[i].irq, str);
+		else
+			lpmd_log_debug ("\t\tWrite \"%s\" to %s\n", str, path);
+		close (fd);
 	}
-	memset (info, 0, sizeof(*info));
+
+	lpmd_log_info ("\t%d IRQs restored\n", info->nr_irqs);
+	info->nr_irqs = 0;
 	return 0;
 }
 
-static int update_one_irq(int irq)
+/* Whether mask is not empty and only contains target CPUs */
+static int irq_mask_within_target(uint32_t *mask)
 {
-	FILE *filep;
-	size_t size = 0;
-	char path[MAX_STR_LENGTH];
-	char *str = NULL;
+	uint32_t any = 0;
+	int i;
+
+	for (i = 0; i < info->nr_words; i++) {
+		if (mask[i] & ~info->target[i])
+			return 0;
+		any |= mask[i];
+	}
 
-	if (info->nr_irqs >= (MAX_IRQS - 1)) {
-		lpmd_log_error ("Too many IRQs\n");
+	return !!any;
+}
+
+/*
+ * Returns 1 when the IRQ is changed, 0 when it is skipped, -1 on error.
+ * The original affinity is saved only when it is changed for the first time.
+ * With keep_within set, IRQs already affined to a subset of the target are
+ * left alone.
+ */
+static int update_one_irq(int irq, int keep_within)
+{
+	char path[MAX_STR_LENGTH];
+	struct info_irq *entry = NULL;
+	ssize_t len;
+	char *str;
+	int slot;
+	int fd;
+
+	if (irq >= info->max_irq && irq_slot_grow (irq)) {
+		lpmd_log_error ("Failed to grow IRQ table\n");
 		return -1;
 	}
 
-	info->irq[info->nr_irqs].irq = irq;
+	slot = info->irq_slot[irq];
+	if (slot == IRQ_SLOT_UNMOVABLE)
+		return 0;
+
+	if (slot == IRQ_SLOT_NONE && info->nr_irqs >= info->size && irq_table_grow ()) {
+		lpmd_log_error ("Failed to grow IRQ table\n");
+		return -1;
+	}
 
 	snprintf (path, MAX_STR_LENGTH, "/proc/irq/%i/smp_affinity", irq);
 
-	filep = fopen (path, "r");
-	if (!filep)
-		return -1;
+	fd = open (path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
 
-	if (getline (&str, &size, filep) <= 0) {
+	len = pread (fd, info->str, info->str_size - 1, 0);
+	if (len <= 0) {
 		lpmd_log_error ("Failed to get IRQ%d smp_affinity\n", irq);
-		free (str);
-		fclose (filep);
+		close (fd);
 		return -1;
 	}
+	info->str[len] = '\0';
+	/* Remove the Newline */
+	if (info->str[len - 1] == '\n')
+		info->str[len - 1] = '\0';
 
-	fclose (filep);
+	str_to_irq_mask (info->str, info->cur);
 
-	snprintf (info->irq[info->nr_irqs].affinity, MAX_STR_LENGTH, "%s", str);
+	/* Already affined to the target CPUs */
+	if (!memcmp (info->cur, info->target, info->nr_words * sizeof(uint32_t))
+			|| (keep_within && irq_mask_within_target (info->cur))) {
+		close (fd);
+		return 0;
+	}
 
-	free (str);
+	str = irq_mask_to_str (info->target);
+	if (write (fd, str, strlen (str)) < 0) {
+		/* Managed and per-CPU IRQs reject affinity changes from user space */
+		if (errno == EIO) {
+			lpmd_log_debug ("\t\tIRQ%d is unmovable, skip\n", irq);
+			info->irq_slot[irq] = IRQ_SLOT_UNMOVABLE;
+			close (fd);
+			return 0;
+		}
+		lpmd_log_error ("Write \"%s\" to %s failed, errno %d\n", str, path, errno);
+		close (fd);
+		return -1;
+	}
+	close (fd);
 
-	/* Remove the Newline */
-	size = strnlen (info->irq[info->nr_irqs].affinity, MAX_STR_LENGTH);
-	info->irq[info->nr_irqs].affinity[size - 1] = '\0';
+	lpmd_log_debug ("\t\tWrite \"%s\" to %s\n", str, path);
 
-	if (lpmd_write_str (path, get_lpm_cpus_hexstr (), LPMD_LOG_DEBUG))
+	if (slot != IRQ_SLOT_NONE)
 		return 1;
 
-	info->nr_irqs++;
+	entry = &info->irq[info->nr_irqs];
+	entry->irq = irq;
+	entry->affinity = info->masks + info->nr_irqs * info->nr_words;
+	memcpy (entry->affinity, info->cur, info->nr_words * sizeof(uint32_t));
+	info->irq_slot[irq] = ++info->nr_irqs;
 
-	return 0;
+	return 1;
 }
 
-static int native_update_irqs(void)
+static int native_update_irqs(int keep_within)
 {
-	FILE *filep;
-	char *line = NULL;
-	size_t size = 0;
+	struct dirent *d;
+	DIR *dir;
+	int nr_changed = 0;
+	int nr_total = 0;
 
 	lpmd_log_info ("\tUpdate IRQ affinity (native)\n");
 
-	filep = fopen ("/proc/interrupts", "r");
-	if (!filep) {
-		perror ("Error open /proc/interrupts\n");
-		return -1;
-	}
-
-	/* first line is the header we don't need; nuke it */
-	if (getline (&line, &size, filep) <= 0) {
-		perror ("Error getline\n");
-		free (line);
-		fclose (filep);
+	dir = opendir ("/proc/irq");
+	if (!dir) {
+		perror ("Error open /proc/irq\n");
 		return -1;
 	}
-	free (line);
 
-	while (!feof (filep)) {
-		int number;
-		char *c;
+	update_irq_target ();
 
-		line = NULL;
-		size = 0;
+	while ((d = readdir (dir)) != NULL) {
+		char *end;
+		int irq;
+		int ret;
 
-		if (getline (&line, &size, filep) <= 0) {
-			free (line);
-			break;
-		}
-
-		/* lines with letters in front are special, like NMI count. Ignore */
-		c = line;
-		while (isblank(*(c)))
-			c++;
-
-		if (!isdigit(*c)) {
-			free (line);
-			break;
-		}
-		c = strchr (line, ':');
-		if (!c) {
-			free (line);
+		/* Skip ".", ".." and default_smp_affinity */
+		if (!isdigit(d->d_name[0]))
 			continue;
-		}
 
-		*c = 0;
-		number = strtoul (line, NULL, 10);
+		irq = strtoul (d->d_name, &end, 10);
+		if (*end != '\0')
+			continue;
 
-		update_one_irq (number);
-		free (line);
+		ret = update_one_irq (irq, keep_within);
+		if (ret > 0)
+			nr_changed++;
+		nr_total++;
 	}
 
-	fclose (filep);
+	closedir (dir);
+
+	lpmd_log_info ("\t%d of %d IRQs updated\n", nr_changed, nr_total);
 
 	return 0;
 }
@@ -278,60 +596,182 @@ static int native_process_irqs(int enter)
 	dump_smp_affinity();
 
 	if (enter)
-		return native_update_irqs ();
+		return native_update_irqs (0);
 	else
 		return native_restore_irqs ();
 }
 
 int process_irqs(int enter, enum lpm_cpu_process_mode mode)
 {
+	int ret;
+
 	/* No need to handle IRQs in offline mode */
 	if (mode == LPM_CPU_OFFLINE)
 		return 0;
 	lpmd_log_info ("Process IRQs ...\n");
+
+	if (!enter) {
+		if (irq_lpm_state == IRQ_LPM_NATIVE)
+			ret = native_process_irqs (0);
+		else if (irqbalance_pid != -1)
+			ret = irqbalance_ban_cpus (0);
+		else
+			ret = 0; /* irqbalance stopped, no banned CPUs to restore */
+		irq_lpm_state = IRQ_LPM_NONE;
+		return ret;
+	}
+
+	if (irqbalance_pid == -1) {
+		irq_lpm_state = IRQ_LPM_NATIVE;
+		return native_process_irqs (1);
+	}
+
+	irq_lpm_state = IRQ_LPM_IRQBALANCE;
+	return irqbalance_ban_cpus (1);
+}
+
+/*
+ * Retarget the IRQs of an ongoing LPM to the current LPM CPUs. Native mode
+ * only rewrites the IRQs that are not within the new CPUs and keeps the
+ * affinities saved on entry, irqbalance gets the new banned CPU list.
+ */
+int process_irqs_switch(enum lpm_cpu_process_mode mode)
+{
+	if (mode == LPM_CPU_OFFLINE)
+		return 0;
+	lpmd_log_info ("Switch IRQs ...\n");
+
+	switch (irq_lpm_state) {
+		case IRQ_LPM_NATIVE:
+			dump_smp_affinity ();
+			return native_update_irqs (1);
+		case IRQ_LPM_IRQBALANCE:
+			/* A restarted irqbalance is handled by check_irqbalance_restart () */
+			if (irqbalance_pid == -1)
+				return 0;
+			return irqbalance_ban_cpus (1);
+		default:
+			return process_irqs (1, mode);
+	}
+}
+
+/* Whether the next process_irqs () goes through irqbalance */
+int irq_use_irqbalance(void)
+{
+	if (irq_lpm_state != IRQ_LPM_NONE)
+		return irq_lpm_state == IRQ_LPM_IRQBALANCE;
+
+	return irqbalance_pid != -1;
+}
+
+static int irqbalance_watch_tmpfs(void)
+{
+	return inotify_add_watch (irqbalance_inotify_fd, SOCKET_TMPFS,
+								IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+}
+
+/*
+ * Watch SOCKET_TMPFS for irqbalance sockets coming and going. When SOCKET_TMPFS
+ * does not exist yet, watch /run for its creation.
+ */
+int irqbalance_monitor_init(void)
+{
+	irqbalance_inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (irqbalance_inotify_fd < 0)
+		return -1;
+
+	wd_irqbalance = irqbalance_watch_tmpfs ();
+	if (wd_irqbalance < 0)
+		wd_run = inotify_add_watch (irqbalance_inotify_fd, "/run", IN_CREATE | IN_MOVED_TO);
+
+	if (wd_irqbalance < 0 && wd_run < 0) {
+		close (irqbalance_inotify_fd);
+		irqbalance_inotify_fd = -1;
+		return -1;
+	}
+
+	lpmd_log_debug ("irqbalance monitor started\n");
+	return irqbalance_inotify_fd;
+}
+
+int check_irqbalance_restart(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int changed = 0;
+	int pid = irqbalance_pid;
+	ssize_t len;
+	char *p;
+
+	while ((len = read (irqbalance_inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event*) p;
+
+			if (event->wd == wd_irqbalance) {
+				if (event->mask & IN_IGNORED) {
+					/* SOCKET_TMPFS is gone, wait for it to come back */
+					wd_irqbalance = -1;
+					if (wd_run < 0)
+						wd_run = inotify_add_watch (irqbalance_inotify_fd, "/run",
+													IN_CREATE | IN_MOVED_TO);
+					/* It may have been recreated before the /run watch was added */
+					wd_irqbalance = irqbalance_watch_tmpfs ();
+					if (wd_irqbalance < 0 && wd_run < 0)
+						lpmd_log_error ("Cannot watch /run, irqbalance restarts are not detected\n");
+				}
+				changed = 1;
+				continue;
+			}
+
+			if (event->wd == wd_run && wd_irqbalance < 0 && event->len
+					&& (event->mask & IN_ISDIR) && !strcmp (event->name, SOCKET_PATH)) {
+				wd_irqbalance = irqbalance_watch_tmpfs ();
+				changed = 1;
+			}
+		}
+	}
+
+	if (!changed)
+		return 0;
+
+	if (irqbalance_detect () == pid)
+		return 0;
+
 	if (irqbalance_pid == -1)
-		return native_process_irqs (enter);
+		lpmd_log_info ("irqbalance stopped, run in native mode\n");
 	else
-		return irqbalance_ban_cpus (enter);
+		lpmd_log_info ("irqbalance socket changed to %s\n", irq_socket_name);
+
+	/* A restarted irqbalance does not know about the banned CPUs */
+	if (irqbalance_pid != -1 && irq_lpm_state == IRQ_LPM_IRQBALANCE) {
+		lpmd_lock ();
+		if (irq_lpm_state == IRQ_LPM_IRQBALANCE)
+			irqbalance_ban_cpus (1);
+		lpmd_unlock ();
+	}
+
+	return 1;
 }
 
 int init_irq(void)
 {
-	DIR *dir;
 	int socket_fd;
 	int ret;
 
 	lpmd_log_info ("Detecting IRQs ...\n");
 
-	dir = opendir ("/run/irqbalance");
-	if (dir) {
-		struct dirent *entry;
-
-		do {
-			entry = readdir (dir);
-			if (entry) {
-				if (!strncmp (entry->d_name, "irqbalance", 10)) {
-					ret = sscanf (entry->d_name, "irqbalance%d.sock", &irqbalance_pid);
-					if (!ret)
-						irqbalance_pid = -1;
-				}
-			}
-		}
-		while ((entry) && (irqbalance_pid == -1));
-	
-		closedir (dir);
-	}
+	ret = irq_info_init ();
+	if (ret)
+		return ret;
 
-	if (irqbalance_pid == -1) {
+	if (irqbalance_detect () == -1) {
 		lpmd_log_info ("\tirqbalance not running, run in native mode\n");
 		return LPMD_SUCCESS;
 	}
 
-	snprintf (irq_socket_name, 64, "%s/%s%d.sock", SOCKET_TMPFS, SOCKET_PATH, irqbalance_pid);
 	socket_fd = socket_init_connection (irq_socket_name);
-	if (socket_fd < 0) {
-		lpmd_log_error ("Can not connect to irqbalance socket /run/irqbalance/irqbalance%d.sock\n",
-						irqbalance_pid);
+	if (socket_fd <= 0) {
+		lpmd_log_error ("Can not connect to irqbalance socket %s\n", irq_socket_name);
 		return LPMD_ERROR;
 	}
 	close (socket_fd);
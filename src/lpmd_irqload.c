@@ -0,0 +1,347 @@
+/*
+ * lpmd_irqload.c: interrupt and softirq load of the LPM CPUs
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Network and storage heavy work runs in hard and soft interrupt context,
+ * which the busy time of the LPM CPUs does not fully reflect. This file
+ * samples the per CPU device interrupt counts of /proc/interrupts and the
+ * NET_RX and BLOCK counts of /proc/softirqs, along with the utilization
+ * samples. The util monitor treats LPM CPUs above IrqRateLimit or
+ * SoftirqRateLimit, per CPU and per second, like overloaded ones, and does
+ * not enter a tier whose CPUs would get more than that.
+ * Both files are kept open and re-read with pread() into buffers that only
+ * grow, and are parsed in place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lpmd.h"
+
+#define PATH_PROC_INTERRUPTS	"/proc/interrupts"
+#define PATH_PROC_SOFTIRQS	"/proc/softirqs"
+#define IRQ_LOAD_BUF_SIZE	16384
+
+enum irq_load_type {
+	IRQ_LOAD_HARD, IRQ_LOAD_SOFT, IRQ_LOAD_MAX,
+};
+
+struct irq_load_file {
+	const char *path;
+	int fd;
+	char *buf;
+	size_t size;
+	/* Cumulative counts per CPU of the last two samples */
+	uint64_t *cur;
+	uint64_t *prev;
+	/* Per CPU and per second, -1 without two samples */
+	int *rate;
+	uint64_t total_rate;
+};
+
+static struct irq_load_file irq_load_files[IRQ_LOAD_MAX] = {
+	[IRQ_LOAD_HARD] = { .path = PATH_PROC_INTERRUPTS, .fd = -1 },
+	[IRQ_LOAD_SOFT] = { .path = PATH_PROC_SOFTIRQS, .fd = -1 },
+};
+
+static int irq_load_nr;
+/* Maps the columns of the current sample to CPU numbers */
+static int *irq_load_cols;
+static uint64_t irq_load_prev_ns;
+static int irq_load_valid;
+
+static int irq_load_limit(enum irq_load_type type)
+{
+	return type == IRQ_LOAD_HARD ? get_irq_rate_limit () : get_softirq_rate_limit ();
+}
+
+static int irq_load_enabled(void)
+{
+	/* A trace has no interrupt counts */
+	if (lpmd_trace_replaying ())
+		return 0;
+
+	return get_irq_rate_limit () || get_softirq_rate_limit ();
+}
+
+static int irq_load_alloc(void)
+{
+	struct irq_load_file *file;
+	int i;
+
+	if (irq_load_cols)
+		return 0;
+
+	irq_load_nr = get_max_cpus ();
+	irq_load_cols = calloc (irq_load_nr, sizeof(*irq_load_cols));
+	if (!irq_load_cols)
+		return 1;
+
+	for (i = 0; i < IRQ_LOAD_MAX; i++) {
+		file = &irq_load_files[i];
+		file->size = IRQ_LOAD_BUF_SIZE;
+		file->buf = malloc (file->size);
+		file->cur = calloc (irq_load_nr, sizeof(*file->cur));
+		file->prev = calloc (irq_load_nr, sizeof(*file->prev));
+		file->rate = calloc (irq_load_nr, sizeof(*file->rate));
+		if (!file->buf || !file->cur || !file->prev || !file->rate) {
+			lpmd_log_error ("Failed to allocate %s buffers\n", file->path);
+			goto err;
+		}
+	}
+
+	return 0;
+
+err: for (i = 0; i < IRQ_LOAD_MAX; i++) {
+		file = &irq_load_files[i];
+		free (file->buf);
+		free (file->cur);
+		free (file->prev);
+		free (file->rate);
+		file->buf = NULL;
+		file->cur = file->prev = NULL;
+		file->rate = NULL;
+	}
+	free (irq_load_cols);
+	irq_load_cols = NULL;
+	return 1;
+}
+
+static int irq_load_read(struct irq_load_file *file)
+{
+	ssize_t len;
+	char *buf;
+
+	if (file->fd < 0) {
+		file->fd = open (file->path, O_RDONLY | O_CLOEXEC);
+		if (file->fd < 0) {
+			lpmd_log_error ("Open %s failed\n", file->path);
+			return 1;
+		}
+	}
+
+	for (;;) {
+		len = pread (file->fd, file->buf, file->size - 1, 0);
+		if (len <= 0) {
+			lpmd_log_error ("Read %s failed\n", file->path);
+			close (file->fd);
+			file->fd = -1;
+			return 1;
+		}
+		file->buf[len] = '\0';
+
+		if ((size_t) len < file->size - 1)
+			return 0;
+
+		buf = realloc (file->buf, file->size * 2);
+		if (!buf) {
+			lpmd_log_error ("Failed to grow %s buffer\n", file->path);
+			return 1;
+		}
+		file->buf = buf;
+		file->size *= 2;
+	}
+}
+
+/* Parse the "CPU0 CPU1 ..." header, offline CPUs have no column */
+static int irq_load_parse_header(char **p)
+{
+	char *end;
+	int cols = 0, cpu;
+
+	while (**p && **p != '\n' && cols < irq_load_nr) {
+		while (**p == ' ')
+			(*p)++;
+		if (strncmp (*p, "CPU", 3))
+			break;
+		cpu = strtol (*p + 3, &end, 10);
+		*p = end;
+		if (cpu < 0 || cpu >= irq_load_nr)
+			break;
+		irq_load_cols[cols++] = cpu;
+	}
+
+	*p = strchr (*p, '\n');
+	if (*p)
+		(*p)++;
+
+	return cols;
+}
+
+/* Add the per CPU counts after the "label:" at p to counts */
+static void irq_load_parse_counts(char *p, int cols, uint64_t *counts)
+{
+	char *end;
+	uint64_t val;
+	int col;
+
+	for (col = 0; col < cols; col++) {
+		while (*p == ' ')
+			p++;
+		if (!isdigit ((unsigned char) *p))
+			break;
+		val = strtoull (p, &end, 10);
+		p = end;
+		counts[irq_load_cols[col]] += val;
+	}
+}
+
+/*
+ * Sum up the counts of the numbered device interrupts of /proc/interrupts,
+ * or of the NET_RX and BLOCK lines of /proc/softirqs.
+ */
+static void irq_load_parse(enum irq_load_type type)
+{
+	struct irq_load_file *file = &irq_load_files[type];
+	char *p = file->buf, *label;
+	int cols;
+
+	memset (file->cur, 0, irq_load_nr * sizeof(*file->cur));
+
+	cols = irq_load_parse_header (&p);
+
+	while (p && *p) {
+		while (*p == ' ')
+			p++;
+		label = p;
+		p = strchr (p, ':');
+		if (!p)
+			break;
+
+		if (type == IRQ_LOAD_HARD ? isdigit ((unsigned char) *label) :
+				!strncmp (label, "NET_RX:", 7) || !strncmp (label, "BLOCK:", 6))
+			irq_load_parse_counts (p + 1, cols, file->cur);
+
+		p = strchr (p, '\n');
+		if (p)
+			p++;
+	}
+}
+
+static void irq_load_update(struct irq_load_file *file, uint64_t delta_ns)
+{
+	uint64_t delta;
+	uint64_t *tmp;
+	int cpu;
+
+	file->total_rate = 0;
+	for (cpu = 0; cpu < irq_load_nr; cpu++) {
+		file->rate[cpu] = -1;
+
+		/* Onlined or offlined in between */
+		if (!irq_load_valid || file->cur[cpu] < file->prev[cpu] || !file->cur[cpu])
+			continue;
+
+		delta = file->cur[cpu] - file->prev[cpu];
+		file->rate[cpu] = delta * 1000000000ULL / delta_ns;
+		file->total_rate += file->rate[cpu];
+	}
+
+	tmp = file->prev;
+	file->prev = file->cur;
+	file->cur = tmp;
+}
+
+/* Take a sample, called with each utilization sample */
+int irq_load_sample(void)
+{
+	uint64_t now, delta_ns;
+	int i;
+
+	if (!irq_load_enabled ()) {
+		irq_load_valid = 0;
+		return 1;
+	}
+
+	if (irq_load_alloc ())
+		return 1;
+
+	for (i = 0; i < IRQ_LOAD_MAX; i++) {
+		if (irq_load_read (&irq_load_files[i])) {
+			irq_load_valid = 0;
+			return 1;
+		}
+	}
+
+	now = lpm_stats_now ();
+	delta_ns = now - irq_load_prev_ns;
+	irq_load_prev_ns = now;
+	if (!delta_ns)
+		irq_load_valid = 0;
+
+	for (i = 0; i < IRQ_LOAD_MAX; i++) {
+		irq_load_parse (i);
+		irq_load_update (&irq_load_files[i], delta_ns);
+	}
+
+	irq_load_valid = 1;
+	return 0;
+}
+
+/* Returns 1 when an LPM CPU is above IrqRateLimit or SoftirqRateLimit */
+int irq_load_over(void)
+{
+	struct irq_load_file *file;
+	int cpu, i;
+
+	if (!irq_load_valid || !irq_load_enabled ())
+		return 0;
+
+	for (i = 0; i < IRQ_LOAD_MAX; i++) {
+		file = &irq_load_files[i];
+		if (!irq_load_limit (i))
+			continue;
+
+		for (cpu = 0; cpu < irq_load_nr; cpu++) {
+			if (!is_cpu_for_lpm (cpu) || file->rate[cpu] <= irq_load_limit (i))
+				continue;
+
+			lpmd_log_info ("\t\t\tCPU%d %s rate %d/s above %d/s\n", cpu,
+							i == IRQ_LOAD_HARD ? "IRQ" : "softirq", file->rate[cpu],
+							irq_load_limit (i));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 when all sampled interrupts, spread on the CPUs of idx, stay
+ * within IrqRateLimit and SoftirqRateLimit.
+ */
+int irq_load_fits(enum cpumask_idx idx)
+{
+	uint64_t nr = has_cpus (idx);
+	int i;
+
+	if (!irq_load_valid || !irq_load_enabled () || !nr)
+		return 1;
+
+	for (i = 0; i < IRQ_LOAD_MAX; i++) {
+		if (irq_load_limit (i) && irq_load_files[i].total_rate / nr > (uint64_t) irq_load_limit (i))
+			return 0;
+	}
+
+	return 1;
+}
@@ -142,11 +142,9 @@ static bool check_intel_lpmd_running(void)
 // SIGTERM & SIGINT handler
 static gboolean sig_int_handler(void)
 {
-//	 Call terminate function
+//	 Call terminate function, returns once the core thread is done
 	lpmd_terminate ();
 
-	sleep (1);
-
 	if (g_main_loop)
 		g_main_loop_quit (g_main_loop);
 
@@ -165,6 +163,9 @@ int main(int argc, char *argv[])
 	gboolean log_debug = FALSE;
 	gboolean no_daemon = FALSE;
 	gboolean systemd = FALSE;
+	gchar *config_file = NULL;
+	gchar *record_file = NULL;
+	gchar *replay_file = NULL;
 	gboolean success;
 	GOptionContext *opt_ctx;
 	int ret;
@@ -180,6 +181,9 @@ int main(int argc, char *argv[])
 			  { "loglevel=info", 0, 0, G_OPTION_ARG_NONE, &log_info, N_ ("Log severity: info level and up"), NULL },
 			  { "loglevel=debug", 0, 0, G_OPTION_ARG_NONE, &log_debug, N_ ("Log severity: debug level and up: Max logging"), NULL },
 			  { "dbus-enable", 0, 0, G_OPTION_ARG_NONE, &dbus_enable, N_ ( "Enable Dbus"), NULL },
+			  { "config-file", 0, 0, G_OPTION_ARG_FILENAME, &config_file, N_ ("Use FILE instead of the default configuration file"), "FILE" },
+			  { "record", 0, 0, G_OPTION_ARG_FILENAME, &record_file, N_ ("Record the inputs of the LPM decisions to the trace FILE"), "FILE" },
+			  { "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_file, N_ ("Replay the trace FILE in dry run mode, report the transitions and exit"), "FILE" },
 			  { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL } };
 
 	if (!g_module_supported ()) {
@@ -222,21 +226,45 @@ int main(int argc, char *argv[])
 		exit (EXIT_SUCCESS);
 	}
 
+	if (config_file)
+		lpmd_set_config_file (config_file);
+
+	/* Dry run in virtual time, needs neither root nor the daemon state */
+	if (replay_file) {
+		lpmd_log_level = G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING;
+		if (log_info)
+			lpmd_log_level |= G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO;
+		if (log_debug)
+			lpmd_log_level |= G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG;
+		use_syslog = FALSE;
+		g_log_set_handler (NULL, G_LOG_LEVEL_MASK, intel_lpmd_logger, NULL);
+
+		ret = lpmd_replay (replay_file);
+		exit (ret == LPMD_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (record_file)
+		lpmd_trace_set_file (record_file);
+
 	if (getuid () != 0) {
 		fprintf (stderr, "You must be root to run intel_lpmd!\n");
 		exit (EXIT_FAILURE);
 	}
 
 	if (g_mkdir_with_parents (TDRUNDIR, 0755) != 0) {
-		fprintf (stderr, "Cannot create '%s': %s", TDRUNDIR, strerror (errno));
+		fprintf (stderr, "Cannot create '%s': %s\n", TDRUNDIR, strerror (errno));
 		exit (EXIT_FAILURE);
 	}
 
 	if (g_mkdir_with_parents (TDCONFDIR, 0755) != 0) {
-		fprintf (stderr, "Cannot create '%s': %s", TDCONFDIR, strerror (errno));
+		fprintf (stderr, "Cannot create '%s': %s\n", TDCONFDIR, strerror (errno));
 		exit (EXIT_FAILURE);
 	}
 
+	/* Only holds caches, so intel_lpmd can run without it */
+	if (g_mkdir_with_parents (TDSTATEDIR, 0755) != 0)
+		fprintf (stderr, "Cannot create '%s': %s\n", TDSTATEDIR, strerror (errno));
+
 	if (log_info) {
 		lpmd_log_level |= G_LOG_LEVEL_INFO;
 	}
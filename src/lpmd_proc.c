@@ -21,6 +21,8 @@
  * processing function on receiving user or system command.
  */
 
+#include <sys/eventfd.h>
+
 #include "lpmd.h"
 
 static lpmd_config_t lpmd_config;
@@ -31,12 +33,19 @@ char *lpm_cmd_str[LPM_CMD_MAX] = {
 		[USER_AUTO] = "usr auto",
 		[HFI_ENTER] = "hfi enter",
 		[HFI_EXIT] = "hfi exit",
+		[HFI_SUV_ENTER] = "hfi suv enter",
+		[HFI_SUV_EXIT] = "hfi suv exit",
+		[DBUS_SUV_ENTER] = "dbus suv enter",
+		[DBUS_SUV_EXIT] = "dbus suv exit",
 		[UTIL_ENTER] = "utl enter",
 		[UTIL_EXIT] = "utl exit",
 };
 
 static int in_low_power_mode = 0;
 
+/* LPM tier used by UTIL_ENTER, see get_lpm_tier_cpumask () */
+static int lpm_tier = 0;
+
 static pthread_mutex_t lpmd_mutex;
 
 int lpmd_lock(void)
@@ -90,6 +99,21 @@ int has_hfi_suv_monitor(void)
 	return !!lpmd_config.hfi_suv_enable;
 }
 
+int get_hfi_debounce(void)
+{
+	return lpmd_config.hfi_debounce;
+}
+
+int get_hfi_lpm_cpus(void)
+{
+	return lpmd_config.hfi_lpm_cpus;
+}
+
+int get_hfi_min_perf(void)
+{
+	return lpmd_config.hfi_min_perf;
+}
+
 int has_util_monitor(void)
 {
 	return !!lpmd_config.util_enable;
@@ -125,6 +149,90 @@ int get_util_exit_hyst(void)
 	return lpmd_config.util_exit_hyst;
 }
 
+int get_util_policy(void)
+{
+	return lpmd_config.util_policy;
+}
+
+int get_util_source(void)
+{
+	return lpmd_config.util_source;
+}
+
+int get_irq_rate_limit(void)
+{
+	return lpmd_config.irq_rate_limit;
+}
+
+int get_softirq_rate_limit(void)
+{
+	return lpmd_config.softirq_rate_limit;
+}
+
+int get_lpm_cpu_policy(void)
+{
+	return lpmd_config.lpm_cpu_policy;
+}
+
+int get_lpm_cpu_modules(void)
+{
+	return lpmd_config.lpm_cpu_modules ? lpmd_config.lpm_cpu_modules : 1;
+}
+
+int get_clamp_target_util(void)
+{
+	return lpmd_config.clamp_target_util;
+}
+
+int get_clamp_target_power(void)
+{
+	return lpmd_config.clamp_target_power;
+}
+
+int get_clamp_max_step(void)
+{
+	return lpmd_config.clamp_max_step;
+}
+
+int get_clamp_interval(void)
+{
+	return lpmd_config.clamp_interval;
+}
+
+int get_config_lpm_tiers(void)
+{
+	return lpmd_config.nr_tiers ? lpmd_config.nr_tiers : 1;
+}
+
+char* get_lpm_tier_cpus(int tier)
+{
+	return lpmd_config.tiers[tier].cpus;
+}
+
+int get_config_exempt_units(void)
+{
+	return lpmd_config.nr_exempt_units;
+}
+
+char* get_config_exempt_unit(int i)
+{
+	return lpmd_config.exempt_units[i];
+}
+
+int get_lpm_tier_entry_threshold(int tier)
+{
+	if (!tier)
+		return lpmd_config.util_entry_threshold;
+	return lpmd_config.tiers[tier].entry_threshold;
+}
+
+int get_lpm_tier_exit_threshold(int tier)
+{
+	if (!tier)
+		return lpmd_config.util_exit_threshold;
+	return lpmd_config.tiers[tier].exit_threshold;
+}
+
 /* ITMT Management */
 #define PATH_ITMT_CONTROL "/proc/sys/kernel/sched_itmt_enabled"
 
@@ -245,50 +353,280 @@ static int lpm_can_process(enum lpm_command cmd)
 
 static int dry_run = 0;
 
+/* Timing of the ongoing transition, see lpmd_stats.c */
+static struct {
+	int enter;
+	enum lpm_command cmd;
+	uint64_t start;
+	uint64_t cpu_start;
+} lpm_timing;
+
+/* Transitions and LPM residency, in dry run mode too, see lpmd_replay () */
+enum lpm_count_type {
+	LPM_COUNT_ENTER, LPM_COUNT_EXIT, LPM_COUNT_SWITCH, LPM_COUNT_MAX,
+};
+
+static unsigned int lpm_counts[LPM_COUNT_MAX][LPM_CMD_MAX];
+static uint64_t lpm_residency_ns;
+static uint64_t lpm_entered_at;
+
+static void lpm_count(enum lpm_count_type type, enum lpm_command cmd)
+{
+	uint64_t now = lpm_stats_now ();
+
+	lpm_counts[type][cmd]++;
+	if (type == LPM_COUNT_ENTER)
+		lpm_entered_at = now;
+	else if (type == LPM_COUNT_EXIT)
+		lpm_residency_ns += now - lpm_entered_at;
+
+	lpm_stats_residency (type != LPM_COUNT_EXIT, cmd);
+}
+
+static void lpm_timing_begin(int enter, enum lpm_command cmd)
+{
+	lpm_timing.enter = enter;
+	lpm_timing.cmd = cmd;
+	lpm_timing.start = lpm_stats_now ();
+}
+
+static void lpm_timing_end(void)
+{
+	uint64_t now = lpm_stats_now ();
+
+	lpm_stats_record (lpm_timing.enter, lpm_timing.cmd, LPM_PHASE_CPU_CGROUPV2 + get_cpu_mode (),
+						now - lpm_timing.cpu_start);
+	lpm_stats_record (lpm_timing.enter, lpm_timing.cmd, LPM_PHASE_TOTAL, now - lpm_timing.start);
+}
+
+static void lpm_process_itmt(int enter)
+{
+	uint64_t start;
+
+	if (lpmd_config.ignore_itmt)
+		return;
+
+	start = lpm_stats_now ();
+	process_itmt (enter);
+	lpm_stats_record (enter, lpm_timing.cmd, LPM_PHASE_ITMT, lpm_stats_now () - start);
+}
+
+static void lpm_process_irqs(int enter)
+{
+	enum lpm_phase phase;
+	uint64_t start;
+
+	if (get_cpu_mode () == LPM_CPU_OFFLINE)
+		return;
+
+	phase = irq_use_irqbalance () ? LPM_PHASE_IRQ_IRQBALANCE : LPM_PHASE_IRQ_NATIVE;
+	start = lpm_stats_now ();
+	process_irqs (enter, get_cpu_mode ());
+	lpm_stats_record (enter, lpm_timing.cmd, phase, lpm_stats_now () - start);
+}
+
+/* The CPU phase is recorded by lpm_timing_end () as it may complete later */
+static void lpm_process_cpus(int enter)
+{
+	lpm_timing.cpu_start = lpm_stats_now ();
+	process_cpus (enter, get_cpu_mode ());
+}
+
+/*
+ * Utilization exits happen on overload, where only releasing the CPUs is
+ * latency critical. The IRQs and ITMT are then restored by a timer job,
+ * once the core thread handled the events pending at the exit. An LPM
+ * entry before that keeps them as they are. Protected by lpmd_lock.
+ */
+static int restore_timer = -1;
+static int restore_pending;
+static enum lpm_command restore_cmd;
+
+static int lpm_exit_deferred(enum lpm_command cmd)
+{
+	return cmd == UTIL_EXIT && restore_timer >= 0;
+}
+
+/* Must be invoked with lpmd_lock held */
+static void lpm_restore_flush(void)
+{
+	enum lpm_command cmd = lpm_timing.cmd;
+
+	if (!restore_pending)
+		return;
+
+	restore_pending = 0;
+	lpmd_timer_arm (restore_timer, -1);
+
+	lpmd_log_info ("Restore IRQs and ITMT ...\n");
+	/* Recorded for the exit request, an async CPU release may still use lpm_timing */
+	lpm_timing.cmd = restore_cmd;
+	lpm_process_irqs (0);
+	lpm_process_itmt (0);
+	lpm_timing.cmd = cmd;
+}
+
+static int restore_timer_fn(void)
+{
+	lpmd_lock ();
+	lpm_restore_flush ();
+	lpmd_unlock ();
+
+	return -1;
+}
+
+/* The LPM CPUs of an enter request, CPUMASK_MAX when unsupported */
+static enum cpumask_idx lpm_cpus_for(enum lpm_command cmd)
+{
+	switch (cmd) {
+		case USER_ENTER:
+		case UTIL_ENTER:
+			/* User requests always use the lowest tier */
+			if (cmd == USER_ENTER)
+				lpm_tier = 0;
+			/* Follow the most efficient CPUs when HFI ranking is enabled */
+			if (!lpm_tier && has_cpus (CPUMASK_HFI_RANKED))
+				return CPUMASK_HFI_RANKED;
+			return get_lpm_tier_cpumask (lpm_tier);
+		case HFI_ENTER:
+			lpm_tier = 0;
+			if (has_cpus (CPUMASK_HFI_RANKED))
+				return CPUMASK_HFI_RANKED;
+			return CPUMASK_HFI;
+		default:
+			return CPUMASK_MAX;
+	}
+}
+
+/*
+ * Move an ongoing LPM to other CPUs without leaving it: only the CPU
+ * restriction and the IRQs that are not within the new CPUs are updated,
+ * and ITMT stays disabled, so work never spreads to all CPUs in between.
+ * Must be invoked with lpmd_lock held.
+ */
+static int switch_lpm(enum lpm_command cmd, enum cpumask_idx idx)
+{
+	enum lpm_phase phase;
+	uint64_t start;
+
+	if (!has_cpus (idx)) {
+		lpmd_log_debug ("Request skipped because no %s LPM CPUs are available ---\n",
+						lpm_cmd_str[cmd]);
+		return 0;
+	}
+
+	set_lpm_cpus (idx);
+	if (!lpm_cpus_changed ()) {
+		lpmd_log_debug ("Request skipped because the system is already in Low Power Mode ---\n");
+		return 0;
+	}
+
+	time_start ();
+
+	lpmd_log_msg ("------ Switch Low Power Mode CPUs (%10s) --- %s", lpm_cmd_str[cmd],
+					get_time ());
+	lpm_count (LPM_COUNT_SWITCH, cmd);
+
+	if (dry_run) {
+		lpmd_log_debug ("----- Dry Run -----\n");
+		goto end;
+	}
+
+	lpm_timing_begin (1, cmd);
+
+	if (get_cpu_mode () != LPM_CPU_OFFLINE) {
+		phase = irq_use_irqbalance () ? LPM_PHASE_IRQ_IRQBALANCE : LPM_PHASE_IRQ_NATIVE;
+		start = lpm_stats_now ();
+		process_irqs_switch (get_cpu_mode ());
+		lpm_stats_record (1, cmd, phase, lpm_stats_now () - start);
+	}
+
+	lpm_timing.cpu_start = lpm_stats_now ();
+	process_cpus_switch (get_cpu_mode ());
+
+	if (process_cpus_pending ())
+		return 0;
+
+	lpm_timing_end ();
+
+end:
+	lpmd_log_info ("----- Done (%s) ---\n", time_delta ());
+
+	return 0;
+}
+
 /* Must be invoked with lpmd_lock held */
 int enter_lpm(enum lpm_command cmd)
 {
+	enum cpumask_idx idx;
+
 	lpmd_log_debug ("Request %d (%10s). lpm_state 0x%x\n", cmd, lpm_cmd_str[cmd], lpm_state);
 
+	/* Never overlap with a transition still waiting for systemd */
+	process_cpus_wait ();
+
 	if (!lpm_can_process (cmd)) {
 		lpmd_log_debug ("Request stopped. lpm_state 0x%x\n", lpm_state);
 		return 1;
 	}
 
+	idx = lpm_cpus_for (cmd);
+
 	if (in_low_power_mode) {
+		if (idx != CPUMASK_MAX)
+			return switch_lpm (cmd, idx);
 		lpmd_log_debug ("Request skipped because the system is already in Low Power Mode ---\n");
 		return 0;
 	}
 
+	if (idx == CPUMASK_MAX) {
+		lpmd_log_info ("Unsupported LPM reason %d\n", cmd);
+		return 1;
+	}
+
 	time_start ();
 
-	switch (cmd) {
-		case USER_ENTER:
-		case UTIL_ENTER:
-			set_lpm_cpus (CPUMASK_LPM_DEFAULT);
-			break;
-		case HFI_ENTER:
-			set_lpm_cpus (CPUMASK_HFI);
-			break;
-		default:
-			lpmd_log_info ("Unsupported LPM reason %d\n", cmd);
-			return 1;
-	}
+	set_lpm_cpus (idx);
 	if (!has_lpm_cpus ()) {
 		lpmd_log_error ("No LPM CPUs available\n");
 		return 1;
 	}
 
 	lpmd_log_msg ("------ Enter Low Power Mode (%10s) --- %s", lpm_cmd_str[cmd], get_time ());
+	lpm_count (LPM_COUNT_ENTER, cmd);
 
 	if (dry_run) {
 		lpmd_log_debug ("----- Dry Run -----\n");
 		goto end;
 	}
 
-	process_itmt (1);
-	process_irqs (1, get_cpu_mode ());
-	process_cpus (1, get_cpu_mode ());
+	lpm_timing_begin (1, cmd);
+	if (restore_pending) {
+		/* ITMT is still disabled, IRQs only need to follow the new LPM CPUs */
+		restore_pending = 0;
+		lpmd_timer_arm (restore_timer, -1);
+		if (get_cpu_mode () != LPM_CPU_OFFLINE) {
+			enum lpm_phase phase = irq_use_irqbalance () ?
+									LPM_PHASE_IRQ_IRQBALANCE : LPM_PHASE_IRQ_NATIVE;
+			uint64_t start = lpm_stats_now ();
+
+			process_irqs_switch (get_cpu_mode ());
+			lpm_stats_record (1, cmd, phase, lpm_stats_now () - start);
+		}
+	}
+	else {
+		lpm_process_itmt (1);
+		lpm_process_irqs (1);
+	}
+	lpm_process_cpus (1);
+
+	/* Completed by lpm_transition_done () */
+	if (process_cpus_pending ()) {
+		in_low_power_mode = 1;
+		return 0;
+	}
+
+	lpm_timing_end ();
 
 end:
 	lpmd_log_info ("----- Done (%s) ---\n", time_delta ());
@@ -302,8 +640,15 @@ int exit_lpm(enum lpm_command cmd)
 {
 	lpmd_log_debug ("Request %d (%10s). lpm_state 0x%x\n", cmd, lpm_cmd_str[cmd], lpm_state);
 
+	/* Never overlap with a transition still waiting for systemd */
+	process_cpus_wait ();
+
 	if (!lpm_can_process (cmd)) {
 		lpmd_log_debug ("Request stopped. lpm_state 0x%x\n", lpm_state);
+		/* Stay in LPM for the user, but leave the HFI CPUs */
+		if (cmd == HFI_EXIT && in_low_power_mode && (lpm_state & LPM_USER_ON)
+				&& !(lpm_state & LPM_SUV_ON))
+			switch_lpm (USER_ENTER, lpm_cpus_for (USER_ENTER));
 		return 1;
 	}
 
@@ -316,15 +661,31 @@ int exit_lpm(enum lpm_command cmd)
 	time_start ();
 
 	lpmd_log_msg ("------ Exit Low Power Mode (%10s) --- %s", lpm_cmd_str[cmd], get_time ());
+	lpm_count (LPM_COUNT_EXIT, cmd);
 
 	if (dry_run) {
 		lpmd_log_debug ("----- Dry Run -----\n");
 		goto end;
 	}
 
-	process_cpus (0, get_cpu_mode ());
-	process_irqs (0, get_cpu_mode ());
-	process_itmt (0);
+	lpm_timing_begin (0, cmd);
+	lpm_process_cpus (0);
+	if (lpm_exit_deferred (cmd)) {
+		restore_pending = 1;
+		restore_cmd = cmd;
+		lpmd_timer_arm (restore_timer, 0);
+	}
+	else {
+		lpm_process_irqs (0);
+		lpm_process_itmt (0);
+	}
+
+	if (process_cpus_pending ()) {
+		in_low_power_mode = 0;
+		return 0;
+	}
+
+	lpm_timing_end ();
 
 end:
 	lpmd_log_info ("----- Done (%s) ---\n", time_delta ());
@@ -333,6 +694,27 @@ end:
 	return 0;
 }
 
+static void cmd_transition_done(int ret);
+
+/*
+ * Called when an asynchronous process_cpus () completes, either because all
+ * replies arrived or because one failed. Must be invoked with lpmd_lock held.
+ */
+void lpm_transition_done(int ret)
+{
+	lpm_timing_end ();
+	lpmd_log_info ("----- Done (%s) ---\n", time_delta ());
+	cmd_transition_done (ret);
+
+	if (!ret || !in_low_power_mode)
+		return;
+
+	lpmd_log_error ("Failed to enter Low Power Mode, roll back\n");
+	process_irqs (0, get_cpu_mode ());
+	process_itmt (0);
+	in_low_power_mode = 0;
+}
+
 static int lpmd_freezed = 0;
 
 /* should be invoked without lock held */
@@ -342,7 +724,7 @@ int process_lpm_unlock(enum lpm_command cmd)
 
 	if (lpmd_freezed) {
 		lpmd_log_error("lpmd freezed, command (%s) ignored\n", lpm_cmd_str[cmd]);
-		return 0;
+		return -EBUSY;
 	}
 
 	switch (cmd) {
@@ -379,6 +761,93 @@ int process_lpm(enum lpm_command cmd)
 	return ret;
 }
 
+int get_lpm_tier(void)
+{
+	int ret;
+
+	lpmd_lock ();
+	ret = lpm_tier;
+	lpmd_unlock ();
+	return ret;
+}
+
+/*
+ * Switch the utilization driven LPM to another tier, or enter LPM in that
+ * tier. Returns 1 when LPM is held by a user or HFI request, which keeps
+ * its own CPUs.
+ */
+int process_lpm_tier(int tier)
+{
+	int ret;
+
+	if (tier < 0 || tier >= get_lpm_tiers ())
+		return -1;
+
+	lpmd_lock ();
+
+	if (!in_low_power_mode) {
+		lpm_tier = tier;
+		ret = process_lpm_unlock (UTIL_ENTER);
+		goto end;
+	}
+
+	ret = 0;
+	if (tier == lpm_tier)
+		goto end;
+
+	ret = 1;
+	if (lpmd_freezed || (lpm_state & (LPM_USER_ON | LPM_HFI_ON | LPM_SUV_ON)))
+		goto end;
+
+	lpmd_log_info ("Switch LPM tier %d -> %d\n", lpm_tier, tier);
+	process_cpus_wait ();
+	lpm_tier = tier;
+	ret = switch_lpm (UTIL_ENTER, lpm_cpus_for (UTIL_ENTER));
+
+end:
+	lpmd_unlock ();
+	return ret;
+}
+
+/*
+ * Replace CPUMASK_HFI_RANKED with the nr CPUs in cpus, and move an ongoing
+ * LPM that follows the ranking to them. Returns 1 when a frozen or SUV
+ * held LPM keeps the previous CPUs.
+ */
+int process_lpm_hfi_ranked(int *cpus, int nr)
+{
+	enum lpm_command cmd;
+	int i;
+
+	lpmd_lock ();
+
+	if (in_low_power_mode && (lpmd_freezed || (lpm_state & LPM_SUV_ON))) {
+		lpmd_unlock ();
+		return 1;
+	}
+
+	/* The CPUs of a transition still waiting for systemd must not change */
+	process_cpus_wait ();
+
+	reset_cpus (CPUMASK_HFI_RANKED);
+	for (i = 0; i < nr; i++)
+		add_cpu (cpus[i], CPUMASK_HFI_RANKED);
+
+	if (in_low_power_mode) {
+		if (lpm_state & LPM_HFI_ON)
+			cmd = HFI_ENTER;
+		else if (lpm_state & LPM_USER_ON)
+			cmd = USER_ENTER;
+		else
+			cmd = UTIL_ENTER;
+		/* Skipped when the CPUs did not change */
+		switch_lpm (cmd, lpm_cpus_for (cmd));
+	}
+
+	lpmd_unlock ();
+	return 0;
+}
+
 static int saved_lpm_state = -1;
 
 int freeze_lpm(void)
@@ -435,82 +904,481 @@ end:
 
 static int
 proc_message(message_capsul_t *msg);
-static int write_pipe_fd;
 
-static void lpmd_send_message(message_name_t msg_id, int size, unsigned char *msg)
-{
-	message_capsul_t msg_cap;
-	int result;
+/*
+ * Commands from the other threads are queued for lpmd_core_main_loop in a
+ * bounded lock-free MPSC ring (one sequence number per slot), and
+ * cmd_event_fd wakes it up.
+ *
+ * A newer command supersedes a pending one of the same class, e.g. a burst
+ * of FORCE_ON/AUTO requests only applies the last one. cmd_pending[] holds
+ * the latest command of each class, and the ring only holds the class, at
+ * most once. The ring is larger than the number of classes, so it cannot
+ * fill up and no command is lost.
+ *
+ * Every command gets a ticket of its class. The core thread completes all
+ * tickets it took the command for at once, and lpmd_send_message () waits
+ * for that with a timeout. lpmd_send_request_async () does not wait, its
+ * callback runs in the GLib main loop instead. A transition waiting for
+ * systemd completes in lpm_transition_done () instead.
+ */
+enum cmd_class {
+	CMD_CLASS_TERMINATE,
+	CMD_CLASS_LPM,
+	CMD_CLASS_SUV,
+	CMD_CLASS_HFI,
+	CMD_CLASS_CONFIG,
+	CMD_CLASS_MAX,
+};
 
-	memset (&msg_cap, 0, sizeof(message_capsul_t));
+#define CMD_RING_SIZE	16
 
-	msg_cap.msg_id = msg_id;
-	msg_cap.msg_size = (size > MAX_MSG_SIZE) ? MAX_MSG_SIZE : size;
-	if (msg)
-		memcpy (msg_cap.msg, msg, msg_cap.msg_size);
+struct cmd_slot {
+	unsigned int seq;
+	enum cmd_class class;
+};
 
-	result = write (write_pipe_fd, &msg_cap, sizeof(message_capsul_t));
-	if (result < 0)
-		lpmd_log_warn ("Write to pipe failed \n");
-}
+/* Longer than a transition through systemd, which times out by itself */
+#define CMD_TIMEOUT_MS	(SYSTEMD_REPLY_TIMEOUT_USEC / 1000 + 1000)
 
-void lpmd_terminate(void)
-{
-	lpmd_send_message (TERMINATE, 0, NULL);
-	sleep (1);
-}
+static struct cmd_slot cmd_ring[CMD_RING_SIZE];
+static unsigned int cmd_head, cmd_tail;
+static int cmd_event_fd = -1;
 
-void lpmd_force_on(void)
-{
-	lpmd_send_message (LPM_FORCE_ON, 0, NULL);
-}
+/* Protected by cmd_mutex */
+static int cmd_pending[CMD_CLASS_MAX];
+static unsigned long cmd_issued[CMD_CLASS_MAX];
+static unsigned long cmd_done[CMD_CLASS_MAX];
+static int cmd_result[CMD_CLASS_MAX];
+static pthread_mutex_t cmd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cmd_cond;
 
-void lpmd_force_off(void)
+/*
+ * An lpmd_send_request_async () caller, on cmd_waiters until its ticket
+ * completes or it times out. timer is only used by the GLib main loop.
+ */
+struct cmd_waiter {
+	struct cmd_waiter *next;
+	message_name_t msg_id;
+	enum cmd_class class;
+	unsigned long ticket;
+	int result;
+	guint timer;
+	lpmd_request_cb cb;
+	void *data;
+};
+
+/* Protected by cmd_mutex */
+static struct cmd_waiter *cmd_waiters;
+
+/* Set by the core thread, read with __atomic by all */
+static bool main_loop_terminate;
+
+/* Core thread only, the command completed by lpm_transition_done () */
+static int cmd_deferred_class = -1;
+static unsigned long cmd_deferred_ticket;
+
+static enum cmd_class cmd_class(message_name_t msg_id)
 {
-	lpmd_send_message (LPM_FORCE_OFF, 0, NULL);
+	switch (msg_id) {
+		case LPM_FORCE_ON:
+		case LPM_FORCE_OFF:
+		case LPM_AUTO:
+			return CMD_CLASS_LPM;
+		case SUV_MODE_ENTER:
+		case SUV_MODE_EXIT:
+			return CMD_CLASS_SUV;
+		case HFI_EVENT:
+			return CMD_CLASS_HFI;
+		case CONFIG_UPDATE:
+			return CMD_CLASS_CONFIG;
+		case TERMINATE:
+		default:
+			return CMD_CLASS_TERMINATE;
+	}
 }
 
-void lpmd_set_auto(void)
+static int cmd_queue_init(void)
 {
-	lpmd_send_message (LPM_AUTO, 0, NULL);
+	pthread_condattr_t attr;
+	int i;
+
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&cmd_cond, &attr);
+	pthread_condattr_destroy (&attr);
+
+	for (i = 0; i < CMD_RING_SIZE; i++)
+		cmd_ring[i].seq = i;
+	for (i = 0; i < CMD_CLASS_MAX; i++)
+		cmd_pending[i] = -1;
+
+	cmd_event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cmd_event_fd < 0)
+		lpmd_log_error ("eventfd creation failed: %s\n", strerror (errno));
+
+	return cmd_event_fd;
 }
 
-void lpmd_suv_enter(void)
+/* Any thread */
+static int cmd_ring_push(enum cmd_class class)
 {
-	lpmd_send_message (SUV_MODE_ENTER, 0, NULL);
+	struct cmd_slot *slot;
+	unsigned int pos, seq;
+
+	pos = __atomic_load_n (&cmd_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &cmd_ring[pos % CMD_RING_SIZE];
+		seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+		if ((int) (seq - pos) < 0)
+			return -1;
+		if (seq == pos && __atomic_compare_exchange_n (&cmd_head, &pos, pos + 1, 1,
+													__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		if (seq != pos)
+			pos = __atomic_load_n (&cmd_head, __ATOMIC_RELAXED);
+	}
+
+	slot->class = class;
+	__atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
 }
 
-void lpmd_suv_exit(void)
+/* lpmd_core_main_loop only */
+static int cmd_ring_pop(enum cmd_class *class)
 {
-	lpmd_send_message (SUV_MODE_EXIT, 0, NULL);
+	struct cmd_slot *slot = &cmd_ring[cmd_tail % CMD_RING_SIZE];
+
+	if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != cmd_tail + 1)
+		return -1;
+
+	*class = slot->class;
+	__atomic_store_n (&slot->seq, cmd_tail + CMD_RING_SIZE, __ATOMIC_RELEASE);
+	cmd_tail++;
+
+	return 0;
 }
 
-void lpmd_notify_hfi_event(void)
+/* GLib main loop, report the result of a completed async request */
+static gboolean cmd_waiter_done(gpointer data)
+{
+	struct cmd_waiter *w = data;
+
+	if (w->timer)
+		g_source_remove (w->timer);
+	if (w->result == LPMD_ERROR)
+		lpmd_log_warn ("Message %d failed or timed out\n", w->msg_id);
+	w->cb (w->result, w->data);
+	free (w);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Must be invoked with cmd_mutex held */
+static void cmd_waiters_complete(enum cmd_class class)
+{
+	struct cmd_waiter **pw = &cmd_waiters;
+	struct cmd_waiter *w;
+
+	while ((w = *pw) != NULL) {
+		if (w->class != class || w->ticket > cmd_done[class]) {
+			pw = &w->next;
+			continue;
+		}
+		*pw = w->next;
+		w->result = cmd_result[class];
+		g_idle_add (cmd_waiter_done, w);
+	}
+}
+
+/* Called by the core thread once the commands up to ticket are handled */
+static void cmd_complete(enum cmd_class class, unsigned long ticket, int result)
+{
+	pthread_mutex_lock (&cmd_mutex);
+	cmd_done[class] = ticket;
+	cmd_result[class] = result;
+	pthread_cond_broadcast (&cmd_cond);
+	cmd_waiters_complete (class);
+	pthread_mutex_unlock (&cmd_mutex);
+}
+
+/* Must be invoked with lpmd_lock held */
+static void cmd_transition_done(int ret)
+{
+	if (cmd_deferred_class < 0)
+		return;
+
+	cmd_complete (cmd_deferred_class, cmd_deferred_ticket, ret ? LPMD_ERROR : LPMD_SUCCESS);
+	cmd_deferred_class = -1;
+}
+
+/*
+ * Queue a command for the core thread. Returns the ticket that completes it,
+ * or 0 when it could not be queued.
+ */
+static unsigned long lpmd_queue_message(message_name_t msg_id)
+{
+	enum cmd_class class = cmd_class (msg_id);
+	unsigned long ticket;
+	uint64_t val = 1;
+	int queued;
+
+	/* Nobody would handle it */
+	if (cmd_event_fd < 0 || __atomic_load_n (&main_loop_terminate, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock (&cmd_mutex);
+	ticket = ++cmd_issued[class];
+	/* Still queued, it will pick up this one instead */
+	queued = cmd_pending[class] >= 0;
+	cmd_pending[class] = msg_id;
+	pthread_mutex_unlock (&cmd_mutex);
+
+	if (queued) {
+		lpmd_log_debug ("Message %d supersedes a pending one\n", msg_id);
+	}
+	else if (cmd_ring_push (class) < 0) {
+		lpmd_log_error ("Command queue full, message %d dropped\n", msg_id);
+		pthread_mutex_lock (&cmd_mutex);
+		cmd_pending[class] = -1;
+		pthread_mutex_unlock (&cmd_mutex);
+		return 0;
+	}
+	else if (write (cmd_event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+		lpmd_log_warn ("Write to eventfd failed: %s\n", strerror (errno));
+	}
+
+	return ticket;
+}
+
+/*
+ * Queue a command and wait until the core thread has handled it. Returns
+ * its result, -EBUSY when LPM is frozen, or LPMD_ERROR on timeout or when
+ * the core thread never started.
+ */
+static int lpmd_send_message(message_name_t msg_id)
+{
+	enum cmd_class class = cmd_class (msg_id);
+	unsigned long ticket;
+	struct timespec deadline;
+	int ret;
+
+	ticket = lpmd_queue_message (msg_id);
+	if (!ticket)
+		return LPMD_ERROR;
+
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += CMD_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (CMD_TIMEOUT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	ret = 0;
+	pthread_mutex_lock (&cmd_mutex);
+	while (cmd_done[class] < ticket && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait (&cmd_cond, &cmd_mutex, &deadline);
+	if (cmd_done[class] >= ticket)
+		ret = cmd_result[class];
+	else
+		ret = LPMD_ERROR;
+	pthread_mutex_unlock (&cmd_mutex);
+
+	if (ret == LPMD_ERROR)
+		lpmd_log_warn ("Message %d failed or timed out\n", msg_id);
+
+	return ret;
+}
+
+/* GLib main loop, the core thread did not complete the request in time */
+static gboolean cmd_waiter_timeout(gpointer data)
+{
+	struct cmd_waiter *w = data, **pw;
+
+	w->timer = 0;
+
+	pthread_mutex_lock (&cmd_mutex);
+	for (pw = &cmd_waiters; *pw && *pw != w; pw = &(*pw)->next)
+		;
+	/* Completed, cmd_waiter_done () is already queued */
+	if (!*pw) {
+		pthread_mutex_unlock (&cmd_mutex);
+		return G_SOURCE_REMOVE;
+	}
+	*pw = w->next;
+	pthread_mutex_unlock (&cmd_mutex);
+
+	w->result = LPMD_ERROR;
+	return cmd_waiter_done (w);
+}
+
+/*
+ * Queue a user request and return at once, for the GLib main loop. cb gets
+ * the result lpmd_send_message () would return, from the GLib main loop.
+ */
+void lpmd_send_request_async(message_name_t msg_id, lpmd_request_cb cb, void *data)
+{
+	struct cmd_waiter *w;
+
+	w = calloc (1, sizeof(*w));
+	if (!w) {
+		cb (LPMD_ERROR, data);
+		return;
+	}
+
+	lpmd_trace_msg (msg_id);
+	w->msg_id = msg_id;
+	w->class = cmd_class (msg_id);
+	w->ticket = lpmd_queue_message (msg_id);
+	if (!w->ticket) {
+		free (w);
+		lpmd_log_warn ("Message %d failed or timed out\n", msg_id);
+		cb (LPMD_ERROR, data);
+		return;
+	}
+	w->cb = cb;
+	w->data = data;
+	w->timer = g_timeout_add (CMD_TIMEOUT_MS, cmd_waiter_timeout, w);
+
+	pthread_mutex_lock (&cmd_mutex);
+	w->next = cmd_waiters;
+	cmd_waiters = w;
+	/* The core thread may have been faster */
+	if (cmd_done[w->class] >= w->ticket)
+		cmd_waiters_complete (w->class);
+	pthread_mutex_unlock (&cmd_mutex);
+}
+
+/* Queue a command without waiting for it, for callbacks of the main loop */
+static void lpmd_post_message(message_name_t msg_id)
+{
+	if (!lpmd_queue_message (msg_id))
+		lpmd_log_warn ("Message %d dropped\n", msg_id);
+}
+
+void lpmd_terminate(void)
+{
+	static int terminating;
+
+	/* Both the D-Bus method and the signal path may ask */
+	if (__atomic_exchange_n (&terminating, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	lpmd_send_message (TERMINATE);
+}
+
+/* User requests, also recorded for lpmd_replay () */
+static int lpmd_send_request(message_name_t msg_id)
 {
-	lpmd_send_message (HFI_EVENT, 0, NULL);
-	sleep (1);
+	lpmd_trace_msg (msg_id);
+	return lpmd_send_message (msg_id);
 }
 
-#define LPMD_NUM_OF_POLL_FDS	4
+int lpmd_force_on(void)
+{
+	return lpmd_send_request (LPM_FORCE_ON);
+}
+
+int lpmd_force_off(void)
+{
+	return lpmd_send_request (LPM_FORCE_OFF);
+}
+
+int lpmd_set_auto(void)
+{
+	return lpmd_send_request (LPM_AUTO);
+}
+
+int lpmd_suv_enter(void)
+{
+	return lpmd_send_request (SUV_MODE_ENTER);
+}
+
+int lpmd_suv_exit(void)
+{
+	return lpmd_send_request (SUV_MODE_EXIT);
+}
+
+void lpmd_notify_hfi_event(void)
+{
+	lpmd_send_message (HFI_EVENT);
+}
 
 static pthread_t lpmd_core_main;
 static pthread_attr_t lpmd_attr;
 
-static struct pollfd poll_fds[LPMD_NUM_OF_POLL_FDS];
+/*
+ * fds polled by lpmd_core_main_loop. poll_handlers[i] processes the events
+ * on poll_fds[i]; a handler returning < 0 removes its fd from the poll set.
+ * prepare, if set, is called before every poll () to update fd and events,
+ * and returns a poll () timeout in ms (-1 for none). When that timeout
+ * expires, process is called with revents 0.
+ */
+struct poll_handler {
+	int (*process)(short revents);
+	int (*prepare)(struct pollfd *pfd);
+};
+
+static struct pollfd *poll_fds;
+static struct poll_handler *poll_handlers;
 static int poll_fd_cnt;
+static int poll_fd_size;
 
-static int idx_pipe_fd = -1;
-static int idx_uevent_fd = -1;
-static int idx_hfi_fd = -1;
+static int lpmd_register_fd(int fd, short events, int (*process)(short revents),
+							int (*prepare)(struct pollfd *pfd))
+{
+	if (poll_fd_cnt == poll_fd_size) {
+		int size = poll_fd_size ? poll_fd_size * 2 : 8;
+		struct pollfd *fds;
+		struct poll_handler *handlers;
+
+		fds = realloc (poll_fds, size * sizeof(*fds));
+		if (!fds)
+			return -1;
+		poll_fds = fds;
+
+		handlers = realloc (poll_handlers, size * sizeof(*handlers));
+		if (!handlers)
+			return -1;
+		poll_handlers = handlers;
+
+		poll_fd_size = size;
+	}
+
+	poll_fds[poll_fd_cnt].fd = fd;
+	poll_fds[poll_fd_cnt].events = events;
+	poll_fds[poll_fd_cnt].revents = 0;
+	poll_handlers[poll_fd_cnt].process = process;
+	poll_handlers[poll_fd_cnt].prepare = prepare;
+
+	return poll_fd_cnt++;
+}
 
 #include <gio/gio.h>
 
 static GDBusProxy *power_profiles_daemon;
 
+/* The configured request for a power profile, -1 when unsupported */
+static int power_profile_msg(const char *active_profile)
+{
+	if (strcmp (active_profile, "power-saver") == 0)
+		return lpmd_config.powersaver_def;
+	else if (strcmp (active_profile, "performance") == 0)
+		return lpmd_config.performance_def;
+	else if (strcmp (active_profile, "balanced") == 0)
+		return lpmd_config.balanced_def;
+
+	lpmd_log_warn("Ignore unsupported power profile: %s\n", active_profile);
+	return -1;
+}
+
 static void power_profiles_changed_cb(void)
 {
 	g_autoptr (GVariant)
 	active_profile_v = NULL;
+	int msg_id;
 
 	active_profile_v = g_dbus_proxy_get_cached_property (power_profiles_daemon, "ActiveProfile");
 
@@ -519,14 +1387,13 @@ static void power_profiles_changed_cb(void)
 
 		lpmd_log_debug ("power_profiles_changed_cb: %s\n", active_profile);
 
-		if (strcmp (active_profile, "power-saver") == 0)
-			lpmd_send_message (lpmd_config.powersaver_def, 0, NULL);
-		else if (strcmp (active_profile, "performance") == 0)
-			lpmd_send_message (lpmd_config.performance_def, 0, NULL);
-		else if (strcmp (active_profile, "balanced") == 0)
-			lpmd_send_message (lpmd_config.balanced_def, 0, NULL);
-		else
-			lpmd_log_warn("Ignore unsupported power profile: %s\n", active_profile);
+		/* The profile rather than the request, a replay maps it with its config */
+		lpmd_trace_profile (active_profile);
+
+		/* Runs in the GLib main loop, which also serves the D-Bus requests */
+		msg_id = power_profile_msg (active_profile);
+		if (msg_id >= 0)
+			lpmd_post_message (msg_id);
 	}
 }
 
@@ -560,7 +1427,7 @@ static void connect_to_power_profile_daemon(void)
 /* Poll time out default */
 #define POLL_TIMEOUT_DEFAULT_SECONDS	1
 
-static bool main_loop_terminate;
+static int config_update_staged(void);
 
 // called from LPMD main thread to process user and system messages
 static int proc_message(message_capsul_t *msg)
@@ -571,34 +1438,41 @@ static int proc_message(message_capsul_t *msg)
 	switch (msg->msg_id) {
 		case TERMINATE:
 			lpmd_log_msg ("Terminating ...\n");
-			ret = -1;
-			main_loop_terminate = true;
+			__atomic_store_n (&main_loop_terminate, true, __ATOMIC_RELEASE);
 			hfi_kill ();
 			process_lpm (USER_EXIT);
+			lpmd_lock ();
+			process_cpus_wait ();
+			lpm_restore_flush ();
+			lpmd_unlock ();
+			lpmd_trace_close ();
 			break;
 		case LPM_FORCE_ON:
 			// Always stay in LPM mode
-			process_lpm (USER_ENTER);
+			ret = process_lpm (USER_ENTER);
 			break;
 		case LPM_FORCE_OFF:
 			// Never enter LPM mode
-			process_lpm (USER_EXIT);
+			ret = process_lpm (USER_EXIT);
 			break;
 		case LPM_AUTO:
 			// Enable oppotunistic LPM
-			process_lpm (USER_AUTO);
+			ret = process_lpm (USER_AUTO);
 			break;
 		case SUV_MODE_ENTER:
 			// Call function to enter SUV mode
-			process_suv_mode (DBUS_SUV_ENTER);
+			ret = process_suv_mode (DBUS_SUV_ENTER);
 			break;
 		case SUV_MODE_EXIT:
 			// Call function to exit SUV mode
-			process_suv_mode (DBUS_SUV_EXIT);
+			ret = process_suv_mode (DBUS_SUV_EXIT);
 			break;
 		case HFI_EVENT:
 			// Call the HFI callback from here
 			break;
+		case CONFIG_UPDATE:
+			ret = config_update_staged ();
+			break;
 		default:
 			break;
 	}
@@ -606,58 +1480,440 @@ static int proc_message(message_capsul_t *msg)
 	return ret;
 }
 
-// LPMD processing thread. This is callback to pthread lpmd_core_main
-static void* lpmd_core_main_loop(void *arg)
+static int process_cmd_fd(short revents)
 {
-	int interval, n;
-	static int first_try = 1;
+	message_capsul_t msg;
+	enum cmd_class class;
+	unsigned long ticket;
+	uint64_t val;
+	int msg_id, pending, ret;
 
-	for (;;) {
+	if (!(revents & POLLIN))
+		return 0;
+
+	/* Resets the counter, every queued command is handled below */
+	if (read (cmd_event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		lpmd_log_warn ("read on eventfd failed: %s\n", strerror (errno));
+
+	while (!cmd_ring_pop (&class)) {
+		pthread_mutex_lock (&cmd_mutex);
+		msg_id = cmd_pending[class];
+		ticket = cmd_issued[class];
+		cmd_pending[class] = -1;
+		pthread_mutex_unlock (&cmd_mutex);
+
+		if (msg_id < 0)
+			continue;
+
+		msg.msg_id = msg_id;
+		ret = proc_message (&msg);
+
+		lpmd_lock ();
+		pending = process_cpus_pending ();
+		if (pending) {
+			cmd_deferred_class = class;
+			cmd_deferred_ticket = ticket;
+		}
+		lpmd_unlock ();
+
+		if (!pending)
+			cmd_complete (class, ticket,
+							ret == -EBUSY ? -EBUSY : ret < 0 ? LPMD_ERROR : LPMD_SUCCESS);
 
-		if (main_loop_terminate)
+		if (__atomic_load_n (&main_loop_terminate, __ATOMIC_ACQUIRE)) {
+			lpmd_log_debug ("Terminating thread..\n");
 			break;
+		}
+	}
+
+	return 0;
+}
+
+static int process_uevent_fd(short revents)
+{
+	if (revents & POLLIN)
+		check_cpu_hotplug ();
+	return 0;
+}
+
+static int process_hfi_fd(short revents)
+{
+	if (revents & POLLIN)
+		hfi_receive ();
+	return 0;
+}
+
+static int process_irqbalance_fd(short revents)
+{
+	if (revents & POLLIN)
+		check_irqbalance_restart ();
+	return 0;
+}
+
+static int process_timer_fd(short revents)
+{
+	if (revents & POLLIN)
+		lpmd_timer_process ();
+	return 0;
+}
+
+static int process_systemd_fd(short revents)
+{
+	lpmd_lock ();
+	systemd_bus_process ();
+	lpmd_unlock ();
+	return 0;
+}
+
+/* The bus fd may change on reconnection, and it may need POLLOUT */
+static int prepare_systemd_fd(struct pollfd *pfd)
+{
+	int timeout = -1;
+
+	pfd->fd = systemd_bus_get_poll (&pfd->events, &timeout);
+	return timeout;
+}
+
+static int hfi_fd = -1;
+static int watch_fd = -1;
+
+static int process_config_fd(short revents);
 
-		if (first_try) {
-			interval = 100;
-			first_try = 0;
-		} else {
-//			 Opportunistic LPM is disabled in below cases
-			if (lpm_state & (LPM_USER_ON | LPM_USER_OFF | LPM_SUV_ON))
-				interval = -1;
-			else
-				interval = periodic_util_update ();
+/*
+ * Runtime tunables. D-Bus property writes are staged here and applied by
+ * the core thread in one CONFIG_UPDATE, together with everything written
+ * before it was handled. A WatchConfig reload goes through the same path.
+ */
+enum tunable_type {
+	TUNABLE_INT,
+	TUNABLE_STR,
+};
+
+struct lpmd_tunable {
+	const char *name;
+	enum tunable_type type;
+	size_t offset;
+	int min;
+	int max;
+};
+
+static const struct lpmd_tunable lpmd_tunables[] = {
+	{ "UtilEntryThreshold", TUNABLE_INT, offsetof (lpmd_config_t, util_entry_threshold), 0, 100 },
+	{ "UtilExitThreshold", TUNABLE_INT, offsetof (lpmd_config_t, util_exit_threshold), 0, 100 },
+	{ "EntryDelayMS", TUNABLE_INT, offsetof (lpmd_config_t, util_entry_delay), 0, UTIL_DELAY_MAX },
+	{ "ExitDelayMS", TUNABLE_INT, offsetof (lpmd_config_t, util_exit_delay), 0, UTIL_DELAY_MAX },
+	{ "EntryHystMS", TUNABLE_INT, offsetof (lpmd_config_t, util_entry_hyst), 0, UTIL_HYST_MAX },
+	{ "ExitHystMS", TUNABLE_INT, offsetof (lpmd_config_t, util_exit_hyst), 0, UTIL_HYST_MAX },
+	{ "HfiLpmEnable", TUNABLE_INT, offsetof (lpmd_config_t, hfi_lpm_enable), 0, 1 },
+	{ "HfiSuvEnable", TUNABLE_INT, offsetof (lpmd_config_t, hfi_suv_enable), 0, 1 },
+	{ "HfiDebounceMS", TUNABLE_INT, offsetof (lpmd_config_t, hfi_debounce), 0, HFI_DEBOUNCE_MAX },
+	{ "ClampTargetUtil", TUNABLE_INT, offsetof (lpmd_config_t, clamp_target_util), 0, 100 },
+	{ "ClampTargetPowerMW", TUNABLE_INT, offsetof (lpmd_config_t, clamp_target_power), 0, CLAMP_POWER_MAX },
+	{ "ClampMaxStep", TUNABLE_INT, offsetof (lpmd_config_t, clamp_max_step), 0, CLAMP_STEP_MAX },
+	{ "IrqRateLimit", TUNABLE_INT, offsetof (lpmd_config_t, irq_rate_limit), 0, IRQ_RATE_MAX },
+	{ "SoftirqRateLimit", TUNABLE_INT, offsetof (lpmd_config_t, softirq_rate_limit), 0, IRQ_RATE_MAX },
+	{ "LpModeCpus", TUNABLE_STR, offsetof (lpmd_config_t, lp_mode_cpus), 0, 0 },
+};
+
+#define NR_TUNABLES	(sizeof(lpmd_tunables) / sizeof(lpmd_tunables[0]))
+
+/* Protected by config_mutex, like the writes to lpmd_config */
+static struct {
+	unsigned int mask;
+	int vals[NR_TUNABLES];
+	char str[MAX_STR_LENGTH];
+} tunables_staged;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int find_tunable(const char *name, enum tunable_type type)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_TUNABLES; i++) {
+		if (!strcmp (lpmd_tunables[i].name, name))
+			return lpmd_tunables[i].type == type ? (int) i : -1;
+	}
+
+	return -1;
+}
+
+int lpmd_get_tunable_int(const char *name, int *val)
+{
+	int i = find_tunable (name, TUNABLE_INT);
+
+	if (i < 0)
+		return LPMD_ERROR;
+
+	pthread_mutex_lock (&config_mutex);
+	*val = *(int*) ((char*) &lpmd_config + lpmd_tunables[i].offset);
+	pthread_mutex_unlock (&config_mutex);
+
+	return LPMD_SUCCESS;
+}
+
+int lpmd_get_tunable_str(const char *name, char *buf, int size)
+{
+	int i = find_tunable (name, TUNABLE_STR);
+
+	if (i < 0)
+		return LPMD_ERROR;
+
+	pthread_mutex_lock (&config_mutex);
+	snprintf (buf, size, "%s", (char*) &lpmd_config + lpmd_tunables[i].offset);
+	pthread_mutex_unlock (&config_mutex);
+
+	return LPMD_SUCCESS;
+}
+
+/* Returns once the core thread has applied the change */
+int lpmd_set_tunable_int(const char *name, int val)
+{
+	int i = find_tunable (name, TUNABLE_INT);
+
+	if (i < 0)
+		return LPMD_ERROR;
+
+	if (val < lpmd_tunables[i].min || val > lpmd_tunables[i].max) {
+		lpmd_log_error ("Invalid %s %d, valid range %d..%d\n", name, val, lpmd_tunables[i].min,
+						lpmd_tunables[i].max);
+		return LPMD_ERROR;
+	}
+
+	pthread_mutex_lock (&config_mutex);
+	tunables_staged.vals[i] = val;
+	tunables_staged.mask |= 1U << i;
+	pthread_mutex_unlock (&config_mutex);
+
+	return lpmd_send_message (CONFIG_UPDATE);
+}
+
+/* "-1" or "" selects the automatic choice, e.g. for LpModeCpus */
+int lpmd_set_tunable_str(const char *name, const char *str)
+{
+	int i = find_tunable (name, TUNABLE_STR);
+
+	if (i < 0)
+		return LPMD_ERROR;
+
+	if (strlen (str) >= MAX_STR_LENGTH) {
+		lpmd_log_error ("%s longer than %d characters, use ranges like 8-15\n", name,
+						MAX_STR_LENGTH - 1);
+		return LPMD_ERROR;
+	}
+
+	if (!strcmp (str, "-1"))
+		str = "";
+
+	pthread_mutex_lock (&config_mutex);
+	snprintf (tunables_staged.str, sizeof(tunables_staged.str), "%s", str);
+	tunables_staged.mask |= 1U << i;
+	pthread_mutex_unlock (&config_mutex);
+
+	return lpmd_send_message (CONFIG_UPDATE);
+}
+
+static int lpm_tiers_changed(lpmd_config_t *a, lpmd_config_t *b)
+{
+	int i;
+
+	if (a->nr_tiers != b->nr_tiers)
+		return 1;
+
+	for (i = 1; i < a->nr_tiers; i++) {
+		if (strcmp (a->tiers[i].cpus, b->tiers[i].cpus))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Switch to a new configuration in the core thread, with the minimal LPM
+ * transition: an ongoing LPM is moved to new LPM CPUs, and only left when
+ * the feature that entered it got disabled. Mode and IgnoreITMT need a
+ * restart.
+ */
+static int apply_config(lpmd_config_t *new)
+{
+	lpmd_config_t old = lpmd_config;
+	int cpus_changed;
+	int ret = LPMD_SUCCESS;
+
+	if (new->mode != old.mode) {
+		lpmd_log_warn ("Mode change needs a restart, keep Mode %d\n", old.mode);
+		new->mode = old.mode;
+	}
+	if (new->ignore_itmt != old.ignore_itmt) {
+		lpmd_log_warn ("IgnoreITMT change needs a restart, keep IgnoreITMT %d\n", old.ignore_itmt);
+		new->ignore_itmt = old.ignore_itmt;
+	}
+	if (!has_suv_support ())
+		new->hfi_suv_enable = 0;
+	lpmd_config_update (new);
+
+	cpus_changed = strcmp (new->lp_mode_cpus, old.lp_mode_cpus) || lpm_tiers_changed (new, &old)
+			|| new->lpm_cpu_policy != old.lpm_cpu_policy
+			|| new->lpm_cpu_modules != old.lpm_cpu_modules;
+
+	lpmd_lock ();
+
+	pthread_mutex_lock (&config_mutex);
+	lpmd_config = *new;
+	pthread_mutex_unlock (&config_mutex);
+
+	if (cpus_changed && update_lpm_cpus (lpmd_config.lp_mode_cpus)) {
+		/* Keep reporting the CPUs still in use */
+		pthread_mutex_lock (&config_mutex);
+		memcpy (lpmd_config.lp_mode_cpus, old.lp_mode_cpus, sizeof(old.lp_mode_cpus));
+		lpmd_config.lpm_cpu_policy = old.lpm_cpu_policy;
+		lpmd_config.lpm_cpu_modules = old.lpm_cpu_modules;
+		lpmd_config.nr_tiers = old.nr_tiers;
+		memcpy (lpmd_config.tiers, old.tiers, sizeof(old.tiers));
+		lpmd_config_update (&lpmd_config);
+		pthread_mutex_unlock (&config_mutex);
+		ret = LPMD_ERROR;
+	}
+	else if (cpus_changed) {
+		if (lpm_tier >= get_lpm_tiers ())
+			lpm_tier = get_lpm_tiers () - 1;
+		/* HFI and SUV use their own CPUs */
+		if (in_low_power_mode && !(lpm_state & (LPM_HFI_ON | LPM_SUV_ON))) {
+			enum lpm_command cmd = (lpm_state & LPM_USER_ON) ? USER_ENTER : UTIL_ENTER;
+
+			process_cpus_wait ();
+			switch_lpm (cmd, lpm_cpus_for (cmd));
 		}
+	}
 
-		n = poll (poll_fds, poll_fd_cnt, interval);
-		if (n < 0) {
-			lpmd_log_warn ("Write to pipe failed \n");
+	lpmd_unlock ();
+
+	if (old.hfi_lpm_enable && !lpmd_config.hfi_lpm_enable && (lpm_state & LPM_HFI_ON))
+		process_lpm (HFI_EXIT);
+	if (old.hfi_suv_enable && !lpmd_config.hfi_suv_enable)
+		process_suv_mode (HFI_SUV_EXIT);
+	if ((lpmd_config.hfi_lpm_enable || lpmd_config.hfi_suv_enable) && hfi_fd < 0) {
+		hfi_fd = hfi_init ();
+		if (hfi_fd > 0)
+			lpmd_register_fd (hfi_fd, POLLIN, process_hfi_fd, NULL);
+	}
+
+	if (old.util_enable && !lpmd_config.util_enable && in_low_power_mode
+			&& !(lpm_state & (LPM_USER_ON | LPM_HFI_ON | LPM_SUV_ON)))
+		process_lpm (UTIL_EXIT);
+	util_config_changed ();
+	clamp_config_changed ();
+
+	if (lpmd_config.watch_config && watch_fd < 0) {
+		watch_fd = lpmd_config_watch_init ();
+		if (watch_fd > 0)
+			lpmd_register_fd (watch_fd, POLLIN, process_config_fd, NULL);
+	}
+
+	lpmd_log_msg ("Configuration updated\n");
+
+	return ret;
+}
+
+static int config_update_staged(void)
+{
+	lpmd_config_t new;
+	unsigned int i;
+
+	pthread_mutex_lock (&config_mutex);
+	new = lpmd_config;
+	for (i = 0; i < NR_TUNABLES; i++) {
+		if (!(tunables_staged.mask & (1U << i)))
 			continue;
-		}
+		if (lpmd_tunables[i].type == TUNABLE_STR)
+			snprintf ((char*) &new + lpmd_tunables[i].offset, MAX_STR_LENGTH, "%s",
+						tunables_staged.str);
+		else
+			*(int*) ((char*) &new + lpmd_tunables[i].offset) = tunables_staged.vals[i];
+	}
+	tunables_staged.mask = 0;
+	pthread_mutex_unlock (&config_mutex);
+
+	return apply_config (&new);
+}
+
+static int process_config_fd(short revents)
+{
+	lpmd_config_t new;
+
+	if (!(revents & POLLIN) || !lpmd_config_watch_process () || !lpmd_config.watch_config)
+		return 0;
+
+	memset (&new, 0, sizeof(new));
+	if (lpmd_get_config (&new) != LPMD_SUCCESS) {
+		lpmd_log_error ("Invalid configuration, keep the current one\n");
+		return 0;
+	}
+
+	apply_config (&new);
+	return 0;
+}
+
+/* Util sampling job */
+#define UTIL_TIMER_SLACK_MS	50
+
+static int util_timer = -1;
+
+static int util_timer_fn(void)
+{
+//	 Opportunistic LPM is disabled in below cases
+	if (lpm_state & (LPM_USER_ON | LPM_USER_OFF | LPM_SUV_ON))
+		return -1;
+
+	return periodic_util_update ();
+}
+
+/* Resume util sampling once opportunistic LPM is allowed again */
+static void util_timer_resume(void)
+{
+	if (util_timer >= 0 && !lpmd_timer_armed (util_timer) && has_util_monitor ()
+			&& !(lpm_state & (LPM_USER_ON | LPM_USER_OFF | LPM_SUV_ON)))
+		lpmd_timer_arm (util_timer, 0);
+}
+
+// LPMD processing thread. This is callback to pthread lpmd_core_main
+static void* lpmd_core_main_loop(void *arg)
+{
+	int timeout, n, i, ret;
 
-		if (idx_pipe_fd >= 0 && (poll_fds[idx_pipe_fd].revents & POLLIN)) {
-//			 process message written on pipe here
+	for (;;) {
 
-			message_capsul_t msg;
+		if (__atomic_load_n (&main_loop_terminate, __ATOMIC_ACQUIRE))
+			break;
 
-			int result = read (poll_fds[idx_pipe_fd].fd, &msg, sizeof(message_capsul_t));
-			if (result < 0) {
-				lpmd_log_warn ("read on wakeup fd failed\n");
-				poll_fds[idx_pipe_fd].revents = 0;
+		/* Periodic work is driven by the timerfd, see lpmd_timer.c */
+		timeout = -1;
+		for (i = 0; i < poll_fd_cnt; i++) {
+			if (!poll_handlers[i].prepare)
 				continue;
-			}
-			if (proc_message (&msg) < 0) {
-				lpmd_log_debug ("Terminating thread..\n");
-			}
+			ret = poll_handlers[i].prepare (&poll_fds[i]);
+			if (ret >= 0 && (timeout < 0 || ret < timeout))
+				timeout = ret;
 		}
 
-		if (idx_uevent_fd >= 0 && (poll_fds[idx_uevent_fd].revents & POLLIN)) {
-			check_cpu_hotplug ();
+		n = poll (poll_fds, poll_fd_cnt, timeout);
+		if (n < 0) {
+			if (errno != EINTR)
+				lpmd_log_warn ("poll failed: %s\n", strerror (errno));
+			continue;
 		}
 
-		if (idx_hfi_fd >= 0 && (poll_fds[idx_hfi_fd].revents & POLLIN)) {
-			hfi_receive ();
+		for (i = 0; i < poll_fd_cnt; i++) {
+			if (poll_fds[i].fd < 0)
+				continue;
+			if (!poll_fds[i].revents && !(n == 0 && poll_handlers[i].prepare))
+				continue;
+
+			ret = poll_handlers[i].process (poll_fds[i].revents);
+			if (ret < 0)
+				poll_fds[i].fd = -1;
 		}
 
+		util_timer_resume ();
 	}
 
 	return NULL;
@@ -665,7 +1921,7 @@ static void* lpmd_core_main_loop(void *arg)
 
 int lpmd_main(void)
 {
-	int wake_fds[2];
+	int trace_flags = 0;
 	int ret;
 
 	lpmd_log_debug ("lpmd_main begin\n");
@@ -688,54 +1944,80 @@ int lpmd_main(void)
 	if (ret)
 		return ret;
 
-//	 Pipe is used for communication between two processes
-	ret = pipe (wake_fds);
-	if (ret) {
-		lpmd_log_error ("pipe creation failed %d:\n", ret);
+	if (!lpmd_config.ignore_itmt)
+		lpmd_cache_knob (PATH_ITMT_CONTROL);
+
+//	 Commands from the other threads
+	ret = cmd_queue_init ();
+	if (ret < 0)
 		return LPMD_FATAL_ERROR;
-	}
-	if (fcntl (wake_fds[0], F_SETFL, O_NONBLOCK) < 0) {
-		lpmd_log_error ("Cannot set non-blocking on pipe: %s\n", strerror (errno));
+	if (lpmd_register_fd (ret, POLLIN, process_cmd_fd, NULL) < 0)
 		return LPMD_FATAL_ERROR;
-	}
-	if (fcntl (wake_fds[1], F_SETFL, O_NONBLOCK) < 0) {
-		lpmd_log_error ("Cannot set non-blocking on pipe: %s\n", strerror (errno));
+
+	/* Before the other sources, they may add timer jobs */
+	ret = lpmd_timer_init ();
+	if (ret < 0)
 		return LPMD_FATAL_ERROR;
-	}
-	write_pipe_fd = wake_fds[1];
+	lpmd_register_fd (ret, POLLIN, process_timer_fd, NULL);
 
-	memset (poll_fds, 0, sizeof(poll_fds));
+	rapl_timer_init ();
+	lpm_stats_residency_init ();
 
-	idx_pipe_fd = poll_fd_cnt;
-	poll_fds[idx_pipe_fd].fd = wake_fds[0];
-	poll_fds[idx_pipe_fd].events = POLLIN;
-	poll_fds[idx_pipe_fd].revents = 0;
-	poll_fd_cnt++;
+	restore_timer = lpmd_timer_add ("restore", restore_timer_fn, 0);
 
-	poll_fds[poll_fd_cnt].fd = uevent_init ();
-	if (poll_fds[poll_fd_cnt].fd > 0) {
-		idx_uevent_fd = poll_fd_cnt;
-		poll_fds[idx_uevent_fd].events = POLLIN;
-		poll_fds[idx_uevent_fd].revents = 0;
-		poll_fd_cnt++;
-	}
+	ret = uevent_init ();
+	if (ret > 0)
+		lpmd_register_fd (ret, POLLIN, process_uevent_fd, NULL);
 
 	if (lpmd_config.hfi_lpm_enable || lpmd_config.hfi_suv_enable) {
-		poll_fds[poll_fd_cnt].fd = hfi_init ();
-		if (poll_fds[poll_fd_cnt].fd > 0) {
-			idx_hfi_fd = poll_fd_cnt;
-			poll_fds[idx_hfi_fd].events = POLLIN;
-			poll_fds[idx_hfi_fd].revents = 0;
-			poll_fd_cnt++;
-		}
+		hfi_fd = hfi_init ();
+		if (hfi_fd > 0)
+			lpmd_register_fd (hfi_fd, POLLIN, process_hfi_fd, NULL);
 	}
 
+	if (lpmd_config.watch_config) {
+		watch_fd = lpmd_config_watch_init ();
+		if (watch_fd > 0)
+			lpmd_register_fd (watch_fd, POLLIN, process_config_fd, NULL);
+	}
+
+	if (lpmd_config.mode != LPM_CPU_OFFLINE) {
+		ret = irqbalance_monitor_init ();
+		if (ret > 0)
+			lpmd_register_fd (ret, POLLIN, process_irqbalance_fd, NULL);
+	}
+
+	ret = psi_init ();
+	if (ret > 0) {
+		lpmd_register_fd (ret, POLLPRI, psi_process, NULL);
+		trace_flags |= LPMD_TRACE_F_PSI;
+	}
+
+	/*
+	 * The system bus may be reconnected later, so keep the slot even when
+	 * the first connection fails. poll () ignores negative fds.
+	 */
+	if (lpmd_config.mode == LPM_CPU_CGROUPV2)
+		lpmd_register_fd (systemd_bus_init (), POLLIN, process_systemd_fd, prepare_systemd_fd);
+
+	if (get_cpu_mode () == LPM_CPU_POWERCLAMP)
+		clamp_init ();
+
+	util_timer = lpmd_timer_add ("util", util_timer_fn, UTIL_TIMER_SLACK_MS);
+	/* First sample shortly after start */
+	if (has_util_monitor ())
+		lpmd_timer_arm (util_timer, 100);
+
+	/* Before the power profile, which is recorded too */
+	if (lpmd_trace_init (trace_flags))
+		return LPMD_FATAL_ERROR;
+
 	pthread_attr_init (&lpmd_attr);
 	pthread_attr_setdetachstate (&lpmd_attr, PTHREAD_CREATE_DETACHED);
 
 	/*
 	 * lpmd_core_main_loop: is the thread where all LPMD actions take place.
-	 * All other thread send message via pipe to trigger processing
+	 * All other thread send message via the command queue to trigger processing
 	 */
 	ret = pthread_create (&lpmd_core_main, &lpmd_attr, lpmd_core_main_loop, NULL);
 	if (ret)
@@ -747,3 +2029,158 @@ int lpmd_main(void)
 
 	return LPMD_SUCCESS;
 }
+
+static const char *replay_rec_str[] = {
+	[LPMD_TRACE_STAT] = "samples",
+	[LPMD_TRACE_HFI] = "hfi",
+	[LPMD_TRACE_HOTPLUG] = "hotplug",
+	[LPMD_TRACE_PROFILE] = "profile",
+	[LPMD_TRACE_MSG] = "requests",
+	[LPMD_TRACE_PSI] = "psi",
+};
+
+#define REPLAY_REC_MAX	(sizeof(replay_rec_str) / sizeof(replay_rec_str[0]))
+
+static void replay_report(const char *path, unsigned int *nr_recs)
+{
+	unsigned int total[LPM_COUNT_MAX] = { 0 };
+	uint64_t duration = lpmd_trace_now ();
+	int cmd, type;
+	char *str;
+
+	printf ("trace %s: %llu.%03llu s", path, (unsigned long long) (duration / 1000000000),
+			(unsigned long long) (duration / 1000000 % 1000));
+	for (type = 0; type < REPLAY_REC_MAX; type++)
+		printf (", %u %s", nr_recs[type], replay_rec_str[type]);
+	printf ("\n");
+
+	printf ("%-14s %8s %8s %8s\n", "reason", "enter", "exit", "switch");
+	for (cmd = 0; cmd < LPM_CMD_MAX; cmd++) {
+		if (!lpm_counts[LPM_COUNT_ENTER][cmd] && !lpm_counts[LPM_COUNT_EXIT][cmd]
+				&& !lpm_counts[LPM_COUNT_SWITCH][cmd])
+			continue;
+		printf ("%-14s %8u %8u %8u\n", lpm_cmd_str[cmd], lpm_counts[LPM_COUNT_ENTER][cmd],
+				lpm_counts[LPM_COUNT_EXIT][cmd], lpm_counts[LPM_COUNT_SWITCH][cmd]);
+		for (type = 0; type < LPM_COUNT_MAX; type++)
+			total[type] += lpm_counts[type][cmd];
+	}
+	printf ("%-14s %8u %8u %8u\n", "total", total[LPM_COUNT_ENTER], total[LPM_COUNT_EXIT],
+			total[LPM_COUNT_SWITCH]);
+
+	printf ("residency %.2f %% (%llu s in LPM)\n",
+			duration ? lpm_residency_ns * 100.0 / duration : 0.0,
+			(unsigned long long) (lpm_residency_ns / 1000000000));
+
+	str = lpm_stats_residency_str ();
+	if (str)
+		printf ("%s", str);
+	free (str);
+}
+
+/*
+ * Feed a trace recorded with --record through the LPM policies of the
+ * current configuration, in dry run mode and in virtual time, so it runs
+ * much faster than real time. Reports how many transitions the
+ * configuration would have caused, and the LPM residency.
+ */
+int lpmd_replay(const char *path)
+{
+	unsigned int nr_recs[REPLAY_REC_MAX] = { 0 };
+	struct lpmd_trace_rec rec;
+	message_capsul_t msg;
+	char *topology;
+	uint64_t next;
+	int hfi_enabled;
+	int flags, msg_id;
+	int ret;
+
+	ret = lpmd_get_config (&lpmd_config);
+	if (ret)
+		return ret;
+
+	pthread_mutex_init (&lpmd_mutex, NULL);
+	dry_run = 1;
+
+	ret = lpmd_trace_replay_open (path, &flags, &topology);
+	if (ret)
+		return ret;
+
+	ret = init_cpu_replay (lpmd_config.lp_mode_cpus, topology);
+	if (ret) {
+		lpmd_log_error ("Invalid CPU topology in trace %s\n", path);
+		goto end;
+	}
+
+	if (!has_suv_support () && lpmd_config.hfi_suv_enable)
+		lpmd_config.hfi_suv_enable = 0;
+
+	hfi_enabled = lpmd_config.hfi_lpm_enable || lpmd_config.hfi_suv_enable;
+	if (hfi_enabled && hfi_replay_init ())
+		hfi_enabled = 0;
+
+	psi_replay_init (flags & LPMD_TRACE_F_PSI);
+
+	lpm_stats_residency_init ();
+
+	util_timer = lpmd_timer_add ("util", util_timer_fn, UTIL_TIMER_SLACK_MS);
+	if (has_util_monitor ())
+		lpmd_timer_arm (util_timer, 100);
+
+	while ((ret = lpmd_trace_read (&rec)) > 0) {
+		/* The timer jobs that would have run before this record */
+		while ((next = lpmd_timer_next ()) < rec.time) {
+			lpmd_trace_set_now (next);
+			lpmd_timer_process ();
+			util_timer_resume ();
+		}
+		lpmd_trace_set_now (rec.time);
+
+		if (rec.type < REPLAY_REC_MAX)
+			nr_recs[rec.type]++;
+
+		msg_id = -1;
+		switch (rec.type) {
+			case LPMD_TRACE_STAT:
+				lpmd_trace_stat_update ();
+				break;
+			case LPMD_TRACE_HFI:
+				if (hfi_enabled)
+					hfi_replay (rec.caps, rec.nr_caps);
+				break;
+			case LPMD_TRACE_HOTPLUG:
+				replay_cpu_hotplug (rec.cpu, rec.online);
+				break;
+			case LPMD_TRACE_PROFILE:
+				msg_id = power_profile_msg (rec.profile);
+				break;
+			case LPMD_TRACE_MSG:
+				if (rec.msg_id >= LPM_FORCE_ON && rec.msg_id <= SUV_MODE_EXIT)
+					msg_id = rec.msg_id;
+				break;
+			case LPMD_TRACE_PSI:
+				psi_process (POLLPRI);
+				break;
+		}
+
+		if (msg_id >= 0) {
+			memset (&msg, 0, sizeof(msg));
+			msg.msg_id = msg_id;
+			proc_message (&msg);
+		}
+
+		util_timer_resume ();
+	}
+
+	if (ret < 0)
+		lpmd_log_error ("Truncated trace %s, replayed up to %llu ms\n", path,
+						(unsigned long long) (lpmd_trace_now () / 1000000));
+
+	if (in_low_power_mode)
+		lpm_residency_ns += lpmd_trace_now () - lpm_entered_at;
+
+	replay_report (path, nr_recs);
+
+end:
+	lpmd_trace_replay_close ();
+	return ret ? LPMD_ERROR : LPMD_SUCCESS;
+}
@@ -0,0 +1,245 @@
+/*
+ * lpmd_rapl.c: RAPL energy counters
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * This file reads the package and core energy counters of the
+ * intel-rapl powercap zones. The counters of all packages are summed up,
+ * and each wraparound at max_energy_range_uj is folded into a 64 bit
+ * total, so callers only ever see monotonic values.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lpmd.h"
+
+#define PATH_POWERCAP		"/sys/class/powercap"
+#define MAX_RAPL_ZONES		16
+/* Far below the time the counters need to wrap around */
+#define RAPL_POLL_MS		30000
+
+struct rapl_zone {
+	enum rapl_domain domain;
+	int fd;
+	uint64_t max_uj;
+	uint64_t last_uj;
+};
+
+static struct rapl_zone rapl_zones[MAX_RAPL_ZONES];
+static int nr_rapl_zones;
+static uint64_t rapl_total_uj[RAPL_DOMAIN_MAX];
+static int rapl_nr_domain_zones[RAPL_DOMAIN_MAX];
+/* 0: not probed, 1: available, -1: no package zone */
+static int rapl_state;
+static pthread_mutex_t rapl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int rapl_read_fd(int fd, uint64_t *val)
+{
+	char buf[32];
+	ssize_t len;
+
+	len = pread (fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 1;
+	buf[len] = '\0';
+
+	*val = strtoull (buf, NULL, 10);
+	return 0;
+}
+
+static int rapl_read_file(const char *path, char *buf, int size)
+{
+	FILE *filep;
+	int ret = 1;
+
+	filep = fopen (path, "r");
+	if (!filep)
+		return 1;
+
+	if (fgets (buf, size, filep)) {
+		buf[strcspn (buf, "\n")] = '\0';
+		ret = 0;
+	}
+	fclose (filep);
+
+	return ret;
+}
+
+static void rapl_add_zone(const char *name)
+{
+	struct rapl_zone *zone;
+	char path[MAX_STR_LENGTH * 2];
+	char type[MAX_STR_LENGTH];
+	enum rapl_domain domain;
+	int fd;
+
+	if (nr_rapl_zones >= MAX_RAPL_ZONES)
+		return;
+
+	snprintf (path, sizeof(path), "%s/%s/name", PATH_POWERCAP, name);
+	if (rapl_read_file (path, type, sizeof(type)))
+		return;
+
+	if (!strncmp (type, "package-", strlen ("package-")))
+		domain = RAPL_PKG;
+	else if (!strcmp (type, "core"))
+		domain = RAPL_CORE;
+	else
+		return;
+
+	zone = &rapl_zones[nr_rapl_zones];
+
+	snprintf (path, sizeof(path), "%s/%s/max_energy_range_uj", PATH_POWERCAP, name);
+	if (rapl_read_file (path, type, sizeof(type)))
+		return;
+	zone->max_uj = strtoull (type, NULL, 10);
+
+	snprintf (path, sizeof(path), "%s/%s/energy_uj", PATH_POWERCAP, name);
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (rapl_read_fd (fd, &zone->last_uj)) {
+		close (fd);
+		return;
+	}
+
+	zone->fd = fd;
+	zone->domain = domain;
+	nr_rapl_zones++;
+	rapl_nr_domain_zones[domain]++;
+
+	lpmd_log_info ("\tRAPL %s energy counter at %s\n", domain == RAPL_PKG ? "package" : "core",
+					path);
+}
+
+static int rapl_init(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int i;
+
+	if (rapl_state)
+		return rapl_state < 0;
+
+	rapl_state = -1;
+
+	dir = opendir (PATH_POWERCAP);
+	if (!dir)
+		return 1;
+
+	/* intel-rapl:N are packages, intel-rapl:N:M their subzones */
+	while ((entry = readdir (dir)) != NULL) {
+		if (!strncmp (entry->d_name, "intel-rapl:", strlen ("intel-rapl:")))
+			rapl_add_zone (entry->d_name);
+	}
+	closedir (dir);
+
+	for (i = 0; i < nr_rapl_zones; i++) {
+		if (rapl_zones[i].domain == RAPL_PKG)
+			rapl_state = 1;
+	}
+
+	if (rapl_state < 0)
+		lpmd_log_info ("\tNo RAPL package energy counter\n");
+
+	return rapl_state < 0;
+}
+
+/* Fold the counters read since the last call into rapl_total_uj */
+static void rapl_update(void)
+{
+	struct rapl_zone *zone;
+	uint64_t cur;
+	int i;
+
+	for (i = 0; i < nr_rapl_zones; i++) {
+		zone = &rapl_zones[i];
+
+		if (rapl_read_fd (zone->fd, &cur))
+			continue;
+
+		if (cur >= zone->last_uj)
+			rapl_total_uj[zone->domain] += cur - zone->last_uj;
+		else
+			rapl_total_uj[zone->domain] += zone->max_uj - zone->last_uj + cur;
+		zone->last_uj = cur;
+	}
+}
+
+/*
+ * Energy used by a domain since lpmd started, in uJ. The counters wrap
+ * within minutes at high power, so this needs to be called more often
+ * than that to not miss a wraparound.
+ */
+int rapl_energy_uj(enum rapl_domain domain, uint64_t *uj)
+{
+	int ret = LPMD_ERROR;
+
+	if (domain < 0 || domain >= RAPL_DOMAIN_MAX)
+		return LPMD_ERROR;
+
+	pthread_mutex_lock (&rapl_mutex);
+
+	if (rapl_init () || !rapl_nr_domain_zones[domain])
+		goto out;
+
+	rapl_update ();
+	*uj = rapl_total_uj[domain];
+	ret = LPMD_SUCCESS;
+
+out:	pthread_mutex_unlock (&rapl_mutex);
+	return ret;
+}
+
+int rapl_has_domain(enum rapl_domain domain)
+{
+	uint64_t uj;
+
+	return !rapl_energy_uj (domain, &uj);
+}
+
+static int rapl_timer_fn(void)
+{
+	uint64_t uj;
+
+	rapl_energy_uj (RAPL_PKG, &uj);
+	return RAPL_POLL_MS;
+}
+
+/* Keep up with wraparounds while nothing else reads the counters */
+int rapl_timer_init(void)
+{
+	int timer;
+
+	if (!rapl_has_domain (RAPL_PKG))
+		return 1;
+
+	timer = lpmd_timer_add ("rapl", rapl_timer_fn, RAPL_POLL_MS / 10);
+	if (timer < 0)
+		return 1;
+
+	lpmd_timer_arm (timer, RAPL_POLL_MS);
+	return 0;
+}
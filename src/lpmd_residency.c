@@ -0,0 +1,413 @@
+/*
+ * lpmd_residency.c: C0 residency based utilization sources
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * This file provides the UtilSource alternatives to /proc/stat for the
+ * utilization monitor, with a us resolution instead of jiffies:
+ * - cpuidle: the per CPU cpuidle state residencies from sysfs. The time not
+ *   spent in any idle state is busy, the time not spent in a real C-state
+ *   (i.e. other than POLL) is C0. The busy time is scaled by
+ *   scaling_cur_freq / cpuinfo_max_freq.
+ * - aperfmperf: the APERF, MPERF and TSC MSRs through /dev/cpu/N/msr. MPERF
+ *   counts at the TSC rate in C0 only, so MPERF / TSC is the C0 residency,
+ *   and APERF / TSC scaled by base / max frequency is the busy time at the
+ *   highest frequency.
+ * Both report a frequency invariant busy percentage: a CPU running flat out
+ * at its lowest frequency has headroom left and looks far less busy than
+ * one at turbo.
+ * All values are in 1/100 %, like the /proc/stat based ones. All files are
+ * kept open and re-read with pread().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "lpmd.h"
+
+#define PATH_CPU_SYSFS		"/sys/devices/system/cpu"
+#define MAX_CPUIDLE_STATES	10
+
+#define MSR_TSC			0x10
+#define MSR_PLATFORM_INFO	0xce
+#define MSR_MPERF		0xe7
+#define MSR_APERF		0xe8
+
+struct residency_cpu {
+	int opened;
+	/* cpuidle */
+	int nr_states;
+	int state_fds[MAX_CPUIDLE_STATES];
+	int state_poll[MAX_CPUIDLE_STATES];
+	int cur_freq_fd;
+	/* aperfmperf */
+	int msr_fd;
+	/* kHz, 0 when unknown */
+	int base_freq;
+	int max_freq;
+	/* Previous sample, valid is 0 when there is none */
+	int valid;
+	uint64_t idle_us;
+	uint64_t poll_us;
+	uint64_t aperf;
+	uint64_t mperf;
+	uint64_t tsc;
+};
+
+static struct residency_cpu *res_cpus;
+static int res_nr;
+static enum util_source_type res_type;
+static uint64_t res_prev_ns;
+
+static int res_read_fd(int fd, uint64_t *val)
+{
+	char buf[32];
+	ssize_t len;
+
+	if (fd < 0)
+		return 1;
+
+	len = pread (fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 1;
+	buf[len] = '\0';
+
+	*val = strtoull (buf, NULL, 10);
+	return 0;
+}
+
+static int res_read_file(const char *path, char *buf, int size)
+{
+	FILE *filep;
+	int ret = 1;
+
+	filep = fopen (path, "r");
+	if (!filep)
+		return 1;
+
+	if (fgets (buf, size, filep)) {
+		buf[strcspn (buf, "\n")] = '\0';
+		ret = 0;
+	}
+	fclose (filep);
+
+	return ret;
+}
+
+static int res_read_freq(int cpu, const char *name)
+{
+	char path[MAX_STR_LENGTH];
+	char buf[32];
+
+	snprintf (path, sizeof(path), "%s/cpu%d/cpufreq/%s", PATH_CPU_SYSFS, cpu, name);
+	if (res_read_file (path, buf, sizeof(buf)))
+		return 0;
+
+	return strtol (buf, NULL, 10);
+}
+
+static int res_read_msr(int fd, uint32_t msr, uint64_t *val)
+{
+	if (pread (fd, val, sizeof(*val), msr) != sizeof(*val))
+		return 1;
+	return 0;
+}
+
+static void res_close_cpu(struct residency_cpu *rc)
+{
+	int i;
+
+	for (i = 0; i < rc->nr_states; i++)
+		close (rc->state_fds[i]);
+	if (rc->cur_freq_fd >= 0)
+		close (rc->cur_freq_fd);
+	if (rc->msr_fd >= 0)
+		close (rc->msr_fd);
+
+	memset (rc, 0, sizeof(*rc));
+	rc->cur_freq_fd = -1;
+	rc->msr_fd = -1;
+}
+
+static int res_open_cpuidle(int cpu, struct residency_cpu *rc)
+{
+	char path[MAX_STR_LENGTH];
+	char name[MAX_STR_LENGTH];
+	int i, fd;
+
+	for (i = 0; i < MAX_CPUIDLE_STATES; i++) {
+		snprintf (path, sizeof(path), "%s/cpu%d/cpuidle/state%d/name", PATH_CPU_SYSFS, cpu, i);
+		if (res_read_file (path, name, sizeof(name)))
+			break;
+
+		snprintf (path, sizeof(path), "%s/cpu%d/cpuidle/state%d/time", PATH_CPU_SYSFS, cpu, i);
+		fd = open (path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			break;
+
+		rc->state_fds[rc->nr_states] = fd;
+		rc->state_poll[rc->nr_states] = !strcmp (name, "POLL");
+		rc->nr_states++;
+	}
+
+	if (!rc->nr_states)
+		return 1;
+
+	snprintf (path, sizeof(path), "%s/cpu%d/cpufreq/scaling_cur_freq", PATH_CPU_SYSFS, cpu);
+	rc->cur_freq_fd = open (path, O_RDONLY | O_CLOEXEC);
+
+	return 0;
+}
+
+static int res_open_msr(int cpu, struct residency_cpu *rc)
+{
+	char path[MAX_STR_LENGTH];
+	uint64_t val;
+
+	snprintf (path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+	rc->msr_fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (rc->msr_fd < 0)
+		return 1;
+
+	if (res_read_msr (rc->msr_fd, MSR_APERF, &val)) {
+		close (rc->msr_fd);
+		rc->msr_fd = -1;
+		return 1;
+	}
+
+	/* Maximum non-turbo ratio, in 100 MHz */
+	if (!res_read_msr (rc->msr_fd, MSR_PLATFORM_INFO, &val))
+		rc->base_freq = ((val >> 8) & 0xff) * 100000;
+	if (!rc->base_freq)
+		rc->base_freq = res_read_freq (cpu, "base_frequency");
+
+	return 0;
+}
+
+static int res_open_cpu(int cpu)
+{
+	struct residency_cpu *rc = &res_cpus[cpu];
+	int ret;
+
+	if (rc->opened)
+		return 0;
+
+	if (res_type == UTIL_SOURCE_CPUIDLE)
+		ret = res_open_cpuidle (cpu, rc);
+	else
+		ret = res_open_msr (cpu, rc);
+
+	if (ret) {
+		res_close_cpu (rc);
+		return 1;
+	}
+
+	rc->max_freq = res_read_freq (cpu, "cpuinfo_max_freq");
+	rc->opened = 1;
+	return 0;
+}
+
+/* Scale a busy time ratio at freq to the one at max_freq, in 1/100 % */
+static int res_scale(uint64_t num, uint64_t den, int freq, int max_freq)
+{
+	uint64_t val;
+
+	if (!den)
+		return 0;
+
+	/*
+	 * num is up to a cycle count of several seconds, num * 10000 * freq
+	 * would overflow: take the ratio first.
+	 */
+	val = num * 10000 / den;
+	if (freq > 0 && max_freq > 0)
+		val = val * freq / max_freq;
+
+	return val > 10000 ? 10000 : val;
+}
+
+/* Returns 0 with a new sample, 1 without a previous one, -1 on errors */
+static int res_sample_cpuidle(struct residency_cpu *rc, uint64_t delta_us, int *busy, int *c0)
+{
+	uint64_t idle = 0, poll = 0, val, d_idle, d_poll;
+	int i, freq = 0, ret = 1;
+
+	for (i = 0; i < rc->nr_states; i++) {
+		if (res_read_fd (rc->state_fds[i], &val))
+			return -1;
+		idle += val;
+		if (rc->state_poll[i])
+			poll += val;
+	}
+
+	if (rc->valid && delta_us) {
+		d_idle = idle - rc->idle_us;
+		d_poll = poll - rc->poll_us;
+		if (d_idle > delta_us)
+			d_idle = delta_us;
+		if (d_idle < d_poll)
+			d_poll = d_idle;
+
+		if (res_read_fd (rc->cur_freq_fd, &val) == 0)
+			freq = val;
+
+		*busy = res_scale (delta_us - d_idle, delta_us, freq, rc->max_freq);
+		*c0 = res_scale (delta_us - d_idle + d_poll, delta_us, 0, 0);
+		ret = 0;
+	}
+
+	rc->idle_us = idle;
+	rc->poll_us = poll;
+	rc->valid = 1;
+	return ret;
+}
+
+static int res_sample_msr(struct residency_cpu *rc, int *busy, int *c0)
+{
+	uint64_t aperf, mperf, tsc;
+	int ret = 1;
+
+	if (res_read_msr (rc->msr_fd, MSR_APERF, &aperf)
+			|| res_read_msr (rc->msr_fd, MSR_MPERF, &mperf)
+			|| res_read_msr (rc->msr_fd, MSR_TSC, &tsc))
+		return -1;
+
+	if (rc->valid && tsc > rc->tsc) {
+		*busy = res_scale (aperf - rc->aperf, tsc - rc->tsc, rc->base_freq, rc->max_freq);
+		*c0 = res_scale (mperf - rc->mperf, tsc - rc->tsc, 0, 0);
+		ret = 0;
+	}
+
+	rc->aperf = aperf;
+	rc->mperf = mperf;
+	rc->tsc = tsc;
+	rc->valid = 1;
+	return ret;
+}
+
+/* Open the counters of the online CPUs and take the reference sample */
+int residency_init(enum util_source_type type)
+{
+	int *busy, *c0;
+	int cpu, nr = 0;
+
+	if (res_cpus && res_type == type)
+		return 0;
+
+	if (res_cpus) {
+		for (cpu = 0; cpu < res_nr; cpu++)
+			res_close_cpu (&res_cpus[cpu]);
+		free (res_cpus);
+		res_cpus = NULL;
+	}
+
+	if (type != UTIL_SOURCE_CPUIDLE && type != UTIL_SOURCE_APERF_MPERF)
+		return 1;
+
+	res_nr = get_max_cpus ();
+	res_cpus = calloc (res_nr, sizeof(*res_cpus));
+	if (!res_cpus)
+		return 1;
+	res_type = type;
+
+	for (cpu = 0; cpu < res_nr; cpu++) {
+		res_cpus[cpu].cur_freq_fd = -1;
+		res_cpus[cpu].msr_fd = -1;
+		if (is_cpu_online (cpu) && !res_open_cpu (cpu))
+			nr++;
+	}
+
+	if (!nr) {
+		free (res_cpus);
+		res_cpus = NULL;
+		return 1;
+	}
+
+	res_prev_ns = 0;
+	busy = calloc (res_nr + 1, sizeof(*busy));
+	c0 = calloc (res_nr + 1, sizeof(*c0));
+	if (busy && c0)
+		residency_read (busy, c0, res_nr + 1);
+	free (busy);
+	free (c0);
+	return 0;
+}
+
+/*
+ * Frequency invariant busy and C0 residency of the system (index 0) and of
+ * each CPU (index cpu + 1) since the previous call, -1 for CPUs without a
+ * previous sample. The system values are the averages of the CPUs.
+ */
+int residency_read(int *busy, int *c0, int nr)
+{
+	struct residency_cpu *rc;
+	uint64_t now, delta_us;
+	int64_t sum_busy = 0, sum_c0 = 0;
+	int cpu, cnt = 0, ret;
+	struct timespec ts;
+
+	if (!res_cpus)
+		return 1;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	delta_us = res_prev_ns ? (now - res_prev_ns) / 1000 : 0;
+	res_prev_ns = now;
+
+	for (cpu = 0; cpu < nr; cpu++)
+		busy[cpu] = c0[cpu] = -1;
+
+	for (cpu = 0; cpu < res_nr && cpu + 1 < nr; cpu++) {
+		rc = &res_cpus[cpu];
+
+		if (!is_cpu_online (cpu)) {
+			if (rc->opened)
+				res_close_cpu (rc);
+			continue;
+		}
+
+		/* Onlined since, starts with a reference sample */
+		if (res_open_cpu (cpu))
+			continue;
+
+		if (res_type == UTIL_SOURCE_CPUIDLE)
+			ret = res_sample_cpuidle (rc, delta_us, &busy[cpu + 1], &c0[cpu + 1]);
+		else
+			ret = res_sample_msr (rc, &busy[cpu + 1], &c0[cpu + 1]);
+
+		if (ret < 0)
+			rc->valid = 0;
+		if (ret)
+			continue;
+
+		sum_busy += busy[cpu + 1];
+		sum_c0 += c0[cpu + 1];
+		cnt++;
+	}
+
+	if (!cnt)
+		return 1;
+
+	busy[0] = sum_busy / cnt;
+	c0[0] = sum_c0 / cnt;
+	return 0;
+}
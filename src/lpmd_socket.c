@@ -85,31 +85,33 @@ int socket_init_connection(char *name)
 	return socket_fd;
 }
 
+/*
+ * The credentials message does not change during the daemon lifetime,
+ * build it once and reuse it for every command.
+ */
+static struct msghdr *credentials_msg;
+
 static struct msghdr* create_credentials_msg()
 {
-	struct ucred *credentials;
+	struct ucred credentials;
 	struct msghdr *msg;
 	struct cmsghdr *cmsg;
 
-	credentials = malloc (sizeof(struct ucred));
-	if (!credentials)
-		return NULL;
+	if (credentials_msg)
+		return credentials_msg;
 
-	credentials->pid = getpid ();
-	credentials->uid = geteuid ();
-	credentials->gid = getegid ();
+	credentials.pid = getpid ();
+	credentials.uid = geteuid ();
+	credentials.gid = getegid ();
 
 	msg = malloc (sizeof(struct msghdr));
-	if (!msg) {
-		free (credentials);
+	if (!msg)
 		return msg;
-	}
 
 	memset (msg, 0, sizeof(struct msghdr));
 	msg->msg_iovlen = 1;
 	msg->msg_control = malloc (CMSG_SPACE(sizeof(struct ucred)));
 	if (!msg->msg_control) {
-		free (credentials);
 		free (msg);
 		return NULL;
 	}
@@ -120,9 +122,9 @@ static struct msghdr* create_credentials_msg()
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_CREDENTIALS;
 	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
-	memcpy (CMSG_DATA(cmsg), credentials, sizeof(struct ucred));
+	memcpy (CMSG_DATA(cmsg), &credentials, sizeof(struct ucred));
 
-	free (credentials);
+	credentials_msg = msg;
 	return msg;
 }
 
@@ -137,31 +139,30 @@ int socket_send_cmd(char *name, char *data)
 	if (!name || !data)
 		return LPMD_ERROR;
 
-	socket_fd = socket_init_connection (name);
-	if (!socket_fd)
-		return LPMD_ERROR;
-
 	msg = create_credentials_msg ();
 	if (!msg)
 		return LPMD_ERROR;
 
+	socket_fd = socket_init_connection (name);
+	if (!socket_fd)
+		return LPMD_ERROR;
+
 	iov.iov_base = (void*) data;
 	iov.iov_len = strlen (data);
 	msg->msg_iov = &iov;
 
-	if (sendmsg (socket_fd, msg, 0) < 0) {
-		free (msg->msg_control);
-		free (msg);
+	ret = sendmsg (socket_fd, msg, 0);
+	msg->msg_iov = NULL;
+	if (ret < 0) {
+		close (socket_fd);
 		return LPMD_ERROR;
 	}
 
+	/* irqbalance closes the connection once the command is handled */
 	ret = read (socket_fd, buf, MAX_STR_LENGTH);
 	if (ret < 0)
 		lpmd_log_debug ("read failed\n");
 
 	close (socket_fd);
-	free (msg->msg_control);
-	free (msg);
 	return LPMD_SUCCESS;
 }
-
@@ -0,0 +1,466 @@
+/*
+ * lpmd_stats.c: LPM transition latency statistics
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * This file records how long each phase of an LPM transition takes, per
+ * direction and per lpm_command, into fixed-bucket histograms. Buckets are
+ * log-linear in microseconds: four sub-buckets per power of two, so any
+ * reported percentile is within 25% of the real value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lpmd.h"
+
+#define HIST_SUB_BITS		2
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+/* Up to 2^25 us (~33 s), anything slower goes to the last bucket */
+#define HIST_MAX_EXP		25
+#define HIST_BUCKETS		(HIST_SUB + (HIST_MAX_EXP - HIST_SUB_BITS) * HIST_SUB)
+
+struct lpm_hist {
+	uint32_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint32_t bucket[HIST_BUCKETS];
+};
+
+static const char *lpm_phase_str[LPM_PHASE_MAX] = {
+	[LPM_PHASE_ITMT] = "itmt",
+	[LPM_PHASE_IRQ_NATIVE] = "irq-native",
+	[LPM_PHASE_IRQ_IRQBALANCE] = "irq-irqbalance",
+	[LPM_PHASE_CPU_CGROUPV2] = "cpu-cgroupv2",
+	[LPM_PHASE_CPU_ISOLATE] = "cpu-isolate",
+	[LPM_PHASE_CPU_POWERCLAMP] = "cpu-powerclamp",
+	[LPM_PHASE_CPU_OFFLINE] = "cpu-offline",
+	[LPM_PHASE_TOTAL] = "total",
+};
+
+/* [exit/enter][lpm_command][phase] */
+static struct lpm_hist lpm_hists[2][LPM_CMD_MAX][LPM_PHASE_MAX];
+static pthread_mutex_t lpm_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* CLOCK_MONOTONIC in ns, or the virtual time of a replay */
+uint64_t lpm_stats_now(void)
+{
+	struct timespec ts;
+
+	if (lpmd_trace_replaying ())
+		return lpmd_trace_now ();
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t us)
+{
+	int exp;
+
+	if (us < HIST_SUB)
+		return us;
+
+	exp = 63 - __builtin_clzll (us);
+	if (exp >= HIST_MAX_EXP)
+		return HIST_BUCKETS - 1;
+
+	return HIST_SUB + (exp - HIST_SUB_BITS) * HIST_SUB
+			+ ((us >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Exclusive upper bound of a bucket, in us */
+static uint64_t hist_bucket_limit(int idx)
+{
+	int exp, sub;
+
+	if (idx < HIST_SUB)
+		return idx + 1;
+
+	exp = (idx - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+	sub = (idx - HIST_SUB) % HIST_SUB;
+
+	return (uint64_t) (HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(struct lpm_hist *hist, int percent)
+{
+	uint64_t target, seen = 0;
+	uint64_t max_us = (hist->max_ns + 999) / 1000;
+	int i;
+
+	target = ((uint64_t) hist->count * percent + 99) / 100;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i >= HIST_BUCKETS - 1 || hist_bucket_limit (i) > max_us)
+		return max_us;
+
+	return hist_bucket_limit (i);
+}
+
+void lpm_stats_record(int enter, enum lpm_command cmd, enum lpm_phase phase, uint64_t ns)
+{
+	struct lpm_hist *hist;
+
+	if (cmd < 0 || cmd >= LPM_CMD_MAX || phase < 0 || phase >= LPM_PHASE_MAX)
+		return;
+
+	pthread_mutex_lock (&lpm_stats_mutex);
+
+	hist = &lpm_hists[!!enter][cmd][phase];
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->bucket[hist_bucket (ns / 1000)]++;
+
+	pthread_mutex_unlock (&lpm_stats_mutex);
+}
+
+/* Average over all lpm_commands of one direction, 0 when nothing recorded */
+uint64_t lpm_stats_mean_ns(int enter, enum lpm_phase phase)
+{
+	uint64_t sum = 0, count = 0;
+	int cmd;
+
+	if (phase < 0 || phase >= LPM_PHASE_MAX)
+		return 0;
+
+	pthread_mutex_lock (&lpm_stats_mutex);
+	for (cmd = 0; cmd < LPM_CMD_MAX; cmd++) {
+		sum += lpm_hists[!!enter][cmd][phase].sum_ns;
+		count += lpm_hists[!!enter][cmd][phase].count;
+	}
+	pthread_mutex_unlock (&lpm_stats_mutex);
+
+	return count ? sum / count : 0;
+}
+
+static int stats_append(char **buf, size_t *size, size_t offset, const char *fmt, ...)
+{
+	va_list args;
+	char *tmp;
+	int len;
+
+	for (;;) {
+		va_start(args, fmt);
+		len = vsnprintf (*buf + offset, *size - offset, fmt, args);
+		va_end(args);
+
+		if (len < 0)
+			return -1;
+		if (offset + len < *size)
+			return len;
+
+		tmp = realloc (*buf, *size * 2);
+		if (!tmp)
+			return -1;
+		*buf = tmp;
+		*size *= 2;
+	}
+}
+
+/*
+ * Format all non-empty histograms, one line per direction/reason/phase.
+ * Latencies are in us. The returned string must be freed by the caller.
+ */
+char* lpm_stats_str(void)
+{
+	size_t size = 4096, offset = 0;
+	struct lpm_hist *hist;
+	const char *cmd_str;
+	char *buf;
+	int dir, cmd, phase;
+	int len;
+
+	buf = malloc (size);
+	if (!buf)
+		return NULL;
+
+	len = stats_append (&buf, &size, offset, "%-6s %-14s %-15s %8s %10s %10s %10s %10s\n",
+						"dir", "reason", "phase", "count", "avg", "p50", "p99", "max");
+	if (len < 0)
+		goto err;
+	offset += len;
+
+	pthread_mutex_lock (&lpm_stats_mutex);
+
+	for (dir = 1; dir >= 0; dir--) {
+		for (cmd = 0; cmd < LPM_CMD_MAX; cmd++) {
+			cmd_str = lpm_cmd_str[cmd] ? lpm_cmd_str[cmd] : "unknown";
+			for (phase = 0; phase < LPM_PHASE_MAX; phase++) {
+				hist = &lpm_hists[dir][cmd][phase];
+				if (!hist->count)
+					continue;
+
+				len = stats_append (&buf, &size, offset,
+									"%-6s %-14s %-15s %8u %10llu %10llu %10llu %10llu\n",
+									dir ? "enter" : "exit", cmd_str, lpm_phase_str[phase],
+									hist->count,
+									(unsigned long long) (hist->sum_ns / hist->count / 1000),
+									(unsigned long long) hist_percentile (hist, 50),
+									(unsigned long long) hist_percentile (hist, 99),
+									(unsigned long long) ((hist->max_ns + 999) / 1000));
+				if (len < 0) {
+					pthread_mutex_unlock (&lpm_stats_mutex);
+					goto err;
+				}
+				offset += len;
+			}
+		}
+	}
+
+	pthread_mutex_unlock (&lpm_stats_mutex);
+
+	return buf;
+
+err:
+	free (buf);
+	return NULL;
+}
+
+/*
+ * Time and energy in and out of LPM, per reason: the lpm_command that
+ * entered LPM, or the one that exited it. The current state is accounted
+ * up to now when reported.
+ */
+enum lpm_reason {
+	LPM_REASON_USER,
+	LPM_REASON_HFI,
+	LPM_REASON_UTIL,
+	LPM_REASON_SUV,
+	LPM_REASON_MAX,
+};
+
+static const char *lpm_reason_str[LPM_REASON_MAX] = {
+	[LPM_REASON_USER] = "user",
+	[LPM_REASON_HFI] = "hfi",
+	[LPM_REASON_UTIL] = "util",
+	[LPM_REASON_SUV] = "suv",
+};
+
+struct lpm_residency {
+	uint32_t count;
+	uint64_t time_ns;
+	uint64_t energy_uj[RAPL_DOMAIN_MAX];
+};
+
+/* [out/in][lpm_reason] */
+static struct lpm_residency lpm_residencies[2][LPM_REASON_MAX];
+
+static struct {
+	int started;
+	int in;
+	enum lpm_reason reason;
+	uint64_t start_ns;
+	int has_energy[RAPL_DOMAIN_MAX];
+	uint64_t start_uj[RAPL_DOMAIN_MAX];
+} lpm_state_cur;
+
+static pthread_mutex_t lpm_residency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static enum lpm_reason lpm_cmd_reason(enum lpm_command cmd)
+{
+	switch (cmd) {
+		case HFI_ENTER:
+		case HFI_EXIT:
+			return LPM_REASON_HFI;
+		case UTIL_ENTER:
+		case UTIL_EXIT:
+			return LPM_REASON_UTIL;
+		case HFI_SUV_ENTER:
+		case HFI_SUV_EXIT:
+		case DBUS_SUV_ENTER:
+		case DBUS_SUV_EXIT:
+			return LPM_REASON_SUV;
+		default:
+			return LPM_REASON_USER;
+	}
+}
+
+/* Energy is not measured when replaying a trace */
+static void lpm_state_begin(int in, enum lpm_reason reason, uint64_t now)
+{
+	int domain;
+
+	lpm_state_cur.in = in;
+	lpm_state_cur.reason = reason;
+	lpm_state_cur.start_ns = now;
+
+	for (domain = 0; domain < RAPL_DOMAIN_MAX; domain++)
+		lpm_state_cur.has_energy[domain] = !lpmd_trace_replaying ()
+				&& !rapl_energy_uj (domain, &lpm_state_cur.start_uj[domain]);
+}
+
+/* Add the current state up to now to res, which is [2][LPM_REASON_MAX] */
+static void lpm_state_account(struct lpm_residency (*res)[LPM_REASON_MAX], uint64_t now)
+{
+	struct lpm_residency *cur = &res[lpm_state_cur.in][lpm_state_cur.reason];
+	uint64_t uj;
+	int domain;
+
+	cur->time_ns += now - lpm_state_cur.start_ns;
+
+	for (domain = 0; domain < RAPL_DOMAIN_MAX; domain++) {
+		if (lpm_state_cur.has_energy[domain] && !rapl_energy_uj (domain, &uj))
+			cur->energy_uj[domain] += uj - lpm_state_cur.start_uj[domain];
+	}
+}
+
+/* Starts accounting out of LPM, as lpmd starts in LPM_USER_OFF */
+void lpm_stats_residency_init(void)
+{
+	pthread_mutex_lock (&lpm_residency_mutex);
+
+	memset (lpm_residencies, 0, sizeof(lpm_residencies));
+	lpm_state_begin (0, LPM_REASON_USER, lpm_stats_now ());
+	lpm_state_cur.started = 1;
+
+	pthread_mutex_unlock (&lpm_residency_mutex);
+}
+
+/*
+ * Called on every LPM enter, exit, and switch to the CPUs of another
+ * reason. in is the new state, cmd the request that caused the change.
+ */
+void lpm_stats_residency(int in, enum lpm_command cmd)
+{
+	enum lpm_reason reason = lpm_cmd_reason (cmd);
+	uint64_t now = lpm_stats_now ();
+
+	pthread_mutex_lock (&lpm_residency_mutex);
+
+	if (!lpm_state_cur.started)
+		goto out;
+
+	if (lpm_state_cur.in == !!in && lpm_state_cur.reason == reason)
+		goto out;
+
+	lpm_state_account (lpm_residencies, now);
+	if (lpm_state_cur.in != !!in)
+		lpm_residencies[!!in][reason].count++;
+	lpm_state_begin (!!in, reason, now);
+
+out:	pthread_mutex_unlock (&lpm_residency_mutex);
+}
+
+/* Average power in mW, energy in uJ over time in ns */
+static unsigned long long lpm_power_mw(uint64_t energy_uj, uint64_t time_ns)
+{
+	if (time_ns < 1000000)
+		return 0;
+
+	return energy_uj / (time_ns / 1000000);
+}
+
+static int residency_append(char **buf, size_t *size, size_t *offset, const char *state,
+							const char *reason, struct lpm_residency *res, uint64_t total_ns)
+{
+	char power[RAPL_DOMAIN_MAX][24];
+	int len, domain;
+
+	/* No energy in replays, or without the RAPL domain */
+	for (domain = 0; domain < RAPL_DOMAIN_MAX; domain++) {
+		if (lpmd_trace_replaying () || !rapl_has_domain (domain))
+			snprintf (power[domain], sizeof(power[domain]), "-");
+		else
+			snprintf (power[domain], sizeof(power[domain]), "%llu",
+						lpm_power_mw (res->energy_uj[domain], res->time_ns));
+	}
+
+	len = stats_append (buf, size, *offset, "%-6s %-6s %8u %12.3f %9.2f %10s %10s\n", state,
+						reason, res->count, res->time_ns / 1e9,
+						total_ns ? res->time_ns * 100.0 / total_ns : 0.0,
+						power[RAPL_PKG], power[RAPL_CORE]);
+	if (len < 0)
+		return -1;
+
+	*offset += len;
+	return 0;
+}
+
+/*
+ * Format the number of entries/exits, the time spent, the residency and
+ * the average package and core power, in and out of LPM per reason and in
+ * total. The returned string must be freed by the caller.
+ */
+char* lpm_stats_residency_str(void)
+{
+	struct lpm_residency res[2][LPM_REASON_MAX];
+	struct lpm_residency sum;
+	size_t size = 2048, offset = 0;
+	uint64_t total_ns = 0;
+	char *buf;
+	int in, reason, domain;
+	int len;
+
+	buf = malloc (size);
+	if (!buf)
+		return NULL;
+
+	pthread_mutex_lock (&lpm_residency_mutex);
+	memcpy (res, lpm_residencies, sizeof(res));
+	if (lpm_state_cur.started)
+		lpm_state_account (res, lpm_stats_now ());
+	pthread_mutex_unlock (&lpm_residency_mutex);
+
+	for (in = 0; in < 2; in++) {
+		for (reason = 0; reason < LPM_REASON_MAX; reason++)
+			total_ns += res[in][reason].time_ns;
+	}
+
+	len = stats_append (&buf, &size, offset, "%-6s %-6s %8s %12s %9s %10s %10s\n", "state",
+						"reason", "count", "time(s)", "resid(%)", "pkg(mW)", "core(mW)");
+	if (len < 0)
+		goto err;
+	offset += len;
+
+	for (in = 1; in >= 0; in--) {
+		memset (&sum, 0, sizeof(sum));
+		for (reason = 0; reason < LPM_REASON_MAX; reason++) {
+			if (!res[in][reason].count && !res[in][reason].time_ns)
+				continue;
+			if (residency_append (&buf, &size, &offset, in ? "in" : "out", lpm_reason_str[reason],
+									&res[in][reason], total_ns))
+				goto err;
+			sum.count += res[in][reason].count;
+			sum.time_ns += res[in][reason].time_ns;
+			for (domain = 0; domain < RAPL_DOMAIN_MAX; domain++)
+				sum.energy_uj[domain] += res[in][reason].energy_uj[domain];
+		}
+		if (residency_append (&buf, &size, &offset, in ? "in" : "out", "total", &sum, total_ns))
+			goto err;
+	}
+
+	return buf;
+
+err:
+	free (buf);
+	return NULL;
+}
@@ -0,0 +1,212 @@
+/*
+ * lpmd_timer.c: timerfd based periodic jobs for the lpmd core thread
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * This file multiplexes several independent jobs (utilization sampling
+ * etc.) on one timerfd polled by lpmd_core_main_loop. Deadlines are
+ * absolute CLOCK_MONOTONIC times, so a job stays periodic no matter how
+ * many other events wake the core thread. Each job has a slack: the timerfd
+ * is armed at the earliest "deadline + slack", and every job whose deadline
+ * has passed by then runs in the same wakeup.
+ * There are only a handful of jobs, so they are kept in a small array.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "lpmd.h"
+
+#define MAX_LPMD_TIMERS		8
+#define TIMER_IDLE		UINT64_MAX
+
+struct lpmd_timer {
+	const char *name;
+	int (*fn)(void);
+	uint64_t slack_ns;
+	uint64_t deadline;
+};
+
+static struct lpmd_timer timers[MAX_LPMD_TIMERS];
+static int nr_timers;
+static int timer_fd = -1;
+static uint64_t timer_fd_expiry = TIMER_IDLE;
+
+/* Follows the virtual time of a replay */
+static uint64_t timer_now(void)
+{
+	return lpm_stats_now ();
+}
+
+static uint64_t timer_expiry(void)
+{
+	uint64_t expiry = TIMER_IDLE;
+	int i;
+
+	for (i = 0; i < nr_timers; i++) {
+		if (timers[i].deadline == TIMER_IDLE)
+			continue;
+		if (timers[i].deadline + timers[i].slack_ns < expiry)
+			expiry = timers[i].deadline + timers[i].slack_ns;
+	}
+
+	return expiry;
+}
+
+static void timer_fd_update(int force)
+{
+	struct itimerspec its;
+	uint64_t expiry;
+
+	if (timer_fd < 0)
+		return;
+
+	expiry = timer_expiry ();
+
+	if (!force && expiry == timer_fd_expiry)
+		return;
+
+	memset (&its, 0, sizeof(its));
+	if (expiry != TIMER_IDLE) {
+		its.it_value.tv_sec = expiry / 1000000000ULL;
+		its.it_value.tv_nsec = expiry % 1000000000ULL;
+		/* An all-zero it_value disarms the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime (timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		lpmd_log_error ("timerfd_settime failed: %s\n", strerror (errno));
+		return;
+	}
+
+	timer_fd_expiry = expiry;
+}
+
+int lpmd_timer_init(void)
+{
+	timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		lpmd_log_error ("timerfd_create failed: %s\n", strerror (errno));
+		return -1;
+	}
+
+	return timer_fd;
+}
+
+/*
+ * Add a job. fn () returns the delay in ms until its next run, or < 0 to
+ * stop until lpmd_timer_arm () is called again. Returns the job id.
+ */
+int lpmd_timer_add(const char *name, int (*fn)(void), int slack_ms)
+{
+	struct lpmd_timer *timer;
+
+	if (nr_timers >= MAX_LPMD_TIMERS) {
+		lpmd_log_error ("Too many timers, %s not added\n", name);
+		return -1;
+	}
+
+	timer = &timers[nr_timers];
+	timer->name = name;
+	timer->fn = fn;
+	timer->slack_ns = (uint64_t) slack_ms * 1000000;
+	timer->deadline = TIMER_IDLE;
+
+	return nr_timers++;
+}
+
+/* Run the job after delay_ms, or stop it when delay_ms < 0 */
+void lpmd_timer_arm(int id, int delay_ms)
+{
+	if (id < 0 || id >= nr_timers)
+		return;
+
+	if (delay_ms < 0)
+		timers[id].deadline = TIMER_IDLE;
+	else
+		timers[id].deadline = timer_now () + (uint64_t) delay_ms * 1000000;
+
+	timer_fd_update (0);
+}
+
+int lpmd_timer_armed(int id)
+{
+	if (id < 0 || id >= nr_timers)
+		return 0;
+
+	return timers[id].deadline != TIMER_IDLE;
+}
+
+/*
+ * When the timerfd would expire next, UINT64_MAX when no job is armed.
+ * A replay has no timerfd and calls lpmd_timer_process () at that time.
+ */
+uint64_t lpmd_timer_next(void)
+{
+	return timer_expiry ();
+}
+
+/* Handle POLLIN on the fd returned by lpmd_timer_init () */
+int lpmd_timer_process(void)
+{
+	uint64_t expirations, period, now;
+	int i, ret;
+
+	if (timer_fd >= 0 && read (timer_fd, &expirations, sizeof(expirations)) < 0
+			&& errno != EAGAIN)
+		lpmd_log_warn ("read on timerfd failed: %s\n", strerror (errno));
+
+	now = timer_now ();
+	for (i = 0; i < nr_timers; i++) {
+		struct lpmd_timer *timer = &timers[i];
+		uint64_t prev = timer->deadline;
+
+		if (prev == TIMER_IDLE || prev > now)
+			continue;
+
+		ret = timer->fn ();
+
+		/* fn () may have re-armed or stopped the job itself */
+		if (timer->deadline != prev)
+			continue;
+
+		if (ret < 0) {
+			timer->deadline = TIMER_IDLE;
+			continue;
+		}
+
+		/*
+		 * Keep the cadence from the previous deadline rather than from
+		 * now, unless we fell more than one period behind.
+		 */
+		period = (uint64_t) ret * 1000000;
+		timer->deadline = prev + period;
+		now = timer_now ();
+		if (timer->deadline <= now)
+			timer->deadline = now + period;
+	}
+
+	/* The timerfd is one-shot and has expired, always reprogram it */
+	timer_fd_update (1);
+
+	return 0;
+}
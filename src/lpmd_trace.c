@@ -0,0 +1,598 @@
+/*
+ * lpmd_trace.c: record and replay the inputs of the LPM decisions
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * With --record, everything the LPM policies react to is written to a
+ * binary trace: /proc/stat samples, HFI capacity updates, CPU hotplug,
+ * power profile changes, D-Bus requests and PSI events. With --replay, the
+ * trace is fed through the same code in dry run mode and in virtual time,
+ * see lpmd_replay ().
+ *
+ * The trace starts with the magic, flags and the CPU topology of the
+ * recording system as text, so the replay does not depend on the system it
+ * runs on. Each record is the time since the previous record in us, the
+ * record type and its payload. All integers are LEB128 varints. /proc/stat
+ * samples only keep the busy and idle time of each CPU, as deltas to the
+ * previous sample, so most of them take two bytes per CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "lpmd.h"
+
+#define TRACE_MAGIC		"LPMDTRC1"
+#define TRACE_MAGIC_LEN		8
+/* Finer than any util sampling interval, see get_util_interval () */
+#define TRACE_STAT_INTERVAL_MS	100
+#define TRACE_STAT_SLACK_MS	20
+/* Flush at least every 5 seconds of samples */
+#define TRACE_FLUSH_SAMPLES	50
+#define TRACE_TOPOLOGY_MAX	(1024 * 1024)
+
+/* Recording */
+static char *trace_path;
+static FILE *trace_file;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start_us, trace_last_us;
+/* trace_last_us before the current record, for trace_cancel () */
+static uint64_t trace_prev_us;
+static unsigned char *trace_buf;
+static size_t trace_buf_size, trace_len;
+static int trace_samples;
+
+/* Pending HFI capacity updates, written as one record by lpmd_trace_hfi_done () */
+static int *trace_caps;
+static int trace_nr_caps, trace_caps_size;
+
+/* busy and idle time of the previous sample, index 0 is the system */
+static unsigned long long *trace_busy, *trace_idle;
+static unsigned long long *sample_busy, *sample_total;
+static int trace_nr;
+
+/* Replay */
+static int replaying;
+static uint64_t replay_now;
+static FILE *replay_file;
+static off_t replay_size;
+static uint64_t replay_time;
+static char *replay_topology;
+static int *replay_caps;
+static int replay_caps_size;
+/* Cumulative busy and idle time, the last sample valid flags */
+static unsigned long long *replay_busy, *replay_idle;
+static unsigned long long *pending_busy, *pending_idle;
+static char *replay_valid, *pending_valid;
+
+void lpmd_trace_set_file(const char *path)
+{
+	free (trace_path);
+	trace_path = path ? strdup (path) : NULL;
+}
+
+static int trace_reserve(size_t len)
+{
+	unsigned char *buf;
+	size_t size;
+
+	if (trace_len + len <= trace_buf_size)
+		return 0;
+
+	size = trace_buf_size ? trace_buf_size : 256;
+	while (size < trace_len + len)
+		size *= 2;
+
+	buf = realloc (trace_buf, size);
+	if (!buf)
+		return -1;
+	trace_buf = buf;
+	trace_buf_size = size;
+	return 0;
+}
+
+static int trace_put(uint64_t val)
+{
+	if (trace_reserve (10))
+		return -1;
+
+	do {
+		unsigned char byte = val & 0x7f;
+
+		val >>= 7;
+		if (val)
+			byte |= 0x80;
+		trace_buf[trace_len++] = byte;
+	} while (val);
+
+	return 0;
+}
+
+static void trace_stop(void)
+{
+	if (trace_file)
+		fclose (trace_file);
+	trace_file = NULL;
+}
+
+/* Start a record, returns with trace_mutex held when recording */
+static int trace_begin(enum lpmd_trace_type type)
+{
+	uint64_t now;
+
+	pthread_mutex_lock (&trace_mutex);
+
+	if (!trace_file) {
+		pthread_mutex_unlock (&trace_mutex);
+		return -1;
+	}
+
+	/* Taken with the mutex held, so the records are in time order */
+	now = lpm_stats_now () / 1000 - trace_start_us;
+	trace_len = 0;
+	trace_put (now - trace_last_us);
+	trace_put (type);
+	trace_prev_us = trace_last_us;
+	trace_last_us = now;
+
+	return 0;
+}
+
+/* Drop the current record */
+static void trace_cancel(void)
+{
+	trace_last_us = trace_prev_us;
+	pthread_mutex_unlock (&trace_mutex);
+}
+
+static void trace_end(enum lpmd_trace_type type)
+{
+	if (fwrite (trace_buf, 1, trace_len, trace_file) != trace_len) {
+		lpmd_log_error ("Failed to write trace %s, stop recording\n", trace_path);
+		trace_stop ();
+		goto end;
+	}
+
+	/* Samples are frequent, don't flush every one of them */
+	if (type != LPMD_TRACE_STAT || ++trace_samples >= TRACE_FLUSH_SAMPLES) {
+		trace_samples = 0;
+		fflush (trace_file);
+	}
+
+end:
+	pthread_mutex_unlock (&trace_mutex);
+}
+
+static int trace_stat_fn(void)
+{
+	unsigned long long busy, idle;
+	int i;
+
+	if (!trace_file)
+		return -1;
+
+	if (util_read_stat (sample_busy, sample_total, trace_nr))
+		return TRACE_STAT_INTERVAL_MS;
+
+	if (trace_begin (LPMD_TRACE_STAT))
+		return -1;
+
+	for (i = 0; i < trace_nr; i++) {
+		/* Offline CPUs are not in /proc/stat */
+		if (!sample_total[i]) {
+			trace_put (0);
+			continue;
+		}
+
+		busy = sample_busy[i];
+		idle = sample_total[i] - sample_busy[i];
+		trace_put ((busy > trace_busy[i] ? busy - trace_busy[i] : 0) + 1);
+		trace_put (idle > trace_idle[i] ? idle - trace_idle[i] : 0);
+		trace_busy[i] = busy;
+		trace_idle[i] = idle;
+	}
+
+	trace_end (LPMD_TRACE_STAT);
+
+	return TRACE_STAT_INTERVAL_MS;
+}
+
+/*
+ * Start recording when a trace file was set, flags are LPMD_TRACE_F_*.
+ * Must be called after the CPUs and the timer are initialized.
+ */
+int lpmd_trace_init(int flags)
+{
+	uint32_t val;
+	char *topology;
+	int timer;
+
+	if (!trace_path)
+		return 0;
+
+	trace_nr = get_max_cpus () + 1;
+	trace_busy = calloc (trace_nr, sizeof(*trace_busy));
+	trace_idle = calloc (trace_nr, sizeof(*trace_idle));
+	sample_busy = calloc (trace_nr, sizeof(*sample_busy));
+	sample_total = calloc (trace_nr, sizeof(*sample_total));
+	topology = cpu_topology_str ();
+	if (!trace_busy || !trace_idle || !sample_busy || !sample_total || !topology) {
+		lpmd_log_error ("Failed to allocate trace buffers\n");
+		free (topology);
+		return LPMD_ERROR;
+	}
+
+	trace_file = fopen (trace_path, "we");
+	if (!trace_file) {
+		lpmd_log_error ("Failed to create trace %s: %s\n", trace_path, strerror (errno));
+		free (topology);
+		return LPMD_ERROR;
+	}
+
+	fwrite (TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace_file);
+	val = flags;
+	fwrite (&val, sizeof(val), 1, trace_file);
+	val = strlen (topology);
+	fwrite (&val, sizeof(val), 1, trace_file);
+	fwrite (topology, 1, val, trace_file);
+	free (topology);
+
+	if (fflush (trace_file)) {
+		lpmd_log_error ("Failed to write trace %s\n", trace_path);
+		trace_stop ();
+		return LPMD_ERROR;
+	}
+
+	trace_start_us = lpm_stats_now () / 1000;
+	trace_last_us = 0;
+
+	timer = lpmd_timer_add ("trace", trace_stat_fn, TRACE_STAT_SLACK_MS);
+	lpmd_timer_arm (timer, 0);
+
+	lpmd_log_info ("Recording trace to %s\n", trace_path);
+
+	return 0;
+}
+
+void lpmd_trace_close(void)
+{
+	pthread_mutex_lock (&trace_mutex);
+	trace_stop ();
+	pthread_mutex_unlock (&trace_mutex);
+}
+
+/* One CPU of an HFI update, see lpmd_trace_hfi_done () */
+void lpmd_trace_hfi(int cpu, int perf, int eff)
+{
+	int *caps;
+
+	if (!trace_file)
+		return;
+
+	if (trace_nr_caps + 3 > trace_caps_size) {
+		caps = realloc (trace_caps, (trace_caps_size + 96) * sizeof(*caps));
+		if (!caps)
+			return;
+		trace_caps = caps;
+		trace_caps_size += 96;
+	}
+
+	trace_caps[trace_nr_caps++] = cpu;
+	trace_caps[trace_nr_caps++] = perf;
+	trace_caps[trace_nr_caps++] = eff;
+}
+
+/* The HFI socket was drained, write all updates since the last call */
+void lpmd_trace_hfi_done(void)
+{
+	int i;
+
+	if (!trace_nr_caps)
+		return;
+
+	if (!trace_begin (LPMD_TRACE_HFI)) {
+		trace_put (trace_nr_caps / 3);
+		for (i = 0; i < trace_nr_caps; i++)
+			trace_put (trace_caps[i] < 0 ? 0 : trace_caps[i]);
+		trace_end (LPMD_TRACE_HFI);
+	}
+
+	trace_nr_caps = 0;
+}
+
+void lpmd_trace_hotplug(int cpu, int online)
+{
+	if (trace_begin (LPMD_TRACE_HOTPLUG))
+		return;
+
+	trace_put (cpu);
+	trace_put (!!online);
+	trace_end (LPMD_TRACE_HOTPLUG);
+}
+
+void lpmd_trace_profile(const char *profile)
+{
+	size_t len = strlen (profile);
+
+	if (trace_begin (LPMD_TRACE_PROFILE))
+		return;
+
+	/* A record without the profile would corrupt the trace */
+	if (trace_put (len) || trace_reserve (len)) {
+		trace_cancel ();
+		return;
+	}
+	memcpy (trace_buf + trace_len, profile, len);
+	trace_len += len;
+	trace_end (LPMD_TRACE_PROFILE);
+}
+
+void lpmd_trace_msg(int msg_id)
+{
+	if (trace_begin (LPMD_TRACE_MSG))
+		return;
+
+	trace_put (msg_id);
+	trace_end (LPMD_TRACE_MSG);
+}
+
+void lpmd_trace_psi(void)
+{
+	if (trace_begin (LPMD_TRACE_PSI))
+		return;
+
+	trace_end (LPMD_TRACE_PSI);
+}
+
+/* Replay */
+int lpmd_trace_replaying(void)
+{
+	return replaying;
+}
+
+/* Virtual CLOCK_MONOTONIC time of a replay in ns, see lpm_stats_now () */
+uint64_t lpmd_trace_now(void)
+{
+	return replay_now;
+}
+
+void lpmd_trace_set_now(uint64_t now)
+{
+	if (now > replay_now)
+		replay_now = now;
+}
+
+static int replay_get(uint64_t *val)
+{
+	int c, shift = 0;
+
+	*val = 0;
+	do {
+		c = getc_unlocked (replay_file);
+		if (c == EOF || shift > 63)
+			return -1;
+		*val |= (uint64_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/*
+ * Open a trace and switch to virtual time. flags returns the LPMD_TRACE_F_*
+ * of the recording, topology the recorded CPU topology for
+ * init_cpu_replay (), valid until lpmd_trace_replay_close ().
+ */
+int lpmd_trace_replay_open(const char *path, int *flags, char **topology)
+{
+	char magic[TRACE_MAGIC_LEN];
+	uint32_t val, len;
+	char *str, *line;
+	struct stat st;
+	int nr = 0;
+
+	replay_file = fopen (path, "re");
+	if (!replay_file) {
+		lpmd_log_error ("Failed to open trace %s: %s\n", path, strerror (errno));
+		return LPMD_ERROR;
+	}
+
+	if (fstat (fileno (replay_file), &st))
+		goto err;
+	replay_size = st.st_size;
+
+	if (fread (magic, 1, sizeof(magic), replay_file) != sizeof(magic)
+			|| memcmp (magic, TRACE_MAGIC, TRACE_MAGIC_LEN)
+			|| fread (&val, sizeof(val), 1, replay_file) != 1
+			|| fread (&len, sizeof(len), 1, replay_file) != 1 || len > TRACE_TOPOLOGY_MAX)
+		goto err;
+
+	replay_topology = malloc (len + 1);
+	if (!replay_topology || fread (replay_topology, 1, len, replay_file) != len)
+		goto err;
+	replay_topology[len] = '\0';
+
+	/* "cpus N" comes first */
+	str = strdup (replay_topology);
+	if (!str)
+		goto err;
+	line = strtok (str, "\n");
+	if (line && !strncmp (line, "cpus ", 5))
+		nr = strtol (line + 5, NULL, 10) + 1;
+	free (str);
+	if (nr <= 1)
+		goto err;
+
+	trace_nr = nr;
+	replay_busy = calloc (nr, sizeof(*replay_busy));
+	replay_idle = calloc (nr, sizeof(*replay_idle));
+	pending_busy = calloc (nr, sizeof(*pending_busy));
+	pending_idle = calloc (nr, sizeof(*pending_idle));
+	replay_valid = calloc (nr, 1);
+	pending_valid = calloc (nr, 1);
+	if (!replay_busy || !replay_idle || !pending_busy || !pending_idle || !replay_valid
+			|| !pending_valid)
+		goto err;
+
+	*flags = val;
+	*topology = replay_topology;
+	replaying = 1;
+	replay_now = replay_time = 0;
+
+	return 0;
+
+err:
+	lpmd_log_error ("Invalid trace %s\n", path);
+	lpmd_trace_replay_close ();
+	return LPMD_ERROR;
+}
+
+/*
+ * Read the next record. Returns 1 with rec filled, 0 at the end of the
+ * trace and -1 for a truncated or corrupted record. A sample only takes
+ * effect with lpmd_trace_stat_update ().
+ */
+int lpmd_trace_read(struct lpmd_trace_rec *rec)
+{
+	uint64_t delta, type, val, val2;
+	int c, i;
+
+	c = getc_unlocked (replay_file);
+	if (c == EOF)
+		return 0;
+	ungetc (c, replay_file);
+
+	if (replay_get (&delta) || replay_get (&type))
+		return -1;
+
+	replay_time += delta * 1000;
+	rec->time = replay_time;
+	rec->type = type;
+
+	switch (rec->type) {
+		case LPMD_TRACE_STAT:
+			for (i = 0; i < trace_nr; i++) {
+				if (replay_get (&val))
+					return -1;
+				pending_valid[i] = !!val;
+				if (!val)
+					continue;
+				if (replay_get (&val2))
+					return -1;
+				pending_busy[i] = replay_busy[i] + val - 1;
+				pending_idle[i] = replay_idle[i] + val2;
+			}
+			break;
+		case LPMD_TRACE_HFI:
+			/* Each update takes at least 3 bytes of what is left of the trace */
+			if (replay_get (&val) || val > (uint64_t) (replay_size - ftell (replay_file)) / 3)
+				return -1;
+			if (val * 3 > (uint64_t) replay_caps_size) {
+				int *caps = realloc (replay_caps, val * 3 * sizeof(*caps));
+
+				if (!caps)
+					return -1;
+				replay_caps = caps;
+				replay_caps_size = val * 3;
+			}
+			for (i = 0; i < val * 3; i++) {
+				if (replay_get (&val2))
+					return -1;
+				replay_caps[i] = val2;
+			}
+			rec->caps = replay_caps;
+			rec->nr_caps = val;
+			break;
+		case LPMD_TRACE_HOTPLUG:
+			if (replay_get (&val) || replay_get (&val2))
+				return -1;
+			rec->cpu = val;
+			rec->online = val2;
+			break;
+		case LPMD_TRACE_PROFILE:
+			if (replay_get (&val) || val >= sizeof(rec->profile))
+				return -1;
+			if (fread (rec->profile, 1, val, replay_file) != val)
+				return -1;
+			rec->profile[val] = '\0';
+			break;
+		case LPMD_TRACE_MSG:
+			if (replay_get (&val))
+				return -1;
+			rec->msg_id = val;
+			break;
+		case LPMD_TRACE_PSI:
+			break;
+		default:
+			return -1;
+	}
+
+	return 1;
+}
+
+/* Make the sample last read the current one */
+void lpmd_trace_stat_update(void)
+{
+	int i;
+
+	for (i = 0; i < trace_nr; i++) {
+		replay_valid[i] = pending_valid[i];
+		if (!pending_valid[i])
+			continue;
+		replay_busy[i] = pending_busy[i];
+		replay_idle[i] = pending_idle[i];
+	}
+}
+
+/*
+ * Cumulative busy and total time of a CPU, or of the system for cpu -1, in
+ * the current sample. Returns -1 when the CPU was not in it.
+ */
+int lpmd_trace_stat(int cpu, unsigned long long *busy, unsigned long long *total)
+{
+	if (cpu + 1 < 0 || cpu + 1 >= trace_nr || !replay_valid[cpu + 1])
+		return -1;
+
+	*busy = replay_busy[cpu + 1];
+	*total = replay_busy[cpu + 1] + replay_idle[cpu + 1];
+	return 0;
+}
+
+void lpmd_trace_replay_close(void)
+{
+	if (replay_file)
+		fclose (replay_file);
+	replay_file = NULL;
+
+	free (replay_topology);
+	free (replay_caps);
+	free (replay_busy);
+	free (replay_idle);
+	free (pending_busy);
+	free (pending_idle);
+	free (replay_valid);
+	free (pending_valid);
+	replay_topology = NULL;
+	replay_caps = NULL;
+	replay_caps_size = 0;
+	replay_busy = replay_idle = pending_busy = pending_idle = NULL;
+	replay_valid = pending_valid = NULL;
+}
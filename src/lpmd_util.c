@@ -25,6 +25,7 @@
 #include <err.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -58,24 +59,50 @@ enum type_stat {
 	STAT_EXT_MAX,
 };
 
-// One for system utilization, MAX_LPM_CPUS for LPM cpu utilization
-unsigned long long proc_stat_prev[MAX_LPM_CPUS + 1][STAT_EXT_MAX];
-unsigned long long proc_stat_cur[MAX_LPM_CPUS + 1][STAT_EXT_MAX];
+/*
+ * proc_stat_cur/prev[0] is for system utilization, proc_stat_cur/prev[cpu + 1]
+ * is for CPU utilization. Both are sized from the possible CPU count.
+ */
+static unsigned long long (*proc_stat_prev)[STAT_EXT_MAX];
+static unsigned long long (*proc_stat_cur)[STAT_EXT_MAX];
+/* Parsed by util_read_stat (), without touching the util samples */
+static unsigned long long (*proc_stat_trace)[STAT_EXT_MAX];
+static int proc_stat_nr;
+
+/* /proc/stat is kept open and re-read with pread() into a reusable buffer */
+#define PROC_STAT_BUF_SIZE	4096
+
+static int proc_stat_fd = -1;
+static char *proc_stat_buf;
+static size_t proc_stat_buf_size;
 
 static int busy_sys = -1;
 static int busy_cpu = -1;
+/* Per-CPU busy of the last sample, -1 for CPUs not used for LPM */
+static int *busy_cpus;
 
-static int calculate_busypct(unsigned long long *cur, unsigned long long *prev)
+static void calculate_busy(unsigned long long *stat, unsigned long long *busy,
+							unsigned long long *total)
 {
 	int idx;
-	unsigned long long busy = 0, total = 0;
 
+	*busy = *total = 0;
 	for (idx = STAT_USER; idx < STAT_MAX; idx++) {
-		total += (cur[idx] - prev[idx]);
+		*total += stat[idx];
 //		 Align with the "top" utility logic
 		if (idx != STAT_IDLE && idx != STAT_IOWAIT)
-			busy += (cur[idx] - prev[idx]);
+			*busy += stat[idx];
 	}
+}
+
+static int calculate_busypct(unsigned long long *cur, unsigned long long *prev)
+{
+	unsigned long long busy, total, prev_busy, prev_total;
+
+	calculate_busy (cur, &busy, &total);
+	calculate_busy (prev, &prev_busy, &prev_total);
+	busy -= prev_busy;
+	total -= prev_total;
 
 	if (total)
 		return busy * 10000 / total;
@@ -83,107 +110,199 @@ static int calculate_busypct(unsigned long long *cur, unsigned long long *prev)
 		return 0;
 }
 
-static int parse_proc_stat(void)
+static int proc_stat_init(void)
 {
-	FILE *filep;
-	int i;
-	int val;
-	int pos = 0;
-	int size = sizeof(unsigned long long) * (MAX_LPM_CPUS + 1) * STAT_MAX;
+	if (proc_stat_fd >= 0)
+		return 0;
 
-	filep = fopen (PATH_PROC_STAT, "r");
-	if (!filep)
-		return 1;
+	if (!proc_stat_cur) {
+		proc_stat_nr = get_max_cpus () + 1;
+		proc_stat_cur = calloc (proc_stat_nr, sizeof(*proc_stat_cur));
+		proc_stat_prev = calloc (proc_stat_nr, sizeof(*proc_stat_prev));
+		proc_stat_trace = calloc (proc_stat_nr, sizeof(*proc_stat_trace));
+		proc_stat_buf_size = PROC_STAT_BUF_SIZE;
+		proc_stat_buf = malloc (proc_stat_buf_size);
+		busy_cpus = calloc (proc_stat_nr - 1, sizeof(*busy_cpus));
+		if (!proc_stat_cur || !proc_stat_prev || !proc_stat_trace || !proc_stat_buf
+				|| !busy_cpus) {
+			lpmd_log_error ("Failed to allocate %s buffers\n", PATH_PROC_STAT);
+			free (proc_stat_cur);
+			free (proc_stat_prev);
+			free (proc_stat_trace);
+			free (proc_stat_buf);
+			free (busy_cpus);
+			proc_stat_cur = proc_stat_prev = proc_stat_trace = NULL;
+			proc_stat_buf = NULL;
+			busy_cpus = NULL;
+			return 1;
+		}
+	}
 
-	memcpy (proc_stat_prev, proc_stat_cur, size);
-	memset (proc_stat_cur, 0, size);
+	/* The samples come from the trace */
+	if (lpmd_trace_replaying ())
+		return 0;
 
-	while (!feof (filep)) {
-		int idx;
-		char *tmpline = NULL;
-		size_t size = 0;
-		char *line;
-		int cpu;
-		char *p;
-		int ret;
+	proc_stat_fd = open (PATH_PROC_STAT, O_RDONLY | O_CLOEXEC);
+	if (proc_stat_fd < 0) {
+		lpmd_log_error ("Open %s failed\n", PATH_PROC_STAT);
+		return 1;
+	}
 
-		tmpline = NULL;
-		size = 0;
+	return 0;
+}
 
-		if (getline (&tmpline, &size, filep) <= 0) {
-			free (tmpline);
-			break;
-		}
+/*
+ * The "cpu" lines always come first in /proc/stat. The buffer only needs to
+ * hold all of them, so the long "intr" line can be truncated.
+ */
+static int proc_stat_has_all_cpus(const char *buf)
+{
+	const char *p = buf;
 
-		line = strdup (tmpline);
+	while ((p = strchr (p, '\n')) != NULL) {
+		p++;
+		if (*p && strncmp (p, "cpu", 3))
+			return 1;
+	}
 
-		p = strtok (line, " ");
+	return 0;
+}
 
-		if (strncmp (p, "cpu", 3)) {
-			free (tmpline);
-			free (line);
-			continue;
+static int proc_stat_read(void)
+{
+	ssize_t len;
+	char *buf;
+
+	for (;;) {
+		len = pread (proc_stat_fd, proc_stat_buf, proc_stat_buf_size - 1, 0);
+		if (len <= 0) {
+			lpmd_log_error ("Read %s failed\n", PATH_PROC_STAT);
+			close (proc_stat_fd);
+			proc_stat_fd = -1;
+			return 1;
 		}
+		proc_stat_buf[len] = '\0';
 
-		ret = sscanf (p, "cpu%d", &cpu);
-		if (ret == -1 && !(strncmp (p, "cpu", 3))) {
-			proc_stat_cur[pos][STAT_VALID] = 1;
-			proc_stat_cur[pos++][STAT_CPU] = -1;
+		if ((size_t) len < proc_stat_buf_size - 1 || proc_stat_has_all_cpus (proc_stat_buf))
+			return 0;
+
+		buf = realloc (proc_stat_buf, proc_stat_buf_size * 2);
+		if (!buf) {
+			lpmd_log_error ("Failed to grow %s buffer\n", PATH_PROC_STAT);
+			return 1;
 		}
-		else if (ret == 1) {
-			if (!is_cpu_for_lpm (cpu)) {
-				free (tmpline);
-				free (line);
-				continue;
-			}
+		proc_stat_buf = buf;
+		proc_stat_buf_size *= 2;
+	}
+}
 
-//			 array 0 is always for system utilization
-			if (!pos)
-				pos = 1;
-			if (pos > MAX_LPM_CPUS) {
-				free (tmpline);
-				free (line);
-				break;;
-			}
-			proc_stat_cur[pos][STAT_VALID] = 1;
-			proc_stat_cur[pos++][STAT_CPU] = cpu;
+/* Parse the "cpu" lines in place, no heap allocation */
+static void proc_stat_parse(char *buf, unsigned long long (*proc_stat)[STAT_EXT_MAX])
+{
+	unsigned long long *stat;
+	char *p = buf;
+	int idx, cpu;
+
+	while (p && !strncmp (p, "cpu", 3)) {
+		p += 3;
+
+		if (*p == ' ') {
+			cpu = -1;
 		}
 		else {
-			free (tmpline);
-			free (line);
-			continue;
+			cpu = strtol (p, &p, 10);
+			if (cpu < 0 || cpu >= proc_stat_nr - 1)
+				goto next;
 		}
 
-		idx = STAT_CPU;
+		stat = proc_stat[cpu + 1];
+		stat[STAT_CPU] = cpu;
+		for (idx = STAT_USER; idx < STAT_MAX; idx++)
+			stat[idx] = strtoull (p, &p, 10);
+		stat[STAT_VALID] = 1;
 
-		while (p != NULL) {
-			if (idx >= STAT_MAX)
-				break;
+next:	p = strchr (p, '\n');
+		if (p)
+			p++;
+	}
+}
 
-			if (idx == STAT_CPU) {
-				idx++;
-				p = strtok (NULL, " ");
-				continue;
-			}
+/* The busy time goes to STAT_USER and the rest to STAT_IDLE */
+static void proc_stat_replay(unsigned long long (*proc_stat)[STAT_EXT_MAX])
+{
+	unsigned long long busy, total;
+	int i;
 
-			sscanf (p, "%llu", &proc_stat_cur[pos - 1][idx]);
-			p = strtok (NULL, " ");
-			idx++;
-		}
+	for (i = 0; i < proc_stat_nr; i++) {
+		if (lpmd_trace_stat (i - 1, &busy, &total))
+			continue;
+		proc_stat[i][STAT_CPU] = i - 1;
+		proc_stat[i][STAT_USER] = busy;
+		proc_stat[i][STAT_IDLE] = total - busy;
+		proc_stat[i][STAT_VALID] = 1;
+	}
+}
+
+/*
+ * Cumulative busy and total time of the system (index 0) and of each CPU
+ * (index cpu + 1) for recording a trace. CPUs that are not in /proc/stat
+ * get a total of 0.
+ */
+int util_read_stat(unsigned long long *busy, unsigned long long *total, int nr)
+{
+	int i;
+
+	if (proc_stat_init () || proc_stat_read ())
+		return 1;
+
+	memset (proc_stat_trace, 0, proc_stat_nr * sizeof(*proc_stat_trace));
+	proc_stat_parse (proc_stat_buf, proc_stat_trace);
 
-		free (tmpline);
-		free (line);
+	for (i = 0; i < nr; i++) {
+		busy[i] = total[i] = 0;
+		if (i < proc_stat_nr && proc_stat_trace[i][STAT_VALID])
+			calculate_busy (proc_stat_trace[i], &busy[i], &total[i]);
 	}
 
-	fclose (filep);
+	return 0;
+}
+
+static int parse_proc_stat(void)
+{
+	unsigned long long (*tmp)[STAT_EXT_MAX];
+	int cpu;
+	int val;
+
+	if (proc_stat_init ())
+		return 1;
+
+	if (!lpmd_trace_replaying () && proc_stat_read ())
+		return 1;
+
+	tmp = proc_stat_prev;
+	proc_stat_prev = proc_stat_cur;
+	proc_stat_cur = tmp;
+	memset (proc_stat_cur, 0, proc_stat_nr * sizeof(*proc_stat_cur));
+
+	if (lpmd_trace_replaying ())
+		proc_stat_replay (proc_stat_cur);
+	else
+		proc_stat_parse (proc_stat_buf, proc_stat_cur);
+
 	busy_sys = calculate_busypct (proc_stat_cur[0], proc_stat_prev[0]);
 
 	busy_cpu = 0;
-	for (i = 1; i < MAX_LPM_CPUS + 1; i++) {
-		if (!proc_stat_cur[i][STAT_VALID])
+	for (cpu = 0; cpu < proc_stat_nr - 1; cpu++) {
+		busy_cpus[cpu] = -1;
+
+		if (!proc_stat_cur[cpu + 1][STAT_VALID] || !proc_stat_prev[cpu + 1][STAT_VALID])
+			continue;
+
+		if (!is_cpu_for_lpm (cpu))
 			continue;
 
-		val = calculate_busypct (proc_stat_cur[i], proc_stat_prev[i]);
+		val = calculate_busypct (proc_stat_cur[cpu + 1], proc_stat_prev[cpu + 1]);
+		busy_cpus[cpu] = val;
 		if (busy_cpu < val)
 			busy_cpu = val;
 	}
@@ -191,23 +310,159 @@ static int parse_proc_stat(void)
 	return 0;
 }
 
+/*
+ * With UtilSource cpuidle or aperfmperf, busy_sys, busy_cpu and busy_cpus
+ * come from residency_read () instead, frequency invariant. busy_c0 is the
+ * average C0 residency of the CPUs.
+ */
+static const char *util_source_names[UTIL_SOURCE_MAX] = {
+	[UTIL_SOURCE_PROC_STAT] = "procstat",
+	[UTIL_SOURCE_CPUIDLE] = "cpuidle",
+	[UTIL_SOURCE_APERF_MPERF] = "aperfmperf",
+};
+
+static enum util_source_type util_source;
+static int *res_busy, *res_c0;
+static int busy_c0 = -1;
+
+static void util_source_init(void)
+{
+	util_source = get_util_source ();
+
+	/* A trace only has the /proc/stat samples */
+	if (lpmd_trace_replaying ())
+		util_source = UTIL_SOURCE_PROC_STAT;
+
+	if (util_source != UTIL_SOURCE_PROC_STAT && !res_busy && !proc_stat_init ()) {
+		res_busy = calloc (proc_stat_nr, sizeof(*res_busy));
+		res_c0 = calloc (proc_stat_nr, sizeof(*res_c0));
+		if (!res_busy || !res_c0) {
+			free (res_busy);
+			free (res_c0);
+			res_busy = res_c0 = NULL;
+		}
+	}
+
+	if (residency_init (util_source) && util_source != UTIL_SOURCE_PROC_STAT) {
+		lpmd_log_warn ("Util source %s not available, use %s\n", util_source_names[util_source],
+						util_source_names[UTIL_SOURCE_PROC_STAT]);
+		util_source = UTIL_SOURCE_PROC_STAT;
+	}
+	else if (util_source != UTIL_SOURCE_PROC_STAT && !res_busy) {
+		util_source = UTIL_SOURCE_PROC_STAT;
+	}
+
+	busy_c0 = -1;
+	lpmd_log_info ("Util source: %s\n", util_source_names[util_source]);
+}
+
+static int parse_residency(void)
+{
+	int cpu;
+
+	if (residency_read (res_busy, res_c0, proc_stat_nr))
+		return 1;
+
+	busy_sys = res_busy[0];
+	busy_c0 = res_c0[0];
+
+	busy_cpu = 0;
+	for (cpu = 0; cpu < proc_stat_nr - 1; cpu++) {
+		busy_cpus[cpu] = -1;
+
+		if (res_busy[cpu + 1] < 0 || !is_cpu_for_lpm (cpu))
+			continue;
+
+		busy_cpus[cpu] = res_busy[cpu + 1];
+		if (busy_cpu < res_busy[cpu + 1])
+			busy_cpu = res_busy[cpu + 1];
+	}
+
+	return 0;
+}
+
+/* SYS_STEP: stay in LPM but switch to util_tier */
 enum system_status {
-	SYS_IDLE, SYS_NORMAL, SYS_OVERLOAD, SYS_UNKNOWN,
+	SYS_IDLE, SYS_NORMAL, SYS_OVERLOAD, SYS_STEP, SYS_UNKNOWN,
 };
 
 static enum system_status sys_stat = SYS_NORMAL;
 
+/* Target LPM tier of SYS_IDLE and SYS_STEP */
+static int util_tier;
+
 static int first_run = 1;
 
+/* Time of the last LPM entry or tier step, in ms */
+static unsigned long last_step_ms;
+
+/* Returns 1 when util_tier uses more CPUs than the current tier */
+static int util_step_up(void)
+{
+	return util_tier > get_lpm_tier ();
+}
+
+/*
+ * Utilization policies decide, based on the busy_sys/busy_cpu samples, when
+ * to enter and exit LPM and how often to sample. The policy is selected with
+ * UtilPolicy in the config file.
+ */
+struct util_policy {
+	const char *name;
+	void (*init)(void);
+	enum system_status (*get_sys_stat)(void);
+	int (*should_proceed)(enum system_status status);
+	int (*get_interval)(void);
+	/* Optional, called after an LPM enter/exit request was issued */
+	void (*transitioned)(enum system_status status);
+};
+
+/* CLOCK_MONOTONIC in ms, virtual in a replay */
+static unsigned long util_time_ms(void)
+{
+	return lpm_stats_now () / 1000000;
+}
+
+/*
+ * With LPM tiers, enter the smallest tier whose entry threshold is met,
+ * step up one tier when the busiest CPU of the current tier is above its
+ * exit threshold, and step down when a smaller tier would fit again.
+ * Only overloading the last tier exits LPM. Steps go through should_proceed
+ * like entries and exits.
+ */
 static enum system_status get_sys_stat(void)
 {
+	int tier, cur;
+
 	if (first_run)
 		return SYS_NORMAL;
 
-	if (!in_lpm () && busy_sys <= (get_util_entry_threshold () * 100))
-		return SYS_IDLE;
-	else if (in_lpm () && busy_cpu > (get_util_exit_threshold () * 100))
-		return SYS_OVERLOAD;
+	if (!in_lpm ()) {
+		for (tier = 0; tier < get_lpm_tiers (); tier++) {
+			if (busy_sys <= (get_lpm_tier_entry_threshold (tier) * 100)
+					&& irq_load_fits (get_lpm_tier_cpumask (tier))) {
+				util_tier = tier;
+				return SYS_IDLE;
+			}
+		}
+		return SYS_NORMAL;
+	}
+
+	cur = get_lpm_tier ();
+	if (busy_cpu > (get_lpm_tier_exit_threshold (cur) * 100) || irq_load_over ()) {
+		if (cur + 1 >= get_lpm_tiers ())
+			return SYS_OVERLOAD;
+		util_tier = cur + 1;
+		return SYS_STEP;
+	}
+
+	for (tier = 0; tier < cur; tier++) {
+		if (busy_sys <= (get_lpm_tier_entry_threshold (tier) * 100)
+				&& irq_load_fits (get_lpm_tier_cpumask (tier))) {
+			util_tier = tier;
+			return SYS_STEP;
+		}
+	}
 
 	return SYS_NORMAL;
 }
@@ -222,7 +477,7 @@ static enum system_status get_sys_stat(void)
  */
 #define DECAY_PERIOD	5
 
-static struct timespec tp_last_in, tp_last_out;
+static unsigned long last_in_ms, last_out_ms;
 
 static unsigned long util_out_hyst, util_in_hyst;
 
@@ -230,21 +485,27 @@ static unsigned long util_in_min, util_out_min;
 
 static unsigned long avg_in, avg_out;
 
+static void util_hyst_init(void)
+{
+	last_in_ms = last_out_ms = last_step_ms = util_time_ms ();
+	avg_in = util_in_hyst = get_util_entry_hyst ();
+	avg_out = util_out_hyst = get_util_exit_hyst ();
+	util_in_min = util_in_hyst / 2;
+	util_out_min = util_out_hyst / 2;
+}
+
 static int util_should_proceed(enum system_status status)
 {
-	struct timespec tp_now;
-	unsigned long cur_in, cur_out;
+	unsigned long now, cur_in, cur_out;
 
 	if (!util_out_hyst && !util_in_hyst)
 		return 1;
 
-	clock_gettime (CLOCK_MONOTONIC, &tp_now);
+	now = util_time_ms ();
 
 	if (status == SYS_IDLE) {
-		cur_out = (tp_now.tv_sec - tp_last_out.tv_sec) * 1000000000 + tp_now.tv_nsec
-				- tp_last_out.tv_nsec;
 //		 in msec
-		cur_out /= 1000000;
+		cur_out = now - last_out_ms;
 
 		avg_out = avg_out * (DECAY_PERIOD - 1) / DECAY_PERIOD + cur_out / DECAY_PERIOD;
 
@@ -258,9 +519,7 @@ static int util_should_proceed(enum system_status status)
 		return 0;
 	}
 	else if (status == SYS_OVERLOAD) {
-		cur_in = (tp_now.tv_sec - tp_last_in.tv_sec) * 1000000000 + tp_now.tv_nsec
-				- tp_last_in.tv_nsec;
-		cur_in /= 1000000;
+		cur_in = now - last_in_ms;
 
 		avg_in = avg_in * (DECAY_PERIOD - 1) / DECAY_PERIOD + cur_in / DECAY_PERIOD;
 
@@ -273,6 +532,20 @@ static int util_should_proceed(enum system_status status)
 
 		return 0;
 	}
+	else if (status == SYS_STEP) {
+		/*
+		 * Stepping up is like an exit and needs util_in_min in the current
+		 * tier, stepping down is like an entry and needs util_in_hyst.
+		 */
+		cur_in = now - last_step_ms;
+
+		if (cur_in >= (util_step_up () ? util_in_min : util_in_hyst))
+			return 1;
+
+		lpmd_log_info ("\t\t\tIgnore SYS_STEP to tier %d: cur_in %lu\n", util_tier, cur_in);
+
+		return 0;
+	}
 	return 0;
 }
 
@@ -301,54 +574,510 @@ static int get_util_interval(void)
 	return interval;
 }
 
-int periodic_util_update(void)
+static void util_hyst_transitioned(enum system_status status)
+{
+	if (status == SYS_IDLE)
+		last_in_ms = util_time_ms ();
+	else if (status == SYS_OVERLOAD)
+		last_out_ms = util_time_ms ();
+}
+
+/*
+ * EWMA policy: predict the length of the next idle period from previous
+ * ones and enter LPM only when the remaining idle time is expected to pay
+ * back the cost of entering and exiting.
+ *
+ * An idle period starts at the first SYS_IDLE sample and ends either at an
+ * LPM exit caused by overload or at the first busy sample outside of LPM.
+ * The mean and mean deviation of the completed periods are tracked like
+ * TCP tracks RTT (RFC 6298), in ms scaled by 1 << UTIL_EWMA_SHIFT and
+ * 1 << UTIL_EWMA_DEV_SHIFT. The predicted period length is the mean minus
+ * one deviation. Once the current period has outlasted that, it is
+ * expected to last at least as long again.
+ *
+ * The transition cost is the measured average total enter plus exit
+ * latency from lpmd_stats.c. Entry requires the expected remaining idle
+ * time to be UTIL_EWMA_BREAKEVEN times that. Exit on overload is never
+ * delayed, because exit latency is what users feel.
+ */
+#define UTIL_EWMA_SHIFT			3
+#define UTIL_EWMA_DEV_SHIFT		2
+#define UTIL_EWMA_BREAKEVEN		10
+/* Transition cost used until a real transition has been measured */
+#define UTIL_EWMA_DEFAULT_COST_MS	100
+
+static unsigned long idle_mean_scaled, idle_dev_scaled;
+static int idle_samples;
+static unsigned long idle_start_ms;
+static int idle_running;
+
+static void util_ewma_init(void)
+{
+	idle_mean_scaled = idle_dev_scaled = 0;
+	idle_samples = 0;
+	idle_running = 0;
+	last_step_ms = util_time_ms ();
+}
+
+static void util_ewma_idle_end(unsigned long now)
+{
+	long len, err;
+
+	if (!idle_running)
+		return;
+
+	idle_running = 0;
+	len = now - idle_start_ms;
+
+	if (!idle_samples++) {
+		idle_mean_scaled = len << UTIL_EWMA_SHIFT;
+		idle_dev_scaled = (len / 2) << UTIL_EWMA_DEV_SHIFT;
+		return;
+	}
+
+	err = len - (long) (idle_mean_scaled >> UTIL_EWMA_SHIFT);
+	idle_mean_scaled += err;
+	if (err < 0)
+		err = -err;
+	idle_dev_scaled += err - (long) (idle_dev_scaled >> UTIL_EWMA_DEV_SHIFT);
+
+	lpmd_log_debug ("\t\t\tIdle period %ld ms, mean %lu ms, dev %lu ms\n", len,
+					idle_mean_scaled >> UTIL_EWMA_SHIFT, idle_dev_scaled >> UTIL_EWMA_DEV_SHIFT);
+}
+
+static unsigned long util_ewma_cost_ms(void)
+{
+	uint64_t enter_ns, exit_ns;
+
+	enter_ns = lpm_stats_mean_ns (1, LPM_PHASE_TOTAL);
+	exit_ns = lpm_stats_mean_ns (0, LPM_PHASE_TOTAL);
+	if (!enter_ns || !exit_ns)
+		return UTIL_EWMA_DEFAULT_COST_MS;
+
+	return (enter_ns + exit_ns) / 1000000 + 1;
+}
+
+static int util_ewma_should_proceed(enum system_status status)
+{
+	unsigned long now = util_time_ms ();
+	unsigned long mean, dev, predicted, elapsed, expected, breakeven;
+
+	if (status == SYS_OVERLOAD) {
+		util_ewma_idle_end (now);
+		return 1;
+	}
+
+	/*
+	 * Like exits, steps up are never delayed. A step down costs another
+	 * transition, so stay in the current tier for the breakeven time first.
+	 */
+	if (status == SYS_STEP) {
+		if (util_step_up ())
+			return 1;
+
+		elapsed = now - last_step_ms;
+		breakeven = util_ewma_cost_ms () * UTIL_EWMA_BREAKEVEN;
+		if (elapsed >= breakeven)
+			return 1;
+
+		lpmd_log_info ("\t\t\tIgnore SYS_STEP to tier %d: in tier %lu ms, breakeven %lu ms\n",
+						util_tier, elapsed, breakeven);
+		return 0;
+	}
+
+	if (status != SYS_IDLE) {
+		/* Any busy sample outside of LPM ends the idle period */
+		if (!in_lpm ())
+			util_ewma_idle_end (now);
+		return 0;
+	}
+
+	if (!idle_running) {
+		idle_running = 1;
+		idle_start_ms = now;
+	}
+
+	mean = idle_mean_scaled >> UTIL_EWMA_SHIFT;
+	dev = idle_dev_scaled >> UTIL_EWMA_DEV_SHIFT;
+	predicted = mean > dev ? mean - dev : 0;
+	elapsed = now - idle_start_ms;
+
+	/* Remaining time of the predicted period, or the time idle so far */
+	expected = predicted > elapsed * 2 ? predicted - elapsed : elapsed;
+
+	breakeven = util_ewma_cost_ms () * UTIL_EWMA_BREAKEVEN;
+	if (expected >= breakeven)
+		return 1;
+
+	lpmd_log_info ("\t\t\tIgnore SYS_IDLE: expected idle %lu ms (predicted %lu, elapsed %lu), "
+					"breakeven %lu ms\n", expected, predicted, elapsed, breakeven);
+	return 0;
+}
+
+static struct util_policy util_policies[UTIL_POLICY_MAX] = {
+	[UTIL_POLICY_LEGACY] = {
+		.name = "legacy",
+		.init = util_hyst_init,
+		.get_sys_stat = get_sys_stat,
+		.should_proceed = util_should_proceed,
+		.get_interval = get_util_interval,
+		.transitioned = util_hyst_transitioned,
+	},
+	[UTIL_POLICY_EWMA] = {
+		.name = "ewma",
+		.init = util_ewma_init,
+		.get_sys_stat = get_sys_stat,
+		.should_proceed = util_ewma_should_proceed,
+		.get_interval = get_util_interval,
+	},
+};
+
+static struct util_policy *util_policy;
+
+/*
+ * Support for PSI (Pressure Stall Information) triggers.
+ * A trigger on /proc/pressure/cpu fires POLLPRI as soon as runnable tasks
+ * have been stalled waiting for a CPU for PSI_STALL_US within any
+ * PSI_WINDOW_US window. While in LPM, that is exactly "the LPM CPUs are not
+ * enough", so exit immediately instead of waiting for the next /proc/stat
+ * sample, and sample /proc/stat less often.
+ */
+#define PATH_PSI_CPU		"/proc/pressure/cpu"
+#define PSI_STALL_US		100000
+#define PSI_WINDOW_US		1000000
+/* Without CAP_SYS_RESOURCE the kernel only accepts multiples of 2s windows */
+#define PSI_WINDOW_UNPRIV_US	2000000
+#define UTIL_PSI_LPM_INTERVAL	5000
+
+static int psi_fd = -1;
+/* A replay gets the PSI events from the trace */
+static int psi_replay;
+
+int psi_init(void)
+{
+	char trigger[MAX_STR_LENGTH];
+	int len, ret;
+
+	if (!has_util_monitor ())
+		return -1;
+
+	psi_fd = open (PATH_PSI_CPU, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (psi_fd < 0) {
+		lpmd_log_info ("PSI not supported: %s\n", strerror (errno));
+		return -1;
+	}
+
+	len = snprintf (trigger, sizeof(trigger), "some %d %d", PSI_STALL_US, PSI_WINDOW_US);
+	ret = write (psi_fd, trigger, len + 1);
+	if (ret < 0 && errno == EINVAL) {
+		len = snprintf (trigger, sizeof(trigger), "some %d %d", PSI_STALL_US * 2,
+						PSI_WINDOW_UNPRIV_US);
+		ret = write (psi_fd, trigger, len + 1);
+	}
+	if (ret < 0) {
+		lpmd_log_info ("Failed to register PSI trigger \"%s\": %s\n", trigger,
+						strerror (errno));
+		close (psi_fd);
+		psi_fd = -1;
+		return -1;
+	}
+
+	lpmd_log_info ("PSI trigger registered: %s %s\n", PATH_PSI_CPU, trigger);
+
+	return psi_fd;
+}
+
+/* Replay with the PSI trigger when the recording had one */
+int psi_replay_init(int registered)
 {
+	if (!has_util_monitor () || !registered)
+		return -1;
+
+	psi_replay = 1;
+	return 0;
+}
+
+/* Handle events on the fd returned by psi_init () */
+int psi_process(short revents)
+{
+	int tier;
+
+	if (revents & POLLERR) {
+		lpmd_log_error ("PSI trigger error, fall back to /proc/stat sampling\n");
+		close (psi_fd);
+		psi_fd = -1;
+		return -1;
+	}
+
+	if (revents & POLLPRI)
+		lpmd_trace_psi ();
+
+	if (!(revents & POLLPRI) || !util_policy || !in_lpm ())
+		return 0;
+
+	lpmd_log_info ("\t\tCPU pressure stall detected\n");
+
+	/* Try the next tier before leaving LPM */
+	tier = get_lpm_tier () + 1;
+	if (tier < get_lpm_tiers ()) {
+		util_tier = tier;
+		if (!util_policy->should_proceed (SYS_STEP))
+			return 0;
+		if (process_lpm_tier (tier) != 1) {
+			first_run = 1;
+			last_step_ms = util_time_ms ();
+			return 0;
+		}
+	}
+
+	sys_stat = SYS_OVERLOAD;
+	if (!util_policy->should_proceed (sys_stat))
+		return 0;
+
+	process_lpm (UTIL_EXIT);
+	first_run = 1;
+	if (util_policy->transitioned)
+		util_policy->transitioned (sys_stat);
+
+	return 0;
+}
+
+/*
+ * The last UTIL_RING_SIZE samples and what was decided on them, so that
+ * GetStats can explain LPM decisions without debug logging. Per-CPU
+ * utilization only covers the CPUs used for LPM at the time of the sample.
+ */
+#define UTIL_RING_SIZE	128
+#define UTIL_RING_NA	UINT16_MAX
+
+enum util_decision {
+	UTIL_DECISION_NONE,
+	/* The policy held back an enter or exit (delay/hysteresis) */
+	UTIL_DECISION_DEFER,
+	UTIL_DECISION_ENTER,
+	UTIL_DECISION_EXIT,
+	UTIL_DECISION_STEP,
+	UTIL_DECISION_MAX,
+};
+
+static const char *util_decision_str[UTIL_DECISION_MAX] = {
+	[UTIL_DECISION_NONE] = "none",
+	[UTIL_DECISION_DEFER] = "defer",
+	[UTIL_DECISION_ENTER] = "enter",
+	[UTIL_DECISION_EXIT] = "exit",
+	[UTIL_DECISION_STEP] = "step",
+};
+
+static const char *sys_stat_str[SYS_UNKNOWN + 1] = {
+	[SYS_IDLE] = "idle",
+	[SYS_NORMAL] = "normal",
+	[SYS_OVERLOAD] = "overload",
+	[SYS_STEP] = "step",
+	[SYS_UNKNOWN] = "unknown",
+};
+
+struct util_sample {
+	unsigned long seq;
+	unsigned long time_ms;
+	int busy_sys;
+	int busy_cpu;
+	int tier;
 	int interval;
-	static int initialized;
+	enum system_status status;
+	enum util_decision decision;
+};
+
+static struct util_sample util_ring[UTIL_RING_SIZE];
+/* UTIL_RING_SIZE rows of (proc_stat_nr - 1) busy values */
+static uint16_t *util_ring_cpus;
+static unsigned long util_ring_seq;
+static pthread_mutex_t util_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void util_ring_add(enum util_decision decision, int interval)
+{
+	struct util_sample *sample;
+	uint16_t *row;
+	int nr_cpus = proc_stat_nr - 1;
+	int cpu, tier;
+
+	if (!busy_cpus)
+		return;
+
+	tier = in_lpm () ? get_lpm_tier () : -1;
+
+	pthread_mutex_lock (&util_ring_mutex);
+
+	if (!util_ring_cpus) {
+		util_ring_cpus = calloc ((size_t) UTIL_RING_SIZE * nr_cpus, sizeof(*util_ring_cpus));
+		if (!util_ring_cpus) {
+			pthread_mutex_unlock (&util_ring_mutex);
+			return;
+		}
+	}
+
+	sample = &util_ring[util_ring_seq % UTIL_RING_SIZE];
+	sample->seq = util_ring_seq;
+	sample->time_ms = util_time_ms ();
+	sample->busy_sys = busy_sys;
+	sample->busy_cpu = busy_cpu;
+	sample->tier = tier;
+	sample->interval = interval;
+	sample->status = sys_stat;
+	sample->decision = decision;
+
+	row = util_ring_cpus + (size_t) (util_ring_seq % UTIL_RING_SIZE) * nr_cpus;
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		row[cpu] = busy_cpus[cpu] < 0 ? UTIL_RING_NA : busy_cpus[cpu];
+
+	util_ring_seq++;
+
+	pthread_mutex_unlock (&util_ring_mutex);
+}
+
+/*
+ * Format the ring, oldest sample first. Utilization is in percent, tier is
+ * the one after the decision, -1 outside of LPM. The returned string must be
+ * freed by the caller.
+ */
+char* util_stats_str(void)
+{
+	struct util_sample *sample;
+	unsigned long seq;
+	uint16_t *row;
+	FILE *filep;
+	char *buf = NULL;
+	size_t size;
+	int nr_cpus = proc_stat_nr - 1;
+	int cpu;
+
+	filep = open_memstream (&buf, &size);
+	if (!filep)
+		return NULL;
+
+	fprintf (filep, "%8s %10s %7s %7s %4s %8s %-8s %-8s %s\n", "seq", "time(ms)", "sys",
+				"cpu", "tier", "interval", "status", "decision", "lpm cpus");
+
+	pthread_mutex_lock (&util_ring_mutex);
+
+	seq = util_ring_seq > UTIL_RING_SIZE ? util_ring_seq - UTIL_RING_SIZE : 0;
+	for (; util_ring_cpus && seq < util_ring_seq; seq++) {
+		sample = &util_ring[seq % UTIL_RING_SIZE];
+		row = util_ring_cpus + (size_t) (seq % UTIL_RING_SIZE) * nr_cpus;
+
+		fprintf (filep, "%8lu %10lu %4d.%02d %4d.%02d %4d %8d %-8s %-8s", sample->seq,
+					sample->time_ms, sample->busy_sys / 100, sample->busy_sys % 100,
+					sample->busy_cpu / 100, sample->busy_cpu % 100, sample->tier,
+					sample->interval, sys_stat_str[sample->status],
+					util_decision_str[sample->decision]);
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (row[cpu] == UTIL_RING_NA)
+				continue;
+			fprintf (filep, " %d:%d.%02d", cpu, row[cpu] / 100, row[cpu] % 100);
+		}
+		fputc ('\n', filep);
+	}
+
+	pthread_mutex_unlock (&util_ring_mutex);
+
+	if (fclose (filep)) {
+		free (buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static int util_initialized;
+
+/* Pick up new thresholds, delays and hysteresis on the next sample */
+void util_config_changed(void)
+{
+	util_initialized = 0;
+	first_run = 1;
+}
+
+int periodic_util_update(void)
+{
+	enum util_decision decision = UTIL_DECISION_NONE;
+	int interval, ret;
 
 //	 poll() timeout should be -1 when util monitor not enabled
 	if (!has_util_monitor ())
 		return -1;
 
-	if (!initialized) {
-		clock_gettime (CLOCK_MONOTONIC, &tp_last_in);
-		clock_gettime (CLOCK_MONOTONIC, &tp_last_out);
-		avg_in = util_in_hyst = get_util_entry_hyst ();
-		avg_out = util_out_hyst = get_util_exit_hyst ();
-		util_in_min = util_in_hyst / 2;
-		util_out_min = util_out_hyst / 2;
-		initialized = 1;
+	if (!util_initialized) {
+		util_policy = &util_policies[get_util_policy ()];
+		lpmd_log_info ("Util policy: %s\n", util_policy->name);
+		util_policy->init ();
+		util_source_init ();
+		util_initialized = 1;
 	}
 
-	parse_proc_stat ();
-	sys_stat = get_sys_stat ();
-	interval = get_util_interval ();
+	if (util_source == UTIL_SOURCE_PROC_STAT)
+		ret = parse_proc_stat ();
+	else
+		ret = parse_residency ();
+
+	/* Don't decide on the busy values of the previous sample */
+	if (ret) {
+		lpmd_log_warn ("No %s utilization sample, skip it\n", util_source_names[util_source]);
+		return util_policy->get_interval ();
+	}
+
+	irq_load_sample ();
+	sys_stat = util_policy->get_sys_stat ();
+	interval = util_policy->get_interval ();
+
+	if ((psi_fd >= 0 || psi_replay) && in_lpm () && !first_run && !get_util_exit_interval ())
+		interval = UTIL_PSI_LPM_INTERVAL;
 
 	lpmd_log_info (
 			"\t\tSYS util %3d.%02d (Entry threshold : %3d ),"
-			" CPU util %3d.%02d ( Exit threshold : %3d ), resample after"
+			" CPU util %3d.%02d ( Exit threshold : %3d ), tier %d, resample after"
 			" %4d ms\n", busy_sys / 100, busy_sys % 100, get_util_entry_threshold (),
-			busy_cpu / 100, busy_cpu % 100, get_util_exit_threshold (), interval);
+			busy_cpu / 100, busy_cpu % 100, get_lpm_tier_exit_threshold (get_lpm_tier ()),
+			get_lpm_tier (), interval);
+	if (busy_c0 >= 0)
+		lpmd_log_debug ("\t\tSYS C0 residency %3d.%02d\n", busy_c0 / 100, busy_c0 % 100);
 
 	first_run = 0;
 
-	if (!util_should_proceed (sys_stat))
-		return interval;
+	if (!util_policy->should_proceed (sys_stat)) {
+		if (sys_stat == SYS_IDLE || sys_stat == SYS_OVERLOAD || sys_stat == SYS_STEP)
+			decision = UTIL_DECISION_DEFER;
+		goto out;
+	}
 
 	switch (sys_stat) {
+		case SYS_STEP:
+			/* Tier steps keep LPM */
+			if (process_lpm_tier (util_tier) != 1) {
+				first_run = 1;
+				last_step_ms = util_time_ms ();
+			}
+			decision = UTIL_DECISION_STEP;
+			break;
 		case SYS_IDLE:
-			process_lpm (UTIL_ENTER);
+			process_lpm_tier (util_tier);
 			first_run = 1;
-			clock_gettime (CLOCK_MONOTONIC, &tp_last_in);
+			last_step_ms = util_time_ms ();
+			if (util_policy->transitioned)
+				util_policy->transitioned (sys_stat);
 			interval = 1000;
+			decision = UTIL_DECISION_ENTER;
 			break;
 		case SYS_OVERLOAD:
 			process_lpm (UTIL_EXIT);
 			first_run = 1;
-			clock_gettime (CLOCK_MONOTONIC, &tp_last_out);
+			if (util_policy->transitioned)
+				util_policy->transitioned (sys_stat);
+			decision = UTIL_DECISION_EXIT;
 			break;
 		default:
 			break;
 	}
+
+out: util_ring_add (decision, interval);
+
 	return interval;
 }
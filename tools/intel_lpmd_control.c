@@ -21,6 +21,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <dbus/dbus-glib.h>
@@ -29,12 +31,67 @@
 #define INTEL_LPMD_SERVICE_OBJECT_PATH  "/org/freedesktop/intel_lpmd"
 #define INTEL_LPMD_SERVICE_INTERFACE    "org.freedesktop.intel_lpmd"
 
+/* Print the util samples of GetStats as they come, until interrupted */
+static int monitor(DBusGProxy *proxy)
+{
+	GError *error = NULL;
+	unsigned long seq, last, next = 0;
+	char *stats, *line, *end;
+	int first = 1;
+
+	for (;;) {
+		if (!dbus_g_proxy_call (proxy, "GetStats", &error, G_TYPE_INVALID, G_TYPE_STRING,
+								&stats, G_TYPE_INVALID)) {
+			g_warning ("Failed to send message: %s", error->message);
+			g_error_free (error);
+			return 1;
+		}
+
+		/* The samples after the header are in order, the last one is the newest */
+		last = next;
+		for (line = strchr (stats, '\n'); line && line[1]; line = strchr (line + 1, '\n'))
+			last = strtoul (line + 1, NULL, 10);
+
+		/* A restarted daemon numbers its samples from 0 again */
+		if (!first && last + 1 < next) {
+			printf ("-- daemon restarted --\n");
+			next = 0;
+		}
+
+		for (line = stats; *line; line = end) {
+			end = strchr (line, '\n');
+			end = end ? end + 1 : line + strlen (line);
+
+			/* The header line */
+			if (line == stats) {
+				if (first)
+					printf ("%.*s", (int) (end - line), line);
+				continue;
+			}
+
+			seq = strtoul (line, NULL, 10);
+			if (!first && seq < next)
+				continue;
+			printf ("%.*s", (int) (end - line), line);
+			next = seq + 1;
+		}
+
+		g_free (stats);
+		fflush (stdout);
+		first = 0;
+		sleep (1);
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	GError *error = NULL;
 	DBusGConnection *bus;
 	DBusGProxy *proxy;
 	char command[20];
+	char *stats = NULL;
 
 	if (geteuid () != 0) {
 		fprintf (stderr, "Must run as root\n");
@@ -44,7 +101,7 @@ int main(int argc, char **argv)
 	if (argc < 2) {
 		fprintf (stderr, "intel_lpmd_control: missing control command\n");
 		fprintf (stderr, "syntax:\n");
-		fprintf (stderr, "intel_lpmd_control ON|OFF|AUTO\n");
+		fprintf (stderr, "intel_lpmd_control ON|OFF|AUTO|stats|hfi|monitor|residency\n");
 		exit (0);
 	}
 
@@ -54,6 +111,14 @@ int main(int argc, char **argv)
 		strcpy (command, "LPM_FORCE_OFF");
 	else if (!strncmp (argv[1], "AUTO", 4))
 		strcpy (command, "LPM_AUTO");
+	else if (!strncmp (argv[1], "stats", 5))
+		strcpy (command, "GetTransitionStats");
+	else if (!strncmp (argv[1], "hfi", 3))
+		strcpy (command, "GetHfiRanking");
+	else if (!strncmp (argv[1], "monitor", 7))
+		strcpy (command, "GetStats");
+	else if (!strncmp (argv[1], "residency", 9))
+		strcpy (command, "GetResidencyStats");
 	else {
 		fprintf (stderr, "intel_lpmd_control: Invalid command\n");
 		exit (0);
@@ -69,6 +134,22 @@ int main(int argc, char **argv)
 									   INTEL_LPMD_SERVICE_OBJECT_PATH,
 									   INTEL_LPMD_SERVICE_INTERFACE);
 
+	if (!strcmp (command, "GetStats"))
+		return monitor (proxy);
+
+	if (!strcmp (command, "GetTransitionStats") || !strcmp (command, "GetHfiRanking")
+			|| !strcmp (command, "GetResidencyStats")) {
+		if (!dbus_g_proxy_call (proxy, command, &error, G_TYPE_INVALID, G_TYPE_STRING, &stats,
+								G_TYPE_INVALID)) {
+			g_warning ("Failed to send message: %s", error->message);
+			g_error_free (error);
+			return 1;
+		}
+		printf ("%s", stats);
+		g_free (stats);
+		return 0;
+	}
+
 	if (!dbus_g_proxy_call (proxy, command, &error, G_TYPE_INVALID, G_TYPE_INVALID)) {
 		g_warning ("Failed to send message: %s", error->message);
 		g_error_free (error);
@@ -0,0 +1,738 @@
+/*
+ * lpmd_bench.c: Intel Low Power Daemon transition and sampler benchmarks
+ *
+ * Copyright (C) 2023 Intel Corporation. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * This program builds the daemon sources into one translation unit, so the
+ * static hot paths can be called directly, and runs:
+ * - enter_lpm ()/exit_lpm () cycles in dry_run mode, and optionally live
+ *   with the installed configuration,
+ * - the hot helpers against a fake /proc and /sys tree in a temporary
+ *   directory.
+ * open (), fopen () and opendir () are wrapped at link time (-Wl,--wrap) to
+ * redirect /proc and /sys to the fake tree and to count the file opens.
+ * Writes to fake files replace their content, like sysfs attributes.
+ * The read/write syscall counts come from /proc/self/io.
+ *
+ * Every result is one line of whitespace separated fields, so runs can be
+ * compared with a script.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../src/lpmd_helpers.c"
+#include "../src/lpmd_clamp.c"
+#include "../src/lpmd_config.c"
+#include "../src/lpmd_cpu.c"
+#include "../src/lpmd_hfi.c"
+#include "../src/lpmd_irq.c"
+#include "../src/lpmd_irqload.c"
+#include "../src/lpmd_proc.c"
+#include "../src/lpmd_rapl.c"
+#include "../src/lpmd_residency.c"
+#include "../src/lpmd_socket.c"
+#include "../src/lpmd_stats.c"
+#include "../src/lpmd_timer.c"
+#include "../src/lpmd_trace.c"
+#include "../src/lpmd_util.c"
+
+#define BENCH_FAKE_FDS		4096
+#define BENCH_KNOB		"/sys/kernel/lpmd_bench"
+
+static int bench_verbose;
+static char *fake_root;
+static unsigned char fake_fds[BENCH_FAKE_FDS];
+static unsigned long nr_opens;
+static volatile sig_atomic_t bench_stop;
+
+/* Referenced by the daemon sources, lpmd_main.c is not built in */
+int in_debug_mode(void)
+{
+	return bench_verbose > 1;
+}
+
+static void bench_logger(const gchar *log_domain, GLogLevelFlags log_level, const gchar *message,
+							gpointer user_data)
+{
+	if (bench_verbose || (log_level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL)))
+		fprintf (stderr, "%s", message);
+}
+
+int __real_open(const char *path, int flags, ...);
+FILE* __real_fopen(const char *path, const char *mode);
+DIR* __real_opendir(const char *path);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int __real_close(int fd);
+
+/* Returns the path in the fake tree, or path itself when not redirected */
+static const char* fake_path(const char *path, char *buf, size_t size)
+{
+	if (!fake_root || (strncmp (path, "/proc/", 6) && strncmp (path, "/sys/", 5)))
+		return path;
+
+	snprintf (buf, size, "%s%s", fake_root, path);
+	return buf;
+}
+
+int __wrap_open(const char *path, int flags, ...)
+{
+	char buf[PATH_MAX];
+	const char *real = fake_path (path, buf, sizeof(buf));
+	mode_t mode = 0;
+	va_list args;
+	int fd;
+
+	if (flags & O_CREAT) {
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+
+	nr_opens++;
+	fd = __real_open (real, flags, mode);
+	if (fd >= 0 && fd < BENCH_FAKE_FDS)
+		fake_fds[fd] = real != path;
+	return fd;
+}
+
+FILE* __wrap_fopen(const char *path, const char *mode)
+{
+	char buf[PATH_MAX];
+
+	nr_opens++;
+	return __real_fopen (fake_path (path, buf, sizeof(buf)), mode);
+}
+
+DIR* __wrap_opendir(const char *path)
+{
+	char buf[PATH_MAX];
+
+	nr_opens++;
+	return __real_opendir (fake_path (path, buf, sizeof(buf)));
+}
+
+int __wrap_close(int fd)
+{
+	if (fd >= 0 && fd < BENCH_FAKE_FDS)
+		fake_fds[fd] = 0;
+	return __real_close (fd);
+}
+
+static int is_fake_fd(int fd)
+{
+	return fd >= 0 && fd < BENCH_FAKE_FDS && fake_fds[fd];
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+	if (!is_fake_fd (fd))
+		return __real_write (fd, buf, count);
+
+	if (ftruncate (fd, 0))
+		return -1;
+	return __real_pwrite (fd, buf, count, 0);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	if (!is_fake_fd (fd))
+		return __real_pwrite (fd, buf, count, offset);
+
+	if (ftruncate (fd, 0))
+		return -1;
+	return __real_pwrite (fd, buf, count, 0);
+}
+
+struct bench_io {
+	unsigned long long syscr;
+	unsigned long long syscw;
+	unsigned long opens;
+};
+
+/* All zero when the kernel has no per-task I/O accounting */
+static void bench_io_read(struct bench_io *io)
+{
+	char buf[512];
+	char *p;
+	int fd, len;
+
+	memset (io, 0, sizeof(*io));
+	io->opens = nr_opens;
+
+	fd = __real_open ("/proc/self/io", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	len = read (fd, buf, sizeof(buf) - 1);
+	close (fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+
+	p = strstr (buf, "syscr:");
+	if (p)
+		io->syscr = strtoull (p + 6, NULL, 10);
+	p = strstr (buf, "syscw:");
+	if (p)
+		io->syscw = strtoull (p + 6, NULL, 10);
+}
+
+struct bench {
+	const char *name;
+	int iters;
+	int nr;
+	uint64_t *ns;
+	struct bench_io io_start;
+	struct bench_io io;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_begin(struct bench *b, const char *name, int iters)
+{
+	memset (b, 0, sizeof(*b));
+	b->name = name;
+	b->iters = iters;
+	b->ns = calloc (iters, sizeof(*b->ns));
+	if (!b->ns) {
+		fprintf (stderr, "Failed to allocate %d samples\n", iters);
+		exit (EXIT_FAILURE);
+	}
+	bench_io_read (&b->io_start);
+}
+
+static void bench_sample(struct bench *b, uint64_t ns)
+{
+	if (b->nr < b->iters)
+		b->ns[b->nr++] = ns;
+}
+
+/* Snapshot the counters before anything outside the measured calls runs */
+static void bench_pause(struct bench *b)
+{
+	struct bench_io now;
+
+	bench_io_read (&now);
+	/* Don't count the read of /proc/self/io by bench_resume () */
+	if (now.syscr > b->io_start.syscr)
+		b->io.syscr += now.syscr - b->io_start.syscr - 1;
+	b->io.syscw += now.syscw - b->io_start.syscw;
+	b->io.opens += now.opens - b->io_start.opens;
+}
+
+static void bench_resume(struct bench *b)
+{
+	bench_io_read (&b->io_start);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_percentile(struct bench *b, int percent)
+{
+	int idx = ((uint64_t) b->nr * percent + 99) / 100;
+
+	return b->ns[idx ? idx - 1 : 0];
+}
+
+static void bench_end(struct bench *b, int paused)
+{
+	uint64_t sum = 0;
+	int i;
+
+	if (!paused)
+		bench_pause (b);
+
+	if (!b->nr) {
+		printf ("%-24s %8d %10s %10s %10s %10s %8s %8s %8s\n", b->name, 0, "-", "-", "-", "-",
+				"-", "-", "-");
+		free (b->ns);
+		return;
+	}
+
+	for (i = 0; i < b->nr; i++)
+		sum += b->ns[i];
+	qsort (b->ns, b->nr, sizeof(*b->ns), cmp_u64);
+
+	printf ("%-24s %8d %10llu %10llu %10llu %10llu %8.1f %8.1f %8.1f\n", b->name, b->nr,
+			(unsigned long long) (sum / b->nr),
+			(unsigned long long) bench_percentile (b, 50),
+			(unsigned long long) bench_percentile (b, 99),
+			(unsigned long long) b->ns[b->nr - 1],
+			(double) b->io.opens / b->nr, (double) b->io.syscr / b->nr,
+			(double) b->io.syscw / b->nr);
+	free (b->ns);
+}
+
+static void bench_header(void)
+{
+	printf ("%-24s %8s %10s %10s %10s %10s %8s %8s %8s\n", "benchmark", "iters", "avg(ns)",
+			"p50(ns)", "p99(ns)", "max(ns)", "opens", "syscr", "syscw");
+}
+
+static int fake_mkdir(const char *path)
+{
+	char buf[PATH_MAX];
+	char *p;
+
+	snprintf (buf, sizeof(buf), "%s%s", fake_root, path);
+	for (p = buf + strlen (fake_root) + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir (buf, 0755) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir (buf, 0755) && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static FILE* fake_create(const char *path)
+{
+	char buf[PATH_MAX];
+
+	snprintf (buf, sizeof(buf), "%s%s", fake_root, path);
+	return __real_fopen (buf, "w");
+}
+
+/* /proc/stat with all CPUs, and a long intr line like on real systems */
+static int fake_proc_stat(void)
+{
+	FILE *filep;
+	int cpu, i;
+
+	filep = fake_create ("/proc/stat");
+	if (!filep)
+		return -1;
+
+	fprintf (filep, "cpu  %d 0 %d %d 0 0 0 0 0 0\n", 1000 * get_max_cpus (),
+				500 * get_max_cpus (), 100000 * get_max_cpus ());
+	for (cpu = 0; cpu < get_max_cpus (); cpu++)
+		fprintf (filep, "cpu%d 1000 0 500 100000 0 0 0 0 0 0\n", cpu);
+	fprintf (filep, "intr 12345678");
+	for (i = 0; i < 1024; i++)
+		fprintf (filep, " %d", i % 7);
+	fprintf (filep, "\nctxt 123456789\nbtime 1700000000\nprocesses 12345\n");
+	fprintf (filep, "procs_running 1\nprocs_blocked 0\nsoftirq 1 2 3 4 5 6 7 8 9 10 11\n");
+
+	return fclose (filep);
+}
+
+/* /proc/irq/N/smp_affinity for nr_irqs IRQs, all affined to every CPU */
+static int fake_proc_irqs(int nr_irqs)
+{
+	char path[MAX_STR_LENGTH];
+	FILE *filep;
+	int irq;
+
+	for (irq = 0; irq < nr_irqs; irq++) {
+		snprintf (path, sizeof(path), "/proc/irq/%d", irq);
+		if (fake_mkdir (path))
+			return -1;
+
+		snprintf (path, sizeof(path), "/proc/irq/%d/smp_affinity", irq);
+		filep = fake_create (path);
+		if (!filep)
+			return -1;
+		fprintf (filep, "%s\n", get_cpus_hexstr (CPUMASK_ONLINE));
+		fclose (filep);
+	}
+
+	return 0;
+}
+
+static int fake_tree_create(int nr_irqs)
+{
+	char tmpl[] = "/tmp/lpmd_bench.XXXXXX";
+	FILE *filep;
+
+	if (!mkdtemp (tmpl))
+		return -1;
+	fake_root = strdup (tmpl);
+	if (!fake_root)
+		return -1;
+
+	if (fake_mkdir ("/proc/irq") || fake_mkdir ("/sys/kernel"))
+		return -1;
+
+	if (fake_proc_stat () || fake_proc_irqs (nr_irqs))
+		return -1;
+
+	filep = fake_create (BENCH_KNOB);
+	if (!filep)
+		return -1;
+	fprintf (filep, "0\n");
+	return fclose (filep);
+}
+
+static void fake_tree_remove(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	if (!fake_root)
+		return;
+
+	snprintf (cmd, sizeof(cmd), "rm -rf '%s'", fake_root);
+	if (system (cmd))
+		fprintf (stderr, "Failed to remove %s\n", fake_root);
+	free (fake_root);
+	fake_root = NULL;
+}
+
+/* Online CPUs 0 .. nr_cpus - 1, the last quarter of them are the LPM CPUs */
+static void fake_topology(int nr_cpus)
+{
+	int cpu;
+
+	topo_max_cpus = nr_cpus;
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		add_cpu (cpu, CPUMASK_ONLINE);
+	for (cpu = nr_cpus - (nr_cpus + 3) / 4; cpu < nr_cpus; cpu++)
+		add_cpu (cpu, CPUMASK_LPM_DEFAULT);
+	max_online_cpu = nr_cpus;
+}
+
+static void bench_dry_run(int iters)
+{
+	struct bench enter, leave;
+	uint64_t start;
+	int i;
+
+	dry_run = 1;
+
+	bench_begin (&enter, "dry_run_enter", iters);
+	bench_begin (&leave, "dry_run_exit", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		bench_resume (&enter);
+		start = bench_now ();
+		process_lpm (USER_ENTER);
+		bench_sample (&enter, bench_now () - start);
+		bench_pause (&enter);
+
+		bench_resume (&leave);
+		start = bench_now ();
+		process_lpm (USER_EXIT);
+		bench_sample (&leave, bench_now () - start);
+		bench_pause (&leave);
+	}
+	bench_end (&enter, 1);
+	bench_end (&leave, 1);
+
+	dry_run = 0;
+}
+
+static void bench_parse_proc_stat(int iters)
+{
+	struct bench b;
+	uint64_t start;
+	int i;
+
+	/* Opens the persistent fd outside of the measurement */
+	parse_proc_stat ();
+
+	bench_begin (&b, "parse_proc_stat", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		start = bench_now ();
+		parse_proc_stat ();
+		bench_sample (&b, bench_now () - start);
+	}
+	bench_end (&b, 0);
+
+	close (proc_stat_fd);
+	proc_stat_fd = -1;
+}
+
+static void bench_native_irqs(int iters)
+{
+	struct bench update, restore;
+	uint64_t start;
+	int i;
+
+	if (!info->irq && irq_info_init ())
+		return;
+
+	bench_begin (&update, "native_update_irqs", iters);
+	bench_begin (&restore, "native_restore_irqs", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		bench_resume (&update);
+		start = bench_now ();
+		native_update_irqs (0);
+		bench_sample (&update, bench_now () - start);
+		bench_pause (&update);
+
+		bench_resume (&restore);
+		start = bench_now ();
+		native_restore_irqs ();
+		bench_sample (&restore, bench_now () - start);
+		bench_pause (&restore);
+	}
+	bench_end (&update, 1);
+	bench_end (&restore, 1);
+}
+
+static void bench_cpumask_to_hexstr(int iters)
+{
+	struct bench b;
+	uint64_t start;
+	char *buf;
+	int i;
+
+	buf = malloc (cpus_hexstr_size ());
+	if (!buf)
+		return;
+
+	bench_begin (&b, "cpumask_to_hexstr", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		start = bench_now ();
+		cpumask_to_hexstr (cpumasks[CPUMASK_LPM_DEFAULT].mask, buf, cpus_hexstr_size ());
+		bench_sample (&b, bench_now () - start);
+	}
+	bench_end (&b, 0);
+
+	free (buf);
+}
+
+/* Alternate the value, an unchanged value is skipped once the knob is cached */
+static void bench_write_str(int iters)
+{
+	struct bench b;
+	uint64_t start;
+	int i;
+
+	bench_begin (&b, "lpmd_write_str", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		start = bench_now ();
+		lpmd_write_str (BENCH_KNOB, i & 1 ? "1" : "0", LPMD_LOG_NONE);
+		bench_sample (&b, bench_now () - start);
+	}
+	bench_end (&b, 0);
+
+	lpmd_cache_knob (BENCH_KNOB);
+
+	bench_begin (&b, "lpmd_write_str_cached", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		start = bench_now ();
+		lpmd_write_str (BENCH_KNOB, i & 1 ? "1" : "0", LPMD_LOG_NONE);
+		bench_sample (&b, bench_now () - start);
+	}
+	bench_end (&b, 0);
+}
+
+static int live_init(void)
+{
+	int fd;
+
+	if (geteuid () != 0) {
+		fprintf (stderr, "Live transitions must run as root\n");
+		return -1;
+	}
+
+	/* intel_lpmd holds a lock on its pid file */
+	fd = __real_open (TDRUNDIR "/intel_lpmd.pid", O_RDWR | O_CLOEXEC);
+	if (fd >= 0) {
+		int running = lockf (fd, F_TEST, 0) == -1;
+
+		close (fd);
+		if (running) {
+			fprintf (stderr, "intel_lpmd is running, stop it first\n");
+			return -1;
+		}
+	}
+
+	if (lpmd_get_config (&lpmd_config))
+		return -1;
+
+	if (init_cpu (lpmd_config.lp_mode_cpus, lpmd_config.mode))
+		return -1;
+
+	if (init_irq ())
+		return -1;
+
+	if (!lpmd_config.ignore_itmt)
+		lpmd_cache_knob (PATH_ITMT_CONTROL);
+
+	return 0;
+}
+
+/* Waits for the systemd replies, so the whole transition is measured */
+static uint64_t live_transition(enum lpm_command cmd)
+{
+	uint64_t start = bench_now ();
+
+	lpmd_lock ();
+	process_lpm_unlock (cmd);
+	process_cpus_wait ();
+	lpmd_unlock ();
+
+	return bench_now () - start;
+}
+
+static void bench_live(int iters)
+{
+	struct bench enter, leave;
+	int i;
+
+	bench_begin (&enter, "live_enter", iters);
+	bench_begin (&leave, "live_exit", iters);
+	for (i = 0; i < iters && !bench_stop; i++) {
+		bench_resume (&enter);
+		bench_sample (&enter, live_transition (USER_ENTER));
+		bench_pause (&enter);
+
+		/* Always leave LPM, also when interrupted */
+		bench_resume (&leave);
+		bench_sample (&leave, live_transition (USER_EXIT));
+		bench_pause (&leave);
+	}
+	bench_end (&enter, 1);
+	bench_end (&leave, 1);
+}
+
+/* Per phase breakdown of the live transitions from lpmd_stats.c */
+static void bench_live_stats(void)
+{
+	char *stats;
+
+	stats = lpm_stats_str ();
+	if (stats) {
+		printf ("\n%s", stats);
+		free (stats);
+	}
+}
+
+static void sig_stop(int sig)
+{
+	bench_stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf (stderr, "lpmd_bench [-n iterations] [-c cpus] [-i irqs] [-l [-L iterations]] [-v]\n");
+	fprintf (stderr, "  -n  iterations of each benchmark, default 1000\n");
+	fprintf (stderr, "  -c  CPUs of the fake topology, default 16, unused with -l\n");
+	fprintf (stderr, "  -i  IRQs in the fake /proc/irq, default 64\n");
+	fprintf (stderr, "  -l  also run live LPM enter/exit cycles with the installed\n");
+	fprintf (stderr, "      configuration, as root and with intel_lpmd stopped\n");
+	fprintf (stderr, "  -L  live cycles, default 20\n");
+	fprintf (stderr, "  -v  show the intel_lpmd messages, twice for debug messages\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int iters = 1000, live_iters = 20;
+	int nr_cpus = 16, nr_irqs = 64;
+	int live = 0;
+	int opt, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt (argc, argv, "n:c:i:lL:vh")) != -1) {
+		switch (opt) {
+			case 'n':
+				iters = atoi (optarg);
+				break;
+			case 'c':
+				nr_cpus = atoi (optarg);
+				break;
+			case 'i':
+				nr_irqs = atoi (optarg);
+				break;
+			case 'l':
+				live = 1;
+				break;
+			case 'L':
+				live_iters = atoi (optarg);
+				break;
+			case 'v':
+				bench_verbose++;
+				break;
+			default:
+				usage ();
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (iters <= 0 || live_iters <= 0 || nr_cpus < 2 || nr_irqs < 0) {
+		usage ();
+		return EXIT_FAILURE;
+	}
+
+	g_log_set_handler (NULL, G_LOG_LEVEL_MASK, bench_logger, NULL);
+	pthread_mutex_init (&lpmd_mutex, NULL);
+	signal (SIGINT, sig_stop);
+	signal (SIGTERM, sig_stop);
+
+	if (live) {
+		if (live_init ())
+			return EXIT_FAILURE;
+	}
+	else {
+		fake_topology (nr_cpus);
+	}
+
+	printf ("%d CPUs, %d LPM CPUs, %d fake IRQs\n\n", get_max_cpus (),
+			has_cpus (CPUMASK_LPM_DEFAULT), nr_irqs);
+	bench_header ();
+
+	if (live)
+		bench_live (live_iters);
+
+	bench_dry_run (iters);
+
+	if (fake_tree_create (nr_irqs)) {
+		fprintf (stderr, "Failed to create the fake /proc and /sys tree\n");
+		ret = EXIT_FAILURE;
+		goto end;
+	}
+
+	bench_parse_proc_stat (iters);
+	bench_native_irqs (iters);
+	bench_cpumask_to_hexstr (iters);
+	bench_write_str (iters);
+
+end:
+	fake_tree_remove ();
+
+	if (live)
+		bench_live_stats ();
+
+	return ret;
+}